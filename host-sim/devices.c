@@ -0,0 +1,182 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    devices.c
+ * @brief   Board of the host simulator. The models go on the buses named by SSD1306_I2C_BUS and
+ * 			QMC_I2C_BUS, so the dual bus build of source/ finds the magnetometer on I2C0.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "devices.h"
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "i2c.h"
+#include "systick.h"
+#include "ssd1306.h"
+
+sim_qmc5883l_t devices_qmc;
+sim_ssd1306_t devices_ssd;
+
+static const i2c_device_t *devices[] = {&ssd1306_i2c_device, &qmc_i2c_device};
+#define NUM_DEVICES (sizeof(devices)/sizeof(devices[0]))
+
+static I2C_Type *const buses[] = {I2C0, I2C1};
+#define NUM_BUSES (sizeof(buses)/sizeof(buses[0]))
+
+/*
+ * Function to get the bus model of a peripheral
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *
+ * Returns:
+ *  the bus model
+ */
+static sim_i2c_bus_t devices_bus(I2C_Type *i2c)
+{
+	return i2c == I2C0 ? SIM_I2C0 : SIM_I2C1;
+}
+
+/*
+ * Function to get the bus model the magnetometer is on
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  the bus model
+ */
+sim_i2c_bus_t devices_qmc_bus()
+{
+	return devices_bus(QMC_I2C_BUS);
+}
+
+/*
+ * Function to power on the models and wire them to their buses. The field of the magnetometer
+ * model can be set after this and before devices_init()
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void devices_attach()
+{
+	sim_ssd1306_attach(&devices_ssd, devices_bus(SSD1306_I2C_BUS));
+	sim_qmc5883l_attach(&devices_qmc, devices_bus(QMC_I2C_BUS));
+}
+
+/*
+ * Function to get the magnetometer configuration main() uses
+ *
+ * Parameters:
+ *  config(out) the configuration
+ *
+ * Returns:
+ *  none
+ */
+void devices_main_config(qmc_config_t *config)
+{
+	config->int_enb = INT_ENB_ENABLE;
+	config->rol_pnt = ROL_PNT_ENABLE;
+	config->soft_rst = SOFT_RST_DISABLE;
+	config->osr = OSR_OPTION_512;
+	config->rng = RNG_OPTION_8G;
+	config->auto_rng = AUTO_RNG_ENABLE;
+	config->odr = ODR_OPTION_10HZ;
+	config->mode = MODE_OPTION_CONTINUOUS;
+}
+
+/*
+ * Function to bring up systick, the buses with a device on them and both devices, in the order
+ * main() does
+ *
+ * Parameters:
+ *  config configuration of the magnetometer
+ *
+ * Returns:
+ *  none
+ */
+void devices_init(qmc_config_t *config)
+{
+	init_systick();
+	for(int i = 0; i < NUM_BUSES; i++)
+	{
+		int used = 0;
+		for(int j = 0; j < NUM_DEVICES; j++)
+		{
+			if(devices[j]->bus == buses[i])
+			{
+				used = 1;
+			}
+		}
+		if(!used)
+		{
+			continue;
+		}
+		init_i2c(buses[i]);
+		i2c_set_speed(buses[i], i2c_get_speed_limit(buses[i], devices, NUM_DEVICES));
+	}
+	CHECK_EQ(init_ssd1306(), SSD1306_OK);
+	CHECK_EQ(init_qmc(config), QMC_OK);
+}
+
+/*
+ * Function to turn off the faults the I2C_FAULT_INJECT build injects, for tests which need every
+ * transfer to go through. Does nothing in the other builds
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void devices_disable_faults()
+{
+#ifdef I2C_FAULT_INJECT
+	for(i2c_fault_t fault = 0; fault < I2C_NUM_FAULTS; fault++)
+	{
+		i2c_set_fault_rate(fault, 0);
+	}
+#endif
+}
+
+/*
+ * Function to check that the bus models saw none of the sequences the KL25Z reference manual
+ * warns about: a start on a busy bus, a stop in the middle of a byte, an ack of the last byte
+ * read, a repeated start with MULT set and D accessed while no byte can start. The stop checks
+ * are left out of the I2C_FAULT_INJECT build
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void devices_check_bus()
+{
+	for(sim_i2c_bus_t bus = SIM_I2C0; bus <= SIM_I2C1; bus++)
+	{
+		sim_i2c_stats_t stats;
+		sim_i2c_get_stats(bus, &stats);
+		CHECK_EQ(stats.start_while_busy, 0);
+#ifndef I2C_FAULT_INJECT//an injected arbitration loss stops the transfer wherever it is, as a real one would
+		CHECK_EQ(stats.stop_mid_byte, 0);
+		CHECK_EQ(stats.last_byte_acked, 0);
+#endif
+		CHECK_EQ(stats.rstart_errata, 0);
+		CHECK_EQ(stats.bad_d_accesses, 0);
+	}
+}
@@ -0,0 +1,42 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    devices.h
+ * @brief   Header file for the board of the host simulator, the display and magnetometer models
+ * 			wired to the buses source/ puts them on, and the bring up main() does.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __DEVICES_H__
+#define __DEVICES_H__
+#include "stdint.h"
+#include "sim_qmc5883l.h"
+#include "sim_ssd1306.h"
+#include "QMC5883L.h"
+
+extern sim_qmc5883l_t devices_qmc;
+extern sim_ssd1306_t devices_ssd;
+
+void devices_attach();
+
+void devices_main_config(qmc_config_t *config);
+
+void devices_init(qmc_config_t *config);
+
+sim_i2c_bus_t devices_qmc_bus();
+
+void devices_disable_faults();
+
+void devices_check_bus();
+
+#endif
@@ -0,0 +1,114 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    host_cmsis.h
+ * @brief   Core intrinsics for the host build, included ahead of every file of source/. It takes the
+ * 			place of cmsis_gcc.h, whose inline assembly is Cortex-M only. PRIMASK is kept by the
+ * 			simulator, so __disable_irq() and __set_PRIMASK() hold off the simulated interrupts the
+ * 			same way they hold off the real ones. Barriers only stop the compiler, the simulator
+ * 			runs one thread so nothing else can reorder memory.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __HOST_CMSIS_H__
+#define __HOST_CMSIS_H__
+#include <stdint.h>
+
+#define __CMSIS_GCC_H//cmsis_gcc.h is skipped, everything it gives is below
+
+uint32_t sim_get_primask();
+void sim_set_primask(uint32_t primask);
+void sim_wait_for_interrupt();
+
+static inline void __enable_irq()
+{
+	sim_set_primask(0);
+}
+
+static inline void __disable_irq()
+{
+	sim_set_primask(1);
+}
+
+static inline uint32_t __get_PRIMASK()
+{
+	return sim_get_primask();
+}
+
+static inline void __set_PRIMASK(uint32_t primask)
+{
+	sim_set_primask(primask & 1);
+}
+
+static inline void __NOP()
+{
+}
+
+static inline void __WFI()
+{
+	sim_wait_for_interrupt();
+}
+
+static inline void __WFE()
+{
+	sim_wait_for_interrupt();
+}
+
+static inline void __SEV()
+{
+}
+
+static inline void __ISB()
+{
+	__asm__ volatile("" ::: "memory");
+}
+
+static inline void __DSB()
+{
+	__asm__ volatile("" ::: "memory");
+}
+
+static inline void __DMB()
+{
+	__asm__ volatile("" ::: "memory");
+}
+
+static inline uint32_t __REV(uint32_t value)
+{
+	return __builtin_bswap32(value);
+}
+
+static inline uint32_t __REV16(uint32_t value)
+{
+	return ((value & 0xFF00FF00U) >> 8) | ((value & 0x00FF00FFU) << 8);
+}
+
+static inline int32_t __REVSH(int32_t value)
+{
+	return (int16_t)__builtin_bswap16((uint16_t)value);
+}
+
+static inline uint32_t __ROR(uint32_t value, uint32_t shift)
+{
+	shift &= 31;
+	return shift ? (value >> shift) | (value << (32 - shift)) : value;
+}
+
+static inline uint8_t __CLZ(uint32_t value)
+{
+	return value ? __builtin_clz(value) : 32;
+}
+
+#define __BKPT(value) __builtin_trap()
+
+#endif
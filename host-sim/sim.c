@@ -0,0 +1,1016 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim.c
+ * @brief   Core of the host simulator: the register mapping, the sanitizer hooks, the virtual
+ * 			clock with its event list, the NVIC, SysTick and PRIMASK.
+ *
+ * 			A hook runs before each access of the instrumented code. It first applies the side
+ * 			effects of the store seen by the previous hook, which has landed by now, then
+ * 			advances the clock and runs the events that are due, takes any interrupt that is
+ * 			pending and not masked, and finally, for a load from a register block, brings the
+ * 			register up to date. Interrupts are taken between two accesses, like on the core, so
+ * 			a read-modify-write of a register can be split by an interrupt as it can on target.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "sim.h"
+#include "sim_gpio.h"
+#include "sim_i2c.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdarg.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/mman.h"
+
+#define PERIPH_BASE			(0x40000000U)
+#define PERIPH_SIZE			(0x00100000U)//AIPS and GPIO, up to the end of the fast GPIO block
+#define SCS_SIZE			(0x00001000U)//SysTick, NVIC and SCB
+
+#define MAX_REGIONS			(24U)
+#define MAX_EVENTS			(32U)
+#define THREAD_PRIORITY		(4U)//below the lowest of the 4 priority levels of the M0+
+#define PRIORITY_SHIFT		(6U)//2 priority bits, at the top of each byte
+#define NO_EVENT			UINT64_MAX
+
+#define NVIC_ISER_OFFSET	(0x000U)
+#define NVIC_ICER_OFFSET	(0x080U)
+#define NVIC_ISPR_OFFSET	(0x100U)
+#define NVIC_ICPR_OFFSET	(0x180U)
+#define NVIC_REGION_SIZE	(0x320U)
+
+#define SYSTICK_CTRL_OFFSET	(0x00U)
+#define SYSTICK_VAL_OFFSET	(0x08U)
+#define SYSTICK_REGION_SIZE	(0x10U)
+#define SYSTICK_EXCEPTION	(15U)
+
+extern void SysTick_Handler() __attribute__((weak));
+extern void DMA0_IRQHandler() __attribute__((weak));
+extern void DMA1_IRQHandler() __attribute__((weak));
+extern void I2C0_IRQHandler() __attribute__((weak));
+extern void I2C1_IRQHandler() __attribute__((weak));
+extern void PORTA_IRQHandler() __attribute__((weak));
+extern void PORTD_IRQHandler() __attribute__((weak));
+
+typedef void (*sim_handler_t)();
+
+typedef struct{
+	sim_irq_level_fn_t level;
+	void *context;
+	uint8_t last;
+}irq_line_t;
+
+//store seen by the last hook, its side effects are applied once it has landed
+typedef struct{
+	uintptr_t addr;
+	uint8_t size;
+	uint32_t old_value;
+	const sim_region_t *region;
+	uint8_t valid;
+}pending_store_t;
+
+static struct{
+	sim_time_t now;
+	sim_time_t next_event;
+	sim_event_t *events[MAX_EVENTS];
+	uint8_t num_events;
+
+	sim_region_t regions[MAX_REGIONS];
+	uint8_t num_regions;
+	pending_store_t store;
+
+	uint64_t pending;//bit per exception number
+	uint32_t enabled;//bit per interrupt
+	irq_line_t lines[SIM_NUM_EXCEPTIONS];
+	sim_handler_t handlers[SIM_NUM_EXCEPTIONS];
+	uint8_t active_priority;
+	uint8_t depth;
+
+	uint32_t primask;
+	sim_time_t primask_since;
+
+	sim_event_t systick_event;
+	sim_time_t systick_start;
+
+	sim_time_t limit;
+	void (*limit_expired)();
+
+	sim_stats_t stats;
+}sim;
+
+/*
+ * Function to map the register blocks of the KL25Z at their addresses. Called once, before the
+ * test runner forks, so every test starts from its own copy
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void sim_init()
+{
+	if(mmap((void *)PERIPH_BASE, PERIPH_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *)PERIPH_BASE ||
+	   mmap((void *)SCS_BASE, SCS_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *)SCS_BASE)
+	{
+		fprintf(stderr, "could not map the KL25Z register blocks, link with -no-pie\n");
+		exit(1);
+	}
+}
+
+/*
+ * Function to print why the run failed and end it
+ *
+ * Parameters:
+ *  fmt printf format of the message, followed by its arguments
+ *
+ * Returns:
+ *  does not return
+ */
+void sim_fail(const char *fmt, ...)
+{
+	va_list args;
+	fflush(stdout);
+	fprintf(stderr, "SIM FAIL at %uus: ", sim_now_us());
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+	fflush(stderr);
+	_exit(2);
+}
+
+/*
+ * Function to get the virtual time
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  core clock cycles since the reset
+ */
+sim_time_t sim_now()
+{
+	return sim.now;
+}
+
+/*
+ * Function to get the virtual time in microseconds
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  microseconds since the reset
+ */
+uint32_t sim_now_us()
+{
+	return (uint32_t)(sim.now / SIM_CYCLES_PER_US);
+}
+
+/*
+ * Function to find the earliest armed event
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void sim_update_next_event()
+{
+	sim.next_event = NO_EVENT;
+	for(int i = 0; i < sim.num_events; i++)
+	{
+		if(sim.events[i]->time < sim.next_event)
+		{
+			sim.next_event = sim.events[i]->time;
+		}
+	}
+}
+
+/*
+ * Function to set up an event of a model, it is not armed
+ *
+ * Parameters:
+ *  event(out) pointer to the event
+ *  fn function to run when it is due
+ *  context passed to fn
+ *
+ * Returns:
+ *  none
+ */
+void sim_event_init(sim_event_t *event, sim_event_fn_t fn, void *context)
+{
+	event->fn = fn;
+	event->context = context;
+	event->armed = 0;
+}
+
+/*
+ * Function to take an event off the event list
+ *
+ * Parameters:
+ *  event pointer to the event, nothing happens if it is not armed
+ *
+ * Returns:
+ *  none
+ */
+void sim_event_cancel(sim_event_t *event)
+{
+	if(!event->armed)
+	{
+		return;
+	}
+	for(int i = 0; i < sim.num_events; i++)
+	{
+		if(sim.events[i] == event)
+		{
+			sim.events[i] = sim.events[--sim.num_events];
+			break;
+		}
+	}
+	event->armed = 0;
+	sim_update_next_event();
+}
+
+/*
+ * Function to arm an event, an armed event is moved to the new time
+ *
+ * Parameters:
+ *  event pointer to the event
+ *  delay cycles from now till it is due
+ *
+ * Returns:
+ *  none
+ */
+void sim_event_schedule(sim_event_t *event, sim_time_t delay)
+{
+	sim_event_cancel(event);
+	if(sim.num_events == MAX_EVENTS)
+	{
+		sim_fail("event list full");
+	}
+	event->time = sim.now + delay;
+	event->armed = 1;
+	sim.events[sim.num_events++] = event;
+	if(event->time < sim.next_event)
+	{
+		sim.next_event = event->time;
+	}
+}
+
+/*
+ * Function to run the earliest due event
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void sim_run_next_event()
+{
+	sim_event_t *event = NULL;
+	for(int i = 0; i < sim.num_events; i++)
+	{
+		if(event == NULL || sim.events[i]->time < event->time)
+		{
+			event = sim.events[i];
+		}
+	}
+	if(event->time > sim.now)
+	{
+		sim.now = event->time;
+	}
+	sim_event_cancel(event);
+	event->fn(event->context);
+}
+
+/*
+ * Function to move the virtual clock forward, running the events that fall due on the way
+ *
+ * Parameters:
+ *  cycles core clock cycles to advance by
+ *
+ * Returns:
+ *  none
+ */
+void sim_advance(sim_time_t cycles)
+{
+	sim_time_t target = sim.now + cycles;
+	while(sim.next_event <= target)
+	{
+		sim_run_next_event();
+	}
+	sim.now = target;
+
+	if(sim.primask && sim.now - sim.primask_since > (sim_time_t)SIM_PRIMASK_MAX_US*SIM_CYCLES_PER_US)
+	{
+		sim_fail("interrupts held off for more than %uus", SIM_PRIMASK_MAX_US);
+	}
+	if(sim.limit && sim.now >= sim.limit)
+	{
+		sim.limit = 0;
+		sim.limit_expired();
+	}
+}
+
+/*
+ * Function to add a register block with side effects
+ *
+ * Parameters:
+ *  region(in) pointer to the description of the block, copied
+ *
+ * Returns:
+ *  none
+ */
+void sim_region_add(const sim_region_t *region)
+{
+	if(sim.num_regions == MAX_REGIONS)
+	{
+		sim_fail("too many register regions");
+	}
+	sim.regions[sim.num_regions++] = *region;
+}
+
+/*
+ * Function to find the register block an address is in
+ *
+ * Parameters:
+ *  addr the address
+ *
+ * Returns:
+ *  pointer to the block, NULL for plain memory and registers without side effects
+ */
+static const sim_region_t* sim_region_find(uintptr_t addr)
+{
+	for(int i = 0; i < sim.num_regions; i++)
+	{
+		if(addr - sim.regions[i].base < sim.regions[i].size)
+		{
+			return &sim.regions[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function to read a register without going through the hooks
+ *
+ * Parameters:
+ *  addr address of the register
+ *  size 1, 2 or 4 bytes
+ *
+ * Returns:
+ *  value of the register
+ */
+static uint32_t sim_load(uintptr_t addr, uint8_t size)
+{
+	switch(size)
+	{
+	case 1:
+		return *(volatile uint8_t *)addr;
+	case 2:
+		return *(volatile uint16_t *)addr;
+	default:
+		return *(volatile uint32_t *)addr;
+	}
+}
+
+/*
+ * Function to apply the side effects of the store seen by the last hook
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void sim_flush()
+{
+	pending_store_t store = sim.store;
+	if(!store.valid)
+	{
+		return;
+	}
+	sim.store.valid = 0;
+	store.region->write(store.region->context, store.addr - store.region->base, store.size, store.old_value);
+}
+
+/*
+ * Function to write a register for a bus master other than the core, the DMA controller, with the
+ * same side effects as a store of the core
+ *
+ * Parameters:
+ *  addr address of the register
+ *  size 1, 2 or 4 bytes
+ *  value value to store
+ *
+ * Returns:
+ *  none
+ */
+void sim_write_register(uintptr_t addr, uint8_t size, uint32_t value)
+{
+	const sim_region_t *region = sim_region_find(addr);
+	uint32_t old_value = sim_load(addr, size);
+
+	switch(size)
+	{
+	case 1:
+		*(volatile uint8_t *)addr = value;
+		break;
+	case 2:
+		*(volatile uint16_t *)addr = value;
+		break;
+	default:
+		*(volatile uint32_t *)addr = value;
+		break;
+	}
+	if(region && region->write)
+	{
+		region->write(region->context, addr - region->base, size, old_value);
+	}
+}
+
+/*
+ * Function to connect the interrupt request line of a model. The line is a level, the NVIC
+ * latches it as pending when it goes high, and again when a handler returns with it still high
+ *
+ * Parameters:
+ *  irq the interrupt
+ *  level function returning the level of the line
+ *  context passed to level
+ *
+ * Returns:
+ *  none
+ */
+void sim_irq_connect(IRQn_Type irq, sim_irq_level_fn_t level, void *context)
+{
+	irq_line_t *line = &sim.lines[SIM_EXCEPTION(irq)];
+	line->level = level;
+	line->context = context;
+	line->last = 0;
+}
+
+/*
+ * Function to latch the interrupt lines that went high
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void sim_poll_lines()
+{
+	for(int e = SIM_EXCEPTION(0); e < SIM_NUM_EXCEPTIONS; e++)
+	{
+		irq_line_t *line = &sim.lines[e];
+		uint8_t level;
+		if(!line->level)
+		{
+			continue;
+		}
+		level = line->level(line->context) ? 1 : 0;
+		if(level && !line->last)
+		{
+			sim.pending |= 1ULL << e;
+		}
+		line->last = level;
+	}
+}
+
+/*
+ * Function to get the priority of an exception from the NVIC and SCB priority registers
+ *
+ * Parameters:
+ *  exception exception number
+ *
+ * Returns:
+ *  priority 0 to 3, lower is more urgent
+ */
+static uint8_t sim_priority(int exception)
+{
+	if(exception == SYSTICK_EXCEPTION)
+	{
+		return (SCB->SHP[1] >> 24) >> PRIORITY_SHIFT;
+	}
+	int irq = exception - SIM_EXCEPTION(0);
+	return ((NVIC->IP[irq >> 2] >> ((irq & 3) * 8)) & 0xFF) >> PRIORITY_SHIFT;
+}
+
+/*
+ * Function to run the handler of an exception
+ *
+ * Parameters:
+ *  exception exception number
+ *  priority its priority
+ *
+ * Returns:
+ *  none
+ */
+static void sim_take(int exception, uint8_t priority)
+{
+	uint8_t preempted = sim.active_priority;
+	sim_time_t start = sim.now;
+	irq_line_t *line = &sim.lines[exception];
+
+	sim.pending &= ~(1ULL << exception);
+	if(!sim.handlers[exception])
+	{
+		sim_fail("no handler for exception %d", exception);
+	}
+	sim.active_priority = priority;
+	sim.depth++;
+	sim.stats.count[exception]++;
+	sim_advance(SIM_IRQ_ENTRY_CYCLES);
+
+	sim.handlers[exception]();
+
+	sim_flush();
+	sim_advance(SIM_IRQ_EXIT_CYCLES);
+	sim.depth--;
+	sim.active_priority = preempted;
+	sim.stats.cycles[exception] += sim.now - start;
+	if(line->level && line->level(line->context))
+	{
+		sim.pending |= 1ULL << exception;
+	}
+}
+
+/*
+ * Function to take the pending interrupts that can preempt the code running now, most urgent first
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void sim_dispatch()
+{
+	while(1)
+	{
+		int best = -1;
+		uint8_t best_priority = sim.active_priority;
+
+		sim_poll_lines();
+		if(sim.primask || !sim.pending)
+		{
+			return;
+		}
+		for(int e = SYSTICK_EXCEPTION; e < SIM_NUM_EXCEPTIONS; e++)
+		{
+			if(!(sim.pending & (1ULL << e)))
+			{
+				continue;
+			}
+			if(e >= SIM_EXCEPTION(0) && !(sim.enabled & (1U << (e - SIM_EXCEPTION(0)))))
+			{
+				continue;
+			}
+			uint8_t priority = sim_priority(e);
+			if(priority < best_priority)
+			{
+				best = e;
+				best_priority = priority;
+			}
+		}
+		if(best < 0)
+		{
+			return;
+		}
+		sim_take(best, best_priority);
+	}
+}
+
+/*
+ * Function to check if the code running now is an interrupt handler
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  1 in a handler, 0 in thread mode
+ */
+int sim_in_handler()
+{
+	return sim.depth != 0;
+}
+
+uint32_t sim_get_primask()
+{
+	return sim.primask;
+}
+
+/*
+ * Function to set PRIMASK, called for __disable_irq(), __enable_irq() and __set_PRIMASK(). Clearing
+ * it takes the interrupts that went pending meanwhile
+ *
+ * Parameters:
+ *  primask 1 to hold off interrupts, 0 to allow them
+ *
+ * Returns:
+ *  none
+ */
+void sim_set_primask(uint32_t primask)
+{
+	sim_flush();
+	sim_advance(1);
+	if(primask && !sim.primask)
+	{
+		sim.primask_since = sim.now;
+	}else if(!primask && sim.primask && sim.now - sim.primask_since > sim.stats.primask_max){
+		sim.stats.primask_max = sim.now - sim.primask_since;
+	}
+	sim.primask = primask;
+	if(!primask)
+	{
+		sim_dispatch();
+	}
+}
+
+/*
+ * Function for __WFI(), sleeps till the next event
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void sim_wait_for_interrupt()
+{
+	sim_flush();
+	if(sim.next_event == NO_EVENT)
+	{
+		sim_fail("WFI with nothing left to wake the core");
+	}
+	sim_advance(sim.next_event - sim.now);
+	sim_dispatch();
+}
+
+/*
+ * Function to let the virtual time run from the test, with the models and interrupts running
+ *
+ * Parameters:
+ *  us microseconds to run for
+ *
+ * Returns:
+ *  none
+ */
+void sim_run_us(uint32_t us)
+{
+	sim_time_t target = sim.now + (sim_time_t)us*SIM_CYCLES_PER_US;
+	sim_flush();
+	sim_dispatch();
+	while(sim.now < target)
+	{
+		sim_time_t step = (sim.next_event < target) ? sim.next_event : target;
+		sim_advance(step > sim.now ? step - sim.now : 0);
+		sim_dispatch();
+	}
+}
+
+/*
+ * Function to let the virtual time run from the test till a condition holds
+ *
+ * Parameters:
+ *  done function checking the condition
+ *  context passed to done
+ *  max_us longest time to run for
+ *
+ * Returns:
+ *  1 if the condition holds, 0 if max_us went by first
+ */
+int sim_run_until(int (*done)(void *context), void *context, uint32_t max_us)
+{
+	sim_time_t target = sim.now + (sim_time_t)max_us*SIM_CYCLES_PER_US;
+	sim_flush();
+	sim_dispatch();
+	while(!done(context))
+	{
+		if(sim.now >= target)
+		{
+			return 0;
+		}
+		sim_time_t step = (sim.next_event < target) ? sim.next_event : target;
+		sim_advance(step > sim.now ? step - sim.now : 0);
+		sim_dispatch();
+	}
+	return 1;
+}
+
+/*
+ * Function to get the counters of the simulator
+ *
+ * Parameters:
+ *  stats(out) pointer to structure to copy the counters into
+ *
+ * Returns:
+ *  none
+ */
+void sim_get_stats(sim_stats_t *stats)
+{
+	*stats = sim.stats;
+}
+
+/*
+ * Function to end the run at a virtual time, for runs of code that never returns
+ *
+ * Parameters:
+ *  us virtual time from now, 0 for no limit
+ *  expired function to call at the limit, it is expected to end the process
+ *
+ * Returns:
+ *  none
+ */
+void sim_set_time_limit(uint32_t us, void (*expired)())
+{
+	sim.limit = us ? sim.now + (sim_time_t)us*SIM_CYCLES_PER_US : 0;
+	sim.limit_expired = expired;
+}
+
+/*
+ * Function to bring the NVIC registers up to date before a load
+ *
+ * Parameters:
+ *  context unused
+ *  offset offset of the register in the NVIC
+ *  size size of the load
+ *
+ * Returns:
+ *  none
+ */
+static void nvic_read(void *context, uint32_t offset, uint8_t size)
+{
+	sim_poll_lines();
+	NVIC->ISER[0] = sim.enabled;
+	NVIC->ICER[0] = sim.enabled;
+	NVIC->ISPR[0] = (uint32_t)(sim.pending >> SIM_EXCEPTION(0));
+	NVIC->ICPR[0] = (uint32_t)(sim.pending >> SIM_EXCEPTION(0));
+}
+
+/*
+ * Function to apply a store to the NVIC. The set and clear registers only act on the bits written as 1
+ *
+ * Parameters:
+ *  context unused
+ *  offset offset of the register in the NVIC
+ *  size size of the store
+ *  old_value value of the register before the store
+ *
+ * Returns:
+ *  none
+ */
+static void nvic_write(void *context, uint32_t offset, uint8_t size, uint32_t old_value)
+{
+	switch(offset)
+	{
+	case NVIC_ISER_OFFSET:
+		sim.enabled |= NVIC->ISER[0];
+		break;
+	case NVIC_ICER_OFFSET:
+		sim.enabled &= ~NVIC->ICER[0];
+		break;
+	case NVIC_ISPR_OFFSET:
+		sim.pending |= (uint64_t)NVIC->ISPR[0] << SIM_EXCEPTION(0);
+		break;
+	case NVIC_ICPR_OFFSET:
+		for(int irq = 0; irq < 32; irq++)
+		{//a level that is still high stays pending
+			irq_line_t *line = &sim.lines[SIM_EXCEPTION(irq)];
+			if((NVIC->ICPR[0] & (1U << irq)) && !(line->level && line->level(line->context)))
+			{
+				sim.pending &= ~(1ULL << SIM_EXCEPTION(irq));
+			}
+		}
+		break;
+	default:
+		return;
+	}
+	nvic_read(context, offset, size);
+}
+
+/*
+ * Function for the SysTick wrap, the counter reloads and the exception goes pending
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  none
+ */
+static void systick_wrap(void *context)
+{
+	sim.systick_start = sim.now;
+	sim_event_schedule(&sim.systick_event, ((sim_time_t)SysTick->LOAD + 1)*SIM_SYSTICK_DIV);
+	if(SysTick->CTRL & SysTick_CTRL_TICKINT_Msk)
+	{
+		sim.pending |= 1ULL << SYSTICK_EXCEPTION;
+	}
+}
+
+/*
+ * Function to bring the SysTick counter up to date before a load
+ *
+ * Parameters:
+ *  context unused
+ *  offset offset of the register in the SysTick block
+ *  size size of the load
+ *
+ * Returns:
+ *  none
+ */
+static void systick_read(void *context, uint32_t offset, uint8_t size)
+{
+	sim_time_t counts;
+	if(offset != SYSTICK_VAL_OFFSET || !(SysTick->CTRL & SysTick_CTRL_ENABLE_Msk))
+	{
+		return;
+	}
+	counts = (sim.now - sim.systick_start)/SIM_SYSTICK_DIV;
+	SysTick->VAL = (counts > SysTick->LOAD) ? 0 : SysTick->LOAD - counts;
+}
+
+/*
+ * Function to apply a store to the SysTick block. Enabling the counter or writing the counter
+ * starts a new period
+ *
+ * Parameters:
+ *  context unused
+ *  offset offset of the register in the SysTick block
+ *  size size of the store
+ *  old_value value of the register before the store
+ *
+ * Returns:
+ *  none
+ */
+static void systick_write(void *context, uint32_t offset, uint8_t size, uint32_t old_value)
+{
+	uint32_t enabled = SysTick->CTRL & SysTick_CTRL_ENABLE_Msk;
+	if(offset == SYSTICK_CTRL_OFFSET && enabled == (old_value & SysTick_CTRL_ENABLE_Msk))
+	{
+		return;
+	}
+	if(offset != SYSTICK_CTRL_OFFSET && offset != SYSTICK_VAL_OFFSET)
+	{
+		return;
+	}
+	if(enabled)
+	{
+		sim.systick_start = sim.now;
+		sim_event_schedule(&sim.systick_event, ((sim_time_t)SysTick->LOAD + 1)*SIM_SYSTICK_DIV);
+	}else{
+		sim_event_cancel(&sim.systick_event);
+	}
+}
+
+/*
+ * Function to put the simulated core and every peripheral model back to their reset state.
+ * Device models are attached by the test after this
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void sim_reset()
+{
+	sim_region_t nvic_region = {
+			.base = NVIC_BASE,
+			.size = NVIC_REGION_SIZE,
+			.read = nvic_read,
+			.write = nvic_write,
+	};
+	sim_region_t systick_region = {
+			.base = SysTick_BASE,
+			.size = SYSTICK_REGION_SIZE,
+			.read = systick_read,
+			.write = systick_write,
+	};
+
+	memset((void *)PERIPH_BASE, 0, PERIPH_SIZE);
+	memset((void *)SCS_BASE, 0, SCS_SIZE);
+	memset(&sim, 0, sizeof(sim));
+	sim.next_event = NO_EVENT;
+	sim.active_priority = THREAD_PRIORITY;
+
+	sim.handlers[SYSTICK_EXCEPTION] = SysTick_Handler;
+	sim.handlers[SIM_EXCEPTION(DMA0_IRQn)] = DMA0_IRQHandler;
+	sim.handlers[SIM_EXCEPTION(DMA1_IRQn)] = DMA1_IRQHandler;
+	sim.handlers[SIM_EXCEPTION(I2C0_IRQn)] = I2C0_IRQHandler;
+	sim.handlers[SIM_EXCEPTION(I2C1_IRQn)] = I2C1_IRQHandler;
+	sim.handlers[SIM_EXCEPTION(PORTA_IRQn)] = PORTA_IRQHandler;
+	sim.handlers[SIM_EXCEPTION(PORTD_IRQn)] = PORTD_IRQHandler;
+
+	sim_event_init(&sim.systick_event, systick_wrap, NULL);
+	sim_region_add(&nvic_region);
+	sim_region_add(&systick_region);
+	sim_gpio_reset();
+	sim_i2c_reset();
+}
+
+/*
+ * Function to run one hook: apply the last store, advance the clock, take the interrupts and bring
+ * a register up to date before it is loaded
+ *
+ * Parameters:
+ *  addr address of the access
+ *  size size of the access
+ *  write 1 for a store, 0 for a load
+ *
+ * Returns:
+ *  none
+ */
+static inline void sim_access(void *addr, uint8_t size, int write)
+{
+	uintptr_t a = (uintptr_t)addr;
+	const sim_region_t *region = NULL;
+
+	sim_flush();
+	sim.stats.accesses++;
+	if(a - PERIPH_BASE < PERIPH_SIZE || a - SCS_BASE < SCS_SIZE)
+	{
+		region = sim_region_find(a);
+		sim_advance(SIM_PERIPH_ACCESS_CYCLES);
+	}else{
+		sim_advance(SIM_ACCESS_CYCLES);
+	}
+	sim_dispatch();
+	if(region == NULL)
+	{
+		return;
+	}
+	if(write)
+	{
+		if(region->write)
+		{
+			sim.store.addr = a;
+			sim.store.size = size;
+			sim.store.old_value = sim_load(a, size);
+			sim.store.region = region;
+			sim.store.valid = 1;
+		}
+	}else if(region->read){
+		region->read(region->context, a - region->base, size);
+	}
+}
+
+/*
+ * Stub of the clock driver, the bus clock of the default RUN configuration
+ */
+uint32_t CLOCK_GetBusClkFreq()
+{
+	return SIM_BUS_HZ;
+}
+
+//hooks of the thread sanitizer instrumentation, in place of its run time library
+void __tsan_init() {}
+void __tsan_func_entry(void *pc) { sim_flush(); sim_advance(SIM_CALL_CYCLES); sim_dispatch(); }
+void __tsan_func_exit() { sim_flush(); }
+void __tsan_read1(void *addr) { sim_access(addr, 1, 0); }
+void __tsan_read2(void *addr) { sim_access(addr, 2, 0); }
+void __tsan_read4(void *addr) { sim_access(addr, 4, 0); }
+void __tsan_read8(void *addr) { sim_access(addr, 8, 0); }
+void __tsan_read16(void *addr) { sim_access(addr, 16, 0); }
+void __tsan_write1(void *addr) { sim_access(addr, 1, 1); }
+void __tsan_write2(void *addr) { sim_access(addr, 2, 1); }
+void __tsan_write4(void *addr) { sim_access(addr, 4, 1); }
+void __tsan_write8(void *addr) { sim_access(addr, 8, 1); }
+void __tsan_write16(void *addr) { sim_access(addr, 16, 1); }
+void __tsan_unaligned_read2(void *addr) { sim_access(addr, 2, 0); }
+void __tsan_unaligned_read4(void *addr) { sim_access(addr, 4, 0); }
+void __tsan_unaligned_read8(void *addr) { sim_access(addr, 8, 0); }
+void __tsan_unaligned_read16(void *addr) { sim_access(addr, 16, 0); }
+void __tsan_unaligned_write2(void *addr) { sim_access(addr, 2, 1); }
+void __tsan_unaligned_write4(void *addr) { sim_access(addr, 4, 1); }
+void __tsan_unaligned_write8(void *addr) { sim_access(addr, 8, 1); }
+void __tsan_unaligned_write16(void *addr) { sim_access(addr, 16, 1); }
+void __tsan_volatile_read1(void *addr) { sim_access(addr, 1, 0); }
+void __tsan_volatile_read2(void *addr) { sim_access(addr, 2, 0); }
+void __tsan_volatile_read4(void *addr) { sim_access(addr, 4, 0); }
+void __tsan_volatile_read8(void *addr) { sim_access(addr, 8, 0); }
+void __tsan_volatile_read16(void *addr) { sim_access(addr, 16, 0); }
+void __tsan_volatile_write1(void *addr) { sim_access(addr, 1, 1); }
+void __tsan_volatile_write2(void *addr) { sim_access(addr, 2, 1); }
+void __tsan_volatile_write4(void *addr) { sim_access(addr, 4, 1); }
+void __tsan_volatile_write8(void *addr) { sim_access(addr, 8, 1); }
+void __tsan_volatile_write16(void *addr) { sim_access(addr, 16, 1); }
+void __tsan_read_range(void *addr, unsigned long size) { sim_access(addr, 4, 0); sim_advance(size/4*SIM_ACCESS_CYCLES); }
+void __tsan_write_range(void *addr, unsigned long size) { sim_access(addr, 4, 1); sim_advance(size/4*SIM_ACCESS_CYCLES); }
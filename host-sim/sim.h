@@ -0,0 +1,113 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim.h
+ * @brief   Header file for the core of the host simulator. The register blocks of the KL25Z are
+ * 			mapped at their real addresses, and the files of source/ are built with the thread
+ * 			sanitizer instrumentation, whose hooks see every load and store before it happens.
+ * 			The hooks advance a virtual clock, run the peripheral models at the right time,
+ * 			apply the side effects of register accesses and take the interrupts, so the drivers
+ * 			run unchanged against the models.
+ *
+ * 			Time is counted in cycles of the 48MHz core clock. Every instrumented access costs
+ * 			SIM_ACCESS_CYCLES and every call SIM_CALL_CYCLES, a rough model of the M0+ that is
+ * 			good for comparing two builds, not for absolute cycle counts.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __SIM_H__
+#define __SIM_H__
+#include "stdint.h"
+#include "MKL25Z4.h"
+
+#define SIM_CORE_HZ				(48000000U)
+#define SIM_BUS_HZ				(24000000U)
+#define SIM_CYCLES_PER_US		(SIM_CORE_HZ/1000000U)
+#define SIM_SYSTICK_DIV			(16U)//systick runs from the core clock divided by 16
+
+#define SIM_ACCESS_CYCLES		(3U)//memory access and the instructions around it
+#define SIM_PERIPH_ACCESS_CYCLES (4U)//through the peripheral bridge
+#define SIM_CALL_CYCLES			(4U)
+#define SIM_IRQ_ENTRY_CYCLES	(15U)
+#define SIM_IRQ_EXIT_CYCLES		(10U)
+
+#define SIM_PRIMASK_MAX_US		(10000U)//interrupts held off for longer than this fail the run
+#define SIM_NUM_EXCEPTIONS		(48U)//16 system exceptions and 32 interrupts
+#define SIM_EXCEPTION(irq)		((irq) + 16)
+
+typedef uint64_t sim_time_t;
+
+typedef void (*sim_event_fn_t)(void *context);
+
+//an event is owned by the model that schedules it, the simulator only links the armed ones
+typedef struct{
+	sim_time_t time;
+	sim_event_fn_t fn;
+	void *context;
+	uint8_t armed;
+}sim_event_t;
+
+//a block of registers with side effects. read runs before a load from the block, write after a
+//store to it has landed, with the value the register had before the store
+typedef struct{
+	uintptr_t base;
+	uint32_t size;
+	void (*read)(void *context, uint32_t offset, uint8_t size);
+	void (*write)(void *context, uint32_t offset, uint8_t size, uint32_t old_value);
+	void *context;
+}sim_region_t;
+
+typedef int (*sim_irq_level_fn_t)(void *context);
+
+typedef struct{
+	uint32_t count[SIM_NUM_EXCEPTIONS];
+	sim_time_t cycles[SIM_NUM_EXCEPTIONS];//time spent in each handler, interrupts it was preempted by included
+	sim_time_t primask_max;//longest time interrupts were held off
+	uint64_t accesses;
+}sim_stats_t;
+
+void sim_init();
+
+void sim_reset();
+
+sim_time_t sim_now();
+
+uint32_t sim_now_us();
+
+void sim_advance(sim_time_t cycles);
+
+void sim_run_us(uint32_t us);
+
+int sim_run_until(int (*done)(void *context), void *context, uint32_t max_us);
+
+void sim_event_init(sim_event_t *event, sim_event_fn_t fn, void *context);
+
+void sim_event_schedule(sim_event_t *event, sim_time_t delay);
+
+void sim_event_cancel(sim_event_t *event);
+
+void sim_region_add(const sim_region_t *region);
+
+void sim_write_register(uintptr_t addr, uint8_t size, uint32_t value);
+
+void sim_irq_connect(IRQn_Type irq, sim_irq_level_fn_t level, void *context);
+
+int sim_in_handler();
+
+void sim_get_stats(sim_stats_t *stats);
+
+void sim_set_time_limit(uint32_t us, void (*expired)());
+
+void sim_fail(const char *fmt, ...);
+
+#endif
@@ -0,0 +1,371 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim_gpio.c
+ * @brief   PORT and GPIO model of the host simulator. Covers the pin mux, the pin interrupt flags
+ * 			with the edge and level modes of IRQC, and the data registers of the GPIO blocks.
+ * 			Pins nobody drives read as 0.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "sim_gpio.h"
+#include "sim.h"
+#include "string.h"
+
+#define PORT_REGION_SIZE	(0xA4U)
+#define PORT_ISFR_OFFSET	(0xA0U)
+#define PORT_PCR_COUNT		(32U)
+#define GPIO_REGION_SIZE	(0x18U)
+#define GPIO_PSOR_OFFSET	(0x04U)
+#define GPIO_PCOR_OFFSET	(0x08U)
+#define GPIO_PTOR_OFFSET	(0x0CU)
+#define GPIO_PDIR_OFFSET	(0x10U)
+#define MUX_GPIO			(1U)
+#define MAX_WATCHES			(4U)
+
+#define IRQC_LOGIC_0		(0x8U)
+#define IRQC_RISING_EDGE	(0x9U)
+#define IRQC_FALLING_EDGE	(0xAU)
+#define IRQC_EITHER_EDGE	(0xBU)
+#define IRQC_LOGIC_1		(0xCU)
+
+typedef struct{
+	sim_gpio_watch_fn_t fn;
+	void *context;
+}watch_t;
+
+static PORT_Type *const ports[SIM_NUM_PORTS] = PORT_BASE_PTRS;
+static GPIO_Type *const gpios[SIM_NUM_PORTS] = GPIO_BASE_PTRS;
+
+static struct{
+	uint32_t input[SIM_NUM_PORTS];//levels driven onto the pins from outside
+	watch_t watches[SIM_NUM_PORTS][MAX_WATCHES];
+	uint8_t num_watches[SIM_NUM_PORTS];
+}gpio;
+
+/*
+ * Function to get the interrupt line of PORTA
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  1 if a pin interrupt flag is set
+ */
+static int porta_irq_level(void *context)
+{
+	return PORTA->ISFR != 0;
+}
+
+/*
+ * Function to get the interrupt line of PORTD
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  1 if a pin interrupt flag is set
+ */
+static int portd_irq_level(void *context)
+{
+	return PORTD->ISFR != 0;
+}
+
+/*
+ * Function to get the mux setting of a pin
+ *
+ * Parameters:
+ *  port the port
+ *  pin the pin number
+ *
+ * Returns:
+ *  MUX field of the pin control register
+ */
+uint8_t sim_gpio_mux(sim_port_t port, uint8_t pin)
+{
+	return (ports[port]->PCR[pin] & PORT_PCR_MUX_MASK) >> PORT_PCR_MUX_SHIFT;
+}
+
+/*
+ * Function to check if the core drives a pin, as a GPIO output
+ *
+ * Parameters:
+ *  port the port
+ *  pin the pin number
+ *
+ * Returns:
+ *  1 if the pin is a GPIO output
+ */
+int sim_gpio_driven(sim_port_t port, uint8_t pin)
+{
+	return sim_gpio_mux(port, pin) == MUX_GPIO && (gpios[port]->PDDR & (1U << pin));
+}
+
+/*
+ * Function to get the level the core drives onto a pin
+ *
+ * Parameters:
+ *  port the port
+ *  pin the pin number
+ *
+ * Returns:
+ *  level in PDOR, only meaningful when sim_gpio_driven() is 1
+ */
+int sim_gpio_output(sim_port_t port, uint8_t pin)
+{
+	return (gpios[port]->PDOR >> pin) & 1;
+}
+
+/*
+ * Function to set the interrupt flag of a pin
+ *
+ * Parameters:
+ *  port the port
+ *  pin the pin number
+ *
+ * Returns:
+ *  none
+ */
+static void sim_gpio_flag(sim_port_t port, uint8_t pin)
+{
+	ports[port]->PCR[pin] |= PORT_PCR_ISF_MASK;
+	ports[port]->ISFR |= 1U << pin;
+}
+
+/*
+ * Function to drive a pin from outside, the way a device wired to it does. An edge sets the
+ * interrupt flag of the pin if its IRQC asks for it
+ *
+ * Parameters:
+ *  port the port
+ *  pin the pin number
+ *  level 0 or 1
+ *
+ * Returns:
+ *  none
+ */
+void sim_gpio_set_input(sim_port_t port, uint8_t pin, int level)
+{
+	uint32_t mask = 1U << pin;
+	int last = (gpio.input[port] & mask) != 0;
+	uint8_t irqc = (ports[port]->PCR[pin] & PORT_PCR_IRQC_MASK) >> PORT_PCR_IRQC_SHIFT;
+
+	level = level ? 1 : 0;
+	if(level)
+	{
+		gpio.input[port] |= mask;
+	}else{
+		gpio.input[port] &= ~mask;
+	}
+	if((irqc == IRQC_RISING_EDGE && level && !last) || (irqc == IRQC_FALLING_EDGE && !level && last) ||
+	   (irqc == IRQC_EITHER_EDGE && level != last) || (irqc == IRQC_LOGIC_0 && !level) ||
+	   (irqc == IRQC_LOGIC_1 && level))
+	{
+		sim_gpio_flag(port, pin);
+	}
+}
+
+/*
+ * Function to ask to be told after each store to the PORT or GPIO registers of a port
+ *
+ * Parameters:
+ *  port the port
+ *  fn function to call
+ *  context passed to fn
+ *
+ * Returns:
+ *  none
+ */
+void sim_gpio_watch(sim_port_t port, sim_gpio_watch_fn_t fn, void *context)
+{
+	if(gpio.num_watches[port] == MAX_WATCHES)
+	{
+		sim_fail("too many watches on port %d", port);
+	}
+	gpio.watches[port][gpio.num_watches[port]].fn = fn;
+	gpio.watches[port][gpio.num_watches[port]].context = context;
+	gpio.num_watches[port]++;
+}
+
+/*
+ * Function to tell the watches of a port about a store
+ *
+ * Parameters:
+ *  port the port
+ *
+ * Returns:
+ *  none
+ */
+static void sim_gpio_notify(sim_port_t port)
+{
+	for(int i = 0; i < gpio.num_watches[port]; i++)
+	{
+		gpio.watches[port][i].fn(gpio.watches[port][i].context);
+	}
+}
+
+/*
+ * Function to apply a store to the PORT registers. ISF in the PCRs and ISFR are write 1 to clear,
+ * a level mode flags again at once while the level holds
+ *
+ * Parameters:
+ *  context the port
+ *  offset offset of the register in the PORT block
+ *  size size of the store
+ *  old_value value of the register before the store
+ *
+ * Returns:
+ *  none
+ */
+static void port_write(void *context, uint32_t offset, uint8_t size, uint32_t old_value)
+{
+	sim_port_t port = (sim_port_t)(uintptr_t)context;
+	PORT_Type *regs = ports[port];
+	uint32_t cleared = 0;
+
+	if(offset == PORT_ISFR_OFFSET)
+	{
+		cleared = regs->ISFR & old_value;
+		regs->ISFR = old_value & ~cleared;
+	}else if(offset < PORT_PCR_COUNT*4){
+		uint8_t pin = offset/4;
+		uint32_t pcr = regs->PCR[pin];
+		if(pcr & old_value & PORT_PCR_ISF_MASK)
+		{
+			cleared = 1U << pin;
+		}
+		regs->PCR[pin] = (pcr & ~PORT_PCR_ISF_MASK) | (old_value & PORT_PCR_ISF_MASK & ~pcr);
+		regs->ISFR &= ~cleared;
+	}else{
+		return;
+	}
+
+	for(int pin = 0; pin < PORT_PCR_COUNT; pin++)
+	{
+		uint8_t irqc;
+		if(!(cleared & (1U << pin)))
+		{
+			continue;
+		}
+		regs->PCR[pin] &= ~PORT_PCR_ISF_MASK;
+		irqc = (regs->PCR[pin] & PORT_PCR_IRQC_MASK) >> PORT_PCR_IRQC_SHIFT;
+		if((irqc == IRQC_LOGIC_0 && !(gpio.input[port] & (1U << pin))) ||
+		   (irqc == IRQC_LOGIC_1 && (gpio.input[port] & (1U << pin))))
+		{
+			sim_gpio_flag(port, pin);
+		}
+	}
+	sim_gpio_notify(port);
+}
+
+/*
+ * Function to bring PDIR up to date before a load. Pins the core drives read back their output
+ *
+ * Parameters:
+ *  context the port
+ *  offset offset of the register in the GPIO block
+ *  size size of the load
+ *
+ * Returns:
+ *  none
+ */
+static void gpio_read(void *context, uint32_t offset, uint8_t size)
+{
+	sim_port_t port = (sim_port_t)(uintptr_t)context;
+	GPIO_Type *regs = gpios[port];
+	uint32_t pdir = gpio.input[port];
+
+	for(int pin = 0; pin < PORT_PCR_COUNT; pin++)
+	{
+		if(sim_gpio_driven(port, pin))
+		{
+			pdir = (pdir & ~(1U << pin)) | (regs->PDOR & (1U << pin));
+		}
+	}
+	*(volatile uint32_t *)&regs->PDIR = pdir;
+}
+
+/*
+ * Function to apply a store to the GPIO registers. The set, clear and toggle registers change
+ * PDOR and read as 0
+ *
+ * Parameters:
+ *  context the port
+ *  offset offset of the register in the GPIO block
+ *  size size of the store
+ *  old_value value of the register before the store
+ *
+ * Returns:
+ *  none
+ */
+static void gpio_write(void *context, uint32_t offset, uint8_t size, uint32_t old_value)
+{
+	sim_port_t port = (sim_port_t)(uintptr_t)context;
+	GPIO_Type *regs = gpios[port];
+
+	switch(offset)
+	{
+	case GPIO_PSOR_OFFSET:
+		regs->PDOR |= regs->PSOR;
+		regs->PSOR = 0;
+		break;
+	case GPIO_PCOR_OFFSET:
+		regs->PDOR &= ~regs->PCOR;
+		regs->PCOR = 0;
+		break;
+	case GPIO_PTOR_OFFSET:
+		regs->PDOR ^= regs->PTOR;
+		regs->PTOR = 0;
+		break;
+	case GPIO_PDIR_OFFSET:
+		*(volatile uint32_t *)&regs->PDIR = old_value;
+		break;
+	default:
+		break;
+	}
+	sim_gpio_notify(port);
+}
+
+/*
+ * Function to put the ports back to their reset state and add their register blocks
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void sim_gpio_reset()
+{
+	memset(&gpio, 0, sizeof(gpio));
+	for(int port = 0; port < SIM_NUM_PORTS; port++)
+	{
+		sim_region_t port_region = {
+				.base = (uintptr_t)ports[port],
+				.size = PORT_REGION_SIZE,
+				.write = port_write,
+				.context = (void *)(uintptr_t)port,
+		};
+		sim_region_t gpio_region = {
+				.base = (uintptr_t)gpios[port],
+				.size = GPIO_REGION_SIZE,
+				.read = gpio_read,
+				.write = gpio_write,
+				.context = (void *)(uintptr_t)port,
+		};
+		sim_region_add(&port_region);
+		sim_region_add(&gpio_region);
+	}
+	sim_irq_connect(PORTA_IRQn, porta_irq_level, NULL);
+	sim_irq_connect(PORTD_IRQn, portd_irq_level, NULL);
+}
@@ -0,0 +1,49 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim_gpio.h
+ * @brief   Header file for the PORT and GPIO model of the host simulator. Device models drive the
+ * 			level of the pins they are wired to, the model gives it back through PDIR and raises
+ * 			the pin interrupts of PORTA and PORTD. Models that watch lines driven by the core, the
+ * 			I2C lines during bus recovery, are told after each store to the port.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __SIM_GPIO_H__
+#define __SIM_GPIO_H__
+#include "stdint.h"
+
+typedef enum{
+	SIM_PORTA,
+	SIM_PORTB,
+	SIM_PORTC,
+	SIM_PORTD,
+	SIM_PORTE,
+	SIM_NUM_PORTS
+}sim_port_t;
+
+typedef void (*sim_gpio_watch_fn_t)(void *context);
+
+void sim_gpio_reset();
+
+void sim_gpio_set_input(sim_port_t port, uint8_t pin, int level);
+
+int sim_gpio_driven(sim_port_t port, uint8_t pin);
+
+int sim_gpio_output(sim_port_t port, uint8_t pin);
+
+uint8_t sim_gpio_mux(sim_port_t port, uint8_t pin);
+
+void sim_gpio_watch(sim_port_t port, sim_gpio_watch_fn_t fn, void *context);
+
+#endif
@@ -0,0 +1,888 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim_i2c.c
+ * @brief   I2C model of the host simulator. A byte takes 9 SCL periods from the write of D, or the
+ * 			read of D in receive mode, then TCF and IICIF are set and the DMA request is raised if
+ * 			DMAEN is set. START and repeated start add their setup time to the first byte, and
+ * 			BUSY drops one SCL period after the STOP.
+ *
+ * 			Only the master side of the module and the 8 bit cycle steal transfers the driver
+ * 			uses are modelled, with one byte per DMA request.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "sim_i2c.h"
+#include "sim.h"
+#include "sim_gpio.h"
+#include "string.h"
+
+#define I2C_REGION_SIZE			(0x0CU)
+#define I2C_C1_OFFSET			(0x02U)
+#define I2C_S_OFFSET			(0x03U)
+#define I2C_D_OFFSET			(0x04U)
+#define I2C_NUM_ICR_VALUES		(64U)
+#define BYTE_CLOCKS				(9U)//8 data bits and the ack
+#define MAX_SLAVES				(4U)
+#define CORE_CYCLES_PER_BUS_CYCLE (SIM_CORE_HZ/SIM_BUS_HZ)
+#define MUX_GPIO				(1U)
+
+#define DMA_CHANNELS_OFFSET		(0x100U)
+#define DMA_CHANNEL_STEP		(0x10U)
+#define DMA_NUM_CHANNELS		(4U)
+#define DMA_DSR_BCR_OFFSET		(0x08U)
+#define DMA_DSR_OFFSET			(0x0BU)//DSR on its own, the top byte of DSR_BCR
+#define DMA_DSR_DONE_BYTE_MASK	(DMA_DSR_BCR_DONE_MASK >> 24)
+#define DMA_STATUS_MASK			(DMA_DSR_BCR_DONE_MASK | DMA_DSR_BCR_BED_MASK | DMA_DSR_BCR_BES_MASK | DMA_DSR_BCR_CE_MASK)
+#define DMA_TRANSFER_CYCLES		(8U)//arbitration, the read from memory and the write to D
+#define DMAMUX_SRC_I2C0			(22U)
+#define DMAMUX_SRC_I2C1			(23U)
+
+//SCL divider for each ICR value, from the I2C divider and hold values table of the KL25 reference manual
+static const uint16_t scl_divider[I2C_NUM_ICR_VALUES] = {
+		20, 22, 24, 26, 28, 30, 34, 40, 28, 32, 36, 40, 44, 48, 56, 68,
+		48, 56, 64, 72, 80, 88, 104, 128, 80, 96, 112, 128, 144, 160, 192, 240,
+		160, 192, 224, 256, 288, 320, 384, 480, 320, 384, 448, 512, 576, 640, 768, 960,
+		640, 768, 896, 1024, 1152, 1280, 1536, 1920, 1280, 1536, 1792, 2048, 2304, 2560, 3072, 3840
+};
+
+typedef enum{
+	BYTE_NONE,
+	BYTE_TX,
+	BYTE_RX
+}byte_phase_t;
+
+typedef struct{
+	I2C_Type *regs;
+	IRQn_Type irq;
+	uint8_t sda_pin;//both buses are on port E
+	uint8_t scl_pin;
+
+	sim_i2c_slave_t *slaves[MAX_SLAVES];
+	uint8_t num_slaves;
+	sim_i2c_slave_t *active;//slave that acked its address
+	uint8_t reading;
+
+	uint8_t busy;
+	sim_time_t busy_since;
+	uint8_t expect_addr;//next byte is an address
+	byte_phase_t phase;
+	uint8_t tx_byte;
+	sim_time_t start_delay;//setup time of a start or repeated start, added to the next byte
+	uint8_t rx_acked;//master acked the last byte it read
+	uint8_t dma_request;
+	uint8_t byte_gap_open;//a byte ended and the next one of the transaction has not started
+	sim_time_t byte_done_at;
+
+	uint8_t sda_held;//a slave holds SDA low
+	uint8_t hold_clocks;//SCL clocks till it lets go, 0 for never
+	uint8_t scl_line;//levels of the lines while they are GPIOs
+	uint8_t sda_line;
+
+	sim_event_t byte_event;
+	sim_event_t stop_event;
+	sim_i2c_stats_t stats;
+}bus_model_t;
+
+typedef struct{
+	uint8_t index;
+	sim_event_t event;
+}dma_channel_t;
+
+static bus_model_t buses[SIM_NUM_I2C];
+static dma_channel_t dma_channels[DMA_NUM_CHANNELS];
+
+static const IRQn_Type dma_irqs[DMA_NUM_CHANNELS] = {DMA0_IRQn, DMA1_IRQn, DMA2_IRQn, DMA3_IRQn};
+
+static void dma_update();
+
+/*
+ * Function to get the divider from the bus clock to SCL of an F register value
+ *
+ * Parameters:
+ *  freq_reg value of the F register
+ *
+ * Returns:
+ *  the divider, ICR divider times MULT
+ */
+uint32_t sim_i2c_divider(uint8_t freq_reg)
+{
+	uint8_t mult = (freq_reg & I2C_F_MULT_MASK) >> I2C_F_MULT_SHIFT;
+	uint8_t icr = (freq_reg & I2C_F_ICR_MASK) >> I2C_F_ICR_SHIFT;
+	return (uint32_t)scl_divider[icr] << mult;
+}
+
+/*
+ * Function to get the SCL period set by the F register
+ *
+ * Parameters:
+ *  bus the bus
+ *
+ * Returns:
+ *  period in core clock cycles
+ */
+static sim_time_t scl_period(bus_model_t *bus)
+{
+	return (sim_time_t)sim_i2c_divider(bus->regs->F) * CORE_CYCLES_PER_BUS_CYCLE;
+}
+
+/*
+ * Function to set the busy state of the bus and BUSY in S
+ *
+ * Parameters:
+ *  bus the bus
+ *  busy 1 if the bus is busy
+ *
+ * Returns:
+ *  none
+ */
+static void bus_set_busy(bus_model_t *bus, uint8_t busy)
+{
+	if(busy && !bus->busy)
+	{
+		bus->busy_since = sim_now();
+		bus->regs->S |= I2C_S_BUSY_MASK;
+	}else if(!busy && bus->busy){
+		bus->stats.busy_cycles += sim_now() - bus->busy_since;
+		bus->regs->S &= ~I2C_S_BUSY_MASK;
+	}
+	bus->busy = busy;
+}
+
+/*
+ * Function to end the transaction of the addressed slave, on a stop or repeated start
+ *
+ * Parameters:
+ *  bus the bus
+ *
+ * Returns:
+ *  none
+ */
+static void bus_release_slave(bus_model_t *bus)
+{
+	if(bus->active && bus->active->stop)
+	{
+		bus->active->stop(bus->active);
+	}
+	bus->active = NULL;
+	bus->reading = 0;
+	bus->rx_acked = 0;
+}
+
+/*
+ * Function to stop the byte on the bus, if there is one
+ *
+ * Parameters:
+ *  bus the bus
+ *
+ * Returns:
+ *  1 if a byte was cut short
+ */
+static int bus_cancel_byte(bus_model_t *bus)
+{
+	if(bus->phase == BYTE_NONE)
+	{
+		return 0;
+	}
+	sim_event_cancel(&bus->byte_event);
+	bus->phase = BYTE_NONE;
+	bus->regs->S |= I2C_S_TCF_MASK;
+	return 1;
+}
+
+/*
+ * Function to address the slaves with the first byte after a start
+ *
+ * Parameters:
+ *  bus the bus
+ *  byte address and read/write bit
+ *
+ * Returns:
+ *  1 if a slave acked
+ */
+static int bus_address(bus_model_t *bus, uint8_t byte)
+{
+	sim_i2c_slave_t *slave = NULL;
+	int ack = 0;
+
+	for(int i = 0; i < bus->num_slaves; i++)
+	{
+		if(bus->slaves[i]->addr == (byte >> 1))
+		{
+			slave = bus->slaves[i];
+			break;
+		}
+	}
+	if(slave && slave->nacks)
+	{
+		slave->nacks--;
+	}else if(slave){
+		ack = slave->start(slave, byte & 1);
+	}
+	bus->active = ack ? slave : NULL;
+	bus->reading = byte & 1;
+	bus->rx_acked = 0;
+	bus->expect_addr = 0;
+	return ack;
+}
+
+/*
+ * Function for the end of a byte on the bus. The slave takes or gives the byte, then TCF and IICIF
+ * are set and the DMA request goes up if DMAEN is set
+ *
+ * Parameters:
+ *  context the bus
+ *
+ * Returns:
+ *  none
+ */
+static void bus_byte_done(void *context)
+{
+	bus_model_t *bus = context;
+	I2C_Type *regs = bus->regs;
+	int ack;
+
+	if(bus->phase == BYTE_TX)
+	{
+		if(bus->expect_addr)
+		{
+			ack = bus_address(bus, bus->tx_byte);
+		}else{
+			ack = bus->active && !bus->reading && bus->active->write(bus->active, bus->tx_byte);
+		}
+		bus->stats.bytes_tx++;
+		if(ack)
+		{
+			regs->S &= ~I2C_S_RXAK_MASK;
+		}else{
+			bus->stats.nacks++;
+			regs->S |= I2C_S_RXAK_MASK;
+		}
+	}else{
+		regs->D = (bus->active && bus->reading) ? bus->active->read(bus->active) : 0xFF;
+		bus->rx_acked = !(regs->C1 & I2C_C1_TXAK_MASK);
+		bus->stats.bytes_rx++;
+	}
+	bus->phase = BYTE_NONE;
+	bus->byte_gap_open = 1;
+	bus->byte_done_at = sim_now();
+	regs->S |= I2C_S_TCF_MASK | I2C_S_IICIF_MASK;
+	if(regs->C1 & I2C_C1_DMAEN_MASK)
+	{
+		bus->dma_request = 1;
+		dma_update();
+	}
+}
+
+/*
+ * Function to put a byte on the bus
+ *
+ * Parameters:
+ *  bus the bus
+ *  phase BYTE_TX or BYTE_RX
+ *
+ * Returns:
+ *  none
+ */
+static void bus_start_byte(bus_model_t *bus, byte_phase_t phase)
+{
+	if(bus->byte_gap_open)
+	{
+		sim_time_t gap = sim_now() - bus->byte_done_at;
+		bus->stats.byte_gaps++;
+		bus->stats.byte_gap_cycles += gap;
+		if(gap > bus->stats.byte_gap_max_cycles)
+		{
+			bus->stats.byte_gap_max_cycles = gap;
+		}
+		bus->byte_gap_open = 0;
+	}
+	bus->phase = phase;
+	bus->regs->S &= ~I2C_S_TCF_MASK;
+	bus->dma_request = 0;
+	sim_event_schedule(&bus->byte_event, bus->start_delay + BYTE_CLOCKS*scl_period(bus));
+	bus->start_delay = 0;
+}
+
+/*
+ * Function for the end of a STOP condition, the bus is free unless a slave holds SDA
+ *
+ * Parameters:
+ *  context the bus
+ *
+ * Returns:
+ *  none
+ */
+static void bus_stop_done(void *context)
+{
+	bus_model_t *bus = context;
+	if(!bus->sda_held)
+	{
+		bus_set_busy(bus, 0);
+	}
+}
+
+/*
+ * Function for MST going from 0 to 1, a START. Arbitration is lost at once if the bus is busy
+ *
+ * Parameters:
+ *  bus the bus
+ *
+ * Returns:
+ *  none
+ */
+static void bus_start(bus_model_t *bus)
+{
+	if(bus->busy)
+	{
+		bus->stats.start_while_busy++;
+		bus->regs->C1 &= ~I2C_C1_MST_MASK;
+		bus->regs->S |= I2C_S_ARBL_MASK | I2C_S_IICIF_MASK;
+		return;
+	}
+	bus_set_busy(bus, 1);
+	bus->expect_addr = 1;
+	bus->byte_gap_open = 0;
+	bus->start_delay = scl_period(bus)/2;
+	bus->stats.starts++;
+}
+
+/*
+ * Function for MST going from 1 to 0, a STOP
+ *
+ * Parameters:
+ *  bus the bus
+ *
+ * Returns:
+ *  none
+ */
+static void bus_stop(bus_model_t *bus)
+{
+	if(bus_cancel_byte(bus))
+	{
+		bus->stats.stop_mid_byte++;
+	}else if(bus->active && bus->reading && bus->rx_acked){
+		bus->stats.last_byte_acked++;
+	}
+	bus_release_slave(bus);
+	bus->expect_addr = 0;
+	bus->byte_gap_open = 0;
+	bus->start_delay = 0;
+	bus->stats.stops++;
+	sim_event_schedule(&bus->stop_event, scl_period(bus));
+}
+
+/*
+ * Function for RSTA being set, a repeated start. Per the errata of the KL25Z it is not made while
+ * MULT is not 0
+ *
+ * Parameters:
+ *  bus the bus
+ *
+ * Returns:
+ *  none
+ */
+static void bus_restart(bus_model_t *bus)
+{
+	bus->regs->C1 &= ~I2C_C1_RSTA_MASK;//reads as 0
+	if(!(bus->regs->C1 & I2C_C1_MST_MASK))
+	{
+		return;
+	}
+	if(bus->regs->F & I2C_F_MULT_MASK)
+	{
+		bus->stats.rstart_errata++;
+		return;
+	}
+	if(bus_cancel_byte(bus))
+	{
+		bus->stats.stop_mid_byte++;
+	}
+	bus_release_slave(bus);
+	bus->expect_addr = 1;
+	bus->byte_gap_open = 0;
+	bus->start_delay = scl_period(bus);
+	bus->stats.rstarts++;
+}
+
+/*
+ * Function to disable the module, the byte on the bus is dropped and the lines are let go.
+ * The bus stays busy till a STOP is seen on the lines
+ *
+ * Parameters:
+ *  bus the bus
+ *
+ * Returns:
+ *  none
+ */
+static void bus_disable(bus_model_t *bus)
+{
+	bus_cancel_byte(bus);
+	bus_release_slave(bus);
+	bus->expect_addr = 0;
+	bus->byte_gap_open = 0;
+	bus->start_delay = 0;
+	bus->dma_request = 0;
+}
+
+/*
+ * Function to get the interrupt line of an I2C module
+ *
+ * Parameters:
+ *  context the bus
+ *
+ * Returns:
+ *  1 if IICIF is set with IICIE
+ */
+static int bus_irq_level(void *context)
+{
+	bus_model_t *bus = context;
+	uint8_t c1 = bus->regs->C1;
+	return (c1 & I2C_C1_IICEN_MASK) && (c1 & I2C_C1_IICIE_MASK) && (bus->regs->S & I2C_S_IICIF_MASK);
+}
+
+/*
+ * Function to apply a store to the registers of an I2C module
+ *
+ * Parameters:
+ *  context the bus
+ *  offset offset of the register
+ *  size size of the store
+ *  old_value value of the register before the store
+ *
+ * Returns:
+ *  none
+ */
+static void i2c_write(void *context, uint32_t offset, uint8_t size, uint32_t old_value)
+{
+	bus_model_t *bus = context;
+	I2C_Type *regs = bus->regs;
+	uint8_t c1 = regs->C1;
+
+	switch(offset)
+	{
+	case I2C_C1_OFFSET:
+		if((old_value & I2C_C1_IICEN_MASK) && !(c1 & I2C_C1_IICEN_MASK))
+		{
+			bus_disable(bus);
+			break;
+		}
+		if(!(c1 & I2C_C1_IICEN_MASK))
+		{
+			break;
+		}
+		if(!(old_value & I2C_C1_MST_MASK) && (c1 & I2C_C1_MST_MASK))
+		{
+			bus_start(bus);
+		}else if((old_value & I2C_C1_MST_MASK) && !(c1 & I2C_C1_MST_MASK)){
+			bus_stop(bus);
+		}
+		if(c1 & I2C_C1_RSTA_MASK)
+		{
+			bus_restart(bus);
+		}
+		break;
+	case I2C_S_OFFSET:
+		regs->S = old_value & ~(regs->S & (I2C_S_ARBL_MASK | I2C_S_IICIF_MASK));
+		break;
+	case I2C_D_OFFSET:
+		if(!(c1 & I2C_C1_IICEN_MASK))
+		{
+			break;
+		}
+		if((c1 & I2C_C1_MST_MASK) && (c1 & I2C_C1_TX_MASK) && bus->phase == BYTE_NONE)
+		{
+			bus->tx_byte = regs->D;
+			bus_start_byte(bus, BYTE_TX);
+		}else{
+			bus->stats.bad_d_accesses++;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Function to run before a load from the registers of an I2C module. Reading D in receive mode
+ * starts the next byte
+ *
+ * Parameters:
+ *  context the bus
+ *  offset offset of the register
+ *  size size of the load
+ *
+ * Returns:
+ *  none
+ */
+static void i2c_read(void *context, uint32_t offset, uint8_t size)
+{
+	bus_model_t *bus = context;
+	uint8_t c1 = bus->regs->C1;
+
+	if(offset != I2C_D_OFFSET || !(c1 & I2C_C1_IICEN_MASK) || !(c1 & I2C_C1_MST_MASK) || (c1 & I2C_C1_TX_MASK))
+	{
+		return;
+	}
+	if(bus->phase == BYTE_NONE)
+	{
+		bus_start_byte(bus, BYTE_RX);
+	}else{
+		bus->stats.bad_d_accesses++;
+	}
+}
+
+/*
+ * Function to get the bus a DMA channel is routed to by the DMAMUX
+ *
+ * Parameters:
+ *  channel the DMA channel
+ *
+ * Returns:
+ *  pointer to the bus, NULL if the channel is not routed to an I2C module
+ */
+static bus_model_t* dma_bus(uint8_t channel)
+{
+	uint8_t chcfg = DMAMUX0->CHCFG[channel];
+	if(!(chcfg & DMAMUX_CHCFG_ENBL_MASK))
+	{
+		return NULL;
+	}
+	switch(chcfg & DMAMUX_CHCFG_SOURCE_MASK)
+	{
+	case DMAMUX_SRC_I2C0:
+		return &buses[SIM_I2C0];
+	case DMAMUX_SRC_I2C1:
+		return &buses[SIM_I2C1];
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Function to check if a DMA channel has a request to serve
+ *
+ * Parameters:
+ *  channel the DMA channel
+ *
+ * Returns:
+ *  1 if the channel should move a byte
+ */
+static int dma_ready(uint8_t channel)
+{
+	bus_model_t *bus = dma_bus(channel);
+	return bus && bus->dma_request && (DMA0->DMA[channel].DCR & DMA_DCR_ERQ_MASK) &&
+		   (DMA0->DMA[channel].DSR_BCR & DMA_DSR_BCR_BCR_MASK);
+}
+
+/*
+ * Function to start serving the DMA requests that can be served
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void dma_update()
+{
+	for(int channel = 0; channel < DMA_NUM_CHANNELS; channel++)
+	{
+		if(dma_ready(channel) && !dma_channels[channel].event.armed)
+		{
+			sim_event_schedule(&dma_channels[channel].event, DMA_TRANSFER_CYCLES);
+		}
+	}
+}
+
+/*
+ * Function for one cycle steal transfer of a DMA channel, a byte from SAR to DAR. The source
+ * address is a host address, the driver stores the low 32 bits of it, which is all of it in a
+ * binary linked with -no-pie
+ *
+ * Parameters:
+ *  context the channel
+ *
+ * Returns:
+ *  none
+ */
+static void dma_transfer(void *context)
+{
+	dma_channel_t *channel = context;
+	volatile uint32_t *sar = &DMA0->DMA[channel->index].SAR;
+	volatile uint32_t *dar = &DMA0->DMA[channel->index].DAR;
+	volatile uint32_t *dsr_bcr = &DMA0->DMA[channel->index].DSR_BCR;
+	volatile uint32_t *dcr = &DMA0->DMA[channel->index].DCR;
+	bus_model_t *bus = dma_bus(channel->index);
+	uint32_t bcr;
+	uint8_t byte;
+
+	if(!dma_ready(channel->index))
+	{
+		return;
+	}
+	byte = *(volatile uint8_t *)(uintptr_t)*sar;
+	bus->dma_request = 0;
+	bus->stats.dma_bytes++;
+	sim_write_register(*dar, 1, byte);
+	if(*dcr & DMA_DCR_SINC_MASK)
+	{
+		(*sar)++;
+	}
+	if(*dcr & DMA_DCR_DINC_MASK)
+	{
+		(*dar)++;
+	}
+	bcr = (*dsr_bcr & DMA_DSR_BCR_BCR_MASK) - 1;
+	*dsr_bcr = (*dsr_bcr & ~DMA_DSR_BCR_BCR_MASK) | bcr;
+	if(bcr == 0)
+	{
+		*dsr_bcr |= DMA_DSR_BCR_DONE_MASK;
+		if(*dcr & DMA_DCR_D_REQ_MASK)
+		{
+			*dcr &= ~DMA_DCR_ERQ_MASK;
+		}
+	}
+}
+
+/*
+ * Function to get the interrupt line of a DMA channel
+ *
+ * Parameters:
+ *  context the channel
+ *
+ * Returns:
+ *  1 if DONE is set with EINT
+ */
+static int dma_irq_level(void *context)
+{
+	dma_channel_t *channel = context;
+	return (DMA0->DMA[channel->index].DSR_BCR & DMA_DSR_BCR_DONE_MASK) &&
+		   (DMA0->DMA[channel->index].DCR & DMA_DCR_EINT_MASK);
+}
+
+/*
+ * Function to apply a store to the registers of the DMA channels. Writing 1 to DONE clears the
+ * status bits
+ *
+ * Parameters:
+ *  context unused
+ *  offset offset of the register from the first channel
+ *  size size of the store
+ *  old_value value of the register before the store
+ *
+ * Returns:
+ *  none
+ */
+static void dma_write(void *context, uint32_t offset, uint8_t size, uint32_t old_value)
+{
+	uint8_t channel = offset/DMA_CHANNEL_STEP;
+	uint8_t reg = offset % DMA_CHANNEL_STEP;
+	volatile uint32_t *dsr_bcr = &DMA0->DMA[channel].DSR_BCR;
+
+	if(reg == DMA_DSR_BCR_OFFSET && size == 4)
+	{
+		uint32_t status = (*dsr_bcr & DMA_DSR_BCR_DONE_MASK) ? 0 : (old_value & ~DMA_DSR_BCR_BCR_MASK);
+		*dsr_bcr = status | (*dsr_bcr & DMA_DSR_BCR_BCR_MASK);
+	}else if(reg == DMA_DSR_OFFSET && size == 1){
+		uint8_t written = DMA0->DMA[channel].DMA_DSR_ACCESS8BIT.DSR;
+		DMA0->DMA[channel].DMA_DSR_ACCESS8BIT.DSR = (written & DMA_DSR_DONE_BYTE_MASK) ? 0 : old_value;
+	}
+	dma_update();
+}
+
+/*
+ * Function to follow the bus lines while they are GPIOs, during a bus recovery. A slave holding SDA
+ * lets go after its clocks, and SDA going high while SCL is high is a STOP that frees the bus.
+ * The levels are given back to the pins
+ *
+ * Parameters:
+ *  context the bus
+ *
+ * Returns:
+ *  none
+ */
+static void bus_lines_update(void *context)
+{
+	bus_model_t *bus = context;
+	int gpio = sim_gpio_mux(SIM_PORTE, bus->sda_pin) == MUX_GPIO && sim_gpio_mux(SIM_PORTE, bus->scl_pin) == MUX_GPIO;
+	uint8_t scl = !(sim_gpio_driven(SIM_PORTE, bus->scl_pin) && !sim_gpio_output(SIM_PORTE, bus->scl_pin));
+	uint8_t sda_driven_low = sim_gpio_driven(SIM_PORTE, bus->sda_pin) && !sim_gpio_output(SIM_PORTE, bus->sda_pin);
+	uint8_t sda;
+
+	if(!gpio)
+	{//the module drives the lines, only a held SDA shows
+		scl = 1;
+		sda_driven_low = 0;
+	}
+	if(gpio && scl && !bus->scl_line && bus->sda_held && bus->hold_clocks && --bus->hold_clocks == 0)
+	{
+		bus->sda_held = 0;
+	}
+	sda = !(bus->sda_held || sda_driven_low);
+	if(gpio && scl && bus->scl_line && sda && !bus->sda_line && bus->busy)
+	{
+		bus_release_slave(bus);
+		bus_set_busy(bus, 0);
+	}
+	bus->scl_line = scl;
+	bus->sda_line = sda;
+	sim_gpio_set_input(SIM_PORTE, bus->scl_pin, scl);
+	sim_gpio_set_input(SIM_PORTE, bus->sda_pin, sda);
+}
+
+/*
+ * Function to attach a device model to a bus
+ *
+ * Parameters:
+ *  bus the bus
+ *  slave(in) pointer to the slave of the model, kept
+ *
+ * Returns:
+ *  none
+ */
+void sim_i2c_attach(sim_i2c_bus_t bus, sim_i2c_slave_t *slave)
+{
+	if(buses[bus].num_slaves == MAX_SLAVES)
+	{
+		sim_fail("too many slaves on I2C%d", bus);
+	}
+	buses[bus].slaves[buses[bus].num_slaves++] = slave;
+}
+
+/*
+ * Function to make a slave hold SDA low, the way a slave does when a transaction was cut short
+ * in the middle of a byte it was sending. The bus stays busy till it lets go
+ *
+ * Parameters:
+ *  bus the bus
+ *  clocks SCL clocks till SDA is let go, 0 to hold it for good
+ *
+ * Returns:
+ *  none
+ */
+void sim_i2c_hold_sda(sim_i2c_bus_t bus, uint8_t clocks)
+{
+	bus_model_t *model = &buses[bus];
+	model->sda_held = 1;
+	model->hold_clocks = clocks;
+	sim_event_cancel(&model->stop_event);
+	bus_set_busy(model, 1);
+	bus_lines_update(model);
+}
+
+/*
+ * Function to check if a bus is busy
+ *
+ * Parameters:
+ *  bus the bus
+ *
+ * Returns:
+ *  1 from a START till the end of the STOP, or while SDA is held
+ */
+int sim_i2c_busy(sim_i2c_bus_t bus)
+{
+	return buses[bus].busy;
+}
+
+/*
+ * Function to get the SCL frequency the module is set to
+ *
+ * Parameters:
+ *  bus the bus
+ *
+ * Returns:
+ *  SCL frequency in Hz
+ */
+uint32_t sim_i2c_scl_hz(sim_i2c_bus_t bus)
+{
+	return SIM_CORE_HZ/scl_period(&buses[bus]);
+}
+
+/*
+ * Function to get the counters of a bus
+ *
+ * Parameters:
+ *  bus the bus
+ *  stats(out) pointer to structure to copy the counters into
+ *
+ * Returns:
+ *  none
+ */
+void sim_i2c_get_stats(sim_i2c_bus_t bus, sim_i2c_stats_t *stats)
+{
+	bus_model_t *model = &buses[bus];
+	*stats = model->stats;
+	if(model->busy)
+	{
+		stats->busy_cycles += sim_now() - model->busy_since;
+	}
+}
+
+/*
+ * Function to put the I2C modules and the DMA channels back to their reset state and add their
+ * register blocks. Device models are attached again after this
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void sim_i2c_reset()
+{
+	sim_region_t dma_region = {
+			.base = DMA_BASE + DMA_CHANNELS_OFFSET,
+			.size = DMA_NUM_CHANNELS*DMA_CHANNEL_STEP,
+			.write = dma_write,
+	};
+
+	memset(buses, 0, sizeof(buses));
+	buses[SIM_I2C0].regs = I2C0;
+	buses[SIM_I2C0].irq = I2C0_IRQn;
+	buses[SIM_I2C0].sda_pin = 25;
+	buses[SIM_I2C0].scl_pin = 24;
+	buses[SIM_I2C1].regs = I2C1;
+	buses[SIM_I2C1].irq = I2C1_IRQn;
+	buses[SIM_I2C1].sda_pin = 0;
+	buses[SIM_I2C1].scl_pin = 1;
+
+	for(int i = 0; i < SIM_NUM_I2C; i++)
+	{
+		bus_model_t *bus = &buses[i];
+		sim_region_t region = {
+				.base = (uintptr_t)bus->regs,
+				.size = I2C_REGION_SIZE,
+				.read = i2c_read,
+				.write = i2c_write,
+				.context = bus,
+		};
+		bus->regs->S = I2C_S_TCF_MASK;
+		bus->scl_line = 1;
+		bus->sda_line = 1;
+		sim_event_init(&bus->byte_event, bus_byte_done, bus);
+		sim_event_init(&bus->stop_event, bus_stop_done, bus);
+		sim_region_add(&region);
+		sim_irq_connect(bus->irq, bus_irq_level, bus);
+		sim_gpio_watch(SIM_PORTE, bus_lines_update, bus);
+		bus_lines_update(bus);
+	}
+
+	for(int i = 0; i < DMA_NUM_CHANNELS; i++)
+	{
+		dma_channels[i].index = i;
+		sim_event_init(&dma_channels[i].event, dma_transfer, &dma_channels[i]);
+		sim_irq_connect(dma_irqs[i], dma_irq_level, &dma_channels[i]);
+	}
+	sim_region_add(&dma_region);
+}
@@ -0,0 +1,83 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim_i2c.h
+ * @brief   Header file for the I2C model of the host simulator: the two I2C modules of the KL25Z
+ * 			with their byte timing taken from the F register, the DMA channels and DMAMUX they
+ * 			use, and the bus lines on PTE for the recovery by bit banging.
+ *
+ * 			Device models attach to a bus as slaves. The model also counts the sequences the
+ * 			KL25Z I2C module does not tolerate, a START while the bus is busy, a STOP in the
+ * 			middle of a byte, a repeated start with MULT not 0 and an ack on the last byte read,
+ * 			so a test can check that the driver never makes them.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __SIM_I2C_H__
+#define __SIM_I2C_H__
+#include "stdint.h"
+
+typedef enum{
+	SIM_I2C0,
+	SIM_I2C1,
+	SIM_NUM_I2C
+}sim_i2c_bus_t;
+
+typedef struct sim_i2c_slave sim_i2c_slave_t;
+
+//a device on the bus. The model embeds this as its first member and gets it back in the callbacks
+struct sim_i2c_slave{
+	uint8_t addr;//7 bit address
+	int (*start)(sim_i2c_slave_t *slave, int read);//addressed after a start, returns 1 to ack
+	int (*write)(sim_i2c_slave_t *slave, uint8_t byte);//returns 1 to ack
+	uint8_t (*read)(sim_i2c_slave_t *slave);
+	void (*stop)(sim_i2c_slave_t *slave);//stop or repeated start, the transaction is over
+	uint16_t nacks;//the next nacks addressing attempts are not acked, set by the test
+};
+
+typedef struct{
+	uint32_t starts;
+	uint32_t rstarts;
+	uint32_t stops;
+	uint32_t bytes_tx;//including address bytes
+	uint32_t bytes_rx;
+	uint32_t nacks;
+	uint32_t dma_bytes;//tx bytes written into D by the DMA channel
+	uint64_t busy_cycles;//core cycles the bus was busy
+	//SCL is held low from the end of a byte till D is accessed for the next one in the same transaction
+	uint32_t byte_gaps;
+	uint64_t byte_gap_cycles;
+	uint32_t byte_gap_max_cycles;
+	//sequences the KL25Z I2C module does not tolerate, expected to stay 0
+	uint32_t start_while_busy;//MST set while the bus was busy, arbitration is lost
+	uint32_t stop_mid_byte;//MST cleared while a byte was on the bus
+	uint32_t last_byte_acked;//STOP after a read byte the master acked, the slave may hold SDA
+	uint32_t rstart_errata;//RSTA set with MULT not 0, no repeated start is made
+	uint32_t bad_d_accesses;//D written or read out of place, the byte is lost
+}sim_i2c_stats_t;
+
+void sim_i2c_reset();
+
+void sim_i2c_attach(sim_i2c_bus_t bus, sim_i2c_slave_t *slave);
+
+void sim_i2c_hold_sda(sim_i2c_bus_t bus, uint8_t clocks);
+
+int sim_i2c_busy(sim_i2c_bus_t bus);
+
+uint32_t sim_i2c_scl_hz(sim_i2c_bus_t bus);
+
+uint32_t sim_i2c_divider(uint8_t freq_reg);
+
+void sim_i2c_get_stats(sim_i2c_bus_t bus, sim_i2c_stats_t *stats);
+
+#endif
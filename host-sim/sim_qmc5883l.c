@@ -0,0 +1,414 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim_qmc5883l.c
+ * @brief   QMC5883L model of the host simulator. In continuous mode a measurement is made every
+ * 			ODR period, it sets DRDY, and DOR as well if DRDY was still set. Reading any of the data
+ * 			registers clears both and drops the DRDY pin. A measurement that falls due while the
+ * 			host is reading is held till the STOP, so a burst never mixes two samples.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "sim_qmc5883l.h"
+#include "sim_gpio.h"
+#include "string.h"
+#include "math.h"
+
+#define QMC_ADDR			(0x0DU)
+#define REG_DATA_X_LSB		(0x00U)
+#define REG_DATA_Z_MSB		(0x05U)
+#define REG_STATUS			(0x06U)
+#define REG_TOUT_LSB		(0x07U)
+#define REG_TOUT_MSB		(0x08U)
+#define REG_CR1				(0x09U)
+#define REG_CR2				(0x0AU)
+#define REG_SRS				(0x0BU)
+#define REG_CHIP_ID			(0x0DU)
+#define CHIP_ID				(0xFFU)
+
+#define SR_DRDY				(0x01U)
+#define SR_OVL				(0x02U)
+#define SR_DOR				(0x04U)
+#define CR1_MODE_MASK		(0x03U)
+#define CR1_MODE_CONTINUOUS	(0x01U)
+#define CR1_ODR_MASK		(0x0CU)
+#define CR1_ODR_SHIFT		(2U)
+#define CR1_RNG_8G			(0x10U)
+#define CR2_INT_DISABLE		(0x01U)
+#define CR2_ROL_PNT			(0x40U)
+#define CR2_SOFT_RST		(0x80U)
+
+#define DRDY_PIN			(4U)//PTD4
+#define LSB_PER_G_2G		(12000)
+#define LSB_PER_G_8G		(3000)
+#define MG_PER_G			(1000)
+#define TOUT_LSB_PER_C		(100)
+#define DEG_TO_RAD			(3.14159265358979 / 180.0)
+
+static const uint16_t odr_hz[] = {10, 50, 100, 200};
+
+/*
+ * Function to drive the DRDY pin from the status register, the pin is off with INT_ENB set
+ *
+ * Parameters:
+ *  qmc the model
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_update_pin(sim_qmc5883l_t *qmc)
+{
+	sim_gpio_set_input(SIM_PORTD, DRDY_PIN, (qmc->regs[REG_STATUS] & SR_DRDY) && !(qmc->regs[REG_CR2] & CR2_INT_DISABLE));
+}
+
+/*
+ * Function to get one axis of the field at the present time
+ *
+ * Parameters:
+ *  qmc the model
+ *  axis 0 to 2 for x, y and z
+ *
+ * Returns:
+ *  field in milligauss
+ */
+static double qmc_field_mg(sim_qmc5883l_t *qmc, int axis)
+{
+	double angle = (double)qmc->rotation_deg_per_s * (double)(sim_now() - qmc->field_time) / SIM_CORE_HZ * DEG_TO_RAD;
+	switch(axis)
+	{
+	case 0:
+		return qmc->field_mg[0]*cos(angle) - qmc->field_mg[1]*sin(angle);
+	case 1:
+		return qmc->field_mg[0]*sin(angle) + qmc->field_mg[1]*cos(angle);
+	default:
+		return qmc->field_mg[2];
+	}
+}
+
+/*
+ * Function to make one measurement into the data registers
+ *
+ * Parameters:
+ *  qmc the model
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_measure(sim_qmc5883l_t *qmc)
+{
+	int32_t lsb_per_g = (qmc->regs[REG_CR1] & CR1_RNG_8G) ? LSB_PER_G_8G : LSB_PER_G_2G;
+	uint8_t status = qmc->regs[REG_STATUS] & ~SR_OVL;
+	int16_t tout = qmc->temperature_c * TOUT_LSB_PER_C;
+
+	for(int axis = 0; axis < 3; axis++)
+	{
+		double value = qmc_field_mg(qmc, axis) * lsb_per_g / MG_PER_G;
+		int16_t out;
+		if(value > INT16_MAX || value < INT16_MIN)
+		{
+			status |= SR_OVL;
+			out = (value > 0) ? INT16_MAX : INT16_MIN;
+		}else{
+			out = (int16_t)lrint(value);
+		}
+		qmc->regs[REG_DATA_X_LSB + 2*axis] = out & 0xFF;
+		qmc->regs[REG_DATA_X_LSB + 2*axis + 1] = (uint16_t)out >> 8;
+	}
+	qmc->regs[REG_TOUT_LSB] = tout & 0xFF;
+	qmc->regs[REG_TOUT_MSB] = (uint16_t)tout >> 8;
+	if(status & SR_DRDY)
+	{
+		status |= SR_DOR;
+		qmc->stats.overruns++;
+	}else{
+		qmc->drdy_time = sim_now();
+	}
+	qmc->regs[REG_STATUS] = status | SR_DRDY;
+	qmc->stats.measurements++;
+	qmc_update_pin(qmc);
+}
+
+/*
+ * Function to schedule the next measurement, or stop measuring outside of continuous mode
+ *
+ * Parameters:
+ *  qmc the model
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_schedule(sim_qmc5883l_t *qmc)
+{
+	uint8_t cr1 = qmc->regs[REG_CR1];
+	if((cr1 & CR1_MODE_MASK) != CR1_MODE_CONTINUOUS)
+	{
+		sim_event_cancel(&qmc->measure_event);
+		return;
+	}
+	sim_event_schedule(&qmc->measure_event, SIM_CORE_HZ/odr_hz[(cr1 & CR1_ODR_MASK) >> CR1_ODR_SHIFT]);
+}
+
+/*
+ * Function for a measurement falling due
+ *
+ * Parameters:
+ *  context the model
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_measure_due(void *context)
+{
+	sim_qmc5883l_t *qmc = context;
+	if(qmc->locked)
+	{
+		qmc->measure_pending = 1;
+		qmc->stats.locked++;
+	}else{
+		qmc_measure(qmc);
+	}
+	qmc_schedule(qmc);
+}
+
+/*
+ * Function to put the registers back to their power on values
+ *
+ * Parameters:
+ *  qmc the model
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_soft_reset(sim_qmc5883l_t *qmc)
+{
+	memset(qmc->regs, 0, sizeof(qmc->regs));
+	qmc->regs[REG_CHIP_ID] = CHIP_ID;
+	qmc->measure_pending = 0;
+	sim_event_cancel(&qmc->measure_event);
+	qmc_update_pin(qmc);
+}
+
+/*
+ * Function for the model being addressed after a start, a read locks the data till the STOP
+ *
+ * Parameters:
+ *  slave the model
+ *  read 1 for a read, 0 for a write
+ *
+ * Returns:
+ *  1, the model always acks
+ */
+static int qmc_start(sim_i2c_slave_t *slave, int read)
+{
+	sim_qmc5883l_t *qmc = (sim_qmc5883l_t *)slave;
+	qmc->pointer_set = 0;
+	qmc->locked = read;
+	return 1;
+}
+
+/*
+ * Function to take a byte written by the host. The first byte of a write sets the register
+ * pointer, the next ones go to the writable registers
+ *
+ * Parameters:
+ *  slave the model
+ *  byte the byte written
+ *
+ * Returns:
+ *  1, the model always acks
+ */
+static int qmc_write(sim_i2c_slave_t *slave, uint8_t byte)
+{
+	sim_qmc5883l_t *qmc = (sim_qmc5883l_t *)slave;
+	uint8_t reg = qmc->pointer;
+
+	if(!qmc->pointer_set)
+	{
+		qmc->pointer = byte;
+		qmc->pointer_set = 1;
+		return 1;
+	}
+	if(reg == REG_CR2 && (byte & CR2_SOFT_RST))
+	{
+		qmc_soft_reset(qmc);
+		return 1;
+	}
+	if(reg == REG_CR1 || reg == REG_CR2 || reg == REG_SRS)
+	{
+		qmc->regs[reg] = byte;
+	}
+	if(reg == REG_CR1)
+	{
+		qmc->stats.cr1_writes++;
+		qmc_schedule(qmc);
+	}else if(reg == REG_CR2){
+		qmc_update_pin(qmc);
+	}
+	qmc->pointer++;
+	return 1;
+}
+
+/*
+ * Function to give the host the register at the pointer. With ROL_PNT the pointer goes from the
+ * status register back to the first data register
+ *
+ * Parameters:
+ *  slave the model
+ *
+ * Returns:
+ *  the register value
+ */
+static uint8_t qmc_read(sim_i2c_slave_t *slave)
+{
+	sim_qmc5883l_t *qmc = (sim_qmc5883l_t *)slave;
+	uint8_t reg = qmc->pointer;
+	uint8_t value = (reg < SIM_QMC_NUM_REGS) ? qmc->regs[reg] : 0;
+
+	if(reg <= REG_DATA_Z_MSB && (qmc->regs[REG_STATUS] & SR_DRDY))
+	{
+		qmc->regs[REG_STATUS] &= ~(SR_DRDY | SR_DOR);
+		qmc->stats.data_reads++;
+		qmc->data_read = 1;
+		qmc_update_pin(qmc);
+	}
+	if(reg == REG_STATUS && (qmc->regs[REG_CR2] & CR2_ROL_PNT))
+	{
+		qmc->pointer = REG_DATA_X_LSB;
+	}else{
+		qmc->pointer++;
+	}
+	return value;
+}
+
+/*
+ * Function for the end of a transaction. The time the data waited to be read is added up, and a
+ * measurement held back by the read is made now
+ *
+ * Parameters:
+ *  slave the model
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_stop(sim_i2c_slave_t *slave)
+{
+	sim_qmc5883l_t *qmc = (sim_qmc5883l_t *)slave;
+	qmc->locked = 0;
+	if(qmc->data_read)
+	{
+		sim_time_t delay = sim_now() - qmc->drdy_time;
+		qmc->data_read = 0;
+		qmc->stats.read_delay_sum += delay;
+		if(delay > qmc->stats.read_delay_max)
+		{
+			qmc->stats.read_delay_max = delay;
+		}
+	}
+	if(qmc->measure_pending)
+	{
+		qmc->measure_pending = 0;
+		qmc_measure(qmc);
+	}
+}
+
+/*
+ * Function to set up the model at power on and attach it to a bus
+ *
+ * Parameters:
+ *  qmc(out) pointer to the model, must stay valid for the rest of the run
+ *  bus the bus it is wired to, DRDY is on PTD4 either way
+ *
+ * Returns:
+ *  none
+ */
+void sim_qmc5883l_attach(sim_qmc5883l_t *qmc, sim_i2c_bus_t bus)
+{
+	memset(qmc, 0, sizeof(*qmc));
+	qmc->slave.addr = QMC_ADDR;
+	qmc->slave.start = qmc_start;
+	qmc->slave.write = qmc_write;
+	qmc->slave.read = qmc_read;
+	qmc->slave.stop = qmc_stop;
+	qmc->temperature_c = 25;
+	sim_event_init(&qmc->measure_event, qmc_measure_due, qmc);
+	qmc_soft_reset(qmc);
+	sim_i2c_attach(bus, &qmc->slave);
+}
+
+/*
+ * Function to set the field the model measures, it stops turning
+ *
+ * Parameters:
+ *  qmc the model
+ *  x_mg, y_mg, z_mg field in milligauss
+ *
+ * Returns:
+ *  none
+ */
+void sim_qmc5883l_set_field(sim_qmc5883l_t *qmc, int32_t x_mg, int32_t y_mg, int32_t z_mg)
+{
+	qmc->field_mg[0] = x_mg;
+	qmc->field_mg[1] = y_mg;
+	qmc->field_mg[2] = z_mg;
+	qmc->rotation_deg_per_s = 0;
+	qmc->field_time = sim_now();
+}
+
+/*
+ * Function to turn the field around z from now on, the way it turns when the compass is turned
+ *
+ * Parameters:
+ *  qmc the model
+ *  deg_per_s rate of turn in degrees per second
+ *
+ * Returns:
+ *  none
+ */
+void sim_qmc5883l_set_rotation(sim_qmc5883l_t *qmc, int32_t deg_per_s)
+{
+	for(int axis = 0; axis < 2; axis++)
+	{
+		qmc->field_mg[axis] = lrint(qmc_field_mg(qmc, axis));
+	}
+	qmc->rotation_deg_per_s = deg_per_s;
+	qmc->field_time = sim_now();
+}
+
+/*
+ * Function to set the die temperature given in TOUT from the next measurement on
+ *
+ * Parameters:
+ *  qmc the model
+ *  celsius temperature
+ *
+ * Returns:
+ *  none
+ */
+void sim_qmc5883l_set_temperature(sim_qmc5883l_t *qmc, int16_t celsius)
+{
+	qmc->temperature_c = celsius;
+}
+
+/*
+ * Function to get the level of the DRDY pin
+ *
+ * Parameters:
+ *  qmc the model
+ *
+ * Returns:
+ *  1 if DRDY is high
+ */
+int sim_qmc5883l_drdy(sim_qmc5883l_t *qmc)
+{
+	return (qmc->regs[REG_STATUS] & SR_DRDY) && !(qmc->regs[REG_CR2] & CR2_INT_DISABLE);
+}
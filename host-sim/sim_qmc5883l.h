@@ -0,0 +1,66 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim_qmc5883l.h
+ * @brief   Header file for the QMC5883L model of the host simulator. It has the register map of
+ * 			the datasheet with the register pointer, rollover and data lock, measures a field set
+ * 			by the test at the ODR of CR1 and drives DRDY on PTD4.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __SIM_QMC5883L_H__
+#define __SIM_QMC5883L_H__
+#include "stdint.h"
+#include "sim.h"
+#include "sim_i2c.h"
+
+#define SIM_QMC_NUM_REGS	(0x0EU)
+
+typedef struct{
+	uint32_t measurements;
+	uint32_t data_reads;//bursts which read the data registers
+	uint32_t overruns;//measurements made while DRDY was still set
+	uint32_t locked;//measurements held back by a read in progress
+	uint32_t cr1_writes;
+	sim_time_t read_delay_sum;//from DRDY going high to the STOP of the burst which read the data
+	sim_time_t read_delay_max;
+}sim_qmc5883l_stats_t;
+
+typedef struct{
+	sim_i2c_slave_t slave;//first member, the I2C model hands it back
+	uint8_t regs[SIM_QMC_NUM_REGS];
+	uint8_t pointer;
+	uint8_t pointer_set;//first byte of a write sets the pointer
+	uint8_t locked;//data is not updated while it is being read
+	uint8_t measure_pending;//a measurement came due while the data was locked
+	uint8_t data_read;//the transaction in progress has read the data registers
+	int32_t field_mg[3];//field at the time it was set, in milligauss
+	int32_t rotation_deg_per_s;//the field turns around z at this rate
+	sim_time_t field_time;
+	sim_time_t drdy_time;//time DRDY last went high
+	int16_t temperature_c;
+	sim_event_t measure_event;
+	sim_qmc5883l_stats_t stats;
+}sim_qmc5883l_t;
+
+void sim_qmc5883l_attach(sim_qmc5883l_t *qmc, sim_i2c_bus_t bus);
+
+void sim_qmc5883l_set_field(sim_qmc5883l_t *qmc, int32_t x_mg, int32_t y_mg, int32_t z_mg);
+
+void sim_qmc5883l_set_rotation(sim_qmc5883l_t *qmc, int32_t deg_per_s);
+
+void sim_qmc5883l_set_temperature(sim_qmc5883l_t *qmc, int16_t celsius);
+
+int sim_qmc5883l_drdy(sim_qmc5883l_t *qmc);
+
+#endif
@@ -0,0 +1,298 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim_ssd1306.c
+ * @brief   SSD1306 model of the host simulator. Every transaction starts with a control byte,
+ * 			Co set means one byte follows before the next control byte, D/C set means the bytes
+ * 			are GDDRAM data. A command waiting for its arguments keeps waiting across
+ * 			transactions, the same as on the controller.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "sim_ssd1306.h"
+#include "string.h"
+
+#define SSD1306_ADDR		(0x3CU)
+#define CONTROL_CO			(0x80U)
+#define CONTROL_DC			(0x40U)
+
+#define CMD_ADDR_MODE		(0x20U)
+#define CMD_COL_ADDR		(0x21U)
+#define CMD_PAGE_ADDR		(0x22U)
+#define CMD_NORMAL			(0xA6U)
+#define CMD_INVERSE			(0xA7U)
+#define CMD_DISPLAY_OFF		(0xAEU)
+#define CMD_DISPLAY_ON		(0xAFU)
+#define CMD_PAGE_START		(0xB0U)//page addressing mode, low 3 bits are the page
+#define CMD_COL_LOW			(0x00U)//page addressing mode, low nibble of the column
+#define CMD_COL_HIGH		(0x10U)//page addressing mode, high nibble of the column
+
+#define ADDR_MODE_HORIZONTAL (0U)
+#define ADDR_MODE_VERTICAL	(1U)
+#define ADDR_MODE_PAGE		(2U)
+
+/*
+ * Function to get the number of argument bytes of a command
+ *
+ * Parameters:
+ *  cmd the command
+ *
+ * Returns:
+ *  number of arguments, -1 for a command the model does not know
+ */
+static int ssd_num_args(uint8_t cmd)
+{
+	switch(cmd)
+	{
+	case 0x20: case 0x81: case 0x8D: case 0xA8: case 0xD3: case 0xD5: case 0xD9: case 0xDA: case 0xDB:
+		return 1;
+	case 0x21: case 0x22: case 0xA3:
+		return 2;
+	case 0x29: case 0x2A:
+		return 5;
+	case 0x26: case 0x27:
+		return 6;
+	case 0x2E: case 0x2F: case 0xA0: case 0xA1: case 0xA4: case 0xA5: case 0xA6: case 0xA7:
+	case 0xAE: case 0xAF: case 0xC0: case 0xC8: case 0xE3:
+		return 0;
+	default:
+		if(cmd <= 0x1F || (cmd >= 0x40 && cmd <= 0x7F) || (cmd >= 0xB0 && cmd <= 0xB7))
+		{
+			return 0;
+		}
+		return -1;
+	}
+}
+
+/*
+ * Function to carry out a command once all its arguments are in
+ *
+ * Parameters:
+ *  ssd the model
+ *
+ * Returns:
+ *  none
+ */
+static void ssd_run_cmd(sim_ssd1306_t *ssd)
+{
+	uint8_t cmd = ssd->cmd;
+	switch(cmd)
+	{
+	case CMD_ADDR_MODE:
+		ssd->addr_mode = ssd->args[0] & 0x03;
+		break;
+	case CMD_COL_ADDR:
+		ssd->col_start = ssd->args[0] & 0x7F;
+		ssd->col_end = ssd->args[1] & 0x7F;
+		ssd->col = ssd->col_start;
+		break;
+	case CMD_PAGE_ADDR:
+		ssd->page_start = ssd->args[0] & 0x07;
+		ssd->page_end = ssd->args[1] & 0x07;
+		ssd->page = ssd->page_start;
+		break;
+	case CMD_NORMAL:
+	case CMD_INVERSE:
+		ssd->inverted = (cmd == CMD_INVERSE);
+		break;
+	case CMD_DISPLAY_OFF:
+	case CMD_DISPLAY_ON:
+		ssd->display_on = (cmd == CMD_DISPLAY_ON);
+		break;
+	default:
+		if(ssd->addr_mode == ADDR_MODE_PAGE && cmd >= CMD_PAGE_START && cmd <= CMD_PAGE_START + 7)
+		{
+			ssd->page = cmd & 0x07;
+		}else if(ssd->addr_mode == ADDR_MODE_PAGE && cmd < CMD_COL_HIGH){
+			ssd->col = (ssd->col & 0xF0) | (cmd & 0x0F);
+		}else if(ssd->addr_mode == ADDR_MODE_PAGE && cmd < CMD_ADDR_MODE){
+			ssd->col = ((cmd & 0x07) << 4) | (ssd->col & 0x0F);
+		}
+		break;
+	}
+}
+
+/*
+ * Function to take a command byte, either a new command or an argument of the last one
+ *
+ * Parameters:
+ *  ssd the model
+ *  byte the byte
+ *
+ * Returns:
+ *  none
+ */
+static void ssd_cmd_byte(sim_ssd1306_t *ssd, uint8_t byte)
+{
+	int num_args;
+	ssd->stats.cmd_bytes++;
+	if(ssd->num_args < ssd->args_expected)
+	{
+		ssd->args[ssd->num_args++] = byte;
+		if(ssd->num_args == ssd->args_expected)
+		{
+			ssd_run_cmd(ssd);
+		}
+		return;
+	}
+	num_args = ssd_num_args(byte);
+	if(num_args < 0)
+	{
+		ssd->stats.unknown_cmds++;
+		num_args = 0;
+	}
+	ssd->cmd = byte;
+	ssd->num_args = 0;
+	ssd->args_expected = num_args;
+	if(num_args == 0)
+	{
+		ssd_run_cmd(ssd);
+	}
+}
+
+/*
+ * Function to write a data byte at the GDDRAM pointer and move the pointer on
+ *
+ * Parameters:
+ *  ssd the model
+ *  byte the byte
+ *
+ * Returns:
+ *  none
+ */
+static void ssd_data_byte(sim_ssd1306_t *ssd, uint8_t byte)
+{
+	ssd->stats.data_bytes++;
+	ssd->gddram[ssd->page][ssd->col] = byte;
+	switch(ssd->addr_mode)
+	{
+	case ADDR_MODE_HORIZONTAL:
+		if(ssd->col++ == ssd->col_end)
+		{
+			ssd->col = ssd->col_start;
+			if(ssd->page++ == ssd->page_end)
+			{
+				ssd->page = ssd->page_start;
+				ssd->stats.frames++;
+			}
+		}
+		break;
+	case ADDR_MODE_VERTICAL:
+		if(ssd->page++ == ssd->page_end)
+		{
+			ssd->page = ssd->page_start;
+			if(ssd->col++ == ssd->col_end)
+			{
+				ssd->col = ssd->col_start;
+				ssd->stats.frames++;
+			}
+		}
+		break;
+	default:
+		if(ssd->page == SIM_SSD1306_PAGES - 1 && ssd->col == SIM_SSD1306_COLUMNS - 1)
+		{
+			ssd->stats.frames++;
+		}
+		ssd->col = (ssd->col + 1) % SIM_SSD1306_COLUMNS;
+		break;
+	}
+}
+
+/*
+ * Function for the model being addressed after a start
+ *
+ * Parameters:
+ *  slave the model
+ *  read 1 for a read, 0 for a write
+ *
+ * Returns:
+ *  1 for a write, 0 for a read, which the SSD1306 does not support over I2C
+ */
+static int ssd_start(sim_i2c_slave_t *slave, int read)
+{
+	sim_ssd1306_t *ssd = (sim_ssd1306_t *)slave;
+	if(read)
+	{
+		return 0;
+	}
+	ssd->control_expected = 1;
+	ssd->stats.transactions++;
+	return 1;
+}
+
+/*
+ * Function to take a byte written by the host, a control byte, a command byte or a data byte
+ *
+ * Parameters:
+ *  slave the model
+ *  byte the byte written
+ *
+ * Returns:
+ *  1, the model always acks
+ */
+static int ssd_write(sim_i2c_slave_t *slave, uint8_t byte)
+{
+	sim_ssd1306_t *ssd = (sim_ssd1306_t *)slave;
+	if(ssd->control_expected)
+	{
+		ssd->control_expected = 0;
+		ssd->single = (byte & CONTROL_CO) != 0;
+		ssd->data = (byte & CONTROL_DC) != 0;
+		return 1;
+	}
+	if(ssd->data)
+	{
+		ssd_data_byte(ssd, byte);
+	}else{
+		ssd_cmd_byte(ssd, byte);
+	}
+	ssd->control_expected = ssd->single;
+	return 1;
+}
+
+/*
+ * Function to give the host a byte, never called as reads are not acked
+ *
+ * Parameters:
+ *  slave the model
+ *
+ * Returns:
+ *  0xFF
+ */
+static uint8_t ssd_read(sim_i2c_slave_t *slave)
+{
+	return 0xFF;
+}
+
+/*
+ * Function to set up the model at power on and attach it to a bus
+ *
+ * Parameters:
+ *  ssd(out) pointer to the model, must stay valid for the rest of the run
+ *  bus the bus it is wired to
+ *
+ * Returns:
+ *  none
+ */
+void sim_ssd1306_attach(sim_ssd1306_t *ssd, sim_i2c_bus_t bus)
+{
+	memset(ssd, 0, sizeof(*ssd));
+	ssd->slave.addr = SSD1306_ADDR;
+	ssd->slave.start = ssd_start;
+	ssd->slave.write = ssd_write;
+	ssd->slave.read = ssd_read;
+	ssd->addr_mode = ADDR_MODE_PAGE;
+	ssd->col_end = SIM_SSD1306_COLUMNS - 1;
+	ssd->page_end = SIM_SSD1306_PAGES - 1;
+	sim_i2c_attach(bus, &ssd->slave);
+}
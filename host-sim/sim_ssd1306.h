@@ -0,0 +1,62 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    sim_ssd1306.h
+ * @brief   Header file for the SSD1306 model of the host simulator. It parses the control bytes
+ * 			and the commands with their arguments, follows the three addressing modes and keeps
+ * 			the GDDRAM, so a test can check what the display shows.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __SIM_SSD1306_H__
+#define __SIM_SSD1306_H__
+#include "stdint.h"
+#include "sim_i2c.h"
+
+#define SIM_SSD1306_PAGES		(8U)
+#define SIM_SSD1306_COLUMNS		(128U)
+#define SIM_SSD1306_MAX_ARGS	(6U)
+
+typedef struct{
+	uint32_t transactions;
+	uint32_t cmd_bytes;//commands and their arguments
+	uint32_t data_bytes;
+	uint32_t frames;//times the GDDRAM pointer went round the whole page and column range, in page
+					//addressing mode times the last column of the last page was written
+	uint32_t unknown_cmds;
+}sim_ssd1306_stats_t;
+
+typedef struct{
+	sim_i2c_slave_t slave;//first member, the I2C model hands it back
+	uint8_t gddram[SIM_SSD1306_PAGES][SIM_SSD1306_COLUMNS];
+	//control byte state, per transaction
+	uint8_t control_expected;
+	uint8_t data;//bytes are data, not commands
+	uint8_t single;//Co set, a control byte follows the next byte
+	//command parser, kept across transactions as on the controller
+	uint8_t cmd;
+	uint8_t args[SIM_SSD1306_MAX_ARGS];
+	uint8_t num_args;
+	uint8_t args_expected;
+	//addressing
+	uint8_t addr_mode;
+	uint8_t col_start, col_end, col;
+	uint8_t page_start, page_end, page;
+	uint8_t display_on;
+	uint8_t inverted;
+	sim_ssd1306_stats_t stats;
+}sim_ssd1306_t;
+
+void sim_ssd1306_attach(sim_ssd1306_t *ssd, sim_i2c_bus_t bus);
+
+#endif
@@ -0,0 +1,144 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test.c
+ * @brief   Test runner of the host simulator. Runs every registered test whose name contains the
+ * 			filter given on the command line, each in a child process with a wall clock limit.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/wait.h"
+
+#define MAX_TESTS			(96U)
+#define TEST_WALL_LIMIT_S	(120U)
+
+static struct{
+	const char *name;
+	test_fn_t fn;
+}tests[MAX_TESTS];
+static uint8_t num_tests;
+
+/*
+ * Function to add a test to the list, called by the TEST() constructors
+ *
+ * Parameters:
+ *  name name of the test
+ *  fn the test
+ *
+ * Returns:
+ *  none
+ */
+void test_register(const char *name, test_fn_t fn)
+{
+	if(num_tests == MAX_TESTS)
+	{
+		fprintf(stderr, "too many tests, raise MAX_TESTS\n");
+		exit(1);
+	}
+	tests[num_tests].name = name;
+	tests[num_tests].fn = fn;
+	num_tests++;
+}
+
+/*
+ * Function to end a test on a failed check
+ *
+ * Parameters:
+ *  file file of the check
+ *  line line of the check
+ *  expr the check
+ *  a left hand side of a CHECK_EQ, 0 for a CHECK
+ *  b right hand side of a CHECK_EQ, 0 for a CHECK
+ *
+ * Returns:
+ *  does not return
+ */
+void test_fail(const char *file, int line, const char *expr, long long a, long long b)
+{
+	printf("%s:%d: check failed: %s", file, line, expr);
+	if(a != b)
+	{
+		printf(" (%lld != %lld)", a, b);
+	}
+	printf(" at %u us\n", sim_now_us());
+	fflush(stdout);
+	_exit(1);
+}
+
+/*
+ * Function to run one test in a child process
+ *
+ * Parameters:
+ *  index index of the test
+ *
+ * Returns:
+ *  1 if it passed, 0 if not
+ */
+static int test_run(uint8_t index)
+{
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if(pid < 0)
+	{
+		perror("fork");
+		return 0;
+	}
+	if(pid == 0)
+	{
+		alarm(TEST_WALL_LIMIT_S);
+		sim_reset();
+		tests[index].fn();
+		exit(0);
+	}
+	waitpid(pid, &status, 0);
+	if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	{
+		printf("PASS %s\n", tests[index].name);
+		return 1;
+	}
+	if(WIFSIGNALED(status))
+	{
+		printf("FAIL %s (signal %d)\n", tests[index].name, WTERMSIG(status));
+	}else{
+		printf("FAIL %s\n", tests[index].name);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filter = argc > 1 ? argv[1] : "";
+	int run = 0, passed = 0;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	sim_init();
+	for(uint8_t i = 0; i < num_tests; i++)
+	{
+		if(strstr(tests[i].name, filter) == NULL)
+		{
+			continue;
+		}
+		run++;
+		passed += test_run(i);
+	}
+	printf("%d of %d tests passed\n", passed, run);
+	return passed == run ? 0 : 1;
+}
@@ -0,0 +1,48 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test.h
+ * @brief   Header file for the test runner of the host simulator. A TEST() registers itself before
+ * 			main(), every test runs in its own process on a freshly reset simulator, so a test that
+ * 			hangs or leaves the drivers in a bad state does not take the others down with it.
+ * 			Benchmarks are tests whose name starts with bench_ and print BENCH lines.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __TEST_H__
+#define __TEST_H__
+#include "stdint.h"
+#include "stdio.h"
+
+typedef void (*test_fn_t)();
+
+void test_register(const char *name, test_fn_t fn);
+
+void test_fail(const char *file, int line, const char *expr, long long a, long long b);
+
+#define TEST(name) \
+	static void name(); \
+	__attribute__((constructor)) static void test_register_##name() { test_register(#name, name); } \
+	static void name()
+
+#define CHECK(cond) \
+	do{ if(!(cond)) test_fail(__FILE__, __LINE__, #cond, 0, 0); }while(0)
+
+//checks a == b and prints both sides if not
+#define CHECK_EQ(a, b) \
+	do{ long long check_a = (long long)(a), check_b = (long long)(b); \
+		if(check_a != check_b) test_fail(__FILE__, __LINE__, #a " == " #b, check_a, check_b); }while(0)
+
+#define BENCH(name, fmt, ...) printf("BENCH %-32s " fmt "\n", name, __VA_ARGS__)
+
+#endif
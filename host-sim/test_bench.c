@@ -0,0 +1,269 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_bench.c
+ * @brief   Benchmarks of the host simulator. Each prints BENCH lines which are compared between
+ * 			the build variants by make bench. Times are simulated, in the cycle model of sim.h.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "ssd1306.h"
+#include "QMC5883L.h"
+#include "state_machine.h"
+#include "stdlib.h"
+
+#define BENCH_SAMPLES			(100U)
+#define BENCH_RUN_S				(30U)//long enough to leave the 10s display test state
+#define BENCH_TX_BYTES			(128U)//one display page without DMA
+#define BENCH_RX_BYTES			(9U)//the data, status and temperature registers of the QMC5883L
+#define BENCH_WAIT_US			(100000U)
+#define NS_PER_US				(1000U)
+#if !defined(I2C_TRACE) && !defined(I2C_FAULT_INJECT)
+#define BENCH_GAP_MAX_US		(4U)//engine_pump() in RAM, SysTick may come in on top of one byte
+#else
+#define BENCH_GAP_MAX_US		(8U)//every byte through engine_service() in flash and the hooks
+#endif
+
+/*
+ * Function to get the cycles spent in the interrupt handlers of the I2C engine, the DMA channels
+ * and the DRDY pin
+ *
+ * Parameters:
+ *  stats simulator statistics
+ *
+ * Returns:
+ *  cycles
+ */
+static sim_time_t bench_isr_cycles(const sim_stats_t *stats)
+{
+	return stats->cycles[SIM_EXCEPTION(I2C0_IRQn)] + stats->cycles[SIM_EXCEPTION(I2C1_IRQn)] +
+			stats->cycles[SIM_EXCEPTION(DMA0_IRQn)] + stats->cycles[SIM_EXCEPTION(DMA1_IRQn)] +
+			stats->cycles[SIM_EXCEPTION(PORTD_IRQn)];
+}
+
+TEST(bench_display_frame)
+{
+	qmc_config_t config;
+	sim_i2c_stats_t before, after;
+	sim_stats_t sim_before, sim_after;
+	sim_time_t start, queued;
+
+	devices_main_config(&config);
+	config.mode = MODE_OPTION_STANDBY;//nothing else on the bus
+	devices_attach();
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+
+	sim_i2c_get_stats(SIM_I2C1, &before);
+	sim_get_stats(&sim_before);
+	start = sim_now();
+	CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+	queued = sim_now() - start;
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	sim_get_stats(&sim_after);
+	sim_i2c_get_stats(SIM_I2C1, &after);
+
+	BENCH("frame_bus_bytes", "%u", after.bytes_tx - before.bytes_tx);
+	BENCH("frame_dma_bytes", "%u", after.dma_bytes - before.dma_bytes);
+	BENCH("frame_transactions", "%u", after.starts - before.starts);
+	BENCH("frame_us", "%u", (uint32_t)((sim_now() - start)/SIM_CYCLES_PER_US));
+	BENCH("frame_queue_us", "%u", (uint32_t)(queued/SIM_CYCLES_PER_US));
+	BENCH("frame_isr_us", "%u", (uint32_t)((bench_isr_cycles(&sim_after) - bench_isr_cycles(&sim_before))/SIM_CYCLES_PER_US));
+	BENCH("frame_isr_count", "%u", (sim_after.count[SIM_EXCEPTION(I2C1_IRQn)] - sim_before.count[SIM_EXCEPTION(I2C1_IRQn)]) +
+			(sim_after.count[SIM_EXCEPTION(DMA0_IRQn)] - sim_before.count[SIM_EXCEPTION(DMA0_IRQn)]));
+	CHECK_EQ(devices_ssd.stats.frames, 2);
+	devices_check_bus();
+}
+
+/*
+ * Function to check if a transaction is over
+ *
+ * Parameters:
+ *  context the transaction
+ *
+ * Returns:
+ *  1 once it has a final status
+ */
+static int bench_xfer_done(void *context)
+{
+	return ((i2c_xfer_t *)context)->status != I2C_STATUS_PENDING;
+}
+
+/*
+ * Function to run one transaction on the engine and print how long SCL was held low between its
+ * bytes, from IICIF to the access of D which starts the next byte, and the time per byte
+ *
+ * Parameters:
+ *  name prefix of the BENCH lines
+ *  i2c the I2C peripheral
+ *  bus the bus model of the peripheral
+ *  xfer the transaction
+ *
+ * Returns:
+ *  the longest gap in core cycles
+ */
+static uint32_t bench_byte_gaps(const char *name, I2C_Type *i2c, sim_i2c_bus_t bus, i2c_xfer_t *xfer)
+{
+	sim_i2c_stats_t before, after;
+	sim_time_t start;
+	uint32_t gaps, bytes;
+	char line[40];
+
+	sim_i2c_get_stats(bus, &before);
+	before.byte_gap_max_cycles = 0;
+	start = sim_now();
+	CHECK_EQ(i2c_submit(i2c, xfer), I2C_STATUS_PENDING);
+	CHECK(sim_run_until(bench_xfer_done, xfer, BENCH_WAIT_US));
+	CHECK_EQ(xfer->status, I2C_STATUS_OK);
+	sim_i2c_get_stats(bus, &after);
+
+	gaps = after.byte_gaps - before.byte_gaps;
+	bytes = (after.bytes_tx - before.bytes_tx) + (after.bytes_rx - before.bytes_rx);
+	CHECK(gaps > 0);
+	snprintf(line, sizeof(line), "%s_gap_mean_ns", name);
+	BENCH(line, "%u", (uint32_t)((after.byte_gap_cycles - before.byte_gap_cycles)*NS_PER_US/gaps/SIM_CYCLES_PER_US));
+	snprintf(line, sizeof(line), "%s_gap_max_ns", name);
+	BENCH(line, "%u", (uint32_t)((uint64_t)after.byte_gap_max_cycles*NS_PER_US/SIM_CYCLES_PER_US));
+	snprintf(line, sizeof(line), "%s_byte_ns", name);
+	BENCH(line, "%u", (uint32_t)((sim_now() - start)*NS_PER_US/bytes/SIM_CYCLES_PER_US));
+	return after.byte_gap_max_cycles;
+}
+
+TEST(bench_byte_latency)
+{
+	static uint8_t page[BENCH_TX_BYTES], regs[BENCH_RX_BYTES];
+	static i2c_xfer_t write = {
+			.addr = SSD1306_DEVICE_ADDR,
+			.cmd = {SSD1306_CMD_BYTE_SEND_MULTIPLE_DATA},
+			.cmd_len = 1,
+			.tx = page,
+			.tx_len = BENCH_TX_BYTES,
+	};
+	static i2c_xfer_t read = {
+			.addr = QMC_DEVICE_ADDR,
+			.cmd = {0},//from the first data register
+			.cmd_len = 1,
+			.rx = regs,
+			.rx_len = BENCH_RX_BYTES,
+	};
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.mode = MODE_OPTION_STANDBY;//nothing else on the bus
+	devices_attach();
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	CHECK_EQ(sim_i2c_scl_hz(SIM_I2C1), i2c_calc_scl_freq(SIM_BUS_HZ, i2c_calc_freq_reg(SIM_BUS_HZ, I2C_SPEED_FAST_HZ)));
+
+	//every byte goes through the I2C interrupt, without DMA
+	CHECK(bench_byte_gaps("byte_tx", SSD1306_I2C_BUS, SIM_I2C1, &write) < BENCH_GAP_MAX_US*SIM_CYCLES_PER_US);
+	CHECK(bench_byte_gaps("byte_rx", QMC_I2C_BUS, devices_qmc_bus(), &read) < BENCH_GAP_MAX_US*SIM_CYCLES_PER_US);
+	devices_check_bus();
+}
+
+TEST(bench_qmc_samples)
+{
+	qmc_config_t config;
+	sim_i2c_stats_t before, after;
+	sim_stats_t sim_before, sim_after;
+	qmc_sample_stats_t sample_stats;
+	int16_t sample[3];
+	sim_time_t start;
+	uint32_t failures = 0;
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, 200, 300, -400);
+	devices_init(&config);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+
+	sim_i2c_get_stats(devices_qmc_bus(), &before);
+	sim_get_stats(&sim_before);
+	start = sim_now();
+	for(int i = 0; i < BENCH_SAMPLES; i++)
+	{
+		if(qmc_get_nex_raw_sample(sample) != QMC_OK)
+		{
+			failures++;
+		}
+	}
+	sim_get_stats(&sim_after);
+	sim_i2c_get_stats(devices_qmc_bus(), &after);
+	qmc_get_sample_stats(&sample_stats);
+
+	BENCH("sample_transactions_x100", "%u", (after.starts + after.rstarts - before.starts - before.rstarts)*100/BENCH_SAMPLES);
+	BENCH("sample_bus_bytes_x100", "%u", (after.bytes_tx + after.bytes_rx - before.bytes_tx - before.bytes_rx)*100/BENCH_SAMPLES);
+	BENCH("sample_bus_busy_us", "%u", (uint32_t)((after.busy_cycles - before.busy_cycles)/BENCH_SAMPLES/SIM_CYCLES_PER_US));
+	BENCH("sample_isr_us", "%u", (uint32_t)((bench_isr_cycles(&sim_after) - bench_isr_cycles(&sim_before))/BENCH_SAMPLES/SIM_CYCLES_PER_US));
+	BENCH("sample_period_us", "%u", (uint32_t)((sim_now() - start)/BENCH_SAMPLES/SIM_CYCLES_PER_US));
+	BENCH("sample_overruns", "%u", sample_stats.overruns);
+	BENCH("sample_failures", "%u", failures);
+#ifndef I2C_FAULT_INJECT
+	CHECK_EQ(failures, 0);
+	CHECK_EQ(sample[0], 200*3);//8G, 3000 LSB/G, auto ranging off so the raw 8G value
+#endif
+	devices_check_bus();
+}
+
+/*
+ * Function for the end of the state machine run, prints what it did and ends the test
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  does not return
+ */
+static void bench_state_machine_done()
+{
+	sim_stats_t stats;
+	sim_i2c_stats_t bus;
+	qmc_sample_stats_t sample_stats;
+	sim_time_t elapsed = sim_now();
+
+	sim_get_stats(&stats);
+	sim_i2c_get_stats(SIM_I2C1, &bus);
+	qmc_get_sample_stats(&sample_stats);
+	BENCH("run_frames", "%u", devices_ssd.stats.frames);
+	BENCH("run_measurements", "%u", devices_qmc.stats.measurements);
+	BENCH("run_samples", "%u", sample_stats.samples);
+	BENCH("run_samples_lost", "%u", sample_stats.overruns);
+	BENCH("run_samples_skipped", "%u", sample_stats.skipped);
+	BENCH("run_i2c1_busy_permille", "%u", (uint32_t)(bus.busy_cycles*1000/elapsed));
+	BENCH("run_isr_permille", "%u", (uint32_t)(bench_isr_cycles(&stats)*1000/elapsed));
+	BENCH("run_primask_max_us", "%u", (uint32_t)(stats.primask_max/SIM_CYCLES_PER_US));
+	devices_check_bus();
+	exit(0);
+}
+
+TEST(bench_state_machine)
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, 200, 300, -400);
+	sim_qmc5883l_set_rotation(&devices_qmc, 30);
+	sim_qmc5883l_set_temperature(&devices_qmc, 25);
+	devices_init(&config);
+	sim_set_time_limit(BENCH_RUN_S*1000000U, bench_state_machine_done);
+	run_state_machine();
+}
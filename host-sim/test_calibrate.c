@@ -0,0 +1,227 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_calibrate.c
+ * @brief   Tests of the fixed point calibration of qmc_calibrate_data() against the same calculation
+ * 			in double, with a soft iron matrix that is not diagonal. 600k axis values go through it,
+ * 			the calibration capture in calibration-py-file and pseudo random values over the whole
+ * 			int16 range, and the values which saturate are checked on their own.
+ *
+ * 			The benchmark gives the cost of one call in the cycle model of the simulator, which counts
+ * 			calls and memory accesses but not the multiplies.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "math.h"
+#include "sim.h"
+#include "QMC5883L.h"
+
+#define CALIBRATE_CAPTURE_FILE	SIM_REPO_DIR "/calibration-py-file/mag_cal_data_three_axis.txt"
+#define CALIBRATE_SAMPLES		(200000U)//600k axis values
+#define CALIBRATE_MAX_ERR_LSB	(2.15)
+#define CALIBRATE_BENCH_CALLS	(100000U)
+
+//a soft iron matrix with the SCALE_* values on the diagonal and a tilt between the axes
+static const double calibrate_matrix[3][3] = {
+		{SCALE_X,	0.021,		-0.013},
+		{0.017,		SCALE_Y,	0.008},
+		{-0.011,	0.006,		SCALE_Z}
+};
+static const int16_t calibrate_offset[3] = {OFFSET_X, OFFSET_Y, OFFSET_Z};
+
+/*
+ * Function to set the calibration of the driver to calibrate_offset and calibrate_matrix
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void calibrate_set()
+{
+	qmc_calibration_data_t cal;
+
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		cal.offset[i] = calibrate_offset[i];
+		for(int j = AXIS_X; j <= AXIS_Z; j++)
+		{
+			cal.matrix[i][j] = QMC_CAL_Q14(calibrate_matrix[i][j]);
+		}
+	}
+	qmc_set_calibration(&cal);
+}
+
+/*
+ * Function to saturate a value to 16 bits
+ *
+ * Parameters:
+ *  value the value
+ *
+ * Returns:
+ *  value limited to INT16_MIN..INT16_MAX
+ */
+static double calibrate_clip(double value)
+{
+	return (value > INT16_MAX) ? INT16_MAX : (value < INT16_MIN) ? INT16_MIN : value;
+}
+
+/*
+ * Function to calibrate a sample in double, with the offset corrected values saturated to 16 bits
+ * as qmc_calibrate_data() documents
+ *
+ * Parameters:
+ *  raw the raw sample
+ *  out(out) the calibrated sample, not rounded
+ *
+ * Returns:
+ *  none
+ */
+static void calibrate_reference(const int16_t raw[], double out[])
+{
+	double centered[3];
+
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		centered[i] = calibrate_clip((double)raw[i] - calibrate_offset[i]);
+	}
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		out[i] = calibrate_clip(calibrate_matrix[i][AXIS_X]*centered[AXIS_X] + calibrate_matrix[i][AXIS_Y]*centered[AXIS_Y] +
+								calibrate_matrix[i][AXIS_Z]*centered[AXIS_Z]);
+	}
+}
+
+/*
+ * Function to check one sample against the reference and keep the largest error
+ *
+ * Parameters:
+ *  raw the raw sample
+ *  max_err(in/out) the largest error so far, LSB
+ *
+ * Returns:
+ *  none
+ */
+static void calibrate_check(const int16_t raw[], double *max_err)
+{
+	int16_t data[3] = {raw[AXIS_X], raw[AXIS_Y], raw[AXIS_Z]};
+	double expected[3];
+
+	qmc_calibrate_data(data);
+	calibrate_reference(raw, expected);
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		*max_err = fmax(*max_err, fabs(data[i] - expected[i]));
+	}
+}
+
+TEST(calibrate_against_double)
+{
+	FILE *file = fopen(CALIBRATE_CAPTURE_FILE, "r");
+	double max_err = 0;
+	uint32_t count = 0, seed = 3;
+	int16_t raw[3];
+	int x, y, z;
+
+	calibrate_set();
+	CHECK(file != NULL);
+	while(file != NULL && fscanf(file, "%d %d %d", &x, &y, &z) == 3)
+	{
+		raw[AXIS_X] = x;
+		raw[AXIS_Y] = y;
+		raw[AXIS_Z] = z;
+		calibrate_check(raw, &max_err);
+		count++;
+	}
+	if(file != NULL)
+	{
+		fclose(file);
+	}
+	CHECK(count > 0);
+	for(; count < CALIBRATE_SAMPLES; count++)
+	{
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			seed = seed*1664525U + 1013904223U;
+			raw[i] = (int16_t)(seed >> 16);
+		}
+		calibrate_check(raw, &max_err);
+	}
+	printf("calibrate_against_double: %u axis values, max error %.3f LSB\n", 3*count, max_err);
+	CHECK(max_err <= CALIBRATE_MAX_ERR_LSB);
+}
+
+TEST(calibrate_saturation)
+{
+	static const int16_t raw[][3] = {
+			{INT16_MAX, 0, 0},//past the top of the range once scaled by 1.03
+			{INT16_MIN, 0, 0},//offset correction past the bottom, then scaled
+			{0, INT16_MAX, 0},//offset correction past the top
+			{INT16_MAX, INT16_MAX, INT16_MAX},//z is pulled back inside by the tilt
+			{INT16_MIN, INT16_MIN, INT16_MIN},
+			{INT16_MIN, INT16_MAX, INT16_MIN},//offset correction saturates, the outputs do not
+	};
+	static const int16_t saturated[][3] = {
+			{INT16_MAX, 0, 0},
+			{INT16_MIN, 0, 0},
+			{0, INT16_MAX, 0},
+			{INT16_MAX, INT16_MAX, 0},
+			{INT16_MIN, INT16_MIN, 0},
+			{0, 0, 0},
+	};
+	int16_t data[3];
+	double expected[3], max_err = 0;
+
+	calibrate_set();
+	for(int n = 0; n < sizeof(raw)/sizeof(raw[0]); n++)
+	{
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			data[i] = raw[n][i];
+		}
+		qmc_calibrate_data(data);
+		calibrate_reference(raw[n], expected);
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			//saturated axes stay at the limit instead of wrapping around, the others are in bounds
+			if(saturated[n][i] != 0)
+			{
+				CHECK_EQ(data[i], saturated[n][i]);
+			}
+			max_err = fmax(max_err, fabs(data[i] - expected[i]));
+		}
+	}
+	CHECK(max_err <= CALIBRATE_MAX_ERR_LSB);
+}
+
+TEST(bench_calibrate)
+{
+	volatile int16_t sink;
+	int16_t data[3];
+	sim_time_t start;
+
+	calibrate_set();
+	start = sim_now();
+	for(int n = 0; n < CALIBRATE_BENCH_CALLS; n++)
+	{
+		data[AXIS_X] = n;
+		data[AXIS_Y] = -n;
+		data[AXIS_Z] = n >> 1;
+		qmc_calibrate_data(data);
+		sink = data[AXIS_X];
+	}
+	(void)sink;
+	BENCH("calibrate_sim_cycles", "%u", (uint32_t)((sim_now() - start)/CALIBRATE_BENCH_CALLS));
+}
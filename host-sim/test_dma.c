@@ -0,0 +1,229 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_dma.c
+ * @brief   Tests of the DMA path of the I2C engine and of the display frames sent over it. The
+ * 			descriptor is read back from the DMA registers while the channel is running, and the
+ * 			frame is checked in the GDDRAM of the SSD1306 model.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+#include "ssd1306.h"
+
+#define DMA_CHANNEL_I2C1	(0U)//I2C1_DMA_CHANNEL of i2c.c
+#define DMAMUX_SRC_I2C1		(23U)
+#define PAGE_LEN			(128U)
+#define PAGE_CMD_LEN		(7U)//control and addressing bytes before the data of a page
+#define DMA_WAIT_US			(100000U)
+#define FRAME_PAGES			(8U)
+#define GLYPH_LEN			(5U)
+
+static i2c_xfer_t page;
+static uint8_t page_data[PAGE_LEN];
+
+/*
+ * Function to bring up both devices with the magnetometer in standby, so that only the display
+ * uses the bus, and wait for the first frame which leaves the GDDRAM pointer at page 0, column 0
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void dma_init()
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.mode = MODE_OPTION_STANDBY;
+	devices_attach();
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+}
+
+/*
+ * Function to queue one page of data for the display as a DMA transaction
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void dma_submit_page()
+{
+	for(int i = 0; i < PAGE_LEN; i++)
+	{
+		page_data[i] = i ^ 0x5A;
+	}
+	page.addr = SSD1306_DEVICE_ADDR;
+	page.flags = I2C_XFER_FLAG_DMA;
+	//page 0 column 0, then the data, like the page transactions of ssd1306.c
+	page.cmd[0] = SSD1306_CMD_BYTE_SEND_ONE_COMMAND;
+	page.cmd[1] = SSD1306_SET_PAGE_START;
+	page.cmd[2] = SSD1306_CMD_BYTE_SEND_ONE_COMMAND;
+	page.cmd[3] = SSD1306_SET_COL_LOW_NIBBLE;
+	page.cmd[4] = SSD1306_CMD_BYTE_SEND_ONE_COMMAND;
+	page.cmd[5] = SSD1306_SET_COL_HIGH_NIBBLE;
+	page.cmd[6] = SSD1306_CMD_BYTE_SEND_MULTIPLE_DATA;
+	page.cmd_len = PAGE_CMD_LEN;
+	page.tx = page_data;
+	page.tx_len = PAGE_LEN;
+	CHECK_EQ(i2c_submit(SSD1306_I2C_BUS, &page), I2C_STATUS_PENDING);
+}
+
+/*
+ * Function to check if the DMA channel of I2C1 has been handed a descriptor
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  1 once the channel takes requests
+ */
+static int dma_running(void *context)
+{
+	return (DMA0->DMA[DMA_CHANNEL_I2C1].DCR & DMA_DCR_ERQ_MASK) != 0;
+}
+
+/*
+ * Function to check if the page transaction is over
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  1 once it has a final status
+ */
+static int dma_page_done(void *context)
+{
+	return page.status != I2C_STATUS_PENDING;
+}
+
+TEST(dma_page_descriptor)
+{
+	sim_i2c_stats_t before, after;
+	sim_stats_t sim_before, sim_after;
+	uint32_t sar, bcr;
+
+	dma_init();
+	sim_i2c_get_stats(SIM_I2C1, &before);
+	sim_get_stats(&sim_before);
+	dma_submit_page();
+	CHECK(sim_run_until(dma_running, NULL, DMA_WAIT_US));
+
+	//the channel is routed to I2C1 and moves the rest of the page, byte by byte, into D
+	CHECK_EQ(DMAMUX0->CHCFG[DMA_CHANNEL_I2C1], DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(DMAMUX_SRC_I2C1));
+	CHECK_EQ(DMA0->DMA[DMA_CHANNEL_I2C1].DAR, (uint32_t)(uintptr_t)&I2C1->D);
+	CHECK_EQ(DMA0->DMA[DMA_CHANNEL_I2C1].DCR, DMA_DCR_EINT_MASK | DMA_DCR_ERQ_MASK | DMA_DCR_CS_MASK |
+			DMA_DCR_SINC_MASK | DMA_DCR_SSIZE(1) | DMA_DCR_DSIZE(1) | DMA_DCR_D_REQ_MASK);
+	sar = DMA0->DMA[DMA_CHANNEL_I2C1].SAR;
+	bcr = DMA0->DMA[DMA_CHANNEL_I2C1].DSR_BCR & DMA_DSR_BCR_BCR_MASK;
+	CHECK(sar >= (uint32_t)(uintptr_t)page_data && sar < (uint32_t)(uintptr_t)&page_data[PAGE_LEN]);
+	CHECK_EQ(sar + bcr, (uint32_t)(uintptr_t)&page_data[PAGE_LEN]);
+	CHECK(I2C1->C1 & I2C_C1_DMAEN_MASK);
+	CHECK(!(I2C1->C1 & I2C_C1_IICIE_MASK));//no interrupt per byte while the channel runs
+
+	CHECK(sim_run_until(dma_page_done, NULL, DMA_WAIT_US));
+	sim_get_stats(&sim_after);
+	sim_i2c_get_stats(SIM_I2C1, &after);
+	CHECK_EQ(page.status, I2C_STATUS_OK);
+	for(int i = 0; i < PAGE_LEN; i++)
+	{
+		CHECK_EQ(devices_ssd.gddram[0][i], page_data[i]);
+	}
+	CHECK(after.dma_bytes - before.dma_bytes >= PAGE_LEN - 1);
+	CHECK_EQ(sim_after.count[SIM_EXCEPTION(DMA0_IRQn)] - sim_before.count[SIM_EXCEPTION(DMA0_IRQn)], 1);
+	CHECK(sim_after.count[SIM_EXCEPTION(I2C1_IRQn)] - sim_before.count[SIM_EXCEPTION(I2C1_IRQn)] <= PAGE_CMD_LEN + 4);
+	CHECK(!(I2C1->C1 & I2C_C1_DMAEN_MASK));
+	CHECK(!(DMA0->DMA[DMA_CHANNEL_I2C1].DSR_BCR & DMA_DSR_BCR_DONE_MASK));
+	devices_check_bus();
+}
+
+TEST(dma_error_ends_transaction)
+{
+	sim_i2c_stats_t before, after;
+
+	dma_init();
+	sim_i2c_get_stats(SIM_I2C1, &before);
+	dma_submit_page();
+	CHECK(sim_run_until(dma_running, NULL, DMA_WAIT_US));
+
+	//a bus error on the source read, the channel stops with BES and DONE set
+	DMA0->DMA[DMA_CHANNEL_I2C1].DCR &= ~DMA_DCR_ERQ_MASK;
+	DMA0->DMA[DMA_CHANNEL_I2C1].DSR_BCR |= DMA_DSR_BCR_BES_MASK | DMA_DSR_BCR_DONE_MASK;
+	sim_write_register((uintptr_t)&NVIC->ISPR[0], 4, 1U << DMA0_IRQn);
+	CHECK(sim_run_until(dma_page_done, NULL, DMA_WAIT_US));
+	CHECK_EQ(page.status, I2C_STATUS_DMA_ERROR);
+	CHECK(!(I2C1->C1 & I2C_C1_DMAEN_MASK));
+	i2c_wait_idle(SSD1306_I2C_BUS);
+	sim_i2c_get_stats(SIM_I2C1, &after);
+	CHECK_EQ(after.stops - before.stops, 1);
+
+	//the engine goes on with the next transaction
+	dma_submit_page();
+	CHECK(sim_run_until(dma_page_done, NULL, DMA_WAIT_US));
+	CHECK_EQ(page.status, I2C_STATUS_OK);
+}
+
+TEST(dma_frame_pages)
+{
+	static const uint8_t hash[GLYPH_LEN] = {0x14, 0x7F, 0x14, 0x7F, 0x14};//'#' in font.h
+	sim_i2c_stats_t before, after;
+	sim_stats_t sim_before, sim_after;
+	uint32_t irqs;
+
+	dma_init();
+	CHECK_EQ(ssd1306_clear_buffer(), SSD1306_OK);
+	for(int p = 0; p < FRAME_PAGES; p++)
+	{
+		CHECK_EQ(ssd1306_write_string_in_buffer(p, p*12, "#", 1), SSD1306_OK);
+	}
+	sim_i2c_get_stats(SIM_I2C1, &before);
+	sim_get_stats(&sim_before);
+	CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	sim_get_stats(&sim_after);
+	sim_i2c_get_stats(SIM_I2C1, &after);
+
+	//every page lands on its own page, nothing else is lit
+	for(int p = 0; p < FRAME_PAGES; p++)
+	{
+		for(int i = 0; i < PAGE_LEN; i++)
+		{
+			uint8_t expected = (i >= p*12 && i < p*12 + GLYPH_LEN) ? hash[i - p*12] : 0;
+			CHECK_EQ(devices_ssd.gddram[p][i], expected);
+		}
+	}
+	CHECK_EQ(devices_ssd.stats.frames, 2);
+
+	irqs = (sim_after.count[SIM_EXCEPTION(I2C1_IRQn)] - sim_before.count[SIM_EXCEPTION(I2C1_IRQn)]) +
+		   (sim_after.count[SIM_EXCEPTION(DMA0_IRQn)] - sim_before.count[SIM_EXCEPTION(DMA0_IRQn)]);
+#ifdef SIM_SSD1306_NO_DMA
+	//polled fallback, an interrupt per byte
+	CHECK_EQ(after.dma_bytes - before.dma_bytes, 0);
+	CHECK(irqs >= FRAME_PAGES*PAGE_LEN);
+#else
+	//addressing and completion only, all but the first data byte of each page go by DMA
+	CHECK_EQ(after.dma_bytes - before.dma_bytes, FRAME_PAGES*(PAGE_LEN - 1));
+	CHECK(irqs <= (PAGE_CMD_LEN + 4)*FRAME_PAGES);
+#endif
+	devices_check_bus();
+}
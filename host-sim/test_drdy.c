@@ -0,0 +1,189 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_drdy.c
+ * @brief   Tests of the DRDY sampling of QMC5883L.c. The magnetometer model drives DRDY on PTD4 at
+ * 			200Hz, and the timestamp of every sample is checked against the time the model set the
+ * 			line. The bus has to carry one burst per sample and no reads of the status register on
+ * 			its own, which the polled path is benched against.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+#include "ssd1306.h"
+#include "systick.h"
+#include "QMC5883L.h"
+#include "stdlib.h"
+
+#define DRDY_SAMPLES			(200U)//one second at 200Hz
+#define DRDY_ODR_PERIOD_US		(5000U)
+#define DRDY_STAMP_MAX_US		(20U)//from the edge to the timestamp taken by the pin interrupt
+#define DRDY_LSB_PER_MG			(12)//2G range, auto ranging off
+#define SAMPLE_BURST_BYTES		(3U + 7U)//both address bytes and the register pointer, then status and data
+#define TEMP_BURST_BYTES		(3U + 2U)//both address bytes and the register pointer, then the temperature
+
+typedef struct{
+	sim_i2c_stats_t bus;
+	sim_qmc5883l_stats_t qmc;
+	qmc_sample_stats_t samples;
+	uint32_t stamp_err_max_us;//sample timestamp against the DRDY edge of the model
+	uint32_t stamp_err_sum_us;
+	uint32_t period_err_max_us;//between the timestamps of two samples against the ODR period
+}drdy_run_t;
+
+/*
+ * Function to bring up both devices with the magnetometer at 200Hz and 2G, wait for the first
+ * frame so only the magnetometer uses the bus from there on, and take one sample
+ *
+ * Parameters:
+ *  int_enb INT_ENB_ENABLE to sample on DRDY, INT_ENB_DISABLE to poll the status register
+ *
+ * Returns:
+ *  none
+ */
+static void drdy_init(qmc_cr2_int_enb_options_t int_enb)
+{
+	qmc_config_t config;
+	int16_t sample[3];
+
+	devices_main_config(&config);
+	config.int_enb = int_enb;
+	config.odr = ODR_OPTION_200HZ;
+	config.rng = RNG_OPTION_2G;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, 200, 300, -400);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+
+	//on a bus of its own the magnetometer kept measuring through the frame, and the sample left
+	//from then may be older than the last edge or overrun, so the run starts after it
+	qmc_get_nex_raw_sample(sample);
+}
+
+/*
+ * Function to take samples back to back and time each one against the DRDY edge the model made
+ * for it
+ *
+ * Parameters:
+ *  run(out) the counts over the run and the timestamp errors
+ *
+ * Returns:
+ *  none
+ */
+static void drdy_run(drdy_run_t *run)
+{
+	sim_i2c_stats_t bus;
+	sim_qmc5883l_stats_t qmc = devices_qmc.stats;
+	qmc_sample_stats_t samples;
+	int16_t sample[3];
+	uint32_t offset_us, edge_us, stamp_us, last_stamp_us = 0, err;
+
+	//now_us() counts from init_systick(), the model from the start of the run
+	offset_us = now_us() - sim_now_us();
+	i2c_wait_idle(QMC_I2C_BUS);//so no burst is counted by the bus and not yet by the model
+	sim_i2c_get_stats(devices_qmc_bus(), &bus);
+	qmc_get_sample_stats(&samples);
+	run->stamp_err_max_us = run->stamp_err_sum_us = run->period_err_max_us = 0;
+	for(int i = 0; i < DRDY_SAMPLES; i++)
+	{
+		CHECK_EQ(qmc_get_nex_raw_sample(sample), QMC_OK);
+		CHECK_EQ(sample[0], 200*DRDY_LSB_PER_MG);
+		CHECK_EQ(sample[2], -400*DRDY_LSB_PER_MG);
+
+		stamp_us = qmc_get_sample_time_us();
+		edge_us = (uint32_t)(devices_qmc.drdy_time/SIM_CYCLES_PER_US) + offset_us;
+		CHECK((int32_t)(stamp_us - edge_us) >= 0);
+		err = stamp_us - edge_us;
+		run->stamp_err_sum_us += err;
+		if(err > run->stamp_err_max_us)
+		{
+			run->stamp_err_max_us = err;
+		}
+		if(i > 0)
+		{
+			err = abs((int32_t)(stamp_us - last_stamp_us - DRDY_ODR_PERIOD_US));
+			if(err > run->period_err_max_us)
+			{
+				run->period_err_max_us = err;
+			}
+		}
+		last_stamp_us = stamp_us;
+	}
+
+	i2c_wait_idle(QMC_I2C_BUS);
+	sim_i2c_get_stats(devices_qmc_bus(), &run->bus);
+	run->bus.starts -= bus.starts;
+	run->bus.rstarts -= bus.rstarts;
+	run->bus.bytes_tx -= bus.bytes_tx;
+	run->bus.bytes_rx -= bus.bytes_rx;
+	run->bus.busy_cycles -= bus.busy_cycles;
+	run->qmc = devices_qmc.stats;
+	run->qmc.measurements -= qmc.measurements;
+	run->qmc.data_reads -= qmc.data_reads;
+	run->qmc.overruns -= qmc.overruns;
+	qmc_get_sample_stats(&run->samples);
+	run->samples.samples -= samples.samples;
+	run->samples.overruns -= samples.overruns;
+}
+
+TEST(drdy_samples_at_200hz)
+{
+	drdy_run_t run;
+	uint32_t temps;
+
+	drdy_init(INT_ENB_ENABLE);
+	drdy_run(&run);
+
+	//every measurement of the model is read, each stamped with its own edge. The first sample may
+	//have been read before the run started
+	CHECK_EQ(run.qmc.overruns, 0);
+	CHECK_EQ(run.samples.overruns, 0);
+	CHECK(run.qmc.data_reads >= DRDY_SAMPLES - 1);
+	CHECK(run.qmc.data_reads <= run.qmc.measurements);
+	CHECK(run.stamp_err_max_us <= DRDY_STAMP_MAX_US);
+	CHECK(run.period_err_max_us <= 1);//now_us() has 1us steps
+
+	//one burst per sample and the temperature once a second, the status register is never polled
+	temps = run.bus.starts - run.qmc.data_reads;
+	CHECK(temps <= 1 + DRDY_SAMPLES*DRDY_ODR_PERIOD_US/(QMC_TEMP_PERIOD_MS*1000U));
+	CHECK_EQ(run.bus.rstarts, run.bus.starts);
+	CHECK_EQ(run.bus.bytes_tx + run.bus.bytes_rx, run.qmc.data_reads*SAMPLE_BURST_BYTES + temps*TEMP_BURST_BYTES);
+	devices_check_bus();
+
+	BENCH("drdy_stamp_err_us", "%u", run.stamp_err_sum_us/DRDY_SAMPLES);
+	BENCH("drdy_stamp_err_max_us", "%u", run.stamp_err_max_us);
+	BENCH("drdy_bus_us_per_sample", "%u", (uint32_t)(run.bus.busy_cycles/run.qmc.data_reads/SIM_CYCLES_PER_US));
+}
+
+TEST(drdy_polled_reads_status)
+{
+	drdy_run_t run;
+
+	drdy_init(INT_ENB_DISABLE);
+	drdy_run(&run);
+
+	//the polled path stamps a sample when it sees DRDY in the status register, up to a whole burst
+	//after the edge, and reads the status register in every burst which finds no new sample
+	CHECK_EQ(run.qmc.overruns, 0);
+	CHECK(run.bus.starts > run.qmc.data_reads);
+	BENCH("polled_stamp_err_us", "%u", run.stamp_err_sum_us/DRDY_SAMPLES);
+	BENCH("polled_stamp_err_max_us", "%u", run.stamp_err_max_us);
+	BENCH("polled_bursts_per_sample_x100", "%u", run.bus.starts*100/run.qmc.data_reads);
+	BENCH("polled_bus_us_per_sample", "%u", (uint32_t)(run.bus.busy_cycles/run.qmc.data_reads/SIM_CYCLES_PER_US));
+}
@@ -0,0 +1,119 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_dualbus.c
+ * @brief   Benchmark of the magnetometer sharing I2C1 with the display against having I2C0 to
+ * 			itself, the dualbus build. Display frames are sent back to back while the magnetometer
+ * 			samples at 200Hz, and the model times each sample from its DRDY edge to the STOP of
+ * 			the burst which read it. Run with make bench and compare the default and dualbus
+ * 			lines.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+#include "ssd1306.h"
+#include "QMC5883L.h"
+
+#define DUAL_SAMPLES			(200U)//one second at 200Hz
+#define DUAL_WAIT_US			(100000U)
+#define DUAL_READ_MAX_US		(600U)//the 10 byte burst read at 400kHz and the interrupts around it
+#define DUAL_PAGE_MAX_US		(3300U)//one display page at 400kHz, the longest a read can wait behind
+
+typedef struct{
+	sim_time_t overlap;//time both buses were busy at once
+	sim_time_t last_time;
+}dual_watch_t;
+
+/*
+ * Function called after every simulator event. Adds up the time both buses were busy, and stops
+ * the run once the frame on the display bus is done
+ *
+ * Parameters:
+ *  context the watch
+ *
+ * Returns:
+ *  1 to stop the run
+ */
+static int dual_watch(void *context)
+{
+	dual_watch_t *watch = context;
+	sim_time_t now = sim_now();
+
+	if(sim_i2c_busy(SIM_I2C0) && sim_i2c_busy(SIM_I2C1))
+	{
+		watch->overlap += now - watch->last_time;
+	}
+	watch->last_time = now;
+	return !ssd1306_frame_in_progress();
+}
+
+TEST(bench_dual_bus)
+{
+	qmc_config_t config;
+	dual_watch_t watch = {0};
+	sim_qmc5883l_stats_t before, after;
+	qmc_sample_stats_t samples_before, samples_after;
+	sim_time_t start, elapsed;
+	uint32_t frames = 0, reads;
+	int dual;
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, 200, 300, -400);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	dual = (devices_qmc_bus() != SIM_I2C1);
+
+	//frames back to back, the model times every sample from DRDY to the STOP of its read
+	devices_qmc.stats.read_delay_max = 0;
+	before = devices_qmc.stats;
+	qmc_get_sample_stats(&samples_before);
+	watch.last_time = start = sim_now();
+	while(devices_qmc.stats.data_reads - before.data_reads < DUAL_SAMPLES)
+	{
+		CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+		frames++;
+		CHECK(sim_run_until(dual_watch, &watch, DUAL_WAIT_US));
+	}
+	after = devices_qmc.stats;
+	qmc_get_sample_stats(&samples_after);
+	elapsed = sim_now() - start;
+	reads = after.data_reads - before.data_reads;
+
+	//every measurement was read before the next one, none lost to the display
+	CHECK_EQ(after.overruns, before.overruns);
+	CHECK(samples_after.samples - samples_before.samples >= reads - 1);
+	BENCH("dual_frames_per_s", "%u", (uint32_t)(frames*(sim_time_t)SIM_CORE_HZ/elapsed));
+	BENCH("dual_samples_per_s", "%u", (uint32_t)(reads*(sim_time_t)SIM_CORE_HZ/elapsed));
+	BENCH("dual_read_delay_us", "%u", (uint32_t)((after.read_delay_sum - before.read_delay_sum)/reads/SIM_CYCLES_PER_US));
+	BENCH("dual_read_delay_max_us", "%u", (uint32_t)(after.read_delay_max/SIM_CYCLES_PER_US));
+	BENCH("dual_overlap_permille", "%u", (uint32_t)(watch.overlap*1000/elapsed));
+
+	//a read waits for at most the display page already on a shared bus, for nothing on its own bus
+	if(dual)
+	{
+		CHECK(after.read_delay_max < DUAL_READ_MAX_US*SIM_CYCLES_PER_US);
+		CHECK(watch.overlap > 0);
+	}else{
+		CHECK(after.read_delay_max < (DUAL_PAGE_MAX_US + DUAL_READ_MAX_US)*SIM_CYCLES_PER_US);
+		CHECK(after.read_delay_max > DUAL_READ_MAX_US*SIM_CYCLES_PER_US);
+	}
+	devices_check_bus();
+}
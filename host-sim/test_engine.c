@@ -0,0 +1,374 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_engine.c
+ * @brief   Tests of the interrupt driven transaction engine of i2c.c, against a slave which logs
+ * 			every byte written to it. Each transaction writes its own index, so the log gives the
+ * 			order the transactions went out on the bus in.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+#include "systick.h"
+
+#define LOG_ADDR			(0x50U)
+#define LOG_LEN				(256U)
+#define ENGINE_XFERS		(1U + I2C_XFER_QUEUE_LEN)//one on the bus and a full queue
+#define ENGINE_WAIT_US		(100000U)
+#define ENGINE_RECOVERY_US	(300U)//clocking the bus free and setting the module up again
+
+typedef struct{
+	sim_i2c_slave_t slave;
+	uint8_t log[LOG_LEN];
+	uint16_t len;
+	uint8_t next_read;
+}log_slave_t;
+
+static log_slave_t log_slave;
+static i2c_xfer_t xfers[ENGINE_XFERS + 1];
+static uint8_t tx[ENGINE_XFERS + 1][4];
+static uint8_t order[2*ENGINE_XFERS];
+static uint8_t num_done;
+
+/*
+ * Function for the log slave being addressed, acks writes and reads
+ *
+ * Parameters:
+ *  slave the slave
+ *  read 1 for a read
+ *
+ * Returns:
+ *  1
+ */
+static int log_start(sim_i2c_slave_t *slave, int read)
+{
+	return 1;
+}
+
+/*
+ * Function to log a byte written to the log slave
+ *
+ * Parameters:
+ *  slave the slave
+ *  byte the byte
+ *
+ * Returns:
+ *  1
+ */
+static int log_write(sim_i2c_slave_t *slave, uint8_t byte)
+{
+	log_slave_t *log = (log_slave_t *)slave;
+	CHECK(log->len < LOG_LEN);
+	log->log[log->len++] = byte;
+	return 1;
+}
+
+/*
+ * Function to give a byte to the host, counts up from 0xA0
+ *
+ * Parameters:
+ *  slave the slave
+ *
+ * Returns:
+ *  the byte
+ */
+static uint8_t log_read(sim_i2c_slave_t *slave)
+{
+	log_slave_t *log = (log_slave_t *)slave;
+	return log->next_read++;
+}
+
+/*
+ * Function to bring up I2C1 at 400kHz with only the log slave on it
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void engine_init()
+{
+	log_slave.slave.addr = LOG_ADDR;
+	log_slave.slave.start = log_start;
+	log_slave.slave.write = log_write;
+	log_slave.slave.read = log_read;
+	log_slave.next_read = 0xA0;
+	sim_i2c_attach(SIM_I2C1, &log_slave.slave);
+	init_systick();
+	init_i2c(I2C1);
+	i2c_set_speed(I2C1, I2C_SPEED_FAST);
+	devices_disable_faults();
+	num_done = 0;
+}
+
+/*
+ * Callback logging the order transactions finish in
+ *
+ * Parameters:
+ *  xfer the transaction
+ *
+ * Returns:
+ *  none
+ */
+static void engine_done(i2c_xfer_t *xfer)
+{
+	CHECK(sim_in_handler());
+	order[num_done++] = (uint8_t)(uintptr_t)xfer->context;
+}
+
+/*
+ * Function to set up transaction i, writing i to the log slave
+ *
+ * Parameters:
+ *  i index of the transaction
+ *  flags flags of the transaction
+ *
+ * Returns:
+ *  pointer to the transaction
+ */
+static i2c_xfer_t* engine_xfer(uint8_t i, uint8_t flags)
+{
+	i2c_xfer_t *xfer = &xfers[i];
+	tx[i][0] = i;
+	xfer->addr = LOG_ADDR;
+	xfer->flags = flags;
+	xfer->cmd_len = 0;
+	xfer->tx = tx[i];
+	xfer->tx_len = 1;
+	xfer->rx = NULL;
+	xfer->rx_len = 0;
+	xfer->callback = engine_done;
+	xfer->context = (void *)(uintptr_t)i;
+	return xfer;
+}
+
+/*
+ * Function to check the engine has gone idle
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  1 if idle
+ */
+static int engine_idle(void *context)
+{
+	return !i2c_engine_busy(I2C1) && !sim_i2c_busy(SIM_I2C1);
+}
+
+TEST(engine_callbacks_in_submit_order)
+{
+	engine_init();
+	for(int i = 0; i < ENGINE_XFERS; i++)
+	{
+		CHECK_EQ(i2c_submit(I2C1, engine_xfer(i, 0)), I2C_STATUS_PENDING);
+	}
+	CHECK_EQ(i2c_submit(I2C1, engine_xfer(ENGINE_XFERS, 0)), I2C_STATUS_QUEUE_FULL);
+	CHECK(sim_run_until(engine_idle, NULL, ENGINE_WAIT_US));
+	CHECK_EQ(num_done, ENGINE_XFERS);
+	CHECK_EQ(log_slave.len, ENGINE_XFERS);
+	for(int i = 0; i < ENGINE_XFERS; i++)
+	{
+		CHECK_EQ(order[i], i);
+		CHECK_EQ(log_slave.log[i], i);
+		CHECK_EQ(xfers[i].status, I2C_STATUS_OK);
+	}
+	devices_check_bus();
+}
+
+TEST(engine_high_priority_overtakes)
+{
+	i2c_arbiter_stats_t stats;
+
+	engine_init();
+	for(int i = 0; i < 5; i++)
+	{
+		i2c_submit(I2C1, engine_xfer(i, 0));
+	}
+	i2c_submit(I2C1, engine_xfer(5, I2C_XFER_FLAG_HIGH_PRIORITY));
+	CHECK(sim_run_until(engine_idle, NULL, ENGINE_WAIT_US));
+	//0 was on the bus already, 5 goes next
+	static const uint8_t expected[] = {0, 5, 1, 2, 3, 4};
+	CHECK_EQ(num_done, sizeof(expected));
+	for(int i = 0; i < sizeof(expected); i++)
+	{
+		CHECK_EQ(order[i], expected[i]);
+		CHECK_EQ(log_slave.log[i], expected[i]);
+	}
+	i2c_get_arbiter_stats(I2C1, &stats);
+	CHECK_EQ(stats.delayed, 1);
+	CHECK_EQ(stats.overtaken, 4);
+	devices_check_bus();
+}
+
+/*
+ * Callback which submits the transaction after the next one from the callback of each even one,
+ * up to transaction 7
+ *
+ * Parameters:
+ *  xfer the transaction
+ *
+ * Returns:
+ *  none
+ */
+static void engine_done_submit(i2c_xfer_t *xfer)
+{
+	uint8_t i = (uint8_t)(uintptr_t)xfer->context;
+	engine_done(xfer);
+	if(i % 2 == 0 && i + 2 < 8)
+	{
+		engine_xfer(i + 2, 0)->callback = engine_done_submit;
+		CHECK_EQ(i2c_submit(I2C1, &xfers[i + 2]), I2C_STATUS_PENDING);
+	}
+}
+
+TEST(engine_submit_from_callback)
+{
+	engine_init();
+	engine_xfer(0, 0)->callback = engine_done_submit;
+	i2c_submit(I2C1, &xfers[0]);
+	i2c_submit(I2C1, engine_xfer(1, 0));
+	CHECK(sim_run_until(engine_idle, NULL, ENGINE_WAIT_US));
+	//a transaction submitted from a callback queues behind the ones already queued, 7 is never submitted
+	static const uint8_t expected[] = {0, 1, 2, 4, 6};
+	CHECK_EQ(num_done, sizeof(expected));
+	for(int i = 0; i < sizeof(expected); i++)
+	{
+		CHECK_EQ(order[i], expected[i]);
+		CHECK_EQ(log_slave.log[i], expected[i]);
+	}
+	devices_check_bus();
+}
+
+TEST(engine_read_with_repeated_start)
+{
+	uint8_t rx[4];
+	i2c_xfer_t *xfer;
+	sim_i2c_stats_t stats;
+
+	engine_init();
+	xfer = engine_xfer(0, 0);
+	xfer->cmd[0] = 0x06;
+	xfer->cmd_len = 1;
+	xfer->tx_len = 0;
+	xfer->rx = rx;
+	xfer->rx_len = sizeof(rx);
+	CHECK_EQ(i2c_submit_and_wait(I2C1, xfer), I2C_STATUS_OK);
+	CHECK_EQ(log_slave.len, 1);
+	CHECK_EQ(log_slave.log[0], 0x06);
+	for(int i = 0; i < sizeof(rx); i++)
+	{
+		CHECK_EQ(rx[i], 0xA0 + i);
+	}
+	sim_i2c_get_stats(SIM_I2C1, &stats);
+	CHECK_EQ(stats.starts, 1);
+	CHECK_EQ(stats.rstarts, 1);
+	CHECK_EQ(stats.bytes_rx, sizeof(rx));
+	devices_check_bus();
+}
+
+TEST(engine_nack_ends_transaction)
+{
+	engine_init();
+	log_slave.slave.nacks = 1;
+	i2c_submit(I2C1, engine_xfer(0, 0));
+	i2c_submit(I2C1, engine_xfer(1, 0));
+	CHECK(sim_run_until(engine_idle, NULL, ENGINE_WAIT_US));
+	CHECK_EQ(xfers[0].status, I2C_STATUS_NACK);
+	CHECK_EQ(xfers[1].status, I2C_STATUS_OK);
+	CHECK_EQ(log_slave.len, 1);
+	CHECK_EQ(log_slave.log[0], 1);
+	devices_check_bus();
+}
+
+TEST(engine_stalled_xfer_aborted_in_handler)
+{
+	sim_time_t start;
+
+	engine_init();
+	//lose the interrupt of the first address byte, nothing on the bus ends the transaction
+	sim_write_register((uintptr_t)&NVIC->ICER[0], 4, 1U << I2C1_IRQn);
+	i2c_submit(I2C1, engine_xfer(0, 0));
+	i2c_submit(I2C1, engine_xfer(1, 0));
+	while(!(I2C1->S & I2C_S_IICIF_MASK))
+	{
+		sim_run_us(1);
+	}
+	sim_write_register((uintptr_t)&I2C1->S, 1, I2C_S_IICIF_MASK);
+	sim_write_register((uintptr_t)&NVIC->ICPR[0], 4, 1U << I2C1_IRQn);
+	sim_write_register((uintptr_t)&NVIC->ISER[0], 4, 1U << I2C1_IRQn);
+
+	//nothing waits on it, SysTick hands the abort to the interrupt after the timeout and the
+	//callbacks of both run there
+	start = sim_now();
+	CHECK(sim_run_until(engine_idle, NULL, ENGINE_WAIT_US));
+	CHECK(sim_now() - start < ((I2C_DEFAULT_TIMEOUT_MS + 1)*1000U + ENGINE_RECOVERY_US)*SIM_CYCLES_PER_US);
+	CHECK_EQ(num_done, 2);
+	CHECK_EQ(order[0], 0);
+	CHECK_EQ(order[1], 1);
+	CHECK_EQ(xfers[0].status, I2C_STATUS_TIMEOUT);
+	CHECK_EQ(xfers[1].status, I2C_STATUS_OK);
+	CHECK_EQ(log_slave.len, 1);
+	CHECK_EQ(log_slave.log[0], 1);
+	devices_check_bus();
+}
+
+TEST(engine_polled_transfer_waits_for_queue)
+{
+	uint8_t byte = 0x77;
+
+	engine_init();
+	for(int i = 0; i < 4; i++)
+	{
+		i2c_submit(I2C1, engine_xfer(i, 0));
+	}
+	CHECK_EQ(i2c_transfer(I2C1, LOG_ADDR, &byte, 1, NULL, 0, 0), I2C_STATUS_OK);
+	CHECK_EQ(num_done, 4);
+	CHECK_EQ(log_slave.len, 5);
+	CHECK_EQ(log_slave.log[4], 0x77);
+	devices_check_bus();
+}
+
+TEST(bench_engine_queue)
+{
+	sim_stats_t before, after;
+	sim_i2c_stats_t bus;
+	sim_time_t start, submit = 0;
+
+	engine_init();
+	sim_get_stats(&before);
+	start = sim_now();
+	for(int i = 0; i < ENGINE_XFERS; i++)
+	{
+		i2c_xfer_t *xfer = engine_xfer(i, 0);
+		sim_time_t submit_start = sim_now();
+		xfer->tx_len = sizeof(tx[i]);
+		i2c_submit(I2C1, xfer);
+		submit += sim_now() - submit_start;
+	}
+	CHECK(sim_run_until(engine_idle, NULL, ENGINE_WAIT_US));
+	sim_get_stats(&after);
+	sim_i2c_get_stats(SIM_I2C1, &bus);
+	BENCH("engine_xfers_per_s", "%u", (uint32_t)((sim_time_t)ENGINE_XFERS*SIM_CORE_HZ/(sim_now() - start)));
+	BENCH("engine_bus_busy_permille", "%u", (uint32_t)(bus.busy_cycles*1000/(sim_now() - start)));
+	BENCH("engine_submit_cycles", "%u", (uint32_t)(submit/ENGINE_XFERS));
+	BENCH("engine_isr_cycles_per_byte", "%u", (uint32_t)((after.cycles[SIM_EXCEPTION(I2C1_IRQn)] -
+			before.cycles[SIM_EXCEPTION(I2C1_IRQn)])/bus.bytes_tx));
+	CHECK_EQ(num_done, ENGINE_XFERS);
+	devices_check_bus();
+}
@@ -0,0 +1,270 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_fault.c
+ * @brief   Tests of the fault injection of i2c.c, run in the fault build. A NACK is injected in the
+ * 			middle of a display frame, and a loop like the one of the state machine is run under each
+ * 			fault on its own at two rates, to bench the samples and frames it still gets through and
+ * 			its worst pass.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+#include "ssd1306.h"
+
+#ifdef I2C_FAULT_INJECT
+#define FAULT_WAIT_US			(100000U)
+#define FAULT_NACK_PAGE			(3U)//the page the NACK is injected in
+#define PAGE_LEN				(128U)
+#define FRAME_PAGES				(8U)
+#define GLYPH_LEN				(5U)
+#define GLYPH_COLUMNS			(12U)//column step of the glyph from one page to the next
+#define FAULT_RUN_US			(1000000U)
+#define FAULT_LOW_PER_MILLE		(2U)
+#define FAULT_HIGH_PER_MILLE	(20U)
+#define FAULT_ODR_PERIOD_US		(5000U)//200Hz
+#define FAULT_PAGE_US			(3300U)//one display page at 400kHz, the longest a read can wait behind
+#define FAULT_STALL_US			((I2C_DEFAULT_TIMEOUT_MS + 1)*1000U)//a dropped interrupt, till SysTick aborts the transaction
+#define FAULT_PASS_STALLS		(5U)//stalled reads and pages one pass may wait through at 20 per mille
+#define FAULT_NONE				(I2C_NUM_FAULTS)
+
+typedef struct{
+	const char *name;
+	i2c_fault_t fault;//FAULT_NONE for a run without faults
+	uint16_t per_mille;
+}fault_case_t;
+
+static const fault_case_t fault_cases[] = {
+		{"none", FAULT_NONE, 0},
+		{"nack", I2C_FAULT_NACK, FAULT_LOW_PER_MILLE},
+		{"nack", I2C_FAULT_NACK, FAULT_HIGH_PER_MILLE},
+		{"stuck_busy", I2C_FAULT_STUCK_BUSY, FAULT_LOW_PER_MILLE},
+		{"stuck_busy", I2C_FAULT_STUCK_BUSY, FAULT_HIGH_PER_MILLE},
+		{"arb_lost", I2C_FAULT_ARB_LOST, FAULT_LOW_PER_MILLE},
+		{"arb_lost", I2C_FAULT_ARB_LOST, FAULT_HIGH_PER_MILLE},
+		{"drop_iicif", I2C_FAULT_DROP_IICIF, FAULT_LOW_PER_MILLE},
+		{"drop_iicif", I2C_FAULT_DROP_IICIF, FAULT_HIGH_PER_MILLE},
+};
+#define NUM_FAULT_CASES (sizeof(fault_cases)/sizeof(fault_cases[0]))
+
+/*
+ * Function to get the number of faults of one kind injected so far
+ *
+ * Parameters:
+ *  fault the fault
+ *
+ * Returns:
+ *  the count
+ */
+static uint32_t fault_injected(i2c_fault_t fault)
+{
+	i2c_fault_stats_t stats;
+	i2c_get_fault_stats(&stats);
+	return stats.injected[fault];
+}
+
+typedef struct{
+	uint32_t nacks;//NACKs injected before the frame
+	uint32_t starts;//starts on the display bus before the frame
+}fault_frame_t;
+
+/*
+ * Function called after every simulator event while the frame is sent. Turns NACKs on once the
+ * START of the page is on the bus, so the address of the page is the byte NACKed, and off again
+ * after the first one
+ *
+ * Parameters:
+ *  context the counts before the frame
+ *
+ * Returns:
+ *  1 to stop the run once the frame is over
+ */
+static int fault_nack_mid_frame(void *context)
+{
+	fault_frame_t *frame = context;
+	sim_i2c_stats_t stats;
+
+	sim_i2c_get_stats(SIM_I2C1, &stats);
+	if(fault_injected(I2C_FAULT_NACK) != frame->nacks)
+	{
+		i2c_set_fault_rate(I2C_FAULT_NACK, 0);
+	}else if(stats.starts - frame->starts == FAULT_NACK_PAGE + 1){//the pages before it and its own
+		i2c_set_fault_rate(I2C_FAULT_NACK, 1000);
+	}
+	return !ssd1306_frame_in_progress();
+}
+
+/*
+ * Function to check the display memory against the frame fault_nack_mid_frame_stops() sends, a '#'
+ * at a column of its own on every page, with one page still holding the blank frame before it
+ *
+ * Parameters:
+ *  stale_page the page which missed the frame, FRAME_PAGES for none
+ *
+ * Returns:
+ *  none
+ */
+static void fault_check_gddram(uint32_t stale_page)
+{
+	static const uint8_t hash[GLYPH_LEN] = {0x14, 0x7F, 0x14, 0x7F, 0x14};//'#' in font.h
+
+	for(uint32_t p = 0; p < FRAME_PAGES; p++)
+	{
+		for(uint32_t i = 0; i < PAGE_LEN; i++)
+		{
+			uint8_t expected = 0;
+			if(p != stale_page && i >= p*GLYPH_COLUMNS && i < p*GLYPH_COLUMNS + GLYPH_LEN)
+			{
+				expected = hash[i - p*GLYPH_COLUMNS];
+			}
+			CHECK_EQ(devices_ssd.gddram[p][i], expected);
+		}
+	}
+}
+
+TEST(fault_nack_mid_frame_stops)
+{
+	qmc_config_t config;
+	sim_i2c_stats_t before, after;
+	fault_frame_t frame;
+
+	devices_main_config(&config);
+	config.mode = MODE_OPTION_STANDBY;//nothing else on the bus
+	devices_attach();
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	for(uint32_t p = 0; p < FRAME_PAGES; p++)
+	{
+		CHECK_EQ(ssd1306_write_string_in_buffer(p, p*GLYPH_COLUMNS, "#", 1), SSD1306_OK);
+	}
+
+	devices_ssd.stats.data_bytes = 0;
+	sim_i2c_get_stats(SIM_I2C1, &before);
+	frame.nacks = fault_injected(I2C_FAULT_NACK);
+	frame.starts = before.starts;
+	CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+	CHECK(sim_run_until(fault_nack_mid_frame, &frame, FAULT_WAIT_US));
+	CHECK_EQ(fault_injected(I2C_FAULT_NACK), frame.nacks + 1);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_NACK_ERROR);
+
+	//the page with the NACK ends with a STOP after its address, the pages after it still go out
+	//to their own rows and the NACKed one keeps the blank frame before
+	sim_run_us(100);
+	sim_i2c_get_stats(SIM_I2C1, &after);
+	CHECK(!sim_i2c_busy(SIM_I2C1));
+	CHECK_EQ(after.starts - before.starts, FRAME_PAGES);
+	CHECK_EQ(after.stops - before.stops, after.starts - before.starts);
+	CHECK_EQ(devices_ssd.stats.data_bytes, (FRAME_PAGES - 1)*PAGE_LEN);
+	fault_check_gddram(FAULT_NACK_PAGE);
+
+	//and the next frame is whole
+	CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	fault_check_gddram(FRAME_PAGES);
+	devices_check_bus();
+}
+
+TEST(bench_fault_rates)
+{
+	qmc_config_t config;
+	qmc_sample_stats_t samples_before, samples_after;
+	int16_t sample[3];
+	char name[40];
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, 200, 300, -400);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+
+	for(int c = 0; c < NUM_FAULT_CASES; c++)
+	{
+		const fault_case_t *fault_case = &fault_cases[c];
+		uint32_t frames = devices_ssd.stats.frames, injected = 0, failures = 0;
+		sim_time_t end, start, pass, pass_max = 0;
+
+		if(fault_case->fault != FAULT_NONE)
+		{
+			injected = fault_injected(fault_case->fault);
+			i2c_set_fault_rate(fault_case->fault, fault_case->per_mille);
+		}
+		qmc_get_sample_stats(&samples_before);
+		end = sim_now() + FAULT_RUN_US*(sim_time_t)SIM_CYCLES_PER_US;
+		while(sim_now() < end)
+		{
+			//one pass of the main loop: the next sample, and a frame once the previous one is out
+			start = sim_now();
+			if(qmc_get_nex_raw_sample(sample) != QMC_OK)
+			{
+				failures++;
+			}
+			if(!ssd1306_frame_in_progress() && ssd1306_update_display() != SSD1306_OK)
+			{
+				failures++;
+			}
+			pass = sim_now() - start;
+			if(pass > pass_max)
+			{
+				pass_max = pass;
+			}
+		}
+		qmc_get_sample_stats(&samples_after);
+		frames = devices_ssd.stats.frames - frames;
+
+		snprintf(name, sizeof(name), "fault_%s_%u_samples_per_s", fault_case->name, fault_case->per_mille);
+		BENCH(name, "%u", (uint32_t)((samples_after.samples - samples_before.samples)*1000000ULL/FAULT_RUN_US));
+		snprintf(name, sizeof(name), "fault_%s_%u_frames_per_s", fault_case->name, fault_case->per_mille);
+		BENCH(name, "%u", (uint32_t)(frames*1000000ULL/FAULT_RUN_US));
+		snprintf(name, sizeof(name), "fault_%s_%u_pass_max_us", fault_case->name, fault_case->per_mille);
+		BENCH(name, "%u", (uint32_t)(pass_max/SIM_CYCLES_PER_US));
+		snprintf(name, sizeof(name), "fault_%s_%u_failures", fault_case->name, fault_case->per_mille);
+		BENCH(name, "%u", failures);
+		if(fault_case->fault != FAULT_NONE)
+		{
+			injected = fault_injected(fault_case->fault) - injected;
+			snprintf(name, sizeof(name), "fault_%s_%u_injected", fault_case->name, fault_case->per_mille);
+			BENCH(name, "%u", injected);
+			i2c_set_fault_rate(fault_case->fault, 0);
+		}
+
+		//faults cost samples and frames but never stop either
+		CHECK(samples_after.samples > samples_before.samples);
+		CHECK(frames > 0);
+		if(fault_case->fault == FAULT_NONE)
+		{
+			CHECK_EQ(failures, 0);
+			CHECK(pass_max < (FAULT_ODR_PERIOD_US + FAULT_PAGE_US)*SIM_CYCLES_PER_US);
+		}else if(fault_case->per_mille == FAULT_HIGH_PER_MILLE){
+			CHECK(injected > 0);
+		}
+		if(fault_case->fault == I2C_FAULT_DROP_IICIF)
+		{//every stalled transaction ends at its own deadline, not at the stall check of a consumer
+			CHECK(pass_max < (FAULT_ODR_PERIOD_US + FAULT_PAGE_US + FAULT_PASS_STALLS*FAULT_STALL_US)*SIM_CYCLES_PER_US);
+		}
+	}
+
+	//the bus is back to normal once the faults stop
+	ssd1306_wait_frame();
+	CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	devices_check_bus();
+}
+#endif
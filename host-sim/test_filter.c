@@ -0,0 +1,283 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_filter.c
+ * @brief   Tests of the block average filter of mag_filter.c. The field of the magnetometer model is
+ * 			set every millisecond to a fixed field plus gaussian noise, so every measurement gets
+ * 			noise of its own. The heading standard deviation of the filter output is measured against
+ * 			the decimation ratio, and the outputs are checked against the samples a second reader of
+ * 			the sample ring gets, for the average, the samples left out for OVL and the time stamp.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "math.h"
+#include "sim.h"
+#include "devices.h"
+#include "ssd1306.h"
+#include "QMC5883L.h"
+#include "mag_filter.h"
+
+#define FILTER_FIELD_STEP_US	(1000U)
+#define FILTER_FIELD_X_MG		(300)
+#define FILTER_FIELD_Y_MG		(0)
+#define FILTER_FIELD_Z_MG		(400)
+#define FILTER_NOISE_MG			(6.0)//standard deviation per axis, 1.15 degree of heading at 300mG
+#define FILTER_OVL_MG			(4000)//past the 2G range
+#define FILTER_OVL_EVERY		(7U)//field steps, with a sample every 5 steps one in seven samples is OVL
+#define FILTER_OUTPUTS			(200U)
+#define FILTER_SAMPLE_WAIT_US	(20000U)
+#define FILTER_SQRT_TOLERANCE	(0.25)//of the std of one sample over sqrt(ratio)
+
+static sim_event_t field_event;
+static uint32_t field_seed, field_steps, field_ovl_every;
+static qmc_sample_reader_t reader;
+
+/*
+ * Function to get gaussian noise, box-muller on a linear congruential generator
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  noise with a standard deviation of 1
+ */
+static double filter_gauss()
+{
+	double u1, u2;
+	field_seed = field_seed*1664525U + 1013904223U;
+	u1 = ((field_seed >> 8) + 1.0)/16777217.0;
+	field_seed = field_seed*1664525U + 1013904223U;
+	u2 = (field_seed >> 8)/16777216.0;
+	return sqrt(-2.0*log(u1))*cos(2.0*M_PI*u2);
+}
+
+/*
+ * Function for a field step, sets the field plus noise, or a field past the range now and then
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  none
+ */
+static void filter_field_step(void *context)
+{
+	field_steps++;
+	if(field_ovl_every && field_steps % field_ovl_every == 0)
+	{
+		sim_qmc5883l_set_field(&devices_qmc, FILTER_OVL_MG, 0, FILTER_FIELD_Z_MG);
+	}else{
+		sim_qmc5883l_set_field(&devices_qmc, lround(FILTER_FIELD_X_MG + FILTER_NOISE_MG*filter_gauss()),
+				lround(FILTER_FIELD_Y_MG + FILTER_NOISE_MG*filter_gauss()), FILTER_FIELD_Z_MG);
+	}
+	sim_event_schedule(&field_event, (sim_time_t)FILTER_FIELD_STEP_US*SIM_CYCLES_PER_US);
+}
+
+/*
+ * Function to bring up the devices with the magnetometer at 200Hz and 2G, and the noisy field
+ *
+ * Parameters:
+ *  ovl_every field steps between fields past the range, 0 for none
+ *
+ * Returns:
+ *  none
+ */
+static void filter_init(uint32_t ovl_every)
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;
+	config.rng = RNG_OPTION_2G;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	field_seed = 1;
+	field_steps = 0;
+	field_ovl_every = ovl_every;
+	sim_event_init(&field_event, filter_field_step, NULL);
+	filter_field_step(NULL);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+}
+
+/*
+ * Function to get the standard deviation of the heading of the filter output
+ *
+ * Parameters:
+ *  ratio decimation ratio
+ *
+ * Returns:
+ *  standard deviation in degrees
+ */
+static double filter_heading_std(uint16_t ratio)
+{
+	mag_filter_t filter;
+	int16_t out[3];
+	double heading, sum = 0, sq = 0, mean;
+
+	mag_filter_init(&filter, ratio);
+	for(int n = 0; n < FILTER_OUTPUTS; n++)
+	{
+		CHECK_EQ(mag_filter_wait(&filter, out), QMC_OK);
+		heading = atan2(out[AXIS_Y], out[AXIS_X])*180.0/M_PI;//around 0, no wrap
+		sum += heading;
+		sq += heading*heading;
+	}
+	mean = sum/FILTER_OUTPUTS;
+	return sqrt(sq/FILTER_OUTPUTS - mean*mean);
+}
+
+TEST(filter_noise_vs_ratio)
+{
+	static const uint16_t ratio[] = {1, 2, 4, 8, 16};
+	double std[sizeof(ratio)/sizeof(ratio[0])], expected;
+
+	filter_init(0);
+	for(int i = 0; i < sizeof(ratio)/sizeof(ratio[0]); i++)
+	{
+		std[i] = filter_heading_std(ratio[i]);
+		expected = std[0]/sqrt(ratio[i]);
+		printf("filter_noise_vs_ratio: ratio %2u, heading std %.3f degree, %.3f for white noise\n", ratio[i], std[i], expected);
+		CHECK(std[i] < expected*(1 + FILTER_SQRT_TOLERANCE));
+		CHECK(std[i] > expected*(1 - FILTER_SQRT_TOLERANCE));
+	}
+	//one sample alone has the noise of the field
+	CHECK(std[0] > 0.8*FILTER_NOISE_MG/FILTER_FIELD_X_MG*180.0/M_PI);
+	CHECK(std[0] < 1.2*FILTER_NOISE_MG/FILTER_FIELD_X_MG*180.0/M_PI);
+	devices_check_bus();
+}
+
+/*
+ * Function to check for a sample in the ring the test reader has not popped yet
+ *
+ * Parameters:
+ *  context(out) the sample
+ *
+ * Returns:
+ *  1 once a sample was popped
+ */
+static int filter_pop(void *context)
+{
+	return qmc_sample_pop(&reader, context);
+}
+
+/*
+ * Function to run a filter along with the test reader, one sample at a time, and check every
+ * output against the average of the samples the reader got
+ *
+ * Parameters:
+ *  ratio decimation ratio
+ *  outputs number of outputs to check
+ *  ovl(out) number of samples with OVL
+ *
+ * Returns:
+ *  number of samples used with frac bits set
+ */
+static uint32_t filter_check_blocks(uint16_t ratio, uint32_t outputs, uint32_t *ovl)
+{
+	mag_filter_t filter;
+	qmc_sample_t sample;
+	int32_t sum[3] = {0}, value, expected;
+	uint32_t count = 0, first_us = 0, done = 0, frac = 0;
+	int16_t out[3];
+
+	*ovl = 0;
+	mag_filter_init(&filter, ratio);
+	qmc_sample_reader_init(&reader);
+	while(done < outputs)
+	{
+		CHECK(sim_run_until(filter_pop, &sample, FILTER_SAMPLE_WAIT_US));
+		CHECK_EQ(reader.overflows, 0);
+		if(sample.status & SR_OVL_MASK)
+		{
+			(*ovl)++;
+			CHECK_EQ(mag_filter_update(&filter), 0);
+			continue;
+		}
+		if(count == 0)
+		{
+			first_us = sample.time_us;
+		}
+		frac += (sample.frac != 0);
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			sum[i] += ((int32_t)sample.axis[i] << QMC_SAMPLE_FRAC_BITS) + QMC_SAMPLE_FRAC(&sample, i);
+		}
+		if(++count < ratio)
+		{
+			CHECK_EQ(mag_filter_update(&filter), 0);
+			continue;
+		}
+		CHECK_EQ(mag_filter_update(&filter), 1);
+		CHECK_EQ(mag_filter_wait(&filter, out), QMC_OK);
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{//rounded to nearest, halves away from zero
+			value = (sum[i] < 0) ? -sum[i] : sum[i];
+			expected = (value + ((ratio << QMC_SAMPLE_FRAC_BITS) >> 1))/(ratio << QMC_SAMPLE_FRAC_BITS);
+			CHECK_EQ(out[i], (sum[i] < 0) ? -expected : expected);
+			sum[i] = 0;
+		}
+		//the middle of the samples used, which is not the middle of the block when its ends were OVL
+		CHECK_EQ(filter.out_time_us, first_us + (sample.time_us - first_us)/2);
+		count = 0;
+		done++;
+	}
+	return frac;
+}
+
+TEST(filter_block_average)
+{
+	uint32_t ovl;
+
+	filter_init(0);
+	filter_check_blocks(1, 20, &ovl);
+	filter_check_blocks(4, 50, &ovl);
+	filter_check_blocks(8, 50, &ovl);
+	filter_check_blocks(MAG_FILTER_MAX_RATIO, 4, &ovl);
+	CHECK_EQ(ovl, 0);
+	devices_check_bus();
+}
+
+TEST(filter_skips_ovl)
+{
+	uint32_t ovl;
+
+	filter_init(FILTER_OVL_EVERY);
+	filter_check_blocks(8, 60, &ovl);
+	printf("filter_skips_ovl: %u samples with OVL left out\n", ovl);
+	CHECK(ovl > 60);
+	devices_check_bus();
+}
+
+TEST(filter_auto_range_frac)
+{
+	qmc_config_t config;
+	uint32_t ovl;
+
+	//auto ranging gives 2G samples in 8G LSB with frac bits, the average keeps the 2G resolution
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;
+	config.rng = RNG_OPTION_2G;
+	config.auto_rng = AUTO_RNG_ENABLE;
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, FILTER_FIELD_X_MG, FILTER_FIELD_Y_MG, FILTER_FIELD_Z_MG);
+	sim_qmc5883l_set_rotation(&devices_qmc, 5);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	CHECK(filter_check_blocks(8, 50, &ovl) > 0);
+	CHECK_EQ(ovl, 0);
+	devices_check_bus();
+}
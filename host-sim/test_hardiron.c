@@ -0,0 +1,257 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_hardiron.c
+ * @brief   Tests of the background hard iron estimator of mag_hardiron.c. Samples on a sphere around a
+ * 			known offset, turned through every orientation, are replayed through
+ * 			mag_hardiron_add_sample() starting from a calibration about 300 counts off. Then the
+ * 			same field goes through the magnetometer model and the sample ring, to check how far
+ * 			mag_hardiron_update() moves the calibration offset per call.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "math.h"
+#include "sim.h"
+#include "devices.h"
+#include "ssd1306.h"
+#include "QMC5883L.h"
+#include "mag_hardiron.h"
+
+#define HARDIRON_LSB_PER_MG		(3)//8G range, auto ranging off
+#define HARDIRON_RADIUS_MG		(500)
+#define HARDIRON_OFFSET_X_MG	(40)
+#define HARDIRON_OFFSET_Y_MG	(-20)
+#define HARDIRON_OFFSET_Z_MG	(30)
+#define HARDIRON_START_ERR		(300)//counts the starting calibration is off by, per axis
+#define HARDIRON_POINTS			(100U)//orientations per pass over the sphere
+#define HARDIRON_NOISE			(4)//counts, peak
+#define HARDIRON_CONVERGED		(3)//counts from the offset, per axis
+#define HARDIRON_MAX_SAMPLES	(1000U)//replayed samples by which the estimate has to have converged
+#define HARDIRON_MAX_UPDATES	(750U)//update calls by which the calibration has to have converged
+#define HARDIRON_ODR_PERIOD_US	(5000U)//200Hz
+#define HARDIRON_Q14_ONE		(1 << QMC_CAL_FRAC_BITS)
+
+static const int32_t hardiron_offset_mg[3] = {HARDIRON_OFFSET_X_MG, HARDIRON_OFFSET_Y_MG, HARDIRON_OFFSET_Z_MG};
+static uint32_t hardiron_seed;
+
+/*
+ * Function to get a point of the field as the device is turned, spread evenly over the sphere
+ * with the golden angle, so consecutive points are far apart
+ *
+ * Parameters:
+ *  n index of the point
+ *  field_mg(out) the field, with the hard iron offset
+ *
+ * Returns:
+ *  none
+ */
+static void hardiron_point(uint32_t n, int32_t field_mg[])
+{
+	double z = 1.0 - (2.0*(n % HARDIRON_POINTS) + 1.0)/HARDIRON_POINTS;
+	double theta = n*M_PI*(3.0 - sqrt(5.0));
+	double r = sqrt(1.0 - z*z);
+
+	field_mg[AXIS_X] = hardiron_offset_mg[AXIS_X] + lround(HARDIRON_RADIUS_MG*r*cos(theta));
+	field_mg[AXIS_Y] = hardiron_offset_mg[AXIS_Y] + lround(HARDIRON_RADIUS_MG*r*sin(theta));
+	field_mg[AXIS_Z] = hardiron_offset_mg[AXIS_Z] + lround(HARDIRON_RADIUS_MG*z);
+}
+
+/*
+ * Function to get the noise of one axis
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  -HARDIRON_NOISE to HARDIRON_NOISE counts
+ */
+static int32_t hardiron_noise()
+{
+	hardiron_seed = hardiron_seed*1664525U + 1013904223U;
+	return (int32_t)((hardiron_seed >> 16) % (2*HARDIRON_NOISE + 1)) - HARDIRON_NOISE;
+}
+
+/*
+ * Function to set the calibration to an identity matrix and the offset off by HARDIRON_START_ERR
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void hardiron_set_start()
+{
+	qmc_calibration_data_t cal;
+
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		cal.offset[i] = hardiron_offset_mg[i]*HARDIRON_LSB_PER_MG + ((i == AXIS_Y) ? -HARDIRON_START_ERR : HARDIRON_START_ERR);
+		for(int j = AXIS_X; j <= AXIS_Z; j++)
+		{
+			cal.matrix[i][j] = (i == j) ? HARDIRON_Q14_ONE : 0;
+		}
+	}
+	qmc_set_calibration(&cal);
+}
+
+/*
+ * Function to get the largest error of an offset, over the axes
+ *
+ * Parameters:
+ *  offset the offset in counts
+ *
+ * Returns:
+ *  largest |offset - hard iron offset|
+ */
+static int32_t hardiron_error(const int32_t offset[])
+{
+	int32_t err, max = 0;
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		err = offset[i] - hardiron_offset_mg[i]*HARDIRON_LSB_PER_MG;
+		err = (err < 0) ? -err : err;
+		max = (err > max) ? err : max;
+	}
+	return max;
+}
+
+/*
+ * Function to get the largest error of the estimate of the estimator
+ *
+ * Parameters:
+ *  est the estimator
+ *
+ * Returns:
+ *  largest error over the axes, counts
+ */
+static int32_t hardiron_est_error(const mag_hardiron_t *est)
+{
+	int32_t offset[3];
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		offset[i] = (est->offset_q8[i] + 128) >> 8;
+	}
+	return hardiron_error(offset);
+}
+
+TEST(hardiron_replay_converges)
+{
+	mag_hardiron_t est;
+	int32_t field[3];
+	int16_t raw[3];
+	uint32_t converged_at = 0, rejected = 0, n;
+	uint8_t confidence_at_start;
+
+	hardiron_seed = 1;
+	hardiron_set_start();
+	mag_hardiron_init(&est);
+	CHECK_EQ(hardiron_est_error(&est), HARDIRON_START_ERR);
+	confidence_at_start = mag_hardiron_confidence(&est);
+	CHECK_EQ(confidence_at_start, 0);
+
+	for(n = 0; n < 4*HARDIRON_MAX_SAMPLES; n++)
+	{
+		hardiron_point(n, field);
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			raw[i] = field[i]*HARDIRON_LSB_PER_MG + hardiron_noise();
+		}
+		mag_hardiron_add_sample(&est, raw);
+		if(converged_at == 0 && hardiron_est_error(&est) <= HARDIRON_CONVERGED)
+		{
+			converged_at = n + 1;
+			rejected = est.rejected;
+		}
+		if(converged_at != 0)
+		{//and stays there
+			CHECK(hardiron_est_error(&est) <= HARDIRON_CONVERGED);
+		}
+	}
+	printf("hardiron_replay_converges: within %d counts after %u samples, %u used, %u rejected, confidence %u%%\n",
+			HARDIRON_CONVERGED, converged_at, est.accepted, est.rejected, mag_hardiron_confidence(&est));
+	CHECK(converged_at != 0 && converged_at <= HARDIRON_MAX_SAMPLES);
+	CHECK(mag_hardiron_confidence(&est) > MAG_HARDIRON_MIN_CONFIDENCE);
+	//samples far off the sphere the estimate starts from are rejected, none after it converged
+	CHECK_EQ(est.rejected, rejected);
+
+	//a magnet held next to it is off the sphere, ignored and does not move the estimate
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		raw[i] = (hardiron_offset_mg[i] + 2*HARDIRON_RADIUS_MG)*HARDIRON_LSB_PER_MG;
+		field[i] = est.offset_q8[i];
+	}
+	CHECK_EQ(mag_hardiron_add_sample(&est, raw), 0);
+	CHECK_EQ(est.rejected, rejected + 1);
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		CHECK_EQ(est.offset_q8[i], field[i]);
+	}
+}
+
+TEST(hardiron_update_one_count_per_call)
+{
+	qmc_config_t config;
+	qmc_calibration_data_t cal, last;
+	mag_hardiron_t est;
+	int32_t field[3], offset[3];
+	uint32_t updates, converged_at = 0, moving_at = 0;
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;
+	config.rng = RNG_OPTION_8G;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	hardiron_point(0, field);
+	sim_qmc5883l_set_field(&devices_qmc, field[AXIS_X], field[AXIS_Y], field[AXIS_Z]);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	hardiron_set_start();
+	mag_hardiron_init(&est);
+
+	//one new orientation per output data period, the estimator run once per period
+	qmc_get_calibration(&last);
+	for(updates = 1; updates <= HARDIRON_MAX_UPDATES + HARDIRON_POINTS; updates++)
+	{
+		hardiron_point(updates, field);
+		sim_qmc5883l_set_field(&devices_qmc, field[AXIS_X], field[AXIS_Y], field[AXIS_Z]);
+		sim_run_us(HARDIRON_ODR_PERIOD_US);
+		mag_hardiron_update(&est);
+		qmc_get_calibration(&cal);
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			CHECK(cal.offset[i] - last.offset[i] <= 1 && cal.offset[i] - last.offset[i] >= -1);
+			offset[i] = cal.offset[i];
+		}
+		if(moving_at == 0 && (cal.offset[AXIS_X] != last.offset[AXIS_X]))
+		{
+			moving_at = updates;
+			CHECK(mag_hardiron_confidence(&est) >= MAG_HARDIRON_MIN_CONFIDENCE);
+		}
+		last = cal;
+		if(converged_at == 0 && hardiron_error(offset) <= HARDIRON_CONVERGED)
+		{
+			converged_at = updates;
+		}
+	}
+	printf("hardiron_update_one_count_per_call: moving after %u calls, calibration within %d counts after %u calls, %u samples used\n",
+			moving_at, HARDIRON_CONVERGED, converged_at, est.accepted);
+	//held until the confidence is up, then 300 counts at one per call take about 300 calls
+	CHECK(moving_at != 0);
+	CHECK(converged_at - moving_at >= HARDIRON_START_ERR - HARDIRON_CONVERGED - 1);
+	CHECK(converged_at != 0 && converged_at <= HARDIRON_MAX_UPDATES);
+	CHECK(hardiron_error(offset) <= HARDIRON_CONVERGED);
+	devices_check_bus();
+}
@@ -0,0 +1,267 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_heading.c
+ * @brief   Tests of the fixed point heading engine of heading.c against atan2 in double. The sweep
+ * 			run by make test covers every vector with both components within +-256, every angle at
+ * 			full scale and a million pseudo random int16 pairs. All 2^32 int16 pairs are swept when
+ * 			HEADING_EXHAUSTIVE=1 is set in the environment, which takes a few minutes.
+ *
+ * 			The benchmark times heading.c against the double atan2 path it replaced. Both are built
+ * 			into this file without the simulator instrumentation and timed in host nanoseconds. The
+ * 			host has a floating point unit and the Cortex-M0+ does not, so the ratio on the board is
+ * 			larger than the one printed here.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "stdlib.h"
+#include "math.h"
+#include "time.h"
+#include "unistd.h"
+#include "heading.h"
+
+//a copy of heading_decidegrees() without the simulator hooks, for the benchmark only
+#define heading_decidegrees heading_bench_decidegrees
+#include "heading.c"
+#undef heading_decidegrees
+
+#define HEADING_SMALL			(256)
+#define HEADING_RANDOM_PAIRS	(1000000U)
+#define HEADING_FULL_SCALE		(32767.0)
+#define HEADING_BENCH_PAIRS		(4096U)
+#define HEADING_BENCH_ROUNDS	(200U)
+#define HEADING_OLD_PI			3.14159//as the state machine had it
+
+//max error in 0.001 degree, measured over all 2^32 int16 pairs, for HEADING_LUT_BITS 4 to 8
+static const uint32_t heading_max_err_mdeg[] = {71, 56, 54, 53, 53};
+#define HEADING_MAX_ERR_MDEG	(heading_max_err_mdeg[HEADING_LUT_BITS - 4])
+
+typedef struct{
+	uint64_t count;
+	double max_err_deg;
+	int16_t worst_x;
+	int16_t worst_y;
+}heading_sweep_t;
+
+/*
+ * Function to check one heading against atan2 in double and keep the largest error
+ *
+ * Parameters:
+ *  sweep the sweep so far
+ *  x, y the vector
+ *
+ * Returns:
+ *  none
+ */
+static void heading_check(heading_sweep_t *sweep, int16_t x, int16_t y)
+{
+	uint16_t heading = heading_decidegrees(x, y);
+	double expected, err;
+
+	sweep->count++;
+	if(heading >= HEADING_FULL_CIRCLE)
+	{
+		CHECK_EQ(heading, HEADING_FULL_CIRCLE - 1);//fails with the value printed
+		return;
+	}
+	if(x == 0 && y == 0)
+	{
+		CHECK_EQ(heading, 0);
+		return;
+	}
+	expected = atan2(y, x)*180.0/M_PI;
+	err = fabs(heading/10.0 - expected);
+	if(err > 180.0)
+	{//0 and 359.9 are 0.1 degree apart
+		err = 360.0 - err;
+	}
+	if(err > sweep->max_err_deg)
+	{
+		sweep->max_err_deg = err;
+		sweep->worst_x = x;
+		sweep->worst_y = y;
+	}
+}
+
+/*
+ * Function to check the largest error of a sweep against the bound for the table size
+ *
+ * Parameters:
+ *  name the benchmark line of the sweep
+ *  sweep the sweep
+ *
+ * Returns:
+ *  none
+ */
+static void heading_check_sweep(const char *name, const heading_sweep_t *sweep)
+{
+	uint32_t err_mdeg = (uint32_t)ceil(sweep->max_err_deg*1000.0);
+
+	printf("%s: %llu vectors, max error %.4f degree at (%d, %d), LUT bits %d\n", name,
+			(unsigned long long)sweep->count, sweep->max_err_deg, sweep->worst_x, sweep->worst_y, HEADING_LUT_BITS);
+	if(err_mdeg > HEADING_MAX_ERR_MDEG)
+	{
+		CHECK_EQ(err_mdeg, HEADING_MAX_ERR_MDEG);//fails with both values printed
+	}
+}
+
+TEST(heading_axes_and_diagonals)
+{
+	CHECK_EQ(heading_decidegrees(0, 0), 0);
+	CHECK_EQ(heading_decidegrees(1, 0), 0);
+	CHECK_EQ(heading_decidegrees(1, 1), 450);
+	CHECK_EQ(heading_decidegrees(0, 1), 900);
+	CHECK_EQ(heading_decidegrees(-1, 1), 1350);
+	CHECK_EQ(heading_decidegrees(-1, 0), 1800);
+	CHECK_EQ(heading_decidegrees(-1, -1), 2250);
+	CHECK_EQ(heading_decidegrees(0, -1), 2700);
+	CHECK_EQ(heading_decidegrees(1, -1), 3150);
+	CHECK_EQ(heading_decidegrees(INT16_MIN, INT16_MIN), 2250);
+	CHECK_EQ(heading_decidegrees(INT16_MAX, INT16_MIN), 3150);
+	CHECK_EQ(heading_decidegrees(INT16_MIN, 0), 1800);
+	CHECK_EQ(heading_decidegrees(0, INT16_MIN), 2700);
+	//just under +x wraps to the top of the range, not to 3600
+	CHECK_EQ(heading_decidegrees(INT16_MAX, -1), 0);
+	CHECK_EQ(heading_decidegrees(INT16_MAX, -100), 3598);
+}
+
+TEST(heading_sampled_sweep)
+{
+	heading_sweep_t sweep = {0};
+	uint32_t seed = 1;
+
+	for(int x = -HEADING_SMALL; x <= HEADING_SMALL; x++)
+	{
+		for(int y = -HEADING_SMALL; y <= HEADING_SMALL; y++)
+		{
+			heading_check(&sweep, x, y);
+		}
+	}
+	for(int i = 0; i < 10*HEADING_FULL_CIRCLE; i++)
+	{//every 0.01 degree at full scale
+		double angle = i*M_PI/(5*HEADING_FULL_CIRCLE);
+		heading_check(&sweep, (int16_t)lround(HEADING_FULL_SCALE*cos(angle)), (int16_t)lround(HEADING_FULL_SCALE*sin(angle)));
+	}
+	for(int i = 0; i < HEADING_RANDOM_PAIRS; i++)
+	{
+		seed = seed*1664525U + 1013904223U;
+		heading_check(&sweep, (int16_t)(seed >> 16), (int16_t)seed);
+	}
+	heading_check_sweep("heading_sampled_sweep", &sweep);
+}
+
+TEST(heading_exhaustive_sweep)
+{
+	heading_sweep_t sweep = {0};
+	const char *enable = getenv("HEADING_EXHAUSTIVE");
+
+	if(enable == NULL || enable[0] != '1')
+	{
+		printf("heading_exhaustive_sweep: set HEADING_EXHAUSTIVE=1 to sweep all 2^32 pairs\n");
+		return;
+	}
+	alarm(0);//longer than the wall limit of test.c, asked for by hand
+	for(int x = INT16_MIN; x <= INT16_MAX; x++)
+	{
+		for(int y = INT16_MIN; y <= INT16_MAX; y++)
+		{
+			heading_check(&sweep, x, y);
+		}
+	}
+	CHECK_EQ(sweep.count, 1ULL << 32);
+	heading_check_sweep("heading_exhaustive_sweep", &sweep);
+}
+
+/*
+ * Function for the heading as the state machine had it before heading.c, atan2 in double
+ *
+ * Parameters:
+ *  x the x component
+ *  y the y component
+ *
+ * Returns:
+ *  heading in degrees, 0 to 360
+ */
+static double heading_old_degrees(int16_t x, int16_t y)
+{
+	double direction = atan2(y, x);
+	if(direction < 0)
+	{
+		direction = (direction*180/HEADING_OLD_PI) + 360;
+	}else{
+		direction = direction*180/HEADING_OLD_PI;
+	}
+	return direction;
+}
+
+/*
+ * Function to get the host time
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  monotonic time in nanoseconds
+ */
+static uint64_t heading_now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000000U + now.tv_nsec;
+}
+
+TEST(bench_heading)
+{
+	static int16_t x[HEADING_BENCH_PAIRS], y[HEADING_BENCH_PAIRS];
+	volatile uint32_t fixed_sum = 0;
+	volatile double old_sum = 0;
+	uint64_t start, fixed_ns, old_ns;
+	uint32_t seed = 7;
+
+	for(int i = 0; i < HEADING_BENCH_PAIRS; i++)
+	{
+		seed = seed*1664525U + 1013904223U;
+		x[i] = (int16_t)(seed >> 16);
+		y[i] = (int16_t)seed;
+		CHECK_EQ(heading_bench_decidegrees(x[i], y[i]), heading_decidegrees(x[i], y[i]));
+	}
+
+	start = heading_now_ns();
+	for(int r = 0; r < HEADING_BENCH_ROUNDS; r++)
+	{
+		uint32_t sum = 0;
+		for(int i = 0; i < HEADING_BENCH_PAIRS; i++)
+		{
+			sum += heading_bench_decidegrees(x[i], y[i]);
+		}
+		fixed_sum += sum;
+	}
+	fixed_ns = heading_now_ns() - start;
+
+	start = heading_now_ns();
+	for(int r = 0; r < HEADING_BENCH_ROUNDS; r++)
+	{
+		double sum = 0;
+		for(int i = 0; i < HEADING_BENCH_PAIRS; i++)
+		{
+			sum += heading_old_degrees(x[i], y[i]);
+		}
+		old_sum += sum;
+	}
+	old_ns = heading_now_ns() - start;
+
+	BENCH("heading_fixed_host_ps", "%u", (uint32_t)(fixed_ns*1000/(HEADING_BENCH_ROUNDS*HEADING_BENCH_PAIRS)));
+	BENCH("heading_double_host_ps", "%u", (uint32_t)(old_ns*1000/(HEADING_BENCH_ROUNDS*HEADING_BENCH_PAIRS)));
+	BENCH("heading_double_over_fixed_x100", "%u", (uint32_t)(old_ns*100/(fixed_ns ? fixed_ns : 1)));
+}
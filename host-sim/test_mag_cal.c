@@ -0,0 +1,282 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_mag_cal.c
+ * @brief   Tests of the streaming ellipsoid fit of mag_cal.c. The 300 samples of the capture in
+ * 			calibration-py-file are fed through mag_cal_add_sample() and mag_cal_solve(), and the
+ * 			centre is checked against a plain least squares fit in double, made here from the
+ * 			samples without the integer sums. The field magnitude after qmc_calibrate_data() is
+ * 			checked to spread less than it does raw.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "math.h"
+#include "mag_cal.h"
+#include "QMC5883L.h"
+
+#define CAL_CAPTURE_FILE		SIM_REPO_DIR "/calibration-py-file/mag_cal_data_three_axis.txt"
+#define CAL_CAPTURE_SAMPLES		(300U)
+#define CAL_TERMS				MAG_CAL_NUM_TERMS
+#define CAL_CENTRE_MAX_ERR		(0.3)//counts
+#define CAL_RAW_MIN_SPREAD		(5.1)//percent, standard deviation of the magnitude over its mean
+#define CAL_MAX_SPREAD			(3.58)
+
+static int16_t capture[CAL_CAPTURE_SAMPLES][3];
+
+/*
+ * Function to read the calibration capture, one sample of three axes per line
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  number of samples read
+ */
+static uint32_t cal_read_capture()
+{
+	FILE *file = fopen(CAL_CAPTURE_FILE, "r");
+	uint32_t count = 0;
+	int x, y, z;
+
+	CHECK(file != NULL);
+	if(file == NULL)
+	{
+		return 0;
+	}
+	while(count < CAL_CAPTURE_SAMPLES && fscanf(file, "%d %d %d", &x, &y, &z) == 3)
+	{
+		capture[count][AXIS_X] = x;
+		capture[count][AXIS_Y] = y;
+		capture[count][AXIS_Z] = z;
+		count++;
+	}
+	fclose(file);
+	return count;
+}
+
+/*
+ * Function to fit the quadric of mag_cal.c in double, from the samples themselves, and get its centre
+ *
+ * Parameters:
+ *  samples the samples
+ *  count number of samples
+ *  centre(out) the centre of the fit
+ *
+ * Returns:
+ *  none
+ */
+static void cal_reference_centre(int16_t samples[][3], uint32_t count, double centre[])
+{
+	double a[CAL_TERMS][CAL_TERMS + 1] = {{0}};
+	double p[CAL_TERMS], q[3][3], g[3], tmp;
+
+	for(int n = 0; n < count; n++)
+	{
+		double x = samples[n][AXIS_X], y = samples[n][AXIS_Y], z = samples[n][AXIS_Z];
+		double d[CAL_TERMS] = {x*x, y*y, z*z, y*z, x*z, x*y, x, y, z};
+		for(int row = 0; row < CAL_TERMS; row++)
+		{
+			for(int col = 0; col < CAL_TERMS; col++)
+			{
+				a[row][col] += d[row]*d[col];
+			}
+			a[row][CAL_TERMS] += d[row];
+		}
+	}
+	for(int col = 0; col < CAL_TERMS; col++)
+	{//gaussian elimination with partial pivoting
+		int pivot = col;
+		for(int row = col + 1; row < CAL_TERMS; row++)
+		{
+			if(fabs(a[row][col]) > fabs(a[pivot][col]))
+			{
+				pivot = row;
+			}
+		}
+		for(int k = 0; k <= CAL_TERMS; k++)
+		{
+			tmp = a[col][k];
+			a[col][k] = a[pivot][k];
+			a[pivot][k] = tmp;
+		}
+		for(int row = col + 1; row < CAL_TERMS; row++)
+		{
+			tmp = a[row][col]/a[col][col];
+			for(int k = col; k <= CAL_TERMS; k++)
+			{
+				a[row][k] -= tmp*a[col][k];
+			}
+		}
+	}
+	for(int row = CAL_TERMS - 1; row >= 0; row--)
+	{
+		tmp = a[row][CAL_TERMS];
+		for(int k = row + 1; k < CAL_TERMS; k++)
+		{
+			tmp -= a[row][k]*p[k];
+		}
+		p[row] = tmp/a[row][row];
+	}
+
+	//centre solves 2*q*c = -g, by cramer's rule
+	q[0][0] = 2*p[0];
+	q[1][1] = 2*p[1];
+	q[2][2] = 2*p[2];
+	q[1][2] = q[2][1] = p[3];
+	q[0][2] = q[2][0] = p[4];
+	q[0][1] = q[1][0] = p[5];
+	for(int i = 0; i < 3; i++)
+	{
+		g[i] = -p[6 + i];
+	}
+	tmp = q[0][0]*(q[1][1]*q[2][2] - q[1][2]*q[2][1]) - q[0][1]*(q[1][0]*q[2][2] - q[1][2]*q[2][0]) +
+		  q[0][2]*(q[1][0]*q[2][1] - q[1][1]*q[2][0]);
+	for(int i = 0; i < 3; i++)
+	{
+		double m[3][3];
+		for(int r = 0; r < 3; r++)
+		{
+			for(int c = 0; c < 3; c++)
+			{
+				m[r][c] = (c == i) ? g[r] : q[r][c];
+			}
+		}
+		centre[i] = (m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1]) - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0]) +
+					 m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]))/tmp;
+	}
+}
+
+/*
+ * Function to get the spread of the field magnitude over the capture
+ *
+ * Parameters:
+ *  samples the samples
+ *  count number of samples
+ *
+ * Returns:
+ *  standard deviation of the magnitude over its mean, in percent
+ */
+static double cal_spread_percent(int16_t samples[][3], uint32_t count)
+{
+	double sum = 0, sq = 0, mean;
+
+	for(int n = 0; n < count; n++)
+	{
+		double r = sqrt((double)samples[n][AXIS_X]*samples[n][AXIS_X] + (double)samples[n][AXIS_Y]*samples[n][AXIS_Y] +
+						(double)samples[n][AXIS_Z]*samples[n][AXIS_Z]);
+		sum += r;
+		sq += r*r;
+	}
+	mean = sum/count;
+	return sqrt(sq/count - mean*mean)*100/mean;
+}
+
+/*
+ * Function to fit samples which all lie on one plane
+ *
+ * Parameters:
+ *  tilt the plane is z = tilt*x/2 + 100
+ *
+ * Returns:
+ *  result of mag_cal_solve()
+ */
+static uint8_t cal_solve_plane(int tilt)
+{
+	qmc_calibration_data_t result;
+	mag_cal_t cal;
+	int16_t sample[3];
+
+	mag_cal_init(&cal);
+	for(int n = 0; n < CAL_CAPTURE_SAMPLES; n++)
+	{
+		sample[AXIS_X] = capture[n][AXIS_X] & ~1;
+		sample[AXIS_Y] = capture[n][AXIS_Y];
+		sample[AXIS_Z] = tilt*sample[AXIS_X]/2 + 100;
+		CHECK_EQ(mag_cal_add_sample(&cal, sample), 1);
+	}
+	return mag_cal_solve(&cal, &result);
+}
+
+TEST(mag_cal_capture)
+{
+	static int16_t calibrated[CAL_CAPTURE_SAMPLES][3];
+	qmc_calibration_data_t result, saved;
+	mag_cal_t cal;
+	double centre[3], raw_spread, spread;
+	uint32_t count = cal_read_capture();
+
+	CHECK_EQ(count, CAL_CAPTURE_SAMPLES);
+	mag_cal_init(&cal);
+	for(int n = 0; n < count; n++)
+	{
+		CHECK_EQ(mag_cal_add_sample(&cal, capture[n]), 1);
+	}
+	CHECK_EQ(cal.samples, CAL_CAPTURE_SAMPLES);
+	CHECK_EQ(cal.rejected, 0);
+	CHECK_EQ(mag_cal_solve(&cal, &result), 1);
+
+	//the rounded offset is still within 0.3 counts of the centre of the fit in double
+	cal_reference_centre(capture, count, centre);
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		CHECK(fabs(result.offset[i] - centre[i]) < CAL_CENTRE_MAX_ERR);
+	}
+
+	qmc_get_calibration(&saved);
+	qmc_set_calibration(&result);
+	for(int n = 0; n < count; n++)
+	{
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			calibrated[n][i] = capture[n][i];
+		}
+		qmc_calibrate_data(calibrated[n]);
+	}
+	qmc_set_calibration(&saved);
+	raw_spread = cal_spread_percent(capture, count);
+	spread = cal_spread_percent(calibrated, count);
+	printf("mag_cal_capture: offset %d %d %d, reference centre %.3f %.3f %.3f, spread raw %.2f%% calibrated %.2f%%\n",
+			result.offset[AXIS_X], result.offset[AXIS_Y], result.offset[AXIS_Z], centre[AXIS_X], centre[AXIS_Y], centre[AXIS_Z],
+			raw_spread, spread);
+	CHECK(raw_spread > CAL_RAW_MIN_SPREAD);
+	CHECK(spread < CAL_MAX_SPREAD);
+}
+
+TEST(mag_cal_degenerate)
+{
+	qmc_calibration_data_t result;
+	mag_cal_t cal;
+
+	CHECK_EQ(cal_read_capture(), CAL_CAPTURE_SAMPLES);
+
+	//too few samples
+	mag_cal_init(&cal);
+	for(int n = 0; n < MAG_CAL_MIN_SAMPLES - 1; n++)
+	{
+		CHECK_EQ(mag_cal_add_sample(&cal, capture[n]), 1);
+	}
+	CHECK_EQ(mag_cal_solve(&cal, &result), 0);
+
+	//turned only about one axis, the samples lie on a plane and no ellipsoid goes through them
+	CHECK_EQ(cal_solve_plane(0), 0);
+	CHECK_EQ(cal_solve_plane(1), 0);
+	CHECK_EQ(cal_solve_plane(-3), 0);
+
+	//out of the 13 bits the sums have room for
+	mag_cal_init(&cal);
+	capture[0][AXIS_Y] = MAG_CAL_MAX_INPUT + 1;
+	CHECK_EQ(mag_cal_add_sample(&cal, capture[0]), 0);
+	CHECK_EQ(cal.rejected, 1);
+	CHECK_EQ(cal.samples, 0);
+}
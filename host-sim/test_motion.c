@@ -0,0 +1,195 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_motion.c
+ * @brief   Tests of the motion adaptive rate controller of mag_motion.c. The field of the magnetometer
+ * 			model is horizontal and turned around z with sim_qmc5883l_set_rotation(), and
+ * 			mag_motion_update() is called every 10ms as the main loop does. The profile switches are
+ * 			counted on the bus as CR1 writes of the magnetometer model.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "devices.h"
+#include "ssd1306.h"
+#include "QMC5883L.h"
+#include "mag_motion.h"
+
+#define MOTION_FIELD_MG			(400)//horizontal, so the sum of absolute values gives the angle exactly
+#define MOTION_POLL_MS			(10U)
+#define MOTION_STILL_MS			(1000U)
+#define MOTION_SLOW_DPS			(30)//between the up levels of the first and second profile
+#define MOTION_FAST_DPS			(90)//above the up level of the second profile
+#define MOTION_UP_MAX_MS		(300U)//two samples at 10Hz for a window, and the poll
+#define MOTION_DOWN_LATE_MS		(300U)//past the hold, the last window with turning in it, and the poll
+#define US_PER_MS				(1000U)
+
+/*
+ * Function to bring up the devices with the magnetometer at 200Hz and 8G and the field still, and
+ * start the controller
+ *
+ * Parameters:
+ *  motion(out) pointer to the controller
+ *
+ * Returns:
+ *  none
+ */
+static void motion_init(mag_motion_t *motion)
+{
+	qmc_config_t config;
+	uint32_t writes;
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;//away from the first profile, so starting the controller writes CR1
+	config.rng = RNG_OPTION_8G;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, MOTION_FIELD_MG, 0, 0);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	writes = devices_qmc.stats.cr1_writes;
+	CHECK_EQ(mag_motion_init(motion), QMC_OK);
+	CHECK_EQ(devices_qmc.stats.cr1_writes, writes + 1);
+	CHECK_EQ(motion->profile, 0);
+}
+
+/*
+ * Function to check the CR1 register of the magnetometer model holds the profile in use
+ *
+ * Parameters:
+ *  motion(in) pointer to the controller
+ *
+ * Returns:
+ *  none
+ */
+static void motion_check_cr1(const mag_motion_t *motion)
+{
+	const mag_motion_profile_t *profile = mag_motion_profile(motion);
+	uint8_t cr1 = devices_qmc.regs[QMC_CR1_ADDR];
+
+	CHECK_EQ((cr1 & CR1_ODR_MASK) >> CR1_ODR_SHIFT, profile->odr);
+	CHECK_EQ((cr1 & CR1_OSR_MASK) >> CR1_OSR_SHIFT, profile->osr);
+	CHECK_EQ((cr1 & CR1_RNG_MASK) >> CR1_RNG_SHIFT, RNG_OPTION_8G);
+}
+
+/*
+ * Function to call mag_motion_update() every MOTION_POLL_MS until it switches the profile. Every
+ * switch has to be exactly one CR1 write, and there are none without a switch
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *  max_ms longest time to wait
+ *
+ * Returns:
+ *  time the switch took in ms, 0 if there was none
+ */
+static uint32_t motion_wait_switch(mag_motion_t *motion, uint32_t max_ms)
+{
+	uint32_t writes = devices_qmc.stats.cr1_writes;
+
+	for(uint32_t ms = MOTION_POLL_MS; ms <= max_ms; ms += MOTION_POLL_MS)
+	{
+		sim_run_us(MOTION_POLL_MS*US_PER_MS);
+		if(mag_motion_update(motion))
+		{
+			CHECK_EQ(devices_qmc.stats.cr1_writes, writes + 1);
+			motion_check_cr1(motion);
+			return ms;
+		}
+		CHECK_EQ(devices_qmc.stats.cr1_writes, writes);
+	}
+	return 0;
+}
+
+TEST(motion_still_stays_slow)
+{
+	mag_motion_t motion;
+
+	motion_init(&motion);
+	motion_check_cr1(&motion);
+	CHECK_EQ(motion_wait_switch(&motion, 3*MAG_MOTION_HOLD_MS), 0);
+	CHECK_EQ(motion.profile, 0);
+	CHECK_EQ(motion.rate_dps, 0);
+	devices_check_bus();
+}
+
+TEST(motion_step_up_immediately)
+{
+	mag_motion_t motion;
+	uint32_t ms;
+
+	motion_init(&motion);
+	CHECK_EQ(motion_wait_switch(&motion, MOTION_STILL_MS), 0);
+
+	//above the up level of the first profile only, one step
+	sim_qmc5883l_set_rotation(&devices_qmc, MOTION_SLOW_DPS);
+	ms = motion_wait_switch(&motion, MOTION_UP_MAX_MS);
+	printf("motion_step_up_immediately: %d dps switched after %u ms\n", MOTION_SLOW_DPS, ms);
+	CHECK(ms != 0);
+	CHECK_EQ(motion.profile, 1);
+	CHECK_EQ(motion_wait_switch(&motion, MOTION_STILL_MS), 0);
+	devices_check_bus();
+}
+
+TEST(motion_step_up_past_a_profile)
+{
+	mag_motion_t motion;
+	uint32_t ms;
+
+	//above the up level of the second profile, straight from the first profile to the last
+	motion_init(&motion);
+	CHECK_EQ(motion_wait_switch(&motion, MOTION_STILL_MS), 0);
+	sim_qmc5883l_set_rotation(&devices_qmc, MOTION_FAST_DPS);
+	ms = motion_wait_switch(&motion, MOTION_UP_MAX_MS);
+	printf("motion_step_up_past_a_profile: %d dps switched after %u ms\n", MOTION_FAST_DPS, ms);
+	CHECK(ms != 0);
+	CHECK_EQ(motion.profile, MAG_MOTION_NUM_PROFILES - 1);
+	CHECK_EQ(motion.stats[1].entries, 0);
+	CHECK_EQ(motion_wait_switch(&motion, MOTION_STILL_MS), 0);
+	CHECK(motion.rate_dps > mag_motion_profiles[MAG_MOTION_NUM_PROFILES - 1].down_dps);
+	devices_check_bus();
+}
+
+TEST(motion_step_down_after_hold)
+{
+	mag_motion_t motion;
+	uint32_t ms;
+
+	motion_init(&motion);
+	sim_qmc5883l_set_rotation(&devices_qmc, MOTION_FAST_DPS);
+	CHECK(motion_wait_switch(&motion, MOTION_UP_MAX_MS) != 0);
+	CHECK_EQ(motion.profile, 2);
+	CHECK_EQ(motion_wait_switch(&motion, MOTION_STILL_MS), 0);
+
+	//once it stops, one profile down per hold, none before the hold is over
+	sim_qmc5883l_set_rotation(&devices_qmc, 0);
+	for(int profile = MAG_MOTION_NUM_PROFILES - 2; profile >= 0; profile--)
+	{
+		ms = motion_wait_switch(&motion, MAG_MOTION_HOLD_MS + MOTION_DOWN_LATE_MS);
+		printf("motion_step_down_after_hold: down to profile %d after %u ms\n", profile, ms);
+		CHECK(ms > MAG_MOTION_HOLD_MS);
+		CHECK_EQ(motion.profile, profile);
+	}
+	CHECK_EQ(motion_wait_switch(&motion, 2*MAG_MOTION_HOLD_MS), 0);
+	for(int i = 0; i < MAG_MOTION_NUM_PROFILES; i++)
+	{
+		CHECK_EQ(motion.stats[i].entries, (i == 0) ? 2 : 1);//the first one is also entered at the start
+		CHECK(motion.stats[i].samples > 0);
+	}
+#ifdef I2C_PROFILE
+	CHECK(motion.stats[2].bus_us > 0);
+#endif
+	devices_check_bus();
+}
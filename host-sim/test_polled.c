@@ -0,0 +1,139 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_polled.c
+ * @brief   Tests of the sequencing of the polled transactions of i2c.c on the bus state: a START
+ * 			waits for the STOP before it to finish, a repeated start is made with MULT cleared as
+ * 			the errata asks, and a lost arbitration releases the bus. The I2C model counts every
+ * 			sequence the KL25Z module does not tolerate.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+
+#define POLLED_XFERS		(50U)
+#define CHIP_ID_REG			(0x0DU)
+#define CHIP_ID				(0xFFU)
+#define F_MULT2_50KHZ		(I2C_F_MULT(1) | I2C_F_ICR(0x1F))//divider 240 times 2, 50kHz from the 24MHz bus clock
+#define POLLED_MAX_GAP_US	(20U)//bus idle time allowed between two transactions, no sleeps
+
+/*
+ * Function to bring up both devices with the magnetometer in standby, so that only the polled
+ * transactions of the test use its bus once the first frame is out
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void polled_init()
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.mode = MODE_OPTION_STANDBY;
+	devices_attach();
+	devices_init(&config);
+	devices_disable_faults();
+	i2c_wait_idle(QMC_I2C_BUS);
+}
+
+/*
+ * Function to read the chip ID with a polled write of the register pointer and a repeated start
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  status of the transaction
+ */
+static i2c_status_t polled_read_id()
+{
+	static const uint8_t reg = CHIP_ID_REG;
+	uint8_t id = 0;
+	i2c_status_t status = i2c_transfer(QMC_I2C_BUS, QMC_DEVICE_ADDR, &reg, 1, &id, 1, 0);
+	if(status == I2C_STATUS_OK)
+	{
+		CHECK_EQ(id, CHIP_ID);
+	}
+	return status;
+}
+
+TEST(polled_back_to_back)
+{
+	sim_i2c_stats_t before, after;
+	sim_time_t start, idle;
+
+	polled_init();
+	sim_i2c_get_stats(devices_qmc_bus(), &before);
+	start = sim_now();
+	for(int i = 0; i < POLLED_XFERS; i++)
+	{
+		CHECK_EQ(polled_read_id(), I2C_STATUS_OK);
+	}
+	while(sim_i2c_busy(devices_qmc_bus()))
+	{
+		sim_run_us(1);
+	}
+	sim_i2c_get_stats(devices_qmc_bus(), &after);
+
+	//every START found the bus free, so none lost arbitration against the STOP before it
+	CHECK_EQ(after.starts - before.starts, POLLED_XFERS);
+	CHECK_EQ(after.rstarts - before.rstarts, POLLED_XFERS);
+	CHECK_EQ(after.stops - before.stops, POLLED_XFERS);
+	devices_check_bus();
+
+	//and the wait ends with the STOP, not after a fixed delay
+	idle = sim_now() - start - (after.busy_cycles - before.busy_cycles);
+	CHECK(idle/POLLED_XFERS < POLLED_MAX_GAP_US*SIM_CYCLES_PER_US);
+	BENCH("polled_xfer_us", "%u", (uint32_t)((sim_now() - start)/POLLED_XFERS/SIM_CYCLES_PER_US));
+	BENCH("polled_gap_us", "%u", (uint32_t)(idle/POLLED_XFERS/SIM_CYCLES_PER_US));
+}
+
+TEST(polled_rstart_with_mult)
+{
+	sim_i2c_stats_t before, after;
+
+	polled_init();
+	sim_write_register((uintptr_t)&QMC_I2C_BUS->F, 1, F_MULT2_50KHZ);
+	CHECK_EQ(sim_i2c_scl_hz(devices_qmc_bus()), 50000);
+	sim_i2c_get_stats(devices_qmc_bus(), &before);
+	CHECK_EQ(polled_read_id(), I2C_STATUS_OK);
+	sim_i2c_get_stats(devices_qmc_bus(), &after);
+
+	CHECK_EQ(after.rstarts - before.rstarts, 1);
+	CHECK_EQ(QMC_I2C_BUS->F, F_MULT2_50KHZ);//put back after the repeated start
+	devices_check_bus();
+}
+
+#ifdef I2C_FAULT_INJECT
+TEST(polled_arbitration_lost)
+{
+	polled_init();
+	i2c_set_fault_rate(I2C_FAULT_ARB_LOST, 1000);
+	CHECK_EQ(polled_read_id(), I2C_STATUS_ARB_LOST);
+	i2c_set_fault_rate(I2C_FAULT_ARB_LOST, 0);
+
+	//the module left master mode and the bus was released for the next transaction
+	CHECK(!(QMC_I2C_BUS->C1 & I2C_C1_MST_MASK));
+	CHECK(!(QMC_I2C_BUS->S & I2C_S_ARBL_MASK));
+	sim_run_us(100);
+	CHECK(!sim_i2c_busy(devices_qmc_bus()));
+	CHECK_EQ(polled_read_id(), I2C_STATUS_OK);
+}
+#endif
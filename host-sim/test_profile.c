@@ -0,0 +1,302 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_profile.c
+ * @brief   Tests of the bus profiler of i2c.c, run in the profile build. The counters are read back
+ * 			from the table i2c_profile_dump() prints, and the bus time against the time the I2C model
+ * 			saw the bus busy. The cost of the profiler is benched in every build, so the profile
+ * 			build can be compared against the default one.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+#include "ssd1306.h"
+#include "stdio.h"
+#include "string.h"
+#include "unistd.h"
+
+#define CHIP_ID_REG			(0x0DU)
+#define PROFILE_READS		(20U)
+#define PROFILE_NACKS		(3U)
+#define PROFILE_PERIOD_US	(1000U)//one read per ms keeps the bus about 10% busy
+#define PROFILE_WINDOW_US	(I2C_PROFILE_WINDOW_MS*1000U)
+#define BENCH_ROUNDS		(10U)
+#define BENCH_BATCH			(10U)//fits in the normal queue
+
+static i2c_xfer_t bench_xfers[BENCH_BATCH];
+static uint8_t bench_rx[BENCH_BATCH];
+
+/*
+ * Function to bring up both devices with the magnetometer in standby, so that only the
+ * transactions of the test are on the bus once the first frame is out
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void profile_init()
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.mode = MODE_OPTION_STANDBY;
+	devices_attach();
+	devices_init(&config);
+	devices_disable_faults();
+	i2c_wait_idle(QMC_I2C_BUS);
+	i2c_wait_idle(SSD1306_I2C_BUS);
+}
+
+#ifdef I2C_PROFILE
+/*
+ * Function to read the chip ID with a polled transaction
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  status of the transaction
+ */
+static i2c_status_t profile_read_id()
+{
+	static const uint8_t reg = CHIP_ID_REG;
+	uint8_t id;
+	return i2c_transfer(QMC_I2C_BUS, QMC_DEVICE_ADDR, &reg, 1, &id, 1, 0);
+}
+
+typedef struct{
+	unsigned addr, xfers, bytes, busy_us, max_us, nacks, arb_lost, errors;
+}profile_row_t;
+
+typedef struct{
+	unsigned utilization;
+	profile_row_t rows[I2C_PROFILE_MAX_DEVICES];
+	int num_rows;
+	unsigned hist[I2C_PROFILE_HIST_BUCKETS];
+}profile_dump_t;
+
+/*
+ * Function to run i2c_profile_dump() with the console going to a file and read the table back
+ *
+ * Parameters:
+ *  dump(out) the values printed
+ *
+ * Returns:
+ *  none
+ */
+static void profile_read_dump(profile_dump_t *dump)
+{
+	FILE *file = tmpfile();
+	int console = dup(STDOUT_FILENO);
+	char line[80];
+	int bucket = 0;
+	profile_row_t row;
+
+	CHECK(file != NULL);
+	fflush(stdout);
+	dup2(fileno(file), STDOUT_FILENO);
+	i2c_profile_dump();
+	fflush(stdout);
+	dup2(console, STDOUT_FILENO);
+	close(console);
+
+	memset(dump, 0, sizeof(*dump));
+	rewind(file);
+	while(fgets(line, sizeof(line), file))
+	{
+		if(sscanf(line, "I2C UTILISATION %u%%", &dump->utilization) == 1)
+		{
+			continue;
+		}
+		if(sscanf(line, "0x%x %u %u %u %u %u %u %u", &row.addr, &row.xfers, &row.bytes, &row.busy_us,
+				&row.max_us, &row.nacks, &row.arb_lost, &row.errors) == 8)
+		{
+			CHECK(dump->num_rows < I2C_PROFILE_MAX_DEVICES);
+			dump->rows[dump->num_rows++] = row;
+			continue;
+		}
+		if((line[0] == '<' || line[0] == '>') && sscanf(strchr(line, ' '), "%u", &dump->hist[bucket]) == 1)
+		{
+			CHECK(bucket < I2C_PROFILE_HIST_BUCKETS);
+			bucket++;
+		}
+	}
+	fclose(file);
+	CHECK_EQ(bucket, I2C_PROFILE_HIST_BUCKETS);
+}
+
+/*
+ * Function to find the row of a device in a dump
+ *
+ * Parameters:
+ *  dump the dump
+ *  addr 7 bit address of the device
+ *
+ * Returns:
+ *  the row, the test fails if there is none
+ */
+static const profile_row_t* profile_row(const profile_dump_t *dump, uint8_t addr)
+{
+	for(int i = 0; i < dump->num_rows; i++)
+	{
+		if(dump->rows[i].addr == addr)
+		{
+			return &dump->rows[i];
+		}
+	}
+	CHECK(0);
+	return NULL;
+}
+
+TEST(profile_device_counters)
+{
+	sim_i2c_stats_t before, after;
+	profile_dump_t dump;
+	const profile_row_t *qmc, *ssd;
+	uint32_t bus_us;
+	unsigned total = 0;
+
+	profile_init();
+	i2c_profile_reset();
+	sim_i2c_get_stats(devices_qmc_bus(), &before);
+	for(int i = 0; i < PROFILE_READS; i++)
+	{
+		CHECK_EQ(profile_read_id(), I2C_STATUS_OK);
+	}
+	devices_qmc.slave.nacks = PROFILE_NACKS;
+	for(int i = 0; i < PROFILE_NACKS; i++)
+	{
+		CHECK_EQ(profile_read_id(), I2C_STATUS_NACK);
+	}
+	i2c_wait_idle(QMC_I2C_BUS);
+	sim_i2c_get_stats(devices_qmc_bus(), &after);
+	bus_us = (uint32_t)((after.busy_cycles - before.busy_cycles)/SIM_CYCLES_PER_US);
+	CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	profile_read_dump(&dump);
+
+	//the register pointer and the ID byte of every read that got through
+	qmc = profile_row(&dump, QMC_DEVICE_ADDR);
+	CHECK_EQ(qmc->xfers, PROFILE_READS + PROFILE_NACKS);
+	CHECK_EQ(qmc->bytes, 2*PROFILE_READS);
+	CHECK_EQ(qmc->nacks, PROFILE_NACKS);
+	CHECK_EQ(qmc->arb_lost + qmc->errors, 0);
+	CHECK_EQ(qmc->busy_us, i2c_profile_busy_us(QMC_DEVICE_ADDR));
+	//timed from the START to the STOP being set, the model counts till the STOP is done
+	CHECK(qmc->busy_us > bus_us*8/10 && qmc->busy_us <= bus_us);
+
+	//the eight pages of the frame
+	ssd = profile_row(&dump, SSD1306_DEVICE_ADDR);
+	CHECK_EQ(ssd->xfers, 8);
+	CHECK_EQ(ssd->bytes, 8*(7 + 128));//the page is addressed and the data control byte sent before every page
+	CHECK(ssd->max_us > 128*9*1000000U/I2C_SPEED_FAST_HZ);
+
+	for(int i = 0; i < I2C_PROFILE_HIST_BUCKETS; i++)
+	{
+		total += dump.hist[i];
+	}
+	CHECK_EQ(total, qmc->xfers + ssd->xfers);
+	CHECK_EQ(dump.hist[I2C_PROFILE_HIST_BUCKETS - 2], 8);//the pages, 2.9ms each
+	BENCH("profile_qmc_read_us", "%u", qmc->busy_us/qmc->xfers);
+	BENCH("profile_model_read_us", "%u", bus_us/qmc->xfers);
+	BENCH("profile_page_max_us", "%u", ssd->max_us);
+}
+
+TEST(profile_utilization_window)
+{
+	sim_time_t end;
+	sim_i2c_stats_t before, after;
+	uint32_t expected;
+
+	profile_init();
+	i2c_profile_reset();
+	CHECK_EQ(i2c_profile_utilization(), 0);
+
+	//two windows of one read per ms, the second one is reported
+	end = sim_now() + 2*PROFILE_WINDOW_US*(sim_time_t)SIM_CYCLES_PER_US;
+	sim_i2c_get_stats(devices_qmc_bus(), &before);
+	while(sim_now() < end)
+	{
+		CHECK_EQ(profile_read_id(), I2C_STATUS_OK);
+		sim_run_us(PROFILE_PERIOD_US - (uint32_t)((sim_now() % (PROFILE_PERIOD_US*SIM_CYCLES_PER_US))/SIM_CYCLES_PER_US));
+	}
+	sim_i2c_get_stats(devices_qmc_bus(), &after);
+	expected = (uint32_t)((after.busy_cycles - before.busy_cycles)*100/(2*PROFILE_WINDOW_US*(sim_time_t)SIM_CYCLES_PER_US));
+	BENCH("profile_utilization_pct", "%u", i2c_profile_utilization());
+	BENCH("profile_model_busy_pct", "%u", expected);
+	CHECK(i2c_profile_utilization() + 2 >= expected && i2c_profile_utilization() <= expected);
+
+	//the window open at the last read still has reads in it, the one after it has none
+	sim_run_us(PROFILE_WINDOW_US + PROFILE_PERIOD_US);
+	CHECK(i2c_profile_utilization() <= expected);
+	sim_run_us(PROFILE_WINDOW_US + PROFILE_PERIOD_US);
+	CHECK_EQ(i2c_profile_utilization(), 0);
+}
+#endif
+
+/*
+ * Function to check if the benched transactions are done
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  1 once the last one has a final status
+ */
+static int bench_batch_done(void *context)
+{
+	return bench_xfers[BENCH_BATCH - 1].status != I2C_STATUS_PENDING;
+}
+
+TEST(bench_profile_overhead)
+{
+	sim_stats_t sim_before, sim_after;
+	sim_time_t submit = 0, start;
+	uint32_t xfers = BENCH_ROUNDS*BENCH_BATCH;
+
+	profile_init();
+	sim_get_stats(&sim_before);
+	for(int round = 0; round < BENCH_ROUNDS; round++)
+	{
+		for(int i = 0; i < BENCH_BATCH; i++)
+		{
+			bench_xfers[i].addr = QMC_DEVICE_ADDR;
+			bench_xfers[i].flags = 0;
+			bench_xfers[i].cmd[0] = CHIP_ID_REG;
+			bench_xfers[i].cmd_len = 1;
+			bench_xfers[i].tx_len = 0;
+			bench_xfers[i].rx = &bench_rx[i];
+			bench_xfers[i].rx_len = 1;
+			start = sim_now();
+			CHECK_EQ(i2c_submit(QMC_I2C_BUS, &bench_xfers[i]), I2C_STATUS_PENDING);
+			submit += sim_now() - start;
+		}
+		CHECK(sim_run_until(bench_batch_done, NULL, 100000));
+		for(int i = 0; i < BENCH_BATCH; i++)
+		{
+			CHECK_EQ(bench_xfers[i].status, I2C_STATUS_OK);
+		}
+	}
+	sim_get_stats(&sim_after);
+
+	//the profiler records from the I2C interrupt when an engine transaction ends
+	BENCH("profile_isr_cycles_per_xfer", "%u", (uint32_t)((sim_after.cycles[SIM_EXCEPTION(I2C0_IRQn)] + sim_after.cycles[SIM_EXCEPTION(I2C1_IRQn)] -
+			sim_before.cycles[SIM_EXCEPTION(I2C0_IRQn)] - sim_before.cycles[SIM_EXCEPTION(I2C1_IRQn)])/xfers));
+	BENCH("profile_submit_cycles", "%u", (uint32_t)(submit/xfers));
+}
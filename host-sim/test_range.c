@@ -0,0 +1,350 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_range.c
+ * @brief   Tests of auto ranging of the QMC5883L driver. Samples are popped from the ring one at a
+ * 			time as they come in, so the sample after which a range change is started is known. The
+ * 			range changes are counted on the bus as CR1 writes of the magnetometer model.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "devices.h"
+#include "ssd1306.h"
+#include "QMC5883L.h"
+
+#define RANGE_ODR_PERIOD_US		(5000U)//200Hz
+#define RANGE_SAMPLE_WAIT_US	(20000U)
+#define RANGE_LSB_PER_MG_8G		(3)
+#define RANGE_LSB_PER_MG_2G		(12)
+#define RANGE_QUIET_MG			(300)//well below the down level
+#define RANGE_LOUD_MG			(1500)//above the down level, below the up level
+#define RANGE_HIGH_MG			(2500)//inside 16 bits at 2G, above the up level
+#define RANGE_FULL_MG			(5000)//past the 16 bits of the 2G range, inside the 8G range
+#define RANGE_ROTATION_DEG_S	(7)
+#define RANGE_ROTATION_SAMPLES	(200U)
+
+static qmc_sample_reader_t reader;
+
+/*
+ * Function to bring up the devices with the magnetometer at 200Hz
+ *
+ * Parameters:
+ *  rng range to start at
+ *  auto_rng auto ranging on or off
+ *
+ * Returns:
+ *  none
+ */
+static void range_init(qmc_cr1_rng_options_t rng, qmc_auto_rng_options_t auto_rng)
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;
+	config.rng = rng;
+	config.auto_rng = auto_rng;
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, RANGE_QUIET_MG, -RANGE_QUIET_MG, RANGE_QUIET_MG/2);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	qmc_sample_reader_init(&reader);
+}
+
+/*
+ * Function to check for a sample in the ring the test has not popped yet
+ *
+ * Parameters:
+ *  context(out) the sample
+ *
+ * Returns:
+ *  1 once a sample was popped
+ */
+static int range_pop(void *context)
+{
+	return qmc_sample_pop(&reader, context);
+}
+
+/*
+ * Function to wait for the next sample, popped as soon as the driver puts it in the ring
+ *
+ * Parameters:
+ *  sample(out) the sample
+ *
+ * Returns:
+ *  none
+ */
+static void range_next(qmc_sample_t *sample)
+{
+	CHECK(sim_run_until(range_pop, sample, RANGE_SAMPLE_WAIT_US));
+	CHECK_EQ(reader.overflows, 0);
+}
+
+/*
+ * Function to get the number of range changes auto ranging has made
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  range_switches of the sample counters
+ */
+static uint32_t range_switches()
+{
+	qmc_sample_stats_t stats;
+	qmc_get_sample_stats(&stats);
+	return stats.range_switches;
+}
+
+/*
+ * Function to get the number of DRDY edges with no sample put in the ring
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  skipped of the sample counters
+ */
+static uint32_t range_skipped()
+{
+	qmc_sample_stats_t stats;
+	qmc_get_sample_stats(&stats);
+	return stats.skipped;
+}
+
+/*
+ * Function to check for a range change made by auto ranging
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  1 once a range change was made
+ */
+static int range_switched(void *context)
+{
+	return range_switches() != 0;
+}
+
+/*
+ * Function to check a sample against the field the model was set to, in 8G LSB
+ *
+ * Parameters:
+ *  sample the sample
+ *  x_mg, y_mg, z_mg the field
+ *
+ * Returns:
+ *  none
+ */
+static void range_check_sample(const qmc_sample_t *sample, int32_t x_mg, int32_t y_mg, int32_t z_mg)
+{
+	CHECK_EQ(sample->status & SR_OVL_MASK, 0);
+	CHECK_EQ(sample->axis[AXIS_X], x_mg*RANGE_LSB_PER_MG_8G);
+	CHECK_EQ(sample->axis[AXIS_Y], y_mg*RANGE_LSB_PER_MG_8G);
+	CHECK_EQ(sample->axis[AXIS_Z], z_mg*RANGE_LSB_PER_MG_8G);
+}
+
+/*
+ * Function to check the calibration offsets the driver uses
+ *
+ * Parameters:
+ *  x, y, z the offsets expected
+ *
+ * Returns:
+ *  none
+ */
+static void range_check_offset(int16_t x, int16_t y, int16_t z)
+{
+	qmc_calibration_data_t cal;
+	qmc_get_calibration(&cal);
+	CHECK_EQ(cal.offset[AXIS_X], x);
+	CHECK_EQ(cal.offset[AXIS_Y], y);
+	CHECK_EQ(cal.offset[AXIS_Z], z);
+}
+
+TEST(range_up_delivers_full_8g_range)
+{
+	qmc_sample_t sample, last;
+	uint32_t switches, writes, skipped;
+
+	range_init(RNG_OPTION_2G, AUTO_RNG_ENABLE);
+	for(int i = 0; i < 4; i++)
+	{//2G samples in 8G LSB
+		range_next(&sample);
+		range_check_sample(&sample, RANGE_QUIET_MG, -RANGE_QUIET_MG, RANGE_QUIET_MG/2);
+	}
+	CHECK_EQ(range_switches(), 0);
+	range_check_offset(OFFSET_X, OFFSET_Y, OFFSET_Z);//calculated at 8G, nothing to rescale
+
+	//5G does not fit the 16 bits of the 2G range, the device flags the sample and the next one
+	//that is not dropped is at 8G
+	switches = range_switches();
+	writes = devices_qmc.stats.cr1_writes;
+	skipped = range_skipped();
+	sim_qmc5883l_set_field(&devices_qmc, RANGE_FULL_MG, -RANGE_FULL_MG/2, RANGE_QUIET_MG);
+	range_next(&last);
+	CHECK(last.status & SR_OVL_MASK);
+	range_next(&sample);
+	range_check_sample(&sample, RANGE_FULL_MG, -RANGE_FULL_MG/2, RANGE_QUIET_MG);
+	CHECK_EQ(range_switches(), switches + 1);
+	CHECK_EQ(devices_qmc.stats.cr1_writes, writes + 1);
+	CHECK_EQ(range_skipped(), skipped + 1);//measured across the change
+	CHECK(sample.time_us - last.time_us > RANGE_ODR_PERIOD_US*3/2);
+	CHECK(sample.time_us - last.time_us < RANGE_ODR_PERIOD_US*5/2);
+
+	//and stays there, every sample delivered
+	for(int i = 0; i < 2*QMC_AUTO_RANGE_HOLD; i++)
+	{
+		last = sample;
+		range_next(&sample);
+		range_check_sample(&sample, RANGE_FULL_MG, -RANGE_FULL_MG/2, RANGE_QUIET_MG);
+		CHECK(sample.time_us - last.time_us < RANGE_ODR_PERIOD_US*3/2);
+	}
+	CHECK_EQ(range_switches(), switches + 1);
+	CHECK_EQ(devices_qmc.stats.cr1_writes, writes + 1);
+	devices_check_bus();
+}
+
+TEST(range_up_on_first_sample_above_level)
+{
+	qmc_sample_t sample;
+	uint32_t writes;
+
+	range_init(RNG_OPTION_2G, AUTO_RNG_ENABLE);
+	range_next(&sample);
+	writes = devices_qmc.stats.cr1_writes;
+
+	//2.5G fits the 2G range, the first sample above the up level is delivered and switches
+	sim_qmc5883l_set_field(&devices_qmc, RANGE_HIGH_MG, 0, 0);
+	range_next(&sample);
+	range_check_sample(&sample, RANGE_HIGH_MG, 0, 0);
+	CHECK(sim_run_until(range_switched, NULL, RANGE_ODR_PERIOD_US));
+	CHECK_EQ(range_switches(), 1);
+	CHECK_EQ(devices_qmc.stats.cr1_writes, writes + 1);
+	range_next(&sample);
+	range_check_sample(&sample, RANGE_HIGH_MG, 0, 0);
+	devices_check_bus();
+}
+
+TEST(range_down_after_hold)
+{
+	qmc_sample_t sample, last;
+	uint32_t quiet = 0, writes, skipped;
+
+	range_init(RNG_OPTION_8G, AUTO_RNG_ENABLE);
+	sim_qmc5883l_set_field(&devices_qmc, RANGE_LOUD_MG, 0, 0);
+	range_next(&sample);
+	range_next(&sample);
+	range_check_sample(&sample, RANGE_LOUD_MG, 0, 0);
+	writes = devices_qmc.stats.cr1_writes;
+	skipped = range_skipped();
+
+	//quiet for less than the hold, then one sample above the down level starts the count again
+	sim_qmc5883l_set_field(&devices_qmc, RANGE_QUIET_MG, 0, 0);
+	for(int i = 0; i < QMC_AUTO_RANGE_HOLD - 1; i++)
+	{
+		range_next(&sample);
+		range_check_sample(&sample, RANGE_QUIET_MG, 0, 0);
+	}
+	sim_qmc5883l_set_field(&devices_qmc, RANGE_LOUD_MG, 0, 0);
+	range_next(&sample);
+	range_check_sample(&sample, RANGE_LOUD_MG, 0, 0);
+	CHECK_EQ(range_switches(), 0);
+
+	//the change is started by the last sample of the hold, the one after it is dropped
+	sim_qmc5883l_set_field(&devices_qmc, RANGE_QUIET_MG, 0, 0);
+	last = sample;
+	while(range_switches() == 0)
+	{
+		last = sample;
+		range_next(&sample);
+		range_check_sample(&sample, RANGE_QUIET_MG, 0, 0);
+		quiet++;
+		CHECK(quiet <= QMC_AUTO_RANGE_HOLD + 1);
+	}
+	//the switch lands between the last quiet 8G sample and the next one popped
+	CHECK_EQ(quiet, QMC_AUTO_RANGE_HOLD + 1);
+	CHECK(sample.time_us - last.time_us > RANGE_ODR_PERIOD_US*3/2);
+	CHECK_EQ(devices_qmc.stats.cr1_writes, writes + 1);
+	CHECK_EQ(range_skipped(), skipped + 1);
+	for(int i = 0; i < QMC_AUTO_RANGE_HOLD; i++)
+	{
+		range_next(&sample);
+		range_check_sample(&sample, RANGE_QUIET_MG, 0, 0);
+	}
+	CHECK_EQ(range_switches(), 1);
+	CHECK_EQ(devices_qmc.stats.cr1_writes, writes + 1);
+	devices_check_bus();
+}
+
+TEST(range_frac_keeps_2g_resolution)
+{
+	qmc_sample_t sample;
+	uint32_t with_frac = 0;
+	int64_t expected = (int64_t)RANGE_QUIET_MG*RANGE_QUIET_MG*2*RANGE_LSB_PER_MG_2G*RANGE_LSB_PER_MG_2G;
+
+	range_init(RNG_OPTION_2G, AUTO_RNG_ENABLE);
+	sim_qmc5883l_set_rotation(&devices_qmc, RANGE_ROTATION_DEG_S);
+	for(int i = 0; i < RANGE_ROTATION_SAMPLES; i++)
+	{
+		int64_t x, y, error;
+		range_next(&sample);
+		x = ((int32_t)sample.axis[AXIS_X] << QMC_SAMPLE_FRAC_BITS) + QMC_SAMPLE_FRAC(&sample, AXIS_X);
+		y = ((int32_t)sample.axis[AXIS_Y] << QMC_SAMPLE_FRAC_BITS) + QMC_SAMPLE_FRAC(&sample, AXIS_Y);
+		//the radius in 2G LSB, to within the rounding of each axis by the device
+		error = x*x + y*y - expected;
+		CHECK(error < 2*RANGE_QUIET_MG*RANGE_LSB_PER_MG_2G*2 && error > -2*RANGE_QUIET_MG*RANGE_LSB_PER_MG_2G*2);
+		if(sample.frac)
+		{
+			with_frac++;
+		}
+	}
+	CHECK_EQ(range_switches(), 0);
+	CHECK(with_frac > RANGE_ROTATION_SAMPLES/2);
+}
+
+TEST(range_calibration_rescaled)
+{
+	qmc_calibration_data_t cal;
+	qmc_sample_t sample;
+
+	//a fixed 2G range has the offsets calculated at 8G multiplied by 4
+	range_init(RNG_OPTION_2G, AUTO_RNG_DISABLE);
+	range_check_offset(OFFSET_X*4, OFFSET_Y*4, OFFSET_Z*4);
+	range_next(&sample);
+	CHECK_EQ(sample.axis[AXIS_X], RANGE_QUIET_MG*RANGE_LSB_PER_MG_2G);
+
+	//set by hand the samples and offsets follow the range, rounding to nearest on the way down
+	CHECK_EQ(qmc_set_range(RNG_OPTION_8G), QMC_OK);
+	range_check_offset(OFFSET_X, OFFSET_Y, OFFSET_Z);
+	range_next(&sample);
+	range_check_sample(&sample, RANGE_QUIET_MG, -RANGE_QUIET_MG, RANGE_QUIET_MG/2);
+	CHECK_EQ(range_switches(), 0);
+
+	qmc_get_calibration(&cal);
+	cal.offset[AXIS_X] = 10000;//saturates at 2G
+	cal.offset[AXIS_Y] = -6;
+	cal.offset[AXIS_Z] = 7;
+	qmc_set_calibration(&cal);
+	CHECK_EQ(qmc_set_range(RNG_OPTION_2G), QMC_OK);
+	range_check_offset(INT16_MAX, -24, 28);
+	cal.offset[AXIS_X] = 5;
+	cal.offset[AXIS_Y] = -6;
+	cal.offset[AXIS_Z] = 7;
+	qmc_set_calibration(&cal);
+	CHECK_EQ(qmc_set_range(RNG_OPTION_8G), QMC_OK);
+	range_check_offset(1, -1, 2);
+	devices_check_bus();
+}
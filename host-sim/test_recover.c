@@ -0,0 +1,199 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_recover.c
+ * @brief   Tests of the timeouts and the bus recovery of i2c.c. The magnetometer model is made to
+ * 			hold SDA low, the way a slave cut off in the middle of a byte does, and the time the
+ * 			driver takes to get the bus back is measured.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+#include "systick.h"
+
+#define CHIP_ID_REG			(0x0DU)
+#define CHIP_ID				(0xFFU)
+#define RECOVERY_CLOCKS		(9U)//the most a slave can need, it releases SDA at the end of its byte
+#define RECOVERY_MAX_US		(300U)//the clocks, the STOP and setting the module up again
+#define LONG_TIMEOUT_MS		(20U)
+#define STOP_US				(100U)//time for the STOP after a transaction to finish on the bus
+#define US_PER_MS			(1000U)
+#define TIMEOUT_MIN_US(ms)	((ms)*US_PER_MS)
+#define TIMEOUT_MAX_US(ms)	(((ms) + 1)*US_PER_MS + RECOVERY_MAX_US)//now() counts whole ms
+
+/*
+ * Function to bring up both devices with the magnetometer in standby and wait for the bus of
+ * the magnetometer to go quiet
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void recover_init()
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.mode = MODE_OPTION_STANDBY;
+	devices_attach();
+	devices_init(&config);
+	devices_disable_faults();
+	i2c_wait_idle(QMC_I2C_BUS);
+}
+
+/*
+ * Function to read the chip ID with a polled transaction
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  status of the transaction
+ */
+static i2c_status_t recover_read_id()
+{
+	static const uint8_t reg = CHIP_ID_REG;
+	uint8_t id = 0;
+	i2c_status_t status = i2c_transfer(QMC_I2C_BUS, QMC_DEVICE_ADDR, &reg, 1, &id, 1, 0);
+	if(status == I2C_STATUS_OK)
+	{
+		CHECK_EQ(id, CHIP_ID);
+	}
+	return status;
+}
+
+/*
+ * Function to time a polled read of the chip ID on a bus whose SDA is held low
+ *
+ * Parameters:
+ *  clocks SCL clocks till the model lets go of SDA, 0 to never let go
+ *  status(out) status of the read
+ *
+ * Returns:
+ *  time the read took in us
+ */
+static uint32_t recover_timed_read(uint8_t clocks, i2c_status_t *status)
+{
+	sim_time_t start;
+
+	sim_i2c_hold_sda(devices_qmc_bus(), clocks);
+	start = sim_now();
+	*status = recover_read_id();
+	return (uint32_t)((sim_now() - start)/SIM_CYCLES_PER_US);
+}
+
+TEST(recover_stuck_sda)
+{
+	i2c_status_t status;
+	uint32_t us;
+
+	recover_init();
+	us = recover_timed_read(RECOVERY_CLOCKS, &status);
+
+	//the read waits out the timeout, the recovery frees SDA and the read goes through
+	CHECK_EQ(status, I2C_STATUS_OK);
+	CHECK(us > TIMEOUT_MIN_US(I2C_DEFAULT_TIMEOUT_MS));
+	CHECK(us < TIMEOUT_MAX_US(I2C_DEFAULT_TIMEOUT_MS));
+	sim_run_us(STOP_US);
+	CHECK(!sim_i2c_busy(devices_qmc_bus()));
+	CHECK_EQ(recover_read_id(), I2C_STATUS_OK);
+	devices_check_bus();
+	BENCH("recover_stuck_read_us", "%u", us);
+}
+
+TEST(recover_clocks_out_sda)
+{
+	sim_time_t start;
+
+	recover_init();
+	sim_i2c_hold_sda(devices_qmc_bus(), RECOVERY_CLOCKS);
+	start = sim_now();
+	CHECK_EQ(i2c_recover_bus(QMC_I2C_BUS), I2C_STATUS_OK);
+	BENCH("recover_us", "%u", (uint32_t)((sim_now() - start)/SIM_CYCLES_PER_US));
+	CHECK(sim_now() - start < RECOVERY_MAX_US*SIM_CYCLES_PER_US);
+	sim_run_us(STOP_US);
+	CHECK(!sim_i2c_busy(devices_qmc_bus()));
+	CHECK_EQ(recover_read_id(), I2C_STATUS_OK);
+	devices_check_bus();
+}
+
+TEST(recover_sda_held_for_good)
+{
+	i2c_status_t status;
+	uint32_t us;
+
+	recover_init();
+	us = recover_timed_read(0, &status);
+
+	//the read fails within one timeout and one recovery, without a START on the held bus
+	CHECK_EQ(status, I2C_STATUS_BUS_ERROR);
+	CHECK(us < TIMEOUT_MAX_US(I2C_DEFAULT_TIMEOUT_MS));
+	CHECK(!(QMC_I2C_BUS->C1 & I2C_C1_MST_MASK));
+	CHECK_EQ(i2c_recover_bus(QMC_I2C_BUS), I2C_STATUS_BUS_ERROR);
+	BENCH("recover_held_read_us", "%u", us);
+
+	//once the slave lets go the next recovery gets the bus back
+	sim_i2c_hold_sda(devices_qmc_bus(), 1);
+	CHECK_EQ(i2c_recover_bus(QMC_I2C_BUS), I2C_STATUS_OK);
+	sim_run_us(STOP_US);
+	CHECK(!sim_i2c_busy(devices_qmc_bus()));
+	CHECK_EQ(recover_read_id(), I2C_STATUS_OK);
+}
+
+TEST(recover_timeout_setting)
+{
+	i2c_status_t status;
+	uint32_t us;
+
+	recover_init();
+	i2c_set_timeout(LONG_TIMEOUT_MS);
+	us = recover_timed_read(RECOVERY_CLOCKS, &status);
+	i2c_set_timeout(I2C_DEFAULT_TIMEOUT_MS);
+
+	CHECK_EQ(status, I2C_STATUS_OK);
+	CHECK(us > TIMEOUT_MIN_US(LONG_TIMEOUT_MS));
+	CHECK(us < TIMEOUT_MAX_US(LONG_TIMEOUT_MS));
+}
+
+TEST(recover_qmc_retry_budget)
+{
+	qmc_config_t config;
+	sim_i2c_stats_t before, after;
+
+	devices_main_config(&config);
+	devices_attach();
+	devices_disable_faults();
+	init_systick();
+	init_i2c(QMC_I2C_BUS);
+	i2c_set_speed(QMC_I2C_BUS, I2C_SPEED_FAST);
+
+	//one nack less than the attempts it has, the last retry gets through
+	devices_qmc.slave.nacks = QMC_I2C_RETRIES;
+	CHECK_EQ(init_qmc(&config), QMC_OK);
+	CHECK_EQ(devices_qmc.slave.nacks, 0);
+
+	//one more and init gives up instead of retrying for ever
+	devices_qmc.slave.nacks = QMC_I2C_RETRIES + 1;
+	sim_i2c_get_stats(devices_qmc_bus(), &before);
+	CHECK_EQ(init_qmc(&config), QMC_NACK_ERROR);
+	sim_i2c_get_stats(devices_qmc_bus(), &after);
+	CHECK_EQ(devices_qmc.slave.nacks, 0);
+	CHECK_EQ(after.nacks - before.nacks, QMC_I2C_RETRIES + 1);
+	CHECK_EQ(after.stops - before.stops, QMC_I2C_RETRIES + 1);
+}
@@ -0,0 +1,329 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_ring.c
+ * @brief   Tests of the sample ring filled by the DRDY interrupt. The field the magnetometer model
+ * 			measures steps every millisecond through (k, 2k, 3k), so a sample copied out of the ring
+ * 			while the interrupt writes over it shows up as axes out of that ratio. The simulator
+ * 			takes interrupts between any two accesses, so the readers are preempted the way they
+ * 			are on target.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "devices.h"
+#include "i2c.h"
+#include "ssd1306.h"
+#include "QMC5883L.h"
+
+#define RING_ODR_PERIOD_US		(5000U)//200Hz
+#define RING_FIELD_STEP_US		(1000U)
+#define RING_FIELD_STEPS		(800U)//3*800mG at 2G is still inside 16 bits
+#define RING_LSB_PER_MG			(12)//2G range, auto ranging off
+#define RING_SAMPLES			(100U)
+#define RING_SAMPLE_TIMEOUT_US	(200000U)//QMC_SAMPLE_TIMEOUT_MS of QMC5883L.c
+#define RING_PAGE_US			(3300U)//one display page at 400kHz, the longest a read can wait behind
+#define RING_POP_JITTER_CYCLES	(64U)
+
+static sim_event_t field_event;
+static uint32_t field_step;
+
+/*
+ * Function for a field step, sets the field to (k, 2k, 3k) milligauss
+ *
+ * Parameters:
+ *  context unused
+ *
+ * Returns:
+ *  none
+ */
+static void ring_field_step(void *context)
+{
+	int32_t k = 1 + (field_step++ % RING_FIELD_STEPS);
+	sim_qmc5883l_set_field(&devices_qmc, k, 2*k, 3*k);
+	sim_event_schedule(&field_event, (sim_time_t)RING_FIELD_STEP_US*SIM_CYCLES_PER_US);
+}
+
+/*
+ * Function to bring up the devices with the magnetometer at 200Hz, 2G and the stepping field
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void ring_init()
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;
+	config.rng = RNG_OPTION_2G;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	field_step = 0;
+	sim_event_init(&field_event, ring_field_step, NULL);
+	ring_field_step(NULL);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+}
+
+/*
+ * Function to check a sample was copied whole, its axes come from one field step
+ *
+ * Parameters:
+ *  sample the sample
+ *
+ * Returns:
+ *  none
+ */
+static void ring_check_sample(const qmc_sample_t *sample)
+{
+	CHECK(sample->axis[0] > 0);
+	CHECK_EQ(sample->axis[0] % RING_LSB_PER_MG, 0);
+	CHECK_EQ(sample->axis[1], 2*sample->axis[0]);
+	CHECK_EQ(sample->axis[2], 3*sample->axis[0]);
+}
+
+/*
+ * Function to get the number of samples the interrupt has put in the ring
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  samples read from the device
+ */
+static uint32_t ring_samples()
+{
+	qmc_sample_stats_t stats;
+	qmc_get_sample_stats(&stats);
+	return stats.samples;
+}
+
+/*
+ * Function to check for a sample put in the ring since the last call
+ *
+ * Parameters:
+ *  context(in/out) pointer to the sample count of the last call
+ *
+ * Returns:
+ *  1 if there is a new sample
+ */
+static int ring_new_sample(void *context)
+{
+	uint32_t *last = context;
+	uint32_t samples = ring_samples();
+	if(samples == *last)
+	{
+		return 0;
+	}
+	*last = samples;
+	return 1;
+}
+
+TEST(ring_every_reader_sees_every_sample)
+{
+	qmc_sample_reader_t readers[2];
+	qmc_sample_t sample, last[2];
+	uint32_t popped[2] = {0, 0};
+	uint32_t first;
+
+	ring_init();
+	qmc_sample_reader_init(&readers[0]);
+	qmc_sample_reader_init(&readers[1]);
+	first = ring_samples();
+	while(ring_samples() - first < RING_SAMPLES)
+	{
+		for(int r = 0; r < 2; r++)
+		{//the second reader falls up to 10 samples behind, well inside the ring
+			while((r == 0 || (sim_now_us()/RING_ODR_PERIOD_US) % 10 == 0) && qmc_sample_pop(&readers[r], &sample))
+			{
+				ring_check_sample(&sample);
+				if(popped[r])
+				{
+					CHECK(sample.time_us - last[r].time_us > RING_ODR_PERIOD_US/2);
+					CHECK(sample.time_us - last[r].time_us < RING_ODR_PERIOD_US*3/2);
+				}
+				last[r] = sample;
+				popped[r]++;
+			}
+		}
+		sim_run_us(100);
+	}
+	for(int r = 0; r < 2; r++)
+	{
+		while(qmc_sample_pop(&readers[r], &sample))
+		{
+			popped[r]++;
+		}
+	}
+	CHECK_EQ(popped[0], ring_samples() - first);
+	CHECK_EQ(popped[1], ring_samples() - first);
+	CHECK_EQ(readers[0].overflows, 0);
+	CHECK_EQ(readers[1].overflows, 0);
+	devices_check_bus();
+}
+
+TEST(ring_overflow_counted)
+{
+	qmc_sample_reader_t reader;
+	qmc_sample_t sample;
+	uint32_t first, popped = 0;
+
+	ring_init();
+	qmc_sample_reader_init(&reader);
+	first = ring_samples();
+	sim_run_us((QMC_SAMPLE_RING_LEN + 18)*RING_ODR_PERIOD_US);
+	while(qmc_sample_pop(&reader, &sample))
+	{
+		ring_check_sample(&sample);
+		popped++;
+	}
+	CHECK_EQ(popped, QMC_SAMPLE_RING_LEN);
+	CHECK_EQ(reader.overflows, ring_samples() - first - QMC_SAMPLE_RING_LEN);
+	CHECK(reader.overflows >= 17);
+}
+
+TEST(ring_pop_preempted_by_writer)
+{
+	qmc_sample_reader_t reader;
+	qmc_sample_t sample;
+	uint32_t first, pops = 0, overflows = 0;
+
+	ring_init();
+	sim_run_us((QMC_SAMPLE_RING_LEN + 1)*RING_ODR_PERIOD_US);
+	first = ring_samples();
+	//a reader a whole ring behind copies the slot the interrupt writes next, popped back to back
+	//with a few cycles more between pops each time, so the writes do not stay in step with the
+	//loop and some land in the middle of a pop
+	while(ring_samples() - first < RING_SAMPLES)
+	{
+		sim_advance(pops % RING_POP_JITTER_CYCLES);
+		qmc_sample_reader_init(&reader);
+		reader.tail -= QMC_SAMPLE_RING_LEN;
+		CHECK_EQ(qmc_sample_pop(&reader, &sample), 1);
+		ring_check_sample(&sample);
+		overflows += reader.overflows;
+		pops++;
+	}
+	BENCH("ring_preempted_pops", "%u of %u", overflows, pops);
+	CHECK(overflows > 0);
+}
+
+TEST(ring_stalled_read_aborted)
+{
+	int16_t result[3];
+	uint32_t last_us, max_gap_us = 0, failures = 0;
+	IRQn_Type irq = QMC_I2C_BUS == I2C0 ? I2C0_IRQn : I2C1_IRQn;
+
+	ring_init();
+	CHECK_EQ(qmc_get_nex_raw_sample(result), QMC_OK);
+	//lose the first byte interrupt of the next read, it stays on the bus with nothing to end it
+	sim_run_until((int (*)(void *))sim_qmc5883l_drdy, &devices_qmc, RING_ODR_PERIOD_US*2);
+	sim_write_register((uintptr_t)&NVIC->ICER[0], 4, 1U << irq);
+	CHECK(sim_run_until((int (*)(void *))i2c_engine_busy, QMC_I2C_BUS, 100));
+	while(!(QMC_I2C_BUS->S & I2C_S_IICIF_MASK))
+	{
+		sim_run_us(1);
+	}
+	sim_write_register((uintptr_t)&QMC_I2C_BUS->S, 1, I2C_S_IICIF_MASK);
+	sim_write_register((uintptr_t)&NVIC->ICPR[0], 4, 1U << irq);//the NVIC latched it while it was off
+	sim_write_register((uintptr_t)&NVIC->ISER[0], 4, 1U << irq);
+
+	//sampling goes on once SysTick aborts the read after the I2C timeout, long before the half sample
+	//timeout the consumer would wait it out at. The first sample after it has DOR set, as the device
+	//made samples nobody read while the read was stalled
+	last_us = sim_now_us();
+	for(int i = 0; i < 10; i++)
+	{
+		if(qmc_get_nex_raw_sample(result) != QMC_OK)
+		{
+			failures++;
+		}
+		CHECK_EQ(result[1], 2*result[0]);
+		if(sim_now_us() - last_us > max_gap_us)
+		{
+			max_gap_us = sim_now_us() - last_us;
+		}
+		last_us = sim_now_us();
+	}
+	BENCH("ring_stall_recovery_us", "%u", max_gap_us);
+	CHECK(failures <= 1);
+	CHECK(max_gap_us > I2C_DEFAULT_TIMEOUT_MS*1000U);
+	CHECK(max_gap_us < (I2C_DEFAULT_TIMEOUT_MS + 1)*1000U + RING_ODR_PERIOD_US);
+}
+
+TEST(ring_wait_with_frames)
+{
+	int16_t result[3];
+	sim_time_t start, wait, wait_max = 0;
+
+	ring_init();
+	CHECK_EQ(qmc_get_nex_raw_sample(result), QMC_OK);
+
+	//a read the DRDY interrupt claims while the consumer waits is not taken for a stalled one,
+	//which would wait for the whole frame on the bus
+	for(int i = 0; i < RING_SAMPLES; i++)
+	{
+		if(!ssd1306_frame_in_progress())
+		{
+			CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+		}
+		start = sim_now();
+		CHECK_EQ(qmc_get_nex_raw_sample(result), QMC_OK);
+		wait = sim_now() - start;
+		if(wait > wait_max)
+		{
+			wait_max = wait;
+		}
+	}
+	BENCH("ring_wait_max_us", "%u", (uint32_t)(wait_max/SIM_CYCLES_PER_US));
+	CHECK(wait_max < (RING_ODR_PERIOD_US + RING_PAGE_US)*SIM_CYCLES_PER_US);
+}
+
+TEST(bench_ring_push_pop)
+{
+	qmc_sample_reader_t reader;
+	qmc_sample_t sample;
+	sim_stats_t before, after;
+	qmc_sample_stats_t stats;
+	sim_time_t start, pop_cycles = 0, latest_cycles = 0;
+	uint32_t first, last;
+
+	ring_init();
+	qmc_sample_reader_init(&reader);
+	first = last = ring_samples();
+	sim_get_stats(&before);
+	for(int i = 0; i < RING_SAMPLES; i++)
+	{
+		CHECK(sim_run_until(ring_new_sample, &last, 2*RING_ODR_PERIOD_US));
+		start = sim_now();
+		CHECK_EQ(qmc_sample_pop(&reader, &sample), 1);
+		pop_cycles += sim_now() - start;
+		reader.tail--;
+		start = sim_now();
+		CHECK_EQ(qmc_sample_read_latest(&reader, &sample), 1);
+		latest_cycles += sim_now() - start;
+	}
+	sim_get_stats(&after);
+	qmc_get_sample_stats(&stats);
+	BENCH("ring_pop_cycles", "%u", (uint32_t)(pop_cycles/RING_SAMPLES));
+	BENCH("ring_read_latest_cycles", "%u", (uint32_t)(latest_cycles/RING_SAMPLES));
+	BENCH("ring_drdy_isr_cycles", "%u", (uint32_t)((after.cycles[SIM_EXCEPTION(PORTD_IRQn)] -
+			before.cycles[SIM_EXCEPTION(PORTD_IRQn)])/(ring_samples() - first)));
+	BENCH("ring_isr_us_x100", "%u", stats.isr_us*100/stats.samples);//DRDY interrupt and the read callback which pushes
+}
@@ -0,0 +1,83 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_smoke.c
+ * @brief   Smoke tests of the host simulator, the drivers of source/ bring up the display and the
+ * 			magnetometer models the way main() does and a frame and a sample make it across.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "devices.h"
+#include "ssd1306.h"
+#include "QMC5883L.h"
+
+/*
+ * Function to bring up both devices with a 50Hz, 2G configuration and a fixed field
+ *
+ * Parameters:
+ *  x_mg, y_mg, z_mg field in milligauss
+ *
+ * Returns:
+ *  none
+ */
+static void smoke_init(int32_t x_mg, int32_t y_mg, int32_t z_mg)
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_50HZ;
+	config.rng = RNG_OPTION_2G;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, x_mg, y_mg, z_mg);
+	devices_init(&config);
+	devices_disable_faults();
+}
+
+TEST(smoke_display_frame)
+{
+	static const uint8_t hash[] = {0x14, 0x7F, 0x14, 0x7F, 0x14};//'#' in font.h
+
+	smoke_init(0, 0, 0);
+	CHECK(devices_ssd.display_on);
+	CHECK_EQ(devices_ssd.stats.unknown_cmds, 0);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	CHECK_EQ(devices_ssd.stats.frames, 1);
+
+	CHECK_EQ(ssd1306_write_string_in_buffer(3, 10, "#", 1), SSD1306_OK);
+	CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	CHECK_EQ(devices_ssd.stats.frames, 2);
+	for(int i = 0; i < sizeof(hash); i++)
+	{
+		CHECK_EQ(devices_ssd.gddram[3][10 + i], hash[i]);
+	}
+	CHECK_EQ(devices_ssd.gddram[3][9], 0);
+	CHECK_EQ(devices_ssd.gddram[3][15], 0);
+	devices_check_bus();
+}
+
+TEST(smoke_qmc_sample)
+{
+	int16_t sample[3];
+
+	smoke_init(250, -400, 100);
+	CHECK_EQ(qmc_get_nex_raw_sample(sample), QMC_OK);
+	CHECK_EQ(sample[0], 250*12);//12000 LSB/G at 2G
+	CHECK_EQ(sample[1], -400*12);
+	CHECK_EQ(sample[2], 100*12);
+	CHECK(devices_qmc.stats.data_reads > 0);
+	devices_check_bus();
+}
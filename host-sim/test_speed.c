@@ -0,0 +1,142 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_speed.c
+ * @brief   Tests of the bus speed calculation of i2c.c. i2c_calc_freq_reg() and i2c_calc_scl_freq()
+ * 			have no hardware access and are checked on their own, at the three speed profiles, at the
+ * 			edges of the ICR and MULT selection and over a sweep of requested frequencies, against the
+ * 			divider table of the I2C model. The speed i2c_set_speed() returns is checked against the
+ * 			SCL the I2C model runs at.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+#include "systick.h"
+
+#define NUM_ICR				(64U)
+#define NUM_MULT			(3U)
+#define F_REG(mult, icr)	(I2C_F_MULT(mult) | I2C_F_ICR(icr))
+#define SWEEP_FIRST_HZ		(1000U)
+#define SWEEP_LAST_HZ		(1500000U)
+#define SWEEP_STEP_PERMILLE	(3U)//each step 0.3% above the last, about 2400 requests
+
+/*
+ * Function to check the F register value for a requested frequency, and the SCL it gives
+ *
+ * Parameters:
+ *  scl_hz requested SCL frequency
+ *  freq_reg expected F register value
+ *  expected_hz expected SCL frequency of that value
+ *
+ * Returns:
+ *  none
+ */
+static void speed_check(uint32_t scl_hz, uint8_t freq_reg, uint32_t expected_hz)
+{
+	uint8_t reg = i2c_calc_freq_reg(SIM_BUS_HZ, scl_hz);
+	CHECK_EQ(reg, freq_reg);
+	CHECK_EQ(i2c_calc_scl_freq(SIM_BUS_HZ, reg), expected_hz);
+}
+
+TEST(speed_profiles)
+{
+	//divider 240, 64 and 24 from the 24MHz bus clock, 400kHz has no exact divider
+	speed_check(I2C_SPEED_STANDARD_HZ, F_REG(0, 0x1F), 100000);
+	speed_check(I2C_SPEED_FAST_HZ, F_REG(0, 0x12), 375000);
+	speed_check(I2C_SPEED_FAST_PLUS_HZ, F_REG(0, 0x02), 1000000);
+}
+
+TEST(speed_icr_mult_edges)
+{
+	//one hertz under an exact divider goes to the next larger divider, never over the request
+	speed_check(I2C_SPEED_STANDARD_HZ - 1, F_REG(0, 0x23), 93750);
+	//divider 28 is in the table at ICR 0x04 and 0x08, the first is taken
+	speed_check(SIM_BUS_HZ/28 + 1, F_REG(0, 0x04), SIM_BUS_HZ/28);
+	//faster than the smallest divider gives the fastest setting
+	speed_check(2000000, F_REG(0, 0x00), 1200000);
+	//the largest divider with MULT 1 is 3840, slower requests step MULT up
+	speed_check(SIM_BUS_HZ/3840, F_REG(0, 0x3F), SIM_BUS_HZ/3840);
+	speed_check(SIM_BUS_HZ/3840 - 1, F_REG(1, 0x3B), SIM_BUS_HZ/(2048*2));
+	speed_check(5000, F_REG(1, 0x3D), SIM_BUS_HZ/(2560*2));
+	speed_check(2000, F_REG(2, 0x3E), SIM_BUS_HZ/(3072*4));
+	//past the largest divider with MULT 4 the slowest setting is all there is
+	speed_check(SIM_BUS_HZ/(3840*4), F_REG(2, 0x3F), SIM_BUS_HZ/(3840*4));
+	speed_check(1000, F_REG(2, 0x3F), SIM_BUS_HZ/(3840*4));
+}
+
+TEST(speed_tables_agree)
+{
+	//the divider table of i2c.c against the one of the I2C model, for every F register value
+	for(int mult = 0; mult < NUM_MULT; mult++)
+	{
+		for(int icr = 0; icr < NUM_ICR; icr++)
+		{
+			CHECK_EQ(i2c_calc_scl_freq(SIM_BUS_HZ, F_REG(mult, icr)), SIM_BUS_HZ/sim_i2c_divider(F_REG(mult, icr)));
+		}
+	}
+}
+
+TEST(speed_sweep)
+{
+	uint32_t requests = 0;
+
+	for(uint32_t scl_hz = SWEEP_FIRST_HZ; scl_hz <= SWEEP_LAST_HZ; scl_hz += scl_hz*SWEEP_STEP_PERMILLE/1000 + 1)
+	{
+		uint8_t reg = i2c_calc_freq_reg(SIM_BUS_HZ, scl_hz);
+		uint32_t best_divider = UINT32_MAX;
+		int best_mult = -1;
+
+		//the smallest divider which keeps SCL at or under the request, with the smallest MULT that has one
+		for(int mult = 0; mult < NUM_MULT && best_mult < 0; mult++)
+		{
+			for(int icr = 0; icr < NUM_ICR; icr++)
+			{
+				uint32_t divider = sim_i2c_divider(F_REG(mult, icr));
+				if((uint64_t)divider*scl_hz >= SIM_BUS_HZ && divider < best_divider)
+				{
+					best_divider = divider;
+					best_mult = mult;
+				}
+			}
+		}
+		if(best_mult < 0)
+		{
+			CHECK_EQ(reg, F_REG(NUM_MULT - 1, NUM_ICR - 1));
+		}else{
+			CHECK_EQ(sim_i2c_divider(reg), best_divider);
+			CHECK_EQ((reg & I2C_F_MULT_MASK) >> I2C_F_MULT_SHIFT, best_mult);
+		}
+		requests++;
+	}
+	CHECK(requests > 2000);
+}
+
+TEST(speed_set_on_bus)
+{
+	static const uint32_t limit_hz[] = {I2C_SPEED_STANDARD_HZ, I2C_SPEED_FAST_HZ, I2C_SPEED_FAST_PLUS_HZ};
+
+	init_systick();
+	init_i2c(I2C1);
+	CHECK_EQ(sim_i2c_scl_hz(SIM_I2C1), SIM_BUS_HZ/480);//the probing speed init_i2c() starts at
+	for(i2c_speed_t speed = I2C_SPEED_STANDARD; speed <= I2C_SPEED_FAST_PLUS; speed++)
+	{
+		uint32_t hz = i2c_set_speed(I2C1, speed);
+		CHECK_EQ(I2C1->F, i2c_calc_freq_reg(SIM_BUS_HZ, limit_hz[speed]));
+		CHECK_EQ(sim_i2c_scl_hz(SIM_I2C1), hz);
+		CHECK(hz <= limit_hz[speed]);
+	}
+}
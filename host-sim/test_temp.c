@@ -0,0 +1,235 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_temp.c
+ * @brief   Tests of the temperature binned offsets of QMC5883L.c. The die temperature of the
+ * 			magnetometer model is changed, the driver reads it on its own every QMC_TEMP_PERIOD_MS,
+ * 			and qmc_set_calibration() and qmc_get_calibration() learn and give back the offset for
+ * 			it. The first temperature read, 25C, is the middle of the bins.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "devices.h"
+#include "ssd1306.h"
+#include "QMC5883L.h"
+
+#define TEMP_START_C			(25)//the model starts at 25C
+#define TEMP_READ_WAIT_US		((QMC_TEMP_PERIOD_MS + 500U)*1000U)
+#define TEMP_BIN_C				((1 << QMC_TEMP_BIN_SHIFT)/(double)QMC_TEMP_LSB_PER_C)//10.24C
+#define TEMP_RANDOM_POINTS		(40U)
+
+/*
+ * Function to check the temperature the driver read against the one the test waits for
+ *
+ * Parameters:
+ *  context pointer to the raw temperature waited for
+ *
+ * Returns:
+ *  1 once the driver read it
+ */
+static int temp_read(void *context)
+{
+	int16_t tout;
+	return qmc_get_temperature(&tout) == QMC_OK && tout == *(int16_t *)context;
+}
+
+/*
+ * Function to change the die temperature and wait for the driver to read it
+ *
+ * Parameters:
+ *  celsius the temperature
+ *
+ * Returns:
+ *  none
+ */
+static void temp_set(int16_t celsius)
+{
+	int16_t tout = celsius*QMC_TEMP_LSB_PER_C;
+
+	sim_qmc5883l_set_temperature(&devices_qmc, celsius);
+	CHECK(sim_run_until(temp_read, &tout, TEMP_READ_WAIT_US));
+}
+
+/*
+ * Function to bring up the devices with the magnetometer at 200Hz and 8G, and wait for the first
+ * temperature read
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void temp_init()
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.odr = ODR_OPTION_200HZ;
+	config.rng = RNG_OPTION_8G;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_attach();
+	sim_qmc5883l_set_field(&devices_qmc, 200, 0, 300);
+	devices_init(&config);
+	devices_disable_faults();
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	temp_set(TEMP_START_C);
+}
+
+/*
+ * Function to set the calibration offset for the current temperature, keeping the matrix
+ *
+ * Parameters:
+ *  x, y, z the offset
+ *
+ * Returns:
+ *  none
+ */
+static void temp_learn(int16_t x, int16_t y, int16_t z)
+{
+	qmc_calibration_data_t cal;
+
+	qmc_get_calibration(&cal);
+	cal.offset[AXIS_X] = x;
+	cal.offset[AXIS_Y] = y;
+	cal.offset[AXIS_Z] = z;
+	qmc_set_calibration(&cal);
+}
+
+/*
+ * Function to check the calibration offset the driver uses at the current temperature
+ *
+ * Parameters:
+ *  x, y, z the offset expected
+ *  tolerance largest difference allowed per axis, LSB
+ *
+ * Returns:
+ *  none
+ */
+static void temp_check(int32_t x, int32_t y, int32_t z, int32_t tolerance)
+{
+	qmc_calibration_data_t cal;
+	int32_t expected[3] = {x, y, z};
+
+	qmc_get_calibration(&cal);
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		if(cal.offset[i] - expected[i] > tolerance || cal.offset[i] - expected[i] < -tolerance)
+		{
+			CHECK_EQ(cal.offset[i], expected[i]);//fails with both values printed
+		}
+	}
+}
+
+TEST(temp_learn_then_interpolate)
+{
+	temp_init();
+
+	//learned at 25C and 35C, 30C is half way between
+	temp_learn(100, -200, 40);
+	temp_set(35);
+	temp_check(100, -200, 40, 0);//only the 25C bin learned so far, held
+	temp_learn(160, -260, 40);
+	temp_check(160, -260, 40, 1);
+	temp_set(30);
+	temp_check(130, -230, 40, 1);
+	temp_set(25);
+	temp_check(100, -200, 40, 1);
+	temp_set(33);
+	temp_check(148, -248, 40, 1);
+
+	//learning again at a temperature moves the line through it, the other bin keeps its value
+	temp_set(35);
+	temp_learn(170, -250, 30);
+	temp_check(170, -250, 30, 1);
+	temp_set(25);
+	temp_check(100, -200, 40, 1);
+	devices_check_bus();
+}
+
+TEST(temp_hold_nearest_bin)
+{
+	qmc_calibration_data_t cal, held;
+
+	temp_init();
+	temp_learn(100, -200, 40);
+	temp_set(35);
+	temp_learn(160, -260, 40);
+
+	//past the learned bins on the hot side the 35C bin is held, its value is on the line at 35.24C
+	temp_set(55);
+	temp_check(100 + 60*TEMP_BIN_C/10, -200 - 60*TEMP_BIN_C/10, 40, 1);
+	qmc_get_calibration(&held);
+	temp_set(60);
+	qmc_get_calibration(&cal);
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		CHECK_EQ(cal.offset[i], held.offset[i]);
+	}
+
+	//and on the cold side the 25C bin
+	temp_set(5);
+	temp_check(100, -200, 40, 0);
+	temp_set(0);
+	temp_check(100, -200, 40, 0);
+	devices_check_bus();
+}
+
+TEST(temp_end_of_range_clamp)
+{
+	temp_init();
+	temp_learn(100, -200, 40);
+
+	//below the first bin the position stops at it, the 25C bin is the nearest learned one
+	temp_set(TEMP_START_C - 60);
+	temp_check(100, -200, 40, 0);
+
+	//above the last bin the position stops at it, so what is learned there holds at any hotter temperature
+	temp_set(TEMP_START_C + 60);
+	temp_learn(300, -100, 0);
+	temp_check(300, -100, 0, 0);
+	temp_set(TEMP_START_C + 90);
+	temp_check(300, -100, 0, 0);
+	temp_set(TEMP_START_C + 120);
+	temp_check(300, -100, 0, 0);
+
+	//and 25C is still what it learned
+	temp_set(TEMP_START_C);
+	temp_check(100, -200, 40, 0);
+	devices_check_bus();
+}
+
+TEST(temp_learn_random_points)
+{
+	uint32_t seed = 5;
+	int16_t celsius, offset[3];
+
+	temp_init();
+	for(int n = 0; n < TEMP_RANDOM_POINTS; n++)
+	{
+		seed = seed*1664525U + 1013904223U;
+		celsius = TEMP_START_C - 40 + (int16_t)((seed >> 16) % 71);//-15C to 55C
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			seed = seed*1664525U + 1013904223U;
+			offset[i] = (int16_t)((seed >> 16) % 1001) - 500;
+		}
+		temp_set(celsius);
+		temp_learn(offset[AXIS_X], offset[AXIS_Y], offset[AXIS_Z]);
+		//every offset learned is given back at its temperature
+		temp_check(offset[AXIS_X], offset[AXIS_Y], offset[AXIS_Z], 1);
+	}
+	devices_check_bus();
+}
@@ -0,0 +1,404 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    test_trace.c
+ * @brief   Tests of the bus trace of i2c.c, run in the trace build. The trace is read back from the
+ * 			lines i2c_trace_dump() prints. A capture is replayed by running the same driver calls
+ * 			against slaves which answer from the trace instead of the device models, and the trace
+ * 			of the replay has to match the capture event for event and microsecond for microsecond.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "test.h"
+#include "sim.h"
+#include "sim_i2c.h"
+#include "devices.h"
+#include "i2c.h"
+#include "ssd1306.h"
+#include "systick.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/wait.h"
+
+#ifdef I2C_TRACE
+#define CHIP_ID_REG			(0x0DU)
+#define CHIP_ID				(0xFFU)
+#define TRACE_MAX_ENTRIES	(1024U)
+#define TRACE_SAMPLES		(4U)
+#define TRACE_ODR_WAIT_US	(4800U)//a little less than one period at 200Hz, the status register is polled for the rest
+#define TRACE_INIT_NACKS	(1U)//the capture has the magnetometer retry its first write
+
+typedef struct{
+	i2c_trace_entry_t entries[TRACE_MAX_ENTRIES];
+	uint32_t count;
+}trace_log_t;
+
+typedef struct{
+	const trace_log_t *log;
+	uint8_t bus;
+	uint32_t next;//first entry not replayed yet
+	uint32_t dma_left;//bytes of the DMA entry at next not written yet
+	uint32_t diverged;//bytes and acks the driver asked for which are not in the trace
+}trace_cursor_t;
+
+typedef struct{
+	sim_i2c_slave_t slave;//first member, the I2C model hands it back
+	trace_cursor_t *cursor;
+}trace_slave_t;
+
+static trace_log_t replayed;
+static trace_cursor_t cursors[SIM_NUM_I2C];
+static trace_slave_t replay_ssd, replay_qmc;
+
+/*
+ * Function to run i2c_trace_dump() with the console going to a file and add the lines to a log
+ *
+ * Parameters:
+ *  log(out) the log the entries are added to
+ *
+ * Returns:
+ *  none
+ */
+static void trace_read_dump(trace_log_t *log)
+{
+	FILE *file = tmpfile();
+	int console = dup(STDOUT_FILENO);
+	char line[80];
+	unsigned count = 0, time_us, bus, event, data;
+
+	CHECK(file != NULL);
+	fflush(stdout);
+	dup2(fileno(file), STDOUT_FILENO);
+	i2c_trace_dump();
+	fflush(stdout);
+	dup2(console, STDOUT_FILENO);
+	close(console);
+
+	rewind(file);
+	CHECK(fgets(line, sizeof(line), file) != NULL);
+	CHECK_EQ(sscanf(line, "I2C TRACE %u", &count), 1);
+	CHECK(count < I2C_TRACE_LEN);//the ring did not wrap, nothing was lost
+	while(fgets(line, sizeof(line), file))
+	{
+		CHECK_EQ(sscanf(line, "%x %x %x %x", &time_us, &bus, &event, &data), 4);
+		CHECK(log->count < TRACE_MAX_ENTRIES);
+		log->entries[log->count].time_us = time_us;
+		log->entries[log->count].bus = bus;
+		log->entries[log->count].event = event;
+		log->entries[log->count].data = data;
+		log->count++;
+		count--;
+	}
+	fclose(file);
+	CHECK_EQ(count, 0);
+}
+
+/*
+ * Function for the driver calls which are captured and replayed: bring up both devices in the
+ * order main() does, read samples by polling the status register and send a frame. The trace is
+ * read after every step, so the ring never wraps
+ *
+ * Parameters:
+ *  log(out) the trace
+ *  samples(out) the samples the driver read
+ *
+ * Returns:
+ *  none
+ */
+static void trace_scenario(trace_log_t *log, int16_t samples[TRACE_SAMPLES][3])
+{
+	qmc_config_t config;
+
+	devices_main_config(&config);
+	config.int_enb = INT_ENB_DISABLE;
+	config.odr = ODR_OPTION_200HZ;
+	config.auto_rng = AUTO_RNG_DISABLE;
+	devices_init(&config);
+	trace_read_dump(log);
+	for(int i = 0; i < TRACE_SAMPLES; i++)
+	{
+		sim_run_us(TRACE_ODR_WAIT_US);
+		CHECK_EQ(qmc_get_nex_raw_sample(samples[i]), QMC_OK);
+		trace_read_dump(log);
+	}
+	CHECK_EQ(ssd1306_write_string_in_buffer(0, 0, "TRACE", 5), SSD1306_OK);
+	CHECK_EQ(ssd1306_update_display(), SSD1306_OK);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	trace_read_dump(log);
+}
+
+/*
+ * Function to move a cursor to the next byte on its bus. Starts, stops and recoveries are left to
+ * the bus model, only what the slave sends or answers is replayed
+ *
+ * Parameters:
+ *  cursor the cursor
+ *
+ * Returns:
+ *  the entry, NULL at the end of the log
+ */
+static const i2c_trace_entry_t* trace_peek(trace_cursor_t *cursor)
+{
+	while(cursor->next < cursor->log->count)
+	{
+		const i2c_trace_entry_t *entry = &cursor->log->entries[cursor->next];
+		if(entry->bus == cursor->bus && (entry->event == I2C_TRACE_TX || entry->event == I2C_TRACE_RX ||
+				entry->event == I2C_TRACE_ACK || entry->event == I2C_TRACE_NACK || entry->event == I2C_TRACE_DMA))
+		{
+			return entry;
+		}
+		cursor->next++;
+	}
+	return NULL;
+}
+
+/*
+ * Function to get the answer of the slave to a byte. A byte the driver handed on to the DMA
+ * channel has no entry of its own and is acked
+ *
+ * Parameters:
+ *  cursor the cursor, past the byte
+ *
+ * Returns:
+ *  1 to ack
+ */
+static int trace_take_ack(trace_cursor_t *cursor)
+{
+	const i2c_trace_entry_t *entry = trace_peek(cursor);
+	if(entry != NULL && (entry->event == I2C_TRACE_ACK || entry->event == I2C_TRACE_NACK))
+	{
+		cursor->next++;
+		return entry->event == I2C_TRACE_ACK;
+	}
+	return 1;
+}
+
+/*
+ * Function to replay a byte written by the driver, the address byte included
+ *
+ * Parameters:
+ *  cursor the cursor
+ *  byte the byte on the bus
+ *
+ * Returns:
+ *  1 to ack
+ */
+static int trace_replay_write(trace_cursor_t *cursor, uint8_t byte)
+{
+	const i2c_trace_entry_t *entry = trace_peek(cursor);
+
+	if(entry != NULL && entry->event == I2C_TRACE_DMA)
+	{
+		if(cursor->dma_left == 0)
+		{
+			cursor->dma_left = entry->data;
+		}
+		if(--cursor->dma_left > 0)
+		{
+			return 1;
+		}
+		cursor->next++;
+		return trace_take_ack(cursor);//the driver checks the ack of the last one
+	}
+	if(entry == NULL || entry->event != I2C_TRACE_TX || entry->data != byte)
+	{
+		cursor->diverged++;
+		return 1;
+	}
+	cursor->next++;
+	return trace_take_ack(cursor);
+}
+
+/*
+ * Function for a replay slave being addressed after a start
+ *
+ * Parameters:
+ *  slave the replay slave
+ *  read 1 for a read, 0 for a write
+ *
+ * Returns:
+ *  1 to ack
+ */
+static int trace_slave_start(sim_i2c_slave_t *slave, int read)
+{
+	return trace_replay_write(((trace_slave_t *)slave)->cursor, (slave->addr << 1) | read);
+}
+
+/*
+ * Function for a byte written to a replay slave
+ *
+ * Parameters:
+ *  slave the replay slave
+ *  byte the byte written
+ *
+ * Returns:
+ *  1 to ack
+ */
+static int trace_slave_write(sim_i2c_slave_t *slave, uint8_t byte)
+{
+	return trace_replay_write(((trace_slave_t *)slave)->cursor, byte);
+}
+
+/*
+ * Function to give the driver the byte the device sent in the capture
+ *
+ * Parameters:
+ *  slave the replay slave
+ *
+ * Returns:
+ *  the byte
+ */
+static uint8_t trace_slave_read(sim_i2c_slave_t *slave)
+{
+	trace_cursor_t *cursor = ((trace_slave_t *)slave)->cursor;
+	const i2c_trace_entry_t *entry = trace_peek(cursor);
+
+	if(entry == NULL || entry->event != I2C_TRACE_RX)
+	{
+		cursor->diverged++;
+		return 0xFF;
+	}
+	cursor->next++;
+	return entry->data;
+}
+
+/*
+ * Function to put a replay slave on the bus of the device it stands in for
+ *
+ * Parameters:
+ *  slave(out) the replay slave
+ *  device the device
+ *  log the captured trace
+ *
+ * Returns:
+ *  none
+ */
+static void trace_slave_attach(trace_slave_t *slave, const i2c_device_t *device, const trace_log_t *log)
+{
+	sim_i2c_bus_t bus = (device->bus == I2C0) ? SIM_I2C0 : SIM_I2C1;
+
+	memset(slave, 0, sizeof(*slave));
+	slave->slave.addr = device->addr;
+	slave->slave.start = trace_slave_start;
+	slave->slave.write = trace_slave_write;
+	slave->slave.read = trace_slave_read;
+	slave->cursor = &cursors[bus];
+	cursors[bus].log = log;
+	cursors[bus].bus = bus;
+	sim_i2c_attach(bus, &slave->slave);
+}
+
+TEST(trace_capture_read)
+{
+	static const uint8_t reg = CHIP_ID_REG;
+	static const uint8_t expected[][2] = {
+		{I2C_TRACE_START, 0}, {I2C_TRACE_TX, QMC_DEVICE_ADDR << 1}, {I2C_TRACE_ACK, 0},
+		{I2C_TRACE_TX, CHIP_ID_REG}, {I2C_TRACE_ACK, 0}, {I2C_TRACE_RSTART, 0},
+		{I2C_TRACE_TX, (QMC_DEVICE_ADDR << 1) | 1}, {I2C_TRACE_ACK, 0},
+		{I2C_TRACE_STOP, 0}, {I2C_TRACE_RX, CHIP_ID},//STOP is set before the last byte is read out of D
+		{I2C_TRACE_START, 0}, {I2C_TRACE_TX, QMC_DEVICE_ADDR << 1}, {I2C_TRACE_NACK, 0}, {I2C_TRACE_STOP, 0},
+	};
+	static trace_log_t log;
+	qmc_config_t config;
+	uint8_t id;
+	uint32_t start_us, end_us;
+
+	devices_main_config(&config);
+	config.mode = MODE_OPTION_STANDBY;
+	devices_attach();
+	devices_init(&config);
+	CHECK_EQ(ssd1306_wait_frame(), SSD1306_OK);
+	trace_read_dump(&log);
+	log.count = 0;
+
+	start_us = now_us();
+	CHECK_EQ(i2c_transfer(QMC_I2C_BUS, QMC_DEVICE_ADDR, &reg, 1, &id, 1, 0), I2C_STATUS_OK);
+	devices_qmc.slave.nacks = 1;
+	CHECK_EQ(i2c_transfer(QMC_I2C_BUS, QMC_DEVICE_ADDR, &reg, 1, &id, 1, 0), I2C_STATUS_NACK);
+	end_us = now_us();
+	trace_read_dump(&log);
+
+	CHECK_EQ(log.count, sizeof(expected)/sizeof(expected[0]));
+	for(int i = 0; i < log.count; i++)
+	{
+		CHECK_EQ(log.entries[i].bus, (QMC_I2C_BUS == I2C0) ? 0 : 1);
+		CHECK_EQ(log.entries[i].event, expected[i][0]);
+		CHECK_EQ(log.entries[i].data, expected[i][1]);
+		CHECK(log.entries[i].time_us >= ((i == 0) ? start_us : log.entries[i - 1].time_us));
+		CHECK(log.entries[i].time_us <= end_us);
+	}
+
+	//an emptied ring starts over
+	trace_read_dump(&log);
+	CHECK_EQ(log.count, sizeof(expected)/sizeof(expected[0]));
+}
+
+TEST(trace_replay)
+{
+	trace_log_t *captured = mmap(NULL, sizeof(trace_log_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	int16_t (*captured_samples)[3] = mmap(NULL, TRACE_SAMPLES*sizeof(*captured_samples), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	int16_t samples[TRACE_SAMPLES][3];
+	uint32_t nacks = 0;
+	int status;
+	pid_t pid;
+
+	CHECK(captured != MAP_FAILED && captured_samples != MAP_FAILED);
+
+	//the capture runs in a process of its own, the replay starts from drivers that were never run
+	fflush(stdout);
+	pid = fork();
+	CHECK(pid >= 0);
+	if(pid == 0)
+	{
+		devices_attach();
+		sim_qmc5883l_set_field(&devices_qmc, 210, -340, 450);
+		devices_qmc.slave.nacks = TRACE_INIT_NACKS;
+		trace_scenario(captured, captured_samples);
+		exit(0);
+	}
+	waitpid(pid, &status, 0);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	for(int i = 0; i < captured->count; i++)
+	{
+		nacks += (captured->entries[i].event == I2C_TRACE_NACK);
+	}
+	CHECK_EQ(nacks, TRACE_INIT_NACKS);
+	CHECK(captured_samples[0][0] != 0);
+
+	trace_slave_attach(&replay_ssd, &ssd1306_i2c_device, captured);
+	trace_slave_attach(&replay_qmc, &qmc_i2c_device, captured);
+	trace_scenario(&replayed, samples);
+
+	//the driver read what the devices sent in the capture, and did the same on the bus at the same time
+	CHECK_EQ(memcmp(samples, captured_samples, sizeof(samples)), 0);
+	CHECK_EQ(cursors[SIM_I2C0].diverged + cursors[SIM_I2C1].diverged, 0);
+	CHECK_EQ(replayed.count, captured->count);
+	for(int i = 0; i < replayed.count; i++)
+	{
+		CHECK_EQ(replayed.entries[i].time_us, captured->entries[i].time_us);
+		CHECK_EQ(replayed.entries[i].bus, captured->entries[i].bus);
+		CHECK_EQ(replayed.entries[i].event, captured->entries[i].event);
+		CHECK_EQ(replayed.entries[i].data, captured->entries[i].data);
+	}
+	for(sim_i2c_bus_t bus = SIM_I2C0; bus < SIM_NUM_I2C; bus++)
+	{
+		CHECK(cursors[bus].log == NULL || trace_peek(&cursors[bus]) == NULL);
+	}
+	devices_check_bus();
+	BENCH("trace_replay_entries", "%u", replayed.count);
+}
+#endif
@@ -18,110 +18,167 @@
  */
 #include "i2c.h"
 #include "QMC5883L.h"
+#include "mag_cal.h"
+#include "arm_math.h"
 #include "fsl_debug_console.h"
 #include "systick.h"
 
 #define BYTE_SHIFT 8
 #define NUM_DOUT_BUFFER 6
+#define NUM_SAMPLE_BUFFER (NUM_DOUT_BUFFER + 1)//status register followed by the data registers
+#define SAMPLE_SR_IDX 0
+#define SAMPLE_DOUT_IDX 1
+#define NUM_CONFIG_REGS 3//CR1, CR2 and SRS period are consecutive
+#define QMC_MAX_WRITE_LEN NUM_CONFIG_REGS
+#define CONFIG_CR1_IDX (QMC_CR1_ADDR - QMC_CR1_ADDR)
+#define CONFIG_CR2_IDX (QMC_CR2_ADDR - QMC_CR1_ADDR)
+#define CONFIG_SRS_IDX (QMC_SRS_PERIOD_ADDR - QMC_CR1_ADDR)
+#define QMC_SAMPLE_TIMEOUT_MS 200//twice the sample period at the slowest odr
+#define QMC_STALLED_READ_MS (QMC_SAMPLE_TIMEOUT_MS/2)//aborted within the wait of a consumer, which then gets its sample
+#define QMC_DRDY_IRQ_PRIORITY 2//below systick, so that the edge timestamps come from a running clock
+#define QMC_DRDY_PIN_MASK (1U << QMC_DRDY_PIN)
+#define PORT_IRQC_RISING_EDGE 0x9
+#define GPIO_PIN_ALT_FUNC_NUM 1
+#define NUM_TOUT_BUFFER 2
+#define US_PER_MS 1000
+#define TEMP_BIN_SIZE (1 << QMC_TEMP_BIN_SHIFT)
+#define TEMP_BIN_MASK (TEMP_BIN_SIZE - 1)
+#define TEMP_POS_MAX ((QMC_TEMP_NUM_BINS - 1) << QMC_TEMP_BIN_SHIFT)
+#define RNG_SCALE_SHIFT 2//8G LSB are 4 2G LSB
+#define CAL_2G_INPUT_SHIFT 1//2G LSB are halved for the fit, keeps the earth field inside MAG_CAL_MAX_INPUT
+
+const i2c_device_t qmc_i2c_device = {
+		.bus = QMC_I2C_BUS,
+		.addr = QMC_DEVICE_ADDR,
+		.max_speed = QMC_MAX_I2C_SPEED,
+		.retries = QMC_I2C_RETRIES,
+};
+
+static qmc_sample_stats_t sample_stats;
+
+static uint8_t drdy_enabled;
+static uint8_t rol_pnt_enabled;
+static uint32_t sample_time_us;
+
+//last values written to the configuration registers, setters skip the bus when nothing changes
+static uint8_t config_regs[NUM_CONFIG_REGS];
+static uint8_t config_regs_synced;
+static volatile uint8_t cr1_busy;//CR1 write from thread context in progress, auto ranging waits for it
+
+//auto ranging, the range is changed by a single CR1 write started from the sample read callback
+static uint8_t auto_range_enabled;
+static qmc_cr1_rng_options_t unit_rng;//range whose LSB the samples are given in
+static qmc_cr1_rng_options_t cal_rng = QMC_CAL_RNG;//range whose LSB the calibration offsets are in
+static volatile qmc_cr1_rng_options_t sample_rng;//range the device measures at
+static volatile uint8_t range_discard;//the next sample was measured across a range change
+static uint8_t range_quiet;//samples in a row that would fit the 2G range
+static void qmc_range_done(i2c_xfer_t *xfer);
+static uint8_t range_cr1;
+static i2c_xfer_t range_xfer = {
+		.addr = QMC_DEVICE_ADDR,
+		.flags = I2C_XFER_FLAG_HIGH_PRIORITY,
+		.cmd = {QMC_CR1_ADDR},
+		.cmd_len = 1,
+		.tx = &range_cr1,
+		.tx_len = 1,
+		.callback = qmc_range_done,
+};
+
+static void qmc_sample_done(i2c_xfer_t *xfer);
+static void qmc_temp_done(i2c_xfer_t *xfer);
+
+//read started by the DRDY interrupt, status and data in one burst with the rollover pointer
+static uint8_t sample_xfer_buffer[NUM_SAMPLE_BUFFER];
+static uint32_t sample_xfer_time_us;
+static i2c_xfer_t sample_xfer = {
+		.addr = QMC_DEVICE_ADDR,
+		.flags = I2C_XFER_FLAG_HIGH_PRIORITY,
+		.cmd = {QMC_SR_ADDR},
+		.cmd_len = 1,
+		.rx = sample_xfer_buffer,
+		.rx_len = NUM_SAMPLE_BUFFER,
+		.callback = qmc_sample_done,
+};
+
+//samples written by the interrupt at head, each reader follows with its own tail
+static qmc_sample_t sample_ring[QMC_SAMPLE_RING_LEN];
+static volatile uint32_t sample_ring_head;
+static qmc_sample_reader_t nex_sample_reader;//used by qmc_get_nex_raw_sample()
+
+//temperature read chained to a sample read, at most once every QMC_TEMP_PERIOD_MS
+static uint8_t temp_xfer_buffer[NUM_TOUT_BUFFER];
+static i2c_xfer_t temp_xfer = {
+		.addr = QMC_DEVICE_ADDR,
+		.flags = I2C_XFER_FLAG_HIGH_PRIORITY,
+		.cmd = {QMC_TOUT_LSB_ADDR},
+		.cmd_len = 1,
+		.rx = temp_xfer_buffer,
+		.rx_len = NUM_TOUT_BUFFER,
+		.callback = qmc_temp_done,
+};
+static uint32_t temp_read_time_us;
+static volatile int16_t temperature;
+static volatile uint8_t temperature_read;
+static volatile uint8_t temperature_updated;//set on each read, cleared once the offset follows it
+
+//hard iron offset per temperature bin, used from thread context only
+static int16_t temp_bin_offset[QMC_TEMP_NUM_BINS][3];
+static uint8_t temp_bin_valid;//bit per bin
+static int16_t temp_ref;//first temperature read, in the middle of the bins
+static int32_t temp_pos;//position of the current temperature in the bins, bin number in the top bits
+static uint8_t temp_pos_valid;
 
 qmc_calibration_data_t calibration_data = {
-		.offset_x = OFFSET_X,
-		.offset_y = OFFSET_Y,
-		.offset_z = OFFSET_Z,
-		.scale_x = SCALE_X,
-		.scale_y = SCALE_Y,
-		.scale_z = SCALE_Z,
+		.offset = {OFFSET_X, OFFSET_Y, OFFSET_Z},
+		.matrix = {
+				{QMC_CAL_Q14(SCALE_X), 0, 0},
+				{0, QMC_CAL_Q14(SCALE_Y), 0},
+				{0, 0, QMC_CAL_Q14(SCALE_Z)},
+		},
 };
 
 /*
- * Function to write specified data into the specified register on
- * the qmc5883l
+ * Function to write consecutive registers on the qmc5883l in one transaction, starting
+ * from the specified register. The register pointer of the qmc5883l increments after each byte
  *
  * Parameters:
- *  reg the address of the register where data has to be written
- *  data the data that has to written
+ *  reg the address of the register from which data write starts
+ *  data(in) pointer to byte array with the data that has to be written
+ *  data_len number of bytes to write, at most QMC_MAX_WRITE_LEN
  *
  * Returns:
  *  1 for success
  *  0 for failure
  */
-qmc_error_t qmc_i2c_write_reg(uint8_t reg,uint8_t data)
+qmc_error_t qmc_i2c_write_regs(uint8_t reg,const uint8_t data[],uint8_t data_len)
 {
-	I2C_TRANSMIT_MODE();
-	I2C_START();
-	I2C_SEND_BYTE(I2C_GET_ADDRESS(QMC_DEVICE_ADDR, I2C_WRITE));
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
-	{
-		return QMC_NACK_ERROR;
-	}
-
-	I2C_SEND_BYTE(reg);
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
+	uint8_t tx[QMC_MAX_WRITE_LEN + 1] = {reg};
+	for(int i = 0; i < data_len; i++)
 	{
-		return QMC_NACK_ERROR;
+		tx[i + 1] = data[i];
 	}
-
-	I2C_SEND_BYTE(data);
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
+	if(i2c_transfer(QMC_I2C_BUS, QMC_DEVICE_ADDR, tx, data_len + 1, NULL, 0, 0) != I2C_STATUS_OK)
 	{
 		return QMC_NACK_ERROR;
 	}
-
-	I2C_STOP();
-
-
 	return QMC_OK;
 }
 
 /*
- * Function to read data from a specific register on the qmc5883l
+ * Function to write specified data into the specified register on
+ * the qmc5883l
  *
  * Parameters:
- *  reg the address of the register from which data has to read
- *	data(out) pointer to byte to store the data that was read
+ *  reg the address of the register where data has to be written
+ *  data the data that has to written
  *
  * Returns:
  *  1 for success
  *  0 for failure
  */
-qmc_error_t qmc_i2c_read_reg(uint8_t reg,uint8_t* data)
+qmc_error_t qmc_i2c_write_reg(uint8_t reg,uint8_t data)
 {
-	I2C_TRANSMIT_MODE();
-	I2C_START();
-	I2C_SEND_BYTE(I2C_GET_ADDRESS(QMC_DEVICE_ADDR, I2C_WRITE));
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
-	{
-		return QMC_NACK_ERROR;
-	}
-
-	I2C_SEND_BYTE(reg);
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
-	{
-		return QMC_NACK_ERROR;
-	}
-
-	I2C_RSTART();
-	I2C_SEND_BYTE(I2C_GET_ADDRESS(QMC_DEVICE_ADDR,I2C_READ));
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
-	{
-		return QMC_NACK_ERROR;
-	}
-	I2C_RECEIVE_MODE();
-	I2C_TX_NACK();
-
-	*data = I2C1->D;//to start receive action of i2c
-	I2C_WAIT_IICIF();
-
-	I2C_STOP();
-	*data = I2C1->D;//data will be available now
-
-	return QMC_OK;
+	return qmc_i2c_write_regs(reg, &data, 1);
 }
 
 /*
@@ -142,50 +199,86 @@ qmc_error_t qmc_i2c_read_reg(uint8_t reg,uint8_t* data)
  */
 qmc_error_t qmc_i2c_read_regs(uint8_t reg,uint8_t buf[],uint8_t buf_len)
 {
-	I2C_TRANSMIT_MODE();
-	I2C_START();
-	I2C_SEND_BYTE(I2C_GET_ADDRESS(QMC_DEVICE_ADDR, I2C_WRITE));
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
+	//queued ahead of display traffic, so a read waits for at most one display page
+	i2c_xfer_t xfer = {
+			.addr = QMC_DEVICE_ADDR,
+			.flags = I2C_XFER_FLAG_HIGH_PRIORITY,
+			.cmd = {reg},
+			.cmd_len = 1,
+			.rx = buf,
+			.rx_len = buf_len,
+	};
+	if(i2c_submit_and_wait(QMC_I2C_BUS, &xfer) != I2C_STATUS_OK)
 	{
 		return QMC_NACK_ERROR;
 	}
+	return QMC_OK;
+}
 
-	I2C_SEND_BYTE(reg);
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
-	{
-		return QMC_NACK_ERROR;
-	}
+/*
+ * Function to read data from a specific register on the qmc5883l
+ *
+ * Parameters:
+ *  reg the address of the register from which data has to read
+ *	data(out) pointer to byte to store the data that was read
+ *
+ * Returns:
+ *  1 for success
+ *  0 for failure
+ */
+qmc_error_t qmc_i2c_read_reg(uint8_t reg,uint8_t* data)
+{
+	return qmc_i2c_read_regs(reg, data, 1);
+}
 
-	I2C_RSTART();
-	I2C_SEND_BYTE(I2C_GET_ADDRESS(QMC_DEVICE_ADDR,I2C_READ));
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
+/*
+ * Function to write consecutive registers on the qmc5883l, retrying failed writes up to the retry
+ * budget of the device
+ *
+ * Parameters:
+ *  reg the address of the register from which data write starts
+ *  data(in) pointer to byte array with the data that has to be written
+ *  data_len number of bytes to write, at most QMC_MAX_WRITE_LEN
+ *
+ * Returns:
+ *  1 for success
+ *  0 for failure
+ */
+static qmc_error_t qmc_i2c_write_regs_retry(uint8_t reg,const uint8_t data[],uint8_t data_len)
+{
+	for(int attempt = 0; attempt <= qmc_i2c_device.retries; attempt++)
 	{
-		return QMC_NACK_ERROR;
+		if(qmc_i2c_write_regs(reg, data, data_len) == QMC_OK)
+		{
+			return QMC_OK;
+		}
 	}
-	I2C_RECEIVE_MODE();
+	return QMC_NACK_ERROR;
+}
 
-	int i = 0;
-	while(i < buf_len)
+/*
+ * Function to read multiple registers on the qmc5883l, retrying failed reads up to the retry
+ * budget of the device
+ *
+ * Parameters:
+ *  reg the address of the register from which data read starts
+ *	buf(out) pointer to byte array to store the data that was read
+ *	buf_len	number of bytes to read from the device, must be equal to len(buf)
+ *
+ * Returns:
+ *  1 for success
+ *  0 for failure
+ */
+static qmc_error_t qmc_i2c_read_regs_retry(uint8_t reg,uint8_t buf[],uint8_t buf_len)
+{
+	for(int attempt = 0; attempt <= qmc_i2c_device.retries; attempt++)
 	{
-		if(i == buf_len-1)
-		{//if on last read, master transmits nack to stop reading
-			I2C_TX_NACK();
-		}else{
-			I2C_TX_ACK();
-		}
-		buf[i] = I2C1->D;//to start receive action of i2c
-		I2C_WAIT_IICIF();
-		if(i == buf_len - 1)
+		if(qmc_i2c_read_regs(reg, buf, buf_len) == QMC_OK)
 		{
-			I2C_STOP();//if not stopped here, reading d will start next fetch
+			return QMC_OK;
 		}
-		buf[i] = I2C1->D;//data will be available now
-		i++;
 	}
-	return QMC_OK;
+	return QMC_NACK_ERROR;
 }
 
 /*
@@ -457,168 +550,1207 @@ static inline int16_t concatenate_bytes(uint8_t MSB, uint8_t LSB)
 }
 
 /*
- *	Function to process raw data from the registers of the IC to form 16-bit signed
- *	result. Register 0 is X_LSB and 1 is X_MSB, put together they form a 16-bit signed
- *	variable representing the reading at the x-axis
+ *	Function to process a sample read from the registers of the IC. The first byte is the status
+ *	register, followed by the data registers starting at X_LSB. Register 0 is X_LSB and 1 is X_MSB,
+ *	put together they form a 16-bit signed variable representing the reading at the x-axis. The
+ *	axes are only decoded when the status register has DRDY set
  *
  * Parameters:
- * 	data(in) pointer to raw byte data of 6 register(MSB and LSB register for each axis: x,y,z)
+ * 	data(in) pointer to the status byte and raw byte data of 6 register(MSB and LSB register for each axis: x,y,z)
  * 	result(out) pointer to signed 16-bit result
  *
  * Returns:
- *  none
+ *  the status register
  */
-void process_raw_data(uint8_t data[],int16_t result[])
+uint8_t process_raw_data(uint8_t data[],int16_t result[])
 {
 	uint8_t MSB, LSB;
+	uint8_t sr = data[SAMPLE_SR_IDX];
+	uint8_t *dout = &data[SAMPLE_DOUT_IDX];
+	if(!getDRDY(sr))
+	{
+		return sr;
+	}
 	for(int i = AXIS_X; i <= AXIS_Z; i++)
 	{
-		MSB = data[2*i+1];//odd number elements are MSB(1..3..5)
-		LSB = data[2*i];//even number elements as LSB(0..2..4)
+		MSB = dout[2*i+1];//odd number elements are MSB(1..3..5)
+		LSB = dout[2*i];//even number elements as LSB(0..2..4)
 		result[i] = concatenate_bytes(MSB, LSB);
 	}
+	return sr;
 }
 
 /*
- * Function to calibrate data according to the calculated value of scale and bias
- *
- * calibrated value for an axis = (scale*(axis_value - offset))
+ * Function to interpolate the learned offset at a position in the temperature bins. Only the two
+ * bins around the position are used, a bin that has not been learned is left out. Past the last
+ * learned bin the offset of that bin is held. One multiply and a shift per axis
  *
  * Parameters:
- *  data(in/out) pointer to data array which is processed and calibrated
+ *  pos position in the bins, bin number in the bits above QMC_TEMP_BIN_SHIFT
+ *  offset(out) pointer to the interpolated offset
  *
  * Returns:
- *  none
+ *  1 if the offset was interpolated
+ *  0 if no bin has been learned yet
  */
-void qmc_calibrate_data(int16_t data[])
+static uint8_t qmc_temp_interpolate(int32_t pos, int16_t offset[])
 {
-	data[0] = (calibration_data.scale_x*(data[AXIS_X] - calibration_data.offset_x));
-	data[1] = (calibration_data.scale_y*(data[AXIS_Y] - calibration_data.offset_y));
-	data[2] = (calibration_data.scale_z*(data[AXIS_Z] - calibration_data.offset_z));
+	int32_t lo = pos >> QMC_TEMP_BIN_SHIFT;
+	int32_t hi = (lo < QMC_TEMP_NUM_BINS - 1) ? lo + 1 : lo;
+	int32_t frac = pos & TEMP_BIN_MASK;
+	uint8_t lo_valid = (temp_bin_valid >> lo) & 1;
+	uint8_t hi_valid = (temp_bin_valid >> hi) & 1;
+
+	if(!lo_valid && !hi_valid)
+	{//hold the nearest learned bin
+		for(int32_t d = 1; !lo_valid; d++)
+		{
+			if(d >= QMC_TEMP_NUM_BINS)
+			{
+				return 0;
+			}
+			if(lo - d >= 0 && ((temp_bin_valid >> (lo - d)) & 1))
+			{
+				lo = lo - d;
+				lo_valid = 1;
+			}else if(hi + d < QMC_TEMP_NUM_BINS && ((temp_bin_valid >> (hi + d)) & 1)){
+				lo = hi + d;
+				lo_valid = 1;
+			}
+		}
+		hi = lo;
+	}else if(!lo_valid){
+		lo = hi;
+	}else if(!hi_valid){
+		hi = lo;
+	}
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		offset[i] = temp_bin_offset[lo][i] + ((((int32_t)temp_bin_offset[hi][i] - temp_bin_offset[lo][i])*frac +
+				(TEMP_BIN_SIZE >> 1)) >> QMC_TEMP_BIN_SHIFT);
+	}
+	return 1;
 }
 
 /*
- * Function to inialise the QMC module accoring to the config provided
+ * Function to learn an offset at a position in the temperature bins. Only the bin nearest to the
+ * position is changed, by as much as it takes for qmc_temp_interpolate() to give the offset back
+ * at that position. Its weight is at least half, so this is one divide per axis
  *
  * Parameters:
- *  config pointer to config structure containing the config for the device
+ *  pos position in the bins, bin number in the bits above QMC_TEMP_BIN_SHIFT
+ *  offset(in) pointer to the offset to learn
  *
  * Returns:
  *  none
  */
-void init_qmc(qmc_config_t *config)
+static void qmc_temp_learn(int32_t pos, const int16_t offset[])
 {
-	uint8_t cr1 = 0, cr2 = 0;
+	int32_t lo = pos >> QMC_TEMP_BIN_SHIFT;
+	int32_t frac = pos & TEMP_BIN_MASK;
+	int32_t near, far, weight, err;
+	int16_t current[3];
 
-	setMODE(config->mode, &cr1);
-	setODR(config->odr,&cr1);
-	setRNG(config->rng,&cr1);
-	setOSR(config->osr,&cr1);
-
-	setSOFT_RST(config->soft_rst, &cr2);
-	setROL_PNT(config->rol_pnt, &cr2);
-	setINT_ENB(config->int_enb, &cr2);
+	if(frac < (TEMP_BIN_SIZE >> 1) || lo == QMC_TEMP_NUM_BINS - 1)
+	{
+		near = lo;
+		far = (lo < QMC_TEMP_NUM_BINS - 1) ? lo + 1 : lo;
+		weight = TEMP_BIN_SIZE - frac;
+	}else{
+		near = lo + 1;
+		far = lo;
+		weight = frac;
+	}
+	if(!((temp_bin_valid >> far) & 1))
+	{//interpolation uses the near bin alone
+		weight = TEMP_BIN_SIZE;
+	}
+	if(!((temp_bin_valid >> near) & 1))
+	{
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			temp_bin_offset[near][i] = offset[i];
+		}
+		temp_bin_valid |= 1U << near;
+	}
+	qmc_temp_interpolate(pos, current);
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		err = ((int32_t)offset[i] - current[i]) << QMC_TEMP_BIN_SHIFT;
+		err = (err < 0) ? (err - (weight >> 1))/weight : (err + (weight >> 1))/weight;
+		temp_bin_offset[near][i] = clip_q31_to_q15(temp_bin_offset[near][i] + err);
+	}
+}
 
-	//write default value into srs period register
-	while(qmc_i2c_write_reg(QMC_SRS_PERIOD_ADDR,QMC_SRS_PERIOD_DEFAULT_VALUE)!= QMC_OK);
-	b_delay(10);//to prevent I2C on KL25Z from locking up
+/*
+ * Function to move the calibration offset to the offset learned for the last temperature read,
+ * when the temperature has been read again since the last call. The first temperature read is
+ * put in the middle of the bins, temperatures past the last bin use the last bin
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_temp_apply()
+{
+	int32_t pos;
+	if(!temperature_updated)
+	{
+		return;
+	}
+	temperature_updated = 0;
+	if(!temp_pos_valid)
+	{
+		temp_ref = temperature;
+	}
+	pos = (int32_t)temperature - temp_ref + ((QMC_TEMP_NUM_BINS/2) << QMC_TEMP_BIN_SHIFT);
+	if(pos < 0)
+	{
+		pos = 0;
+	}else if(pos > TEMP_POS_MAX){
+		pos = TEMP_POS_MAX;
+	}
+	temp_pos = pos;
+	temp_pos_valid = 1;
+	qmc_temp_interpolate(temp_pos, calibration_data.offset);
+}
 
-	//write cr1 register
-	while(qmc_i2c_write_reg(QMC_CR1_ADDR,cr1)!= QMC_OK);
-	b_delay(10);//to prevent I2C on KL25Z from locking up
+/*
+ * Function to calibrate data according to the calculated hard iron offset and soft iron matrix
+ *
+ * calibrated value = matrix*(axis values - offset)
+ *
+ * All integer, the Cortex-M0+ has no FPU. The offset corrected values are saturated to 16 bits,
+ * each row is summed in 64 bits from 32 bit products and saturated back to 16 bits with the
+ * CMSIS clip helpers, so large inputs clip instead of wrapping around. The offset is first moved
+ * to the one learned for the last temperature read, if it changed since the last call
+ *
+ * Parameters:
+ *  data(in/out) pointer to data array which is processed and calibrated
+ *
+ * Returns:
+ *  none
+ */
+void qmc_calibrate_data(int16_t data[])
+{
+	q15_t centered[3];
+	q63_t acc;
 
-	//write cr2 register
-	while(qmc_i2c_write_reg(QMC_CR2_ADDR,cr2)!= QMC_OK);
-	b_delay(10);//to prevent I2C on KL25Z from locking up
+	qmc_temp_apply();
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		centered[i] = clip_q31_to_q15((q31_t)data[i] - calibration_data.offset[i]);
+	}
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		acc = (q63_t)((q31_t)calibration_data.matrix[i][AXIS_X] * centered[AXIS_X]);
+		acc += (q31_t)calibration_data.matrix[i][AXIS_Y] * centered[AXIS_Y];
+		acc += (q31_t)calibration_data.matrix[i][AXIS_Z] * centered[AXIS_Z];
+		acc += 1 << (QMC_CAL_FRAC_BITS - 1);//round to nearest
+		data[i] = clip_q31_to_q15(clip_q63_to_q31(acc >> QMC_CAL_FRAC_BITS));
+	}
 }
 
 /*
- * Function to get next raw sample from QMC5883L IC
+ * Function to rescale the calibration offsets, including the ones learned per temperature, to the
+ * LSB of another range. The soft iron matrix has no unit and is left as it is
  *
  * Parameters:
- *  result(out) pointer to 16-bit integer array to collect the raw sample values
+ *  rng the range whose LSB the offsets should be in
  *
  * Returns:
- *  1 on success
- *  0 on failure
+ *  none
  */
-qmc_error_t qmc_get_nex_raw_sample(int16_t result[])
+static void qmc_rescale_calibration(qmc_cr1_rng_options_t rng)
 {
-	qmc_error_t ret;
-	uint8_t sr = 0;
-	uint8_t dout_buffer[NUM_DOUT_BUFFER];
-	while(1)
+	int16_t *offset;
+	if(rng == cal_rng)
+	{
+		return;
+	}
+	for(int bin = 0; bin <= QMC_TEMP_NUM_BINS; bin++)
 	{
-		ret = qmc_i2c_read_reg(QMC_SR_ADDR,&sr);
-		b_delay(10);//to prevent I2C on KL25Z from locking up
-		if(ret == QMC_OK)
+		offset = (bin < QMC_TEMP_NUM_BINS) ? temp_bin_offset[bin] : calibration_data.offset;
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
 		{
-			if(getDOR(sr))
+			if(rng == RNG_OPTION_2G)
 			{
-				ret = QMC_ERROR_DOR;
-			}
-			if(getOVL(sr))
-			{
-				ret = QMC_ERROR_OVL;
-			}
-			if(getDRDY(sr))
-			{
-				while(qmc_i2c_read_regs(QMC_DATA_X_LSB_ADDR,dout_buffer,NUM_DOUT_BUFFER) != QMC_OK);
-				process_raw_data(dout_buffer, result);
-				break;
+				offset[i] = clip_q31_to_q15((int32_t)offset[i] << RNG_SCALE_SHIFT);
+			}else{
+				offset[i] = (offset[i] + (1 << (RNG_SCALE_SHIFT - 1))) >> RNG_SCALE_SHIFT;
 			}
 		}
-		b_delay(10);//to prevent I2C on KL25Z from locking up
 	}
-	return ret;
+	cal_rng = rng;
 }
 
 /*
- * Function to run a calibration routine based on:
- * 	https://github.com/kriswiner/MPU6050/wiki/Simple-and-Effective-Magnetometer-Calibration
+ * Function to bring a sample measured at sample_rng to the unit of the samples. Only a 2G sample
+ * given in 8G LSB needs it, it is divided by 4 rounding down, so it always fits and only the device
+ * sets OVL. The bits shifted out are handed back for the frac field of the sample
  *
- * It collects max and min values in each axis for the number of samples specified. After that it
- * uses the following formula to find the offset(bias) in each axis:
+ * Parameters:
+ *  axis(in/out) pointer to the x, y and z values
  *
- * 		offset = (max - min)/2
+ * Returns:
+ *  the bits below the LSB of each axis, QMC_SAMPLE_FRAC_BITS per axis from x up
+ */
+static uint8_t qmc_normalize_sample(int16_t axis[])
+{
+	uint8_t frac = 0;
+	if(sample_rng == unit_rng)
+	{
+		return 0;
+	}
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		frac |= (axis[i] & ((1 << RNG_SCALE_SHIFT) - 1)) << (QMC_SAMPLE_FRAC_BITS*i);
+		axis[i] >>= RNG_SCALE_SHIFT;
+	}
+	return frac;
+}
+
+/*
+ * Function to pick the range for the samples to come from a sample in 8G LSB. The 8G range is
+ * taken on the first sample with OVL set or above QMC_AUTO_RANGE_UP_LEVEL, the 2G range only once
+ * QMC_AUTO_RANGE_HOLD samples in a row stayed below QMC_AUTO_RANGE_DOWN_LEVEL
  *
  * Parameters:
- *  num_samples the number of samples for which the calibration should run
+ *  axis(in) pointer to the x, y and z values in 8G LSB
+ *  sr the status register read with the sample
  *
  * Returns:
- *  none
+ *  the range to measure at
  */
-void qmc_run_calibration(uint16_t num_samples)
+static qmc_cr1_rng_options_t qmc_auto_range_next(const int16_t axis[], uint8_t sr)
 {
-	uint16_t i = 0;
-	int16_t max_value[3] = {-32767,-32767,-32767};
-	int16_t min_value[3] = {32767,32767,32767};
-	int16_t raw_sample_value[3] = {0};
-	float bias[3] = {0};
-	while(i < num_samples)
+	int32_t peak = 0, value;
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
 	{
-		qmc_get_nex_raw_sample(raw_sample_value);
-		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		value = (axis[i] < 0) ? -(int32_t)axis[i] : axis[i];
+		if(value > peak)
 		{
-			if(raw_sample_value[i] < min_value[i])
-			{
-				min_value[i] = raw_sample_value[i];
-			}
-			if(raw_sample_value[i] > max_value[i])
-			{
-				max_value[i] = raw_sample_value[i];
-			}
+			peak = value;
 		}
-		b_delay(1);
-		i++;
 	}
-	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	if(getOVL(sr) || peak > QMC_AUTO_RANGE_UP_LEVEL ||
+			(sample_rng == RNG_OPTION_8G && peak >= QMC_AUTO_RANGE_DOWN_LEVEL))
+	{
+		range_quiet = 0;
+		return RNG_OPTION_8G;
+	}
+	if(sample_rng == RNG_OPTION_2G || ++range_quiet < QMC_AUTO_RANGE_HOLD)
+	{
+		return sample_rng;
+	}
+	range_quiet = 0;
+	return RNG_OPTION_2G;
+}
+
+/*
+ * Callback of the CR1 write started by auto ranging, runs in interrupt context. The sample after
+ * the write may have been measured partly at the old range and is dropped
+ *
+ * Parameters:
+ *  xfer the finished CR1 write
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_range_done(i2c_xfer_t *xfer)
+{
+	if(xfer->status != I2C_STATUS_OK)
+	{//the next sample tries again
+		return;
+	}
+	config_regs[CONFIG_CR1_IDX] = range_cr1;
+	sample_rng = getRNG(range_cr1);
+	range_discard = 1;
+	sample_stats.range_switches++;
+}
+
+/*
+ * Function to start the CR1 write for a range change from interrupt context. Nothing is started
+ * while a CR1 write from thread context or the previous range change is in progress, the next
+ * sample decides again
+ *
+ * Parameters:
+ *  rng the range to change to
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_auto_range_start(qmc_cr1_rng_options_t rng)
+{
+	if(cr1_busy || range_xfer.status == I2C_STATUS_PENDING)
 	{
-		bias[i] = (((float)(max_value[i] + min_value[i]))/2.0f);
+		return;
 	}
-	calibration_data.offset_x = bias[AXIS_X];
-	calibration_data.offset_y = bias[AXIS_Y];
-	calibration_data.offset_z = bias[AXIS_Z];
+	range_cr1 = config_regs[CONFIG_CR1_IDX];
+	setRNG(rng, &range_cr1);
+	i2c_submit(QMC_I2C_BUS, &range_xfer);
+}
+
+/*
+ * Function to set up the DRDY pin of the QMC5883L as a GPIO input interrupting on the rising edge
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void init_qmc_drdy()
+{
+	SIM->SCGC5 |= QMC_DRDY_CLOCK_GATE;
+
+	QMC_DRDY_PORT->PCR[QMC_DRDY_PIN] &= ~(PORT_PCR_MUX_MASK | PORT_PCR_IRQC_MASK);
+	QMC_DRDY_PORT->PCR[QMC_DRDY_PIN] = PORT_PCR_MUX(GPIO_PIN_ALT_FUNC_NUM) | PORT_PCR_ISF_MASK |
+			PORT_PCR_IRQC(PORT_IRQC_RISING_EDGE);
+	QMC_DRDY_GPIO->PDDR &= ~QMC_DRDY_PIN_MASK;
+
+	qmc_sample_reader_init(&nex_sample_reader);
+	drdy_enabled = 1;
+
+	NVIC_SetPriority(QMC_DRDY_IRQ, QMC_DRDY_IRQ_PRIORITY);
+	NVIC_ClearPendingIRQ(QMC_DRDY_IRQ);
+	NVIC_EnableIRQ(QMC_DRDY_IRQ);
+}
+
+/*
+ * Function to claim the sample read for a new sample, unless the read of the previous one is
+ * still on the bus. Claiming with interrupts off keeps the DRDY interrupt and the thread from both
+ * starting it
+ *
+ * Parameters:
+ *  time_us time of the DRDY edge in microseconds
+ *
+ * Returns:
+ *  1 if the read was claimed, it has to be started with qmc_start_read()
+ *  0 if the read is already on the bus
+ */
+static uint8_t qmc_claim_read(uint32_t time_us)
+{
+	uint8_t claimed = 0;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if(sample_xfer.status != I2C_STATUS_PENDING)
+	{
+		sample_xfer.status = I2C_STATUS_PENDING;
+		sample_xfer_time_us = time_us;
+		claimed = 1;
+	}
+	__set_PRIMASK(primask);
+	return claimed;
+}
+
+/*
+ * Function to start a sample read claimed with qmc_claim_read(). Called with interrupts on, since
+ * the start may wait on the bus
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_start_read()
+{
+	i2c_status_t status = i2c_submit(QMC_I2C_BUS, &sample_xfer);
+	uint32_t primask;
+
+	if(status != I2C_STATUS_PENDING)
+	{
+		primask = __get_PRIMASK();
+		__disable_irq();
+		sample_xfer.status = status;//releases the claim
+		sample_stats.skipped++;
+		__set_PRIMASK(primask);
+	}
+}
+
+/*
+ * Function to record a rising edge on the DRDY line. Called by the DRDY pin interrupt, and can be
+ * called directly to drive the driver from a simulated DRDY line. Starts the read of the sample,
+ * unless the read of the previous one is still on the bus
+ *
+ * Parameters:
+ *  time_us time of the edge in microseconds
+ *
+ * Returns:
+ *  none
+ */
+void qmc_drdy_event(uint32_t time_us)
+{
+	if(qmc_claim_read(time_us))
+	{
+		qmc_start_read();
+	}else{
+		sample_stats.skipped++;
+	}
+}
+
+/*
+ * Function to handle a finished sample read. Decodes the sample and pushes it into the ring, then
+ * starts the range change if auto ranging asks for one and the temperature read when it is due.
+ * If DRDY went high again while the read was on the bus its edge was dropped, so the next read is
+ * started here
+ *
+ * Parameters:
+ *  xfer the finished sample read
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_sample_process(i2c_xfer_t *xfer)
+{
+	qmc_sample_t sample;
+	qmc_cr1_rng_options_t rng;
+
+	if(xfer->status != I2C_STATUS_OK)
+	{//the line stays high, qmc_get_nex_raw_sample() restarts the read while it waits
+		sample_stats.skipped++;
+		return;
+	}
+	sample.time_us = sample_xfer_time_us;
+	sample.status = process_raw_data(sample_xfer_buffer, sample.axis);
+	if(!getDRDY(sample.status))
+	{//nothing decoded
+		sample_stats.skipped++;
+		return;
+	}
+	if(range_discard)
+	{//measured across a range change, not published
+		range_discard = 0;
+		sample_stats.skipped++;
+	}else{
+		sample.frac = qmc_normalize_sample(sample.axis);
+		if(getDOR(sample.status))
+		{
+			sample_stats.overruns++;
+		}
+		sample_stats.samples++;
+		//decoded aside, the slot holds the oldest published sample till here
+		sample_ring[sample_ring_head & (QMC_SAMPLE_RING_LEN - 1)] = sample;
+		__DMB();//slot is complete before readers can see it
+		sample_ring_head++;
+
+		if(auto_range_enabled)
+		{
+			rng = qmc_auto_range_next(sample.axis, sample.status);
+			if(rng != sample_rng)
+			{
+				qmc_auto_range_start(rng);
+			}
+		}
+	}
+
+	if(temp_xfer.status != I2C_STATUS_PENDING && (!temperature_read ||
+			sample_xfer_time_us - temp_read_time_us >= QMC_TEMP_PERIOD_MS*US_PER_MS))
+	{
+		temp_read_time_us = sample_xfer_time_us;
+		i2c_submit(QMC_I2C_BUS, &temp_xfer);//a failed submit is retried after the next sample
+	}
+
+	if(QMC_DRDY_GPIO->PDIR & QMC_DRDY_PIN_MASK)
+	{
+		qmc_drdy_event(now_us());
+	}
+}
+
+/*
+ * Callback of the sample read, runs in interrupt context. Its time is counted in the isr_us of the
+ * sample counters
+ *
+ * Parameters:
+ *  xfer the finished sample read
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_sample_done(i2c_xfer_t *xfer)
+{
+	uint32_t start_us = now_us();
+	qmc_sample_process(xfer);
+	sample_stats.isr_us += now_us() - start_us;
+}
+
+/*
+ * Callback of the temperature read, runs in interrupt context. The calibration offset follows the
+ * new temperature the next time it is used
+ *
+ * Parameters:
+ *  xfer the finished temperature read
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_temp_done(i2c_xfer_t *xfer)
+{
+	if(xfer->status != I2C_STATUS_OK)
+	{
+		return;
+	}
+	temperature = concatenate_bytes(temp_xfer_buffer[1], temp_xfer_buffer[0]);
+	temperature_read = 1;
+	temperature_updated = 1;
+}
+
+/*
+ * Function to start the sample read if the DRDY line is high with no read on the bus, after an
+ * edge that came before the pin was set up or after a failed read. A read which lost an interrupt
+ * is aborted by i2c_tick() after the I2C timeout, one still on the bus after QMC_STALLED_READ_MS
+ * is waited out here so the consumer does not poll a DRDY line the read is behind
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void qmc_restart_stalled_read()
+{
+	uint32_t time_us = now_us();
+
+	//signed, a read claimed by the DRDY interrupt since time_us was taken is newer than it
+	if(sample_xfer.status == I2C_STATUS_PENDING && (int32_t)(time_us - sample_xfer_time_us) > QMC_STALLED_READ_MS*US_PER_MS)
+	{
+		i2c_wait_idle(QMC_I2C_BUS);
+	}
+	if((QMC_DRDY_GPIO->PDIR & QMC_DRDY_PIN_MASK) && qmc_claim_read(time_us))
+	{//started with interrupts on, as the start may wait on the bus
+		qmc_start_read();
+	}
+}
+
+/*
+ * PORTD Interrupt Handler. Timestamps the rising edge of DRDY and starts the read of the sample
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void PORTD_IRQHandler()
+{
+	uint32_t time_us;
+	if(QMC_DRDY_PORT->ISFR & QMC_DRDY_PIN_MASK)
+	{
+		QMC_DRDY_PORT->ISFR = QMC_DRDY_PIN_MASK;
+		time_us = now_us();
+		qmc_drdy_event(time_us);
+		sample_stats.isr_us += now_us() - time_us;
+	}
+}
+
+/*
+ * Function to start reading the sample ring from its newest sample onwards
+ *
+ * Parameters:
+ *  reader(out) pointer to the reader to set up
+ *
+ * Returns:
+ *  none
+ */
+void qmc_sample_reader_init(qmc_sample_reader_t *reader)
+{
+	reader->tail = sample_ring_head;
+	reader->overflows = 0;
+}
+
+/*
+ * Function to take the oldest sample the reader has not seen out of the sample ring, without
+ * blocking. Samples the interrupt wrote over before the reader got to them are counted in its
+ * overflows. The writer only runs in interrupt context, so a sample taken over while being
+ * copied shows up as the head having moved more than a ring length past it
+ *
+ * Parameters:
+ *  reader(in/out) pointer to the reader
+ *  sample(out) pointer to the sample to fill
+ *
+ * Returns:
+ *  1 if a sample was copied
+ *  0 if the reader has seen every sample
+ */
+uint8_t qmc_sample_pop(qmc_sample_reader_t *reader, qmc_sample_t *sample)
+{
+	uint32_t head;
+	while(1)
+	{
+		head = sample_ring_head;
+		if(head == reader->tail)
+		{
+			return 0;
+		}
+		if(head - reader->tail > QMC_SAMPLE_RING_LEN)
+		{
+			reader->overflows += head - reader->tail - QMC_SAMPLE_RING_LEN;
+			reader->tail = head - QMC_SAMPLE_RING_LEN;
+		}
+		__DMB();
+		*sample = sample_ring[reader->tail & (QMC_SAMPLE_RING_LEN - 1)];
+		__DMB();
+		if(sample_ring_head - reader->tail <= QMC_SAMPLE_RING_LEN)
+		{
+			reader->tail++;
+			return 1;
+		}
+	}
+}
+
+/*
+ * Function to take the newest sample out of the sample ring, without blocking. Older samples
+ * the reader has not seen are skipped and not counted as overflows
+ *
+ * Parameters:
+ *  reader(in/out) pointer to the reader
+ *  sample(out) pointer to the sample to fill
+ *
+ * Returns:
+ *  1 if a sample was copied
+ *  0 if the reader has seen every sample
+ */
+uint8_t qmc_sample_read_latest(qmc_sample_reader_t *reader, qmc_sample_t *sample)
+{
+	uint32_t head = sample_ring_head;
+	if(head == reader->tail)
+	{
+		return 0;
+	}
+	reader->tail = head - 1;
+	return qmc_sample_pop(reader, sample);
+}
+
+/*
+ * Function to inialise the QMC module accoring to the config provided. With AUTO_RNG_ENABLE the
+ * samples are in 8G LSB whatever the range, so the whole 8G range fits in 16 bits, otherwise in
+ * LSB of the range set. The calibration offsets are rescaled to that unit
+ *
+ * Parameters:
+ *  config pointer to config structure containing the config for the device
+ *
+ * Returns:
+ *  1 on success
+ *  0 if a register could not be written within the retry budget
+ */
+qmc_error_t init_qmc(qmc_config_t *config)
+{
+	uint8_t cr1 = 0, cr2 = 0;
+
+	setMODE(config->mode, &cr1);
+	setODR(config->odr,&cr1);
+	setRNG(config->rng,&cr1);
+	setOSR(config->osr,&cr1);
+
+	setSOFT_RST(config->soft_rst, &cr2);
+	//the read started by the DRDY interrupt needs the rollover pointer
+	setROL_PNT(config->int_enb == INT_ENB_ENABLE ? ROL_PNT_ENABLE : config->rol_pnt, &cr2);
+	setINT_ENB(config->int_enb, &cr2);
+
+	config_regs[CONFIG_CR1_IDX] = cr1;
+	config_regs[CONFIG_CR2_IDX] = cr2;
+	config_regs[CONFIG_SRS_IDX] = QMC_SRS_PERIOD_DEFAULT_VALUE;
+
+	//write cr1, cr2 and srs period registers in one transaction
+	config_regs_synced = 0;
+	if(qmc_i2c_write_regs_retry(QMC_CR1_ADDR, config_regs, NUM_CONFIG_REGS) != QMC_OK)
+	{
+		return QMC_NACK_ERROR;
+	}
+	config_regs_synced = 1;
+
+	auto_range_enabled = (config->auto_rng == AUTO_RNG_ENABLE);
+	sample_rng = config->rng;
+	unit_rng = auto_range_enabled ? RNG_OPTION_8G : config->rng;
+	qmc_rescale_calibration(unit_rng);
+
+	rol_pnt_enabled = (getROL_PNT(cr2) == ROL_PNT_ENABLE);
+	if(config->int_enb == INT_ENB_ENABLE)
+	{
+		init_qmc_drdy();
+	}
+	return QMC_OK;
+}
+
+/*
+ * Function to change a field of CR1, skipping the bus if the device already has it. The new value
+ * is made from the copy of CR1 with interrupts off, once no range change from auto ranging is on
+ * the bus, and auto ranging holds off until the write is done, so neither loses the other's change
+ *
+ * Parameters:
+ *  mask the bits of the field
+ *  value the new value of the field, in place
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+static qmc_error_t qmc_update_cr1(uint8_t mask, uint8_t value)
+{
+	uint8_t cr1;
+	uint32_t primask;
+	qmc_error_t ret = QMC_OK;
+
+	while(1)
+	{
+		primask = __get_PRIMASK();
+		__disable_irq();
+		if(range_xfer.status != I2C_STATUS_PENDING)
+		{
+			cr1_busy = 1;
+			cr1 = (config_regs[CONFIG_CR1_IDX] & ~mask) | value;
+			__set_PRIMASK(primask);
+			break;
+		}
+		__set_PRIMASK(primask);
+	}
+	if(!config_regs_synced || cr1 != config_regs[CONFIG_CR1_IDX])
+	{
+		ret = qmc_i2c_write_regs_retry(QMC_CR1_ADDR, &cr1, 1);
+	}
+	if(ret == QMC_OK && getRNG(cr1) != sample_rng)
+	{
+		primask = __get_PRIMASK();
+		__disable_irq();
+		sample_rng = getRNG(cr1);
+		if(!auto_range_enabled)
+		{//the samples follow the range set
+			unit_rng = sample_rng;
+		}
+		range_discard = 1;
+		__set_PRIMASK(primask);
+		qmc_rescale_calibration(unit_rng);
+	}
+	if(ret == QMC_OK)
+	{
+		config_regs[CONFIG_CR1_IDX] = cr1;
+	}
+	cr1_busy = 0;
+	return ret;
+}
+
+/*
+ * Function to change the field range of the QMC module at runtime
+ *
+ * Parameters:
+ *  option the choice of rng setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_range(qmc_cr1_rng_options_t option)
+{
+	uint8_t value = 0;
+	setRNG(option, &value);
+	return qmc_update_cr1(CR1_RNG_MASK, value);
+}
+
+/*
+ * Function to change the output data rate of the QMC module at runtime
+ *
+ * Parameters:
+ *  option the choice of odr setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_odr(qmc_cr1_odr_options_t option)
+{
+	uint8_t value = 0;
+	setODR(option, &value);
+	return qmc_update_cr1(CR1_ODR_MASK, value);
+}
+
+/*
+ * Function to change the over sample ratio of the QMC module at runtime
+ *
+ * Parameters:
+ *  option the choice of osr setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_osr(qmc_cr1_osr_options_t option)
+{
+	uint8_t value = 0;
+	setOSR(option, &value);
+	return qmc_update_cr1(CR1_OSR_MASK, value);
+}
+
+/*
+ * Function to change the output data rate and the over sample ratio of the QMC module together,
+ * with a single register write
+ *
+ * Parameters:
+ *  odr the choice of odr setting
+ *  osr the choice of osr setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_rate(qmc_cr1_odr_options_t odr, qmc_cr1_osr_options_t osr)
+{
+	uint8_t value = 0;
+	setODR(odr, &value);
+	setOSR(osr, &value);
+	return qmc_update_cr1(CR1_ODR_MASK | CR1_OSR_MASK, value);
+}
+
+/*
+ * Function to change the mode of the QMC module at runtime
+ *
+ * Parameters:
+ *  option the choice of mode setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_mode(qmc_cr1_mode_options_t option)
+{
+	uint8_t value = 0;
+	setMODE(option, &value);
+	return qmc_update_cr1(CR1_MODE_MASK, value);
+}
+
+/*
+ * Function to get the current configuration of the QMC module, from the copy of its configuration
+ * registers kept by the driver
+ *
+ * Parameters:
+ *  config(out) pointer to config structure to fill
+ *
+ * Returns:
+ *  none
+ */
+void qmc_get_config(qmc_config_t *config)
+{
+	uint8_t cr1 = config_regs[CONFIG_CR1_IDX];
+	uint8_t cr2 = config_regs[CONFIG_CR2_IDX];
+
+	config->mode = getMODE(cr1);
+	config->odr = getODR(cr1);
+	config->rng = getRNG(cr1);
+	config->osr = getOSR(cr1);
+	config->soft_rst = getSOFT_RST(cr2);
+	config->rol_pnt = getROL_PNT(cr2);
+	config->int_enb = getINT_ENB(cr2);
+	config->auto_rng = auto_range_enabled ? AUTO_RNG_ENABLE : AUTO_RNG_DISABLE;
+}
+
+/*
+ * Function to read the status register and, if a sample is ready, the data registers into a sample
+ * buffer laid out for process_raw_data().
+ *
+ * With ROL_PNT_ENABLE the register pointer rolls over from 0x06 to 0x00, so one 7 byte read starting
+ * at the status register gets the status and all three axes. The status comes first, reading a data
+ * register clears DRDY and DOR. That is 10 bytes on the wire in one transaction, against 13 bytes in
+ * two transactions when the status and the data are read separately.
+ *
+ * Parameters:
+ *  buf(out) pointer to byte array of NUM_SAMPLE_BUFFER bytes
+ *
+ * Returns:
+ *  1 for success
+ *  0 for failure
+ */
+static qmc_error_t qmc_read_sample(uint8_t buf[])
+{
+	if(rol_pnt_enabled)
+	{
+		return qmc_i2c_read_regs(QMC_SR_ADDR, buf, NUM_SAMPLE_BUFFER);
+	}
+	if(qmc_i2c_read_reg(QMC_SR_ADDR, &buf[SAMPLE_SR_IDX]) != QMC_OK)
+	{
+		return QMC_NACK_ERROR;
+	}
+	if(!getDRDY(buf[SAMPLE_SR_IDX]))
+	{
+		return QMC_OK;
+	}
+	return qmc_i2c_read_regs_retry(QMC_DATA_X_LSB_ADDR, &buf[SAMPLE_DOUT_IDX], NUM_DOUT_BUFFER);
+}
+
+/*
+ * Function to read the temperature when it is due, for the polled sample path. A failed read is
+ * retried after the next sample
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void qmc_poll_temperature()
+{
+	uint8_t tout[NUM_TOUT_BUFFER];
+	if(temperature_read && sample_time_us - temp_read_time_us < QMC_TEMP_PERIOD_MS*US_PER_MS)
+	{
+		return;
+	}
+	temp_read_time_us = sample_time_us;
+	if(qmc_i2c_read_regs(QMC_TOUT_LSB_ADDR, tout, NUM_TOUT_BUFFER) == QMC_OK)
+	{
+		temperature = concatenate_bytes(tout[1], tout[0]);
+		temperature_read = 1;
+		temperature_updated = 1;
+	}
+}
+
+/*
+ * Function to wait for the newest sample in the sample ring that qmc_get_nex_raw_sample() has not
+ * returned yet
+ *
+ * Parameters:
+ *  result(out) pointer to 16-bit integer array to collect the raw sample values
+ *
+ * Returns:
+ *  1 on success
+ *  0 on failure
+ */
+static qmc_error_t qmc_get_ring_sample(int16_t result[])
+{
+	qmc_sample_t sample;
+	ticktime_t start = now();
+	while(!qmc_sample_read_latest(&nex_sample_reader, &sample))
+	{
+		if(now() - start > QMC_SAMPLE_TIMEOUT_MS)
+		{
+			return QMC_ERROR_TIMEOUT;
+		}
+		qmc_restart_stalled_read();
+	}
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		result[i] = sample.axis[i];
+	}
+	sample_time_us = sample.time_us;
+	if(getDOR(sample.status))
+	{
+		return QMC_ERROR_DOR;
+	}
+	if(getOVL(sample.status))
+	{
+		return QMC_ERROR_OVL;
+	}
+	return QMC_OK;
+}
+
+/*
+ * Function to get next raw sample from QMC5883L IC. With INT_ENB_ENABLE samples are read by the
+ * DRDY interrupt into the sample ring and this returns the newest one it has not returned yet,
+ * otherwise it polls the status register. Gives up if the device does not respond within its
+ * retry budget, or no sample is ready within QMC_SAMPLE_TIMEOUT_MS
+ *
+ * Parameters:
+ *  result(out) pointer to 16-bit integer array to collect the raw sample values
+ *
+ * Returns:
+ *  1 on success
+ *  0 on failure
+ */
+qmc_error_t qmc_get_nex_raw_sample(int16_t result[])
+{
+	qmc_error_t ret;
+	uint8_t sr = 0;
+	uint8_t sample_buffer[NUM_SAMPLE_BUFFER];
+	uint8_t failures = 0;
+	qmc_cr1_rng_options_t rng;
+	ticktime_t start = now();
+	if(drdy_enabled)
+	{
+		return qmc_get_ring_sample(result);
+	}
+	while(1)
+	{
+		if(qmc_read_sample(sample_buffer) != QMC_OK)
+		{
+			if(++failures > qmc_i2c_device.retries)
+			{
+				return QMC_NACK_ERROR;
+			}
+		}else{
+			sr = process_raw_data(sample_buffer, result);
+			if(getDRDY(sr))
+			{
+				if(!range_discard)
+				{
+					break;
+				}
+				range_discard = 0;//measured across a range change
+				sample_stats.skipped++;
+			}
+		}
+		if(now() - start > QMC_SAMPLE_TIMEOUT_MS)
+		{
+			return QMC_ERROR_TIMEOUT;
+		}
+	}
+	qmc_normalize_sample(result);
+	sample_time_us = now_us();
+	sample_stats.samples++;
+	ret = QMC_OK;
+	if(getDOR(sr))
+	{
+		ret = QMC_ERROR_DOR;
+		sample_stats.overruns++;
+	}
+	if(getOVL(sr))
+	{
+		ret = QMC_ERROR_OVL;
+	}
+	qmc_poll_temperature();
+	if(auto_range_enabled)
+	{
+		rng = qmc_auto_range_next(result, sr);
+		if(rng != sample_rng && qmc_set_range(rng) == QMC_OK)
+		{
+			sample_stats.range_switches++;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Function to get the time at which the last sample returned by qmc_get_nex_raw_sample() became
+ * ready. With INT_ENB_ENABLE this is the time of the DRDY edge, otherwise the time the status
+ * register was seen with DRDY set
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  time of the sample in microseconds, as returned by now_us()
+ */
+uint32_t qmc_get_sample_time_us()
+{
+	return sample_time_us;
+}
+
+/*
+ * Function to get the sample counters of the QMC5883L driver
+ *
+ * Parameters:
+ *  stats(out) pointer to structure to copy the counters into
+ *
+ * Returns:
+ *  none
+ */
+void qmc_get_sample_stats(qmc_sample_stats_t *stats)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();//counted by the sample read callback too
+	*stats = sample_stats;
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Function to get the calibration used by qmc_calibrate_data()
+ *
+ * Parameters:
+ *  cal(out) pointer to structure to copy the calibration into
+ *
+ * Returns:
+ *  none
+ */
+void qmc_get_calibration(qmc_calibration_data_t *cal)
+{
+	qmc_temp_apply();
+	*cal = calibration_data;
+}
+
+/*
+ * Function to set the calibration used by qmc_calibrate_data(). Once the temperature has been read
+ * the offset is also learned for the current temperature
+ *
+ * Parameters:
+ *  cal(in) pointer to the new calibration
+ *
+ * Returns:
+ *  none
+ */
+void qmc_set_calibration(const qmc_calibration_data_t *cal)
+{
+	qmc_temp_apply();
+	calibration_data = *cal;
+	if(temp_pos_valid)
+	{
+		qmc_temp_learn(temp_pos, cal->offset);
+	}
+}
+
+/*
+ * Function to get the last die temperature read from the device
+ *
+ * Parameters:
+ *  tout(out) pointer to the raw temperature
+ *
+ * Returns:
+ *  1 if the temperature has been read
+ *  0 if it has not been read yet
+ */
+qmc_error_t qmc_get_temperature(int16_t *tout)
+{
+	if(!temperature_read)
+	{
+		return QMC_NACK_ERROR;
+	}
+	*tout = temperature;
+	return QMC_OK;
+}
+
+/*
+ * Function to run a calibration routine. The device has to be turned through as many orientations
+ * as possible while it runs. Every sample is added to a streaming ellipsoid fit(mag_cal), which
+ * gives both the hard iron offset and the soft iron matrix without storing the samples. Samples in
+ * 2G LSB are halved on the way in, the earth field would not fit MAG_CAL_MAX_INPUT otherwise
+ *
+ * Parameters:
+ *  num_samples the number of samples for which the calibration should run
+ *
+ * Returns:
+ *  1 if the calibration was updated
+ *  0 if the samples did not give an ellipsoid, the previous calibration is kept
+ */
+qmc_error_t qmc_run_calibration(uint16_t num_samples)
+{
+	static mag_cal_t cal;//kept off the stack, the solve needs a fair amount of it
+	qmc_calibration_data_t result;
+	int16_t raw_sample_value[3] = {0};
+	uint16_t i = 0;
+	uint8_t shift = (unit_rng == RNG_OPTION_2G) ? CAL_2G_INPUT_SHIFT : 0;
+
+	mag_cal_init(&cal);
+	while(i < num_samples)
+	{
+		if(qmc_get_nex_raw_sample(raw_sample_value) == QMC_OK)
+		{
+			for(int j = AXIS_X; j <= AXIS_Z; j++)
+			{
+				raw_sample_value[j] >>= shift;
+			}
+			mag_cal_add_sample(&cal, raw_sample_value);
+		}
+		i++;
+	}
+	if(!mag_cal_solve(&cal, &result))
+	{
+		return QMC_ERROR_CALIBRATION;
+	}
+	for(int j = AXIS_X; j <= AXIS_Z; j++)
+	{//the matrix keeps the scale of its input, only the offset has to be scaled back
+		result.offset[j] = clip_q31_to_q15((int32_t)result.offset[j] << shift);
+	}
+	qmc_set_calibration(&result);//learned for the temperature at the end of the run
+	return QMC_OK;
 }
 
 /*
@@ -18,8 +18,19 @@
  */
 #ifndef __QMC5883L_H__
 #define __QMC5883L_H__
+#include "i2c.h"
 
 #define QMC_DEVICE_ADDR 	(0x0DU)
+#define QMC_I2C_BUS			I2C1//change to I2C0 and wire to PTE25(SDA)/PTE24(SCL) to keep reads off the display bus
+#define QMC_MAX_I2C_SPEED	I2C_SPEED_FAST
+#define QMC_I2C_RETRIES		(3U)
+
+//DRDY output of the QMC5883L, wired to PTD4(J1 pin 6). Only PORTA and PORTD can interrupt on the KL25Z
+#define QMC_DRDY_PORT		PORTD
+#define QMC_DRDY_GPIO		PTD
+#define QMC_DRDY_PIN		(4U)
+#define QMC_DRDY_IRQ		PORTD_IRQn
+#define QMC_DRDY_CLOCK_GATE	SIM_SCGC5_PORTD_MASK
 
 #define QMC_DATA_X_LSB_ADDR (0x00U)
 #define QMC_DATA_X_MSB_ADDR	(0x01U)
@@ -59,6 +70,23 @@
 
 #define QMC_SRS_PERIOD_DEFAULT_VALUE (0x01U)
 
+//the die temperature is read on its own every QMC_TEMP_PERIOD_MS, not as part of each sample
+#define QMC_TEMP_PERIOD_MS	(1000U)
+#define QMC_TEMP_LSB_PER_C	(100)//slope of TOUT, its zero point is not calibrated
+
+//hard iron offset learned per temperature bin, bins are centered on the first temperature read
+#define QMC_TEMP_BIN_SHIFT	(10)//1024 LSB, about 10C per bin
+#define QMC_TEMP_NUM_BINS	(8)//-40C to +30C around the first reading
+
+//auto ranging levels, in 8G LSB(3000 LSB/G) which is the unit of samples when auto ranging
+#define QMC_AUTO_RANGE_UP_LEVEL		(5000)//about 1.7G, 2G to 8G on the first sample above it or with OVL
+#define QMC_AUTO_RANGE_DOWN_LEVEL	(3000)//1G, 8G to 2G once QMC_AUTO_RANGE_HOLD samples stay below it
+#define QMC_AUTO_RANGE_HOLD			(16U)
+
+//2G samples given in 8G LSB keep the bits shifted out of each axis in the frac field of the sample
+#define QMC_SAMPLE_FRAC_BITS		(2)
+#define QMC_SAMPLE_FRAC(sample, axis) (((sample)->frac >> (QMC_SAMPLE_FRAC_BITS*(axis))) & ((1 << QMC_SAMPLE_FRAC_BITS) - 1))
+
 typedef enum{
 	AXIS_X,
 	AXIS_Y,
@@ -70,6 +98,8 @@ typedef enum{
 	QMC_OK = 1,
 	QMC_ERROR_DOR = 0,
 	QMC_ERROR_OVL = 0,
+	QMC_ERROR_TIMEOUT = 0,
+	QMC_ERROR_CALIBRATION = 0,
 }qmc_error_t;
 
 typedef enum{
@@ -89,6 +119,8 @@ typedef enum{
 	RNG_OPTION_8G
 }qmc_cr1_rng_options_t;
 
+#define QMC_OSR_MAX	(512U)//over sample ratio of OSR_OPTION_512, each next option halves it
+
 typedef enum{
 	OSR_OPTION_512,
 	OSR_OPTION_256,
@@ -111,6 +143,11 @@ typedef enum{
 	INT_ENB_DISABLE
 }qmc_cr2_int_enb_options_t;
 
+typedef enum{
+	AUTO_RNG_DISABLE,
+	AUTO_RNG_ENABLE
+}qmc_auto_rng_options_t;
+
 typedef struct{
 	qmc_cr1_mode_options_t mode;
 	qmc_cr1_odr_options_t odr;
@@ -119,39 +156,151 @@ typedef struct{
 	qmc_cr2_soft_rst_options_t soft_rst;
 	qmc_cr2_rol_pnt_options_t rol_pnt;
 	qmc_cr2_int_enb_options_t int_enb;
+	qmc_auto_rng_options_t auto_rng;//switch between 2G and 8G with the field, rng is the starting range
 }qmc_config_t;
 
 //calculation for scale and offset is present in /calibration-py-file
 #define OFFSET_X 54
 #define OFFSET_Y -193
 #define OFFSET_Z -31
+#define QMC_CAL_RNG RNG_OPTION_8G//range the offsets were calculated at, rescaled to the unit of the samples
 
 #define SCALE_X 1.03
 #define SCALE_Y	1.01
 #define SCALE_Z	0.95
 
+//soft iron matrix entries are Q2.14, range -2 to just under 2, turned into integers at compile time
+#define QMC_CAL_FRAC_BITS	(14)
+#define QMC_CAL_Q14(value)	((int16_t)((value) * (1 << QMC_CAL_FRAC_BITS) + ((value) < 0 ? -0.5 : 0.5)))
+
 typedef struct{
-	int16_t offset_x;
-	int16_t offset_y;
-	int16_t offset_z;
-	float scale_x;
-	float scale_y;
-	float scale_z;
+	int16_t offset[3];//hard iron offset, subtracted first
+	int16_t matrix[3][3];//soft iron correction in Q2.14, applied to the offset corrected sample
 }qmc_calibration_data_t;
 
+typedef struct{
+	uint32_t samples;//samples read from the device
+	uint32_t overruns;//samples flagged by DOR, at least one sample was lost before each of them
+	uint32_t skipped;//DRDY edges with no sample in the ring, the read was still busy or failed
+	uint32_t range_switches;//range changes made by auto ranging
+	uint32_t isr_us;//time spent in the DRDY interrupt and the sample read callback
+}qmc_sample_stats_t;
+
+#define QMC_SAMPLE_RING_LEN	32//power of two, 160ms at 200Hz
+
+typedef struct{
+	uint32_t time_us;//time of the DRDY edge, as returned by now_us()
+	int16_t axis[3];//raw x, y and z, rounded down to 8G LSB when auto ranging
+	uint8_t status;//status register read with the sample
+	uint8_t frac;//QMC_SAMPLE_FRAC() of an axis is what it has below the LSB, in 1/4 LSB, 0 for 8G samples
+}qmc_sample_t;
+
+typedef struct{
+	uint32_t tail;//next sample to read
+	uint32_t overflows;//samples written over before this reader got to them
+}qmc_sample_reader_t;
+
+extern const i2c_device_t qmc_i2c_device;
+
 /*
- * Function to inialise the QMC module accoring to the config provided
+ * Function to inialise the QMC module accoring to the config provided. With AUTO_RNG_ENABLE the
+ * samples are in 8G LSB whatever the range, so the whole 8G range fits in 16 bits, otherwise in
+ * LSB of the range set. The calibration offsets are rescaled to that unit
  *
  * Parameters:
  *  config pointer to config structure containing the config for the device
  *
  * Returns:
+ *  1 on success
+ *  0 if a register could not be written within the retry budget
+ */
+qmc_error_t init_qmc(qmc_config_t *config);
+
+/*
+ * Function to change the field range of the QMC module at runtime. The bus is only used if the
+ * range actually changes. With AUTO_RNG_ENABLE the range is changed again as the field requires,
+ * otherwise the samples and calibration offsets move to the LSB of the new range
+ *
+ * Parameters:
+ *  option the choice of rng setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_range(qmc_cr1_rng_options_t option);
+
+/*
+ * Function to change the output data rate of the QMC module at runtime. The bus is only used if
+ * the rate actually changes
+ *
+ * Parameters:
+ *  option the choice of odr setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_odr(qmc_cr1_odr_options_t option);
+
+/*
+ * Function to change the over sample ratio of the QMC module at runtime. The bus is only used if
+ * the ratio actually changes
+ *
+ * Parameters:
+ *  option the choice of osr setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_osr(qmc_cr1_osr_options_t option);
+
+/*
+ * Function to change the output data rate and the over sample ratio of the QMC module together,
+ * with a single register write. The bus is only used if either actually changes
+ *
+ * Parameters:
+ *  odr the choice of odr setting
+ *  osr the choice of osr setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_rate(qmc_cr1_odr_options_t odr, qmc_cr1_osr_options_t osr);
+
+/*
+ * Function to change the mode of the QMC module at runtime. The bus is only used if the mode
+ * actually changes
+ *
+ * Parameters:
+ *  option the choice of mode setting
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the register could not be written within the retry budget
+ */
+qmc_error_t qmc_set_mode(qmc_cr1_mode_options_t option);
+
+/*
+ * Function to get the current configuration of the QMC module, from the copy of its configuration
+ * registers kept by the driver
+ *
+ * Parameters:
+ *  config(out) pointer to config structure to fill
+ *
+ * Returns:
  *  none
  */
-void init_qmc(qmc_config_t *config);
+void qmc_get_config(qmc_config_t *config);
 
 /*
- * Function to get next raw sample from QMC5883L IC
+ * Function to get next raw sample from QMC5883L IC. With INT_ENB_ENABLE samples are read by the
+ * DRDY interrupt into the sample ring and this returns the newest one it has not returned yet,
+ * otherwise it polls the status register. Gives up if the device does not respond within its
+ * retry budget, or no sample is ready within 200ms. With AUTO_RNG_ENABLE the values are in 8G LSB,
+ * 2G samples are rounded down to it
  *
  * Parameters:
  *  result(out) pointer to 16-bit integer array to collect the raw sample values
@@ -162,6 +311,97 @@ void init_qmc(qmc_config_t *config);
  */
 qmc_error_t qmc_get_nex_raw_sample(int16_t result[]);
 
+/*
+ * Function to get the time at which the last sample returned by qmc_get_nex_raw_sample() became
+ * ready. With INT_ENB_ENABLE this is the time of the DRDY edge, otherwise the time the status
+ * register was seen with DRDY set
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  time of the sample in microseconds, as returned by now_us()
+ */
+uint32_t qmc_get_sample_time_us();
+
+/*
+ * Function to start reading the sample ring from its newest sample onwards. Each consumer of the
+ * ring has its own reader and reads at its own pace
+ *
+ * Parameters:
+ *  reader(out) pointer to the reader to set up
+ *
+ * Returns:
+ *  none
+ */
+void qmc_sample_reader_init(qmc_sample_reader_t *reader);
+
+/*
+ * Function to take the oldest sample the reader has not seen out of the sample ring, without
+ * blocking. Samples written over before the reader got to them are counted in its overflows.
+ * The ring is only filled with INT_ENB_ENABLE
+ *
+ * Parameters:
+ *  reader(in/out) pointer to the reader
+ *  sample(out) pointer to the sample to fill
+ *
+ * Returns:
+ *  1 if a sample was copied
+ *  0 if the reader has seen every sample
+ */
+uint8_t qmc_sample_pop(qmc_sample_reader_t *reader, qmc_sample_t *sample);
+
+/*
+ * Function to take the newest sample out of the sample ring, without blocking. Older samples
+ * the reader has not seen are skipped and not counted as overflows
+ *
+ * Parameters:
+ *  reader(in/out) pointer to the reader
+ *  sample(out) pointer to the sample to fill
+ *
+ * Returns:
+ *  1 if a sample was copied
+ *  0 if the reader has seen every sample
+ */
+uint8_t qmc_sample_read_latest(qmc_sample_reader_t *reader, qmc_sample_t *sample);
+
+/*
+ * Function to start the sample read if the DRDY line is high with no read on the bus, after an
+ * edge that came before the pin was set up or after a failed read, and to wait out a read which has
+ * been on the bus for longer than half the sample timeout. Consumers waiting on the sample ring call
+ * it while they wait
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void qmc_restart_stalled_read();
+
+/*
+ * Function to record a rising edge on the DRDY line. Called by the DRDY pin interrupt, and can be
+ * called directly to drive the driver from a simulated DRDY line. Starts the read of the sample
+ *
+ * Parameters:
+ *  time_us time of the edge in microseconds
+ *
+ * Returns:
+ *  none
+ */
+void qmc_drdy_event(uint32_t time_us);
+
+/*
+ * Function to get the sample counters of the QMC5883L driver
+ *
+ * Parameters:
+ *  stats(out) pointer to structure to copy the counters into
+ *
+ * Returns:
+ *  none
+ */
+void qmc_get_sample_stats(qmc_sample_stats_t *stats);
+
 /*
  * Function to dump raw sensor values on the terminal to run a python based calibration routine
  * based on:
@@ -183,26 +423,62 @@ qmc_error_t qmc_get_nex_raw_sample(int16_t result[]);
 void qmc_dump_calibration_data(uint16_t num_samples_to_dump);
 
 /*
- * Function to run a calibration routine based on:
- * 	https://github.com/kriswiner/MPU6050/wiki/Simple-and-Effective-Magnetometer-Calibration
+ * Function to get the last die temperature read from the device. The slope is QMC_TEMP_LSB_PER_C
+ * but the zero point differs between parts, so it is only good for temperature changes
  *
- * It collects max and min values in each axis for the number of samples specified. After that it
- * uses the following formula to find the offset(bias) in each axis:
+ * Parameters:
+ *  tout(out) pointer to the raw temperature
  *
- * 		offset = (max - min)/2
+ * Returns:
+ *  1 if the temperature has been read
+ *  0 if it has not been read yet
+ */
+qmc_error_t qmc_get_temperature(int16_t *tout);
+
+/*
+ * Function to get the calibration used by qmc_calibrate_data()
  *
  * Parameters:
- *  num_samples the number of samples for which the calibration should run
+ *  cal(out) pointer to structure to copy the calibration into
+ *
+ * Returns:
+ *  none
+ */
+void qmc_get_calibration(qmc_calibration_data_t *cal);
+
+/*
+ * Function to set the calibration used by qmc_calibrate_data(). Once the temperature has been read
+ * the offset is also learned for the current temperature, qmc_calibrate_data() interpolates the
+ * learned offsets as the temperature changes
+ *
+ * Parameters:
+ *  cal(in) pointer to the new calibration
  *
  * Returns:
  *  none
  */
-void qmc_run_calibration(uint16_t num_samples);
+void qmc_set_calibration(const qmc_calibration_data_t *cal);
+
+/*
+ * Function to run a calibration routine. The device has to be turned through as many orientations
+ * as possible while it runs. Every sample is added to a streaming ellipsoid fit(mag_cal), which
+ * gives both the hard iron offset and the soft iron matrix without storing the samples
+ *
+ * Parameters:
+ *  num_samples the number of samples for which the calibration should run
+ *
+ * Returns:
+ *  1 if the calibration was updated
+ *  0 if the samples did not give an ellipsoid, the previous calibration is kept
+ */
+qmc_error_t qmc_run_calibration(uint16_t num_samples);
 
 /*
- * Function to calibrate data according to the calculated value of scale and bias
+ * Function to calibrate data according to the calculated hard iron offset and soft iron matrix,
+ * in fixed point with saturation. The offset follows the temperature once offsets have been learned
+ * for it
  *
- * calibrated value for an axis = (scale*(axis_value - offset))
+ * calibrated value = matrix*(axis values - offset)
  *
  * Parameters:
  *  data(in/out) pointer to data array which is processed and calibrated
@@ -0,0 +1,85 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    heading.c
+ * @brief   Fixed point heading engine. The vector is folded into the first octant(0 to 45 degrees)
+ * 			by taking absolute values and swapping x and y, where atan of the ratio of the smaller
+ * 			to the larger component is read from a table with linear interpolation. The angle is
+ * 			then unfolded to the right octant. One integer division per heading, no floating point.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "heading.h"
+#include "heading_lut.h"
+
+#define RATIO_BITS			16//ratio of the components, 0..1 in Q16
+#define FRAC_BITS			(RATIO_BITS - HEADING_LUT_BITS)
+#define UNITS_SHIFT			6//table units are 1/640 degree, 64 of them in 0.1 degree
+#define DEG_90				(90U*640U)
+#define DEG_180				(180U*640U)
+#define DEG_360				(360U*640U)
+
+/*
+ * Function to calculate the heading of a field vector, atan2(y, x) in 0.1 degree units wrapped to
+ * 0..3599, 0 along +x and increasing towards +y.
+ *
+ * Parameters:
+ *  x the x component
+ *  y the y component
+ *
+ * Returns:
+ *  heading in 0.1 degree units, 0 for a zero vector
+ */
+uint16_t heading_decidegrees(int16_t x, int16_t y)
+{
+	uint32_t ax = (x < 0) ? -(int32_t)x : x;
+	uint32_t ay = (y < 0) ? -(int32_t)y : y;
+	uint32_t ratio, idx, frac, angle;
+
+	if(ax == 0 && ay == 0)
+	{
+		return 0;
+	}
+
+	//octant reduction, the ratio is at most 1, 2^15 << 16 still fits in 32 bits
+	if(ay <= ax)
+	{
+		ratio = (ay << RATIO_BITS)/ax;
+	}else{
+		ratio = (ax << RATIO_BITS)/ay;
+	}
+	idx = ratio >> FRAC_BITS;
+	frac = ratio & ((1U << FRAC_BITS) - 1);
+	angle = heading_lut[idx];
+	if(frac)
+	{//idx is below 2^HEADING_LUT_BITS here, ratio of 1 has no fraction
+		angle += ((heading_lut[idx + 1] - heading_lut[idx])*frac + (1U << (FRAC_BITS - 1))) >> FRAC_BITS;
+	}
+	if(ay > ax)
+	{
+		angle = DEG_90 - angle;
+	}
+
+	//back to the quadrant of the vector
+	if(x < 0)
+	{
+		angle = DEG_180 - angle;
+	}
+	if(y < 0)
+	{
+		angle = DEG_360 - angle;
+	}
+
+	angle = (angle + (1U << (UNITS_SHIFT - 1))) >> UNITS_SHIFT;
+	return (angle >= HEADING_FULL_CIRCLE) ? angle - HEADING_FULL_CIRCLE : angle;
+}
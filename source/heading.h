@@ -0,0 +1,45 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    heading.h
+ * @brief   Header file for the fixed point heading engine. Replaces atan2 in double, which the
+ * 			Cortex-M0+ has to do in software.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __HEADING_H__
+#define __HEADING_H__
+#include "stdint.h"
+
+//size of the atan table, 2^bits + 1 entries of 2 bytes. Max error over all int16 inputs, 0.05 degree of it is
+//the rounding to 0.1 degree units: 4: 0.070, 5: 0.056, 6: 0.053, 7: 0.052, 8: 0.052 degree
+#ifndef HEADING_LUT_BITS
+#define HEADING_LUT_BITS	5
+#endif
+
+#define HEADING_FULL_CIRCLE	(3600U)//0.1 degree units
+
+/*
+ * Function to calculate the heading of a field vector, atan2(y, x) in 0.1 degree units wrapped to
+ * 0..3599, 0 along +x and increasing towards +y.
+ *
+ * Parameters:
+ *  x the x component
+ *  y the y component
+ *
+ * Returns:
+ *  heading in 0.1 degree units, 0 for a zero vector
+ */
+uint16_t heading_decidegrees(int16_t x, int16_t y);
+
+#endif
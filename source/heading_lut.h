@@ -0,0 +1,111 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    heading_lut.h
+ * @brief   Tables of atan(i/N) for i = 0..N, N = 2^HEADING_LUT_BITS, in units of 1/640 degree.
+ * 			Only included by heading.c. Generated with:
+ *
+ * 				round(atan(i/N)*180/pi*640)
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __HEADING_LUT_H__
+#define __HEADING_LUT_H__
+
+#if HEADING_LUT_BITS == 4
+static const uint16_t heading_lut[(1U << HEADING_LUT_BITS) + 1] = {
+		0, 2289, 4560, 6797, 8983, 11107, 13156, 15123,
+		17002, 18789, 20483, 22085, 23597, 25020, 26359, 27618,
+		28800
+};
+#elif HEADING_LUT_BITS == 5
+static const uint16_t heading_lut[(1U << HEADING_LUT_BITS) + 1] = {
+		0, 1146, 2289, 3428, 4560, 5684, 6797, 7897,
+		8983, 10054, 11107, 12141, 13156, 14150, 15123, 16073,
+		17002, 17907, 18789, 19648, 20483, 21296, 22085, 22852,
+		23597, 24319, 25020, 25700, 26359, 26998, 27618, 28218,
+		28800
+};
+#elif HEADING_LUT_BITS == 6
+static const uint16_t heading_lut[(1U << HEADING_LUT_BITS) + 1] = {
+		0, 573, 1146, 1718, 2289, 2859, 3428, 3995,
+		4560, 5123, 5684, 6242, 6797, 7348, 7897, 8442,
+		8983, 9520, 10054, 10582, 11107, 11626, 12141, 12651,
+		13156, 13656, 14150, 14639, 15123, 15601, 16073, 16540,
+		17002, 17457, 17907, 18351, 18789, 19221, 19648, 20069,
+		20483, 20893, 21296, 21694, 22085, 22472, 22852, 23227,
+		23597, 23961, 24319, 24672, 25020, 25363, 25700, 26032,
+		26359, 26681, 26998, 27310, 27618, 27920, 28218, 28511,
+		28800
+};
+#elif HEADING_LUT_BITS == 7
+static const uint16_t heading_lut[(1U << HEADING_LUT_BITS) + 1] = {
+		0, 286, 573, 859, 1146, 1432, 1718, 2003,
+		2289, 2574, 2859, 3144, 3428, 3711, 3995, 4278,
+		4560, 4842, 5123, 5404, 5684, 5963, 6242, 6519,
+		6797, 7073, 7348, 7623, 7897, 8170, 8442, 8713,
+		8983, 9252, 9520, 9788, 10054, 10318, 10582, 10845,
+		11107, 11367, 11626, 11884, 12141, 12397, 12651, 12904,
+		13156, 13406, 13656, 13903, 14150, 14395, 14639, 14882,
+		15123, 15363, 15601, 15838, 16073, 16308, 16540, 16772,
+		17002, 17230, 17457, 17683, 17907, 18130, 18351, 18571,
+		18789, 19006, 19221, 19435, 19648, 19859, 20069, 20277,
+		20483, 20689, 20893, 21095, 21296, 21495, 21694, 21890,
+		22085, 22279, 22472, 22663, 22852, 23040, 23227, 23413,
+		23597, 23779, 23961, 24141, 24319, 24496, 24672, 24847,
+		25020, 25192, 25363, 25532, 25700, 25867, 26032, 26196,
+		26359, 26521, 26681, 26840, 26998, 27155, 27310, 27464,
+		27618, 27769, 27920, 28070, 28218, 28365, 28511, 28656,
+		28800
+};
+#elif HEADING_LUT_BITS == 8
+static const uint16_t heading_lut[(1U << HEADING_LUT_BITS) + 1] = {
+		0, 143, 286, 430, 573, 716, 859, 1002,
+		1146, 1289, 1432, 1575, 1718, 1861, 2003, 2146,
+		2289, 2432, 2574, 2717, 2859, 3001, 3144, 3286,
+		3428, 3570, 3711, 3853, 3995, 4136, 4278, 4419,
+		4560, 4701, 4842, 4982, 5123, 5263, 5404, 5544,
+		5684, 5823, 5963, 6102, 6242, 6381, 6519, 6658,
+		6797, 6935, 7073, 7211, 7348, 7486, 7623, 7760,
+		7897, 8034, 8170, 8306, 8442, 8578, 8713, 8848,
+		8983, 9118, 9252, 9387, 9520, 9654, 9788, 9921,
+		10054, 10186, 10318, 10451, 10582, 10714, 10845, 10976,
+		11107, 11237, 11367, 11497, 11626, 11755, 11884, 12013,
+		12141, 12269, 12397, 12524, 12651, 12778, 12904, 13030,
+		13156, 13281, 13406, 13531, 13656, 13780, 13903, 14027,
+		14150, 14273, 14395, 14517, 14639, 14761, 14882, 15002,
+		15123, 15243, 15363, 15482, 15601, 15720, 15838, 15956,
+		16073, 16191, 16308, 16424, 16540, 16656, 16772, 16887,
+		17002, 17116, 17230, 17344, 17457, 17570, 17683, 17795,
+		17907, 18018, 18130, 18240, 18351, 18461, 18571, 18680,
+		18789, 18898, 19006, 19114, 19221, 19328, 19435, 19542,
+		19648, 19754, 19859, 19964, 20069, 20173, 20277, 20380,
+		20483, 20586, 20689, 20791, 20893, 20994, 21095, 21196,
+		21296, 21396, 21495, 21595, 21694, 21792, 21890, 21988,
+		22085, 22183, 22279, 22376, 22472, 22567, 22663, 22758,
+		22852, 22947, 23040, 23134, 23227, 23320, 23413, 23505,
+		23597, 23688, 23779, 23870, 23961, 24051, 24141, 24230,
+		24319, 24408, 24496, 24585, 24672, 24760, 24847, 24934,
+		25020, 25106, 25192, 25277, 25363, 25447, 25532, 25616,
+		25700, 25783, 25867, 25949, 26032, 26114, 26196, 26278,
+		26359, 26440, 26521, 26601, 26681, 26761, 26840, 26919,
+		26998, 27077, 27155, 27233, 27310, 27387, 27464, 27541,
+		27618, 27694, 27769, 27845, 27920, 27995, 28070, 28144,
+		28218, 28292, 28365, 28438, 28511, 28584, 28656, 28728,
+		28800
+};
+#else
+#error "HEADING_LUT_BITS must be 4 to 8"
+#endif
+
+#endif
@@ -10,9 +10,10 @@
 
 /**
  * @file    i2c.h
- * @brief   Header for I2C Module driver code for FRDMKL25Z I2C Peripheral. It uses the I2C1 module.
- * 			PTE0 <--> SDA
- * 			PTE1 <--> SCL
+ * @brief   Header for I2C Module driver code for FRDMKL25Z I2C Peripherals. Both I2C modules can be used,
+ * 			each with its own transaction engine, so transfers on the two buses overlap.
+ * 			I2C0: PTE25 <--> SDA, PTE24 <--> SCL
+ * 			I2C1: PTE0  <--> SDA, PTE1  <--> SCL
  *
  * @author  Krish Shah
  * @date    December 13 2023
@@ -21,6 +22,8 @@
 #ifndef __I2C_H__
 #define __I2C_H__
 #include "stdint.h"
+#include "MKL25Z4.h"
+#include "systick.h"
 
 typedef enum{
 	I2C_NACK = 0,
@@ -32,131 +35,411 @@ typedef enum{
 	I2C_READ = 1
 }i2c_operation_t;
 
+typedef enum{
+	I2C_STATUS_OK = 0,
+	I2C_STATUS_NACK,
+	I2C_STATUS_ARB_LOST,
+	I2C_STATUS_PENDING,
+	I2C_STATUS_QUEUE_FULL,
+	I2C_STATUS_DMA_ERROR,
+	I2C_STATUS_TIMEOUT,
+	I2C_STATUS_BUS_ERROR
+}i2c_status_t;
+
+#define I2C_DEFAULT_TIMEOUT_MS		(5U)
+
+typedef enum{
+	I2C_SPEED_STANDARD,
+	I2C_SPEED_FAST,
+	I2C_SPEED_FAST_PLUS
+}i2c_speed_t;
+
+#define I2C_SPEED_STANDARD_HZ		(100000U)
+#define I2C_SPEED_FAST_HZ			(400000U)
+#define I2C_SPEED_FAST_PLUS_HZ		(1000000U)
+
+//describes a device, the bus it sits on, the fastest SCL it is rated for and how many times its driver
+//retries a failed transaction before giving up
+typedef struct{
+	I2C_Type *bus;
+	uint8_t addr;
+	i2c_speed_t max_speed;
+	uint8_t retries;
+}i2c_device_t;
+
+#define I2C_XFER_QUEUE_LEN			(12U)//per priority
+#define I2C_XFER_CMD_MAX_LEN		(7U)
+
+//end the transaction with a repeated start into the next queued transaction instead of a STOP.
+//only honoured for write-only transactions, read transactions always end with a STOP
+#define I2C_XFER_FLAG_REPEATED_START (0x01U)
+
+//move the tx bytes from memory into the D register with the DMA controller instead of one interrupt per byte.
+//ack is only checked on the last byte when this is used
+#define I2C_XFER_FLAG_DMA			(0x02U)
+
+//queue ahead of all normal priority transactions, it runs as soon as the transaction on the bus is done
+#define I2C_XFER_FLAG_HIGH_PRIORITY	(0x04U)
+
+typedef struct{
+	uint32_t delayed;//high priority transactions which found the bus busy
+	uint32_t overtaken;//normal priority transactions a high priority one was run ahead of
+}i2c_arbiter_stats_t;
+
+#undef I2C_PROFILE//change to #define to record per device timing and error counters for every transaction
+
+#define I2C_PROFILE_MAX_DEVICES		(4U)
+#define I2C_PROFILE_HIST_BUCKETS	(8U)//bucket 0 is below 64us, every next bucket doubles, last one is open ended
+#define I2C_PROFILE_WINDOW_MS		(1000U)//length of the window the bus utilisation is averaged over
+
+typedef struct{
+	uint8_t addr;
+	uint32_t xfers;
+	uint32_t bytes;//bytes of successful transactions, not counting address bytes
+	uint32_t busy_us;
+	uint32_t max_us;
+	uint32_t nacks;
+	uint32_t arb_lost;
+	uint32_t errors;//timeouts, dma and bus errors
+}i2c_profile_device_t;
+
+#undef I2C_TRACE//change to #define to log every bus event into a RAM ring, dumped with i2c_trace_dump()
+
+#define I2C_TRACE_LEN				(512U)//entries, 8 bytes each, holds the bring up of both devices
+
+typedef enum{
+	I2C_TRACE_START,//data is non zero if the bus had to be recovered first
+	I2C_TRACE_RSTART,
+	I2C_TRACE_STOP,
+	I2C_TRACE_TX,//data is the byte written, the first one after a start is the address
+	I2C_TRACE_RX,//data is the byte read
+	I2C_TRACE_ACK,
+	I2C_TRACE_NACK,
+	I2C_TRACE_ARB_LOST,
+	I2C_TRACE_DMA,//data is the low byte of the number of tx bytes handed to the DMA channel
+	I2C_TRACE_RECOVER//data is the status of the recovery
+}i2c_trace_event_t;
+
+typedef struct{
+	uint32_t time_us;
+	uint8_t bus;//0 for I2C0, 1 for I2C1
+	uint8_t event;
+	uint8_t data;
+}i2c_trace_entry_t;
+
+#undef I2C_FAULT_INJECT//change to #define to inject bus faults at the rates set with i2c_set_fault_rate()
+
+typedef enum{
+	I2C_FAULT_NACK,//an ack from the slave is read as a nack
+	I2C_FAULT_STUCK_BUSY,//the bus stays busy before a start till the timeout, then is recovered
+	I2C_FAULT_ARB_LOST,//arbitration is reported lost after a byte
+	I2C_FAULT_DROP_IICIF,//a byte complete flag is missed, the transaction stalls till the timeout
+	I2C_NUM_FAULTS
+}i2c_fault_t;
+
+//default injection rates, out of 1000 chances
+#define I2C_FAULT_NACK_PER_MILLE			(10U)
+#define I2C_FAULT_STUCK_BUSY_PER_MILLE		(2U)
+#define I2C_FAULT_ARB_LOST_PER_MILLE		(2U)
+#define I2C_FAULT_DROP_IICIF_PER_MILLE		(1U)
+
+typedef struct{
+	uint32_t injected[I2C_NUM_FAULTS];
+}i2c_fault_stats_t;
+
+typedef struct i2c_xfer i2c_xfer_t;
+
+typedef void (*i2c_xfer_callback_t)(i2c_xfer_t *xfer);
+
+/*
+ * Transaction descriptor for the interrupt driven engine. The engine sends the address, then the
+ * cmd bytes (register address, or control and addressing bytes), then the tx bytes. If rx_len is non zero a repeated
+ * start is issued and rx_len bytes are read into rx.
+ *
+ * The descriptor and the buffers it points to must stay valid until status is no longer
+ * I2C_STATUS_PENDING. The callback is optional and always runs in interrupt context, from the I2C
+ * or DMA interrupt of the bus. That includes a transaction aborted with I2C_STATUS_TIMEOUT after it
+ * stalled, the abort is handed to the I2C interrupt.
+ */
+struct i2c_xfer{
+	uint8_t addr;
+	uint8_t flags;
+	uint8_t cmd[I2C_XFER_CMD_MAX_LEN];
+	uint8_t cmd_len;
+	const uint8_t *tx;
+	uint16_t tx_len;
+	uint8_t *rx;
+	uint16_t rx_len;
+	i2c_xfer_callback_t callback;
+	void *context;
+	volatile i2c_status_t status;
+};
+
 /*
- * Function to initialize the I2C1 peripheral on the FRDMKL25Z, and its corresponding pins.
- * 			PTE0 <--> SDA
- * 			PTE1 <--> SCL
+ * Function to initialize an I2C peripheral on the FRDMKL25Z, and its corresponding pins.
+ * 			I2C0: PTE25 <--> SDA, PTE24 <--> SCL (shared with the onboard MMA8451Q accelerometer)
+ * 			I2C1: PTE0  <--> SDA, PTE1  <--> SCL
  *
- * Core clock in this project is 48MHz. The mul is left to default value of 1(to avoid restart error as mentioned in the
- * errata sheet), and prescaler is set to 480 by using an ICR value of 0x27.
+ * The peripheral starts at a divider of 480 (ICR 0x27, MULT 1), 50kHz from the 24MHz bus clock, which every
+ * device on the bus can follow while the bus is probed. The working speed is set afterwards with
+ * i2c_set_speed(), which takes the F register value from i2c_calc_freq_reg().
+ *
+ * It also routes the DMA request of the peripheral to its own DMA channel, channel 0 for I2C1 and channel 1
+ * for I2C0, which is used for I2C_XFER_FLAG_DMA transactions.
  *
  * Parameters:
- *  none
+ *  i2c the I2C peripheral
  *
  * Returns:
  *  none
  */
-void init_i2c();
+void init_i2c(I2C_Type *i2c);
 
 /*
- * Sends a start condition on the I2C line
+ * Function to wait for the bus to be free. If it stays busy past the timeout the bus is recovered.
  *
  * Parameters:
- *  none
+ *  i2c the I2C peripheral
  *
  * Returns:
- *  none
+ *  I2C_STATUS_OK if the bus became free
+ *  I2C_STATUS_TIMEOUT if it had to be recovered
+ *  I2C_STATUS_BUS_ERROR if SDA is still held low after the recovery
  */
-void I2C_START();
+i2c_status_t i2c_wait_bus_free(I2C_Type *i2c);
 
 /*
- * Sends a stop condition on the I2C line
+ * Function to check if a wait that began at start has gone over the configured timeout
  *
  * Parameters:
- *  none
+ *  start tick value at which the wait began
+ *
+ * Returns:
+ *  1 if the deadline has passed, 0 otherwise
+ */
+int i2c_deadline_passed(ticktime_t start);
+
+/*
+ * Function to recover the bus after a timeout. The I2C module is switched off and the pins are used as
+ * GPIOs. SCL is clocked till the slave holding SDA releases it, then a STOP is generated by taking
+ * SDA high while SCL is high. After that the pins and the I2C module are set up again.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *
+ * Returns:
+ *  I2C_STATUS_OK if SDA was released
+ *  I2C_STATUS_BUS_ERROR if SDA is still held low
+ */
+i2c_status_t i2c_recover_bus(I2C_Type *i2c);
+
+/*
+ * Function to add one event to the trace ring, the oldest event is overwritten once it is full.
+ * Only present when I2C_TRACE is defined, use I2C_TRACE_EVENT() instead of calling it directly.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *  event the bus event
+ *  data byte that goes with the event
  *
  * Returns:
  *  none
  */
-void I2C_STOP();
+void i2c_trace_record(I2C_Type *i2c, i2c_trace_event_t event, uint8_t data);
+
+/*
+ * Function to decide if a fault should be injected at this point. Only present when I2C_FAULT_INJECT
+ * is defined, use I2C_FAULT() instead of calling it directly.
+ *
+ * Parameters:
+ *  fault the fault to roll for
+ *
+ * Returns:
+ *  1 if the fault should be injected, 0 otherwise
+ */
+int i2c_fault_roll(i2c_fault_t fault);
+
+/*
+ * Function to decide if a fault should be injected at this point, always 0 when I2C_FAULT_INJECT is
+ * not defined so the injection points compile away
+ *
+ * Parameters:
+ *  fault the fault to roll for
+ *
+ * Returns:
+ *  1 if the fault should be injected, 0 otherwise
+ */
+static inline int I2C_FAULT(i2c_fault_t fault)
+{
+#ifdef I2C_FAULT_INJECT
+	return i2c_fault_roll(fault);
+#else
+	return 0;
+#endif
+}
 
 /*
- * Sends a Restart condition on the on the I2C line
+ * Function to check if fault injection is compiled in
  *
  * Parameters:
  *  none
  *
  * Returns:
+ *  1 if I2C_FAULT_INJECT is defined, 0 otherwise
+ */
+static inline int I2C_FAULT_ENABLED()
+{
+#ifdef I2C_FAULT_INJECT
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Function to log a bus event in the trace ring, compiles to nothing when I2C_TRACE is not defined
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *  event the bus event
+ *  data byte that goes with the event
+ *
+ * Returns:
  *  none
  */
-void I2C_RSTART();
+static inline void I2C_TRACE_EVENT(I2C_Type *i2c, i2c_trace_event_t event, uint8_t data)
+{
+#ifdef I2C_TRACE
+	i2c_trace_record(i2c, event, data);
+#endif
+}
 
 /*
- * Blocking delay call to wait for event on I2C Lines
+ * Sends a stop condition on the I2C line
  *
  * Parameters:
+ *  i2c the I2C peripheral
+ *
+ * Returns:
  *  none
+ */
+static inline void I2C_STOP(I2C_Type *i2c)
+{
+	i2c->C1 &= ~I2C_C1_MST_MASK;
+	I2C_TRACE_EVENT(i2c, I2C_TRACE_STOP, 0);
+}
+
+/*
+ * Sends a Restart condition on the on the I2C line. According to the errata sheet a repeated start
+ * can not be generated while MULT is not 1, so MULT is cleared around setting RSTA.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
  *
  * Returns:
  *  none
  */
-void I2C_WAIT_IICIF();
+static inline void I2C_RSTART(I2C_Type *i2c)
+{
+	uint8_t freq_reg = i2c->F;
+	i2c->F = freq_reg & ~I2C_F_MULT_MASK;
+	i2c->C1 |= I2C_C1_RSTA_MASK;
+	i2c->F = freq_reg;
+	I2C_TRACE_EVENT(i2c, I2C_TRACE_RSTART, 0);
+}
 
 /*
  * Function to check if an ack or nack was received after the previous transaction
  *
  * Parameters:
- *  none
+ *  i2c the I2C peripheral
  *
  * Returns:
  *  1 for ack, 0 for nack
  */
-i2c_ack_t I2C_RXAK();
+static inline i2c_ack_t I2C_RXAK(I2C_Type *i2c)
+{
+	if((i2c->S & I2C_S_RXAK_MASK) || I2C_FAULT(I2C_FAULT_NACK)){
+		//no ack was received
+		I2C_TRACE_EVENT(i2c, I2C_TRACE_NACK, 0);
+		return I2C_NACK;
+	}else{
+		I2C_TRACE_EVENT(i2c, I2C_TRACE_ACK, 0);
+		return I2C_ACK;
+	}
+}
 
 /*
  * Send a ack on the i2c lines
  *
  * Parameters:
- *  none
+ *  i2c the I2C peripheral
  *
  * Returns:
  *  none
  */
-void I2C_TX_ACK();
+static inline void I2C_TX_ACK(I2C_Type *i2c)
+{
+	i2c->C1 &= ~I2C_C1_TXAK_MASK;
+}
 
 /*
  * Send a nack on the i2c lines
  *
  * Parameters:
- *  none
+ *  i2c the I2C peripheral
  *
  * Returns:
  *  none
  */
-void I2C_TX_NACK();
+static inline void I2C_TX_NACK(I2C_Type *i2c)
+{
+	i2c->C1 |= I2C_C1_TXAK_MASK;
+}
 
 /*
  * Set I2C peripheral into transmit mode
  *
  * Parameters:
- *  none
+ *  i2c the I2C peripheral
  *
  * Returns:
  *  none
  */
-void I2C_TRANSMIT_MODE();
+static inline void I2C_TRANSMIT_MODE(I2C_Type *i2c)
+{
+	i2c->C1 |= I2C_C1_TX_MASK;
+}
 
 /*
  * Set I2C peripheral into receive mode
  *
  * Parameters:
- *  none
+ *  i2c the I2C peripheral
  *
  * Returns:
  *  none
  */
-void I2C_RECEIVE_MODE();
+static inline void I2C_RECEIVE_MODE(I2C_Type *i2c)
+{
+	i2c->C1 &= ~I2C_C1_TX_MASK;
+}
 
 /*
  * Send one byte of data on the I2C lines
  *
  * Parameters:
+ *  i2c the I2C peripheral
  *  byte the byte of data on the I2C lines
  *
  * Returns:
  *  none
  */
-void I2C_SEND_BYTE(uint8_t byte);
+static inline void I2C_SEND_BYTE(I2C_Type *i2c, uint8_t byte)
+{
+	i2c->D = byte;
+	I2C_TRACE_EVENT(i2c, I2C_TRACE_TX, byte);
+}
 
 /*
  * Function to calculate the i2c address based on read or write mode
@@ -168,5 +451,340 @@ void I2C_SEND_BYTE(uint8_t byte);
  * Returns:
  *  8 bit i2c address
  */
-uint8_t I2C_GET_ADDRESS(uint8_t addr, i2c_operation_t operation);
+static inline uint8_t I2C_GET_ADDRESS(uint8_t addr, i2c_operation_t operation)
+{
+	return (addr<<1 | operation);
+}
+
+/*
+ * Sends a start condition on the I2C line. Waits for the STOP of the previous transaction to finish
+ * on the bus first, since setting MST while the bus is still busy locks up the KL25Z I2C module.
+ * If the bus does not become free within the timeout it is recovered before the start is sent.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *
+ * Returns:
+ *  I2C_STATUS_OK if the bus was free
+ *  I2C_STATUS_TIMEOUT if the bus had to be recovered
+ *  I2C_STATUS_BUS_ERROR if SDA is still held low after the recovery, the start then loses arbitration
+ */
+static inline i2c_status_t I2C_START(I2C_Type *i2c)
+{
+	i2c_status_t status = I2C_STATUS_OK;
+	if((i2c->S & I2C_S_BUSY_MASK) || I2C_FAULT_ENABLED())
+	{//stuck busy faults are injected in the wait
+		status = i2c_wait_bus_free(i2c);
+	}
+	I2C_TRANSMIT_MODE(i2c);//recovery resets C1
+	i2c->C1 |= I2C_C1_MST_MASK;
+	I2C_TRACE_EVENT(i2c, I2C_TRACE_START, status);
+	return status;
+}
+
+/*
+ * Blocking delay call to wait for event on I2C Lines. If arbitration was lost the module has
+ * already dropped out of master mode, the flag is cleared and the loss is reported. If nothing
+ * happens within the timeout the bus is recovered.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *
+ * Returns:
+ *  I2C_STATUS_OK when the byte is done
+ *  I2C_STATUS_ARB_LOST if arbitration was lost
+ *  I2C_STATUS_TIMEOUT if the bus had to be recovered
+ */
+static inline i2c_status_t I2C_WAIT_IICIF(I2C_Type *i2c)
+{
+	uint8_t status;
+	ticktime_t start = now();
+	int dropped = I2C_FAULT(I2C_FAULT_DROP_IICIF);
+	while(((status = i2c->S) & I2C_S_IICIF_MASK) == 0 || dropped)
+	{
+		if(i2c_deadline_passed(start))
+		{
+			i2c_recover_bus(i2c);
+			return I2C_STATUS_TIMEOUT;
+		}
+	}
+	i2c->S = I2C_S_IICIF_MASK;
+	if((status & I2C_S_ARBL_MASK) || I2C_FAULT(I2C_FAULT_ARB_LOST))
+	{
+		i2c->S = I2C_S_ARBL_MASK;
+		i2c->C1 &= ~I2C_C1_MST_MASK;//already dropped on a real loss, an injected one must release the bus
+		I2C_TRACE_EVENT(i2c, I2C_TRACE_ARB_LOST, 0);
+		return I2C_STATUS_ARB_LOST;
+	}
+	return I2C_STATUS_OK;
+}
+
+/*
+ * Function to run one polled transaction on the bus. The tx bytes are written first, then if rx_len is
+ * non zero a repeated start is issued and rx_len bytes are read. Every byte is checked for an ack, and
+ * the bus is released with a STOP on any error. Waits till the interrupt driven engine is idle, and
+ * transactions submitted while the polled transaction has the bus are queued till it releases the bus.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *  addr 7 bit i2c address of the device
+ *  tx pointer to the bytes to write, can be NULL if tx_len is 0
+ *  tx_len number of bytes to write
+ *  rx(out) pointer to the buffer for the bytes read, can be NULL if rx_len is 0
+ *  rx_len number of bytes to read
+ *  flags I2C_XFER_FLAG_REPEATED_START to keep the bus after a write-only transaction, the next
+ *        transaction then starts with a repeated start
+ *
+ * Returns:
+ *  I2C_STATUS_OK on success
+ *  I2C_STATUS_NACK, I2C_STATUS_ARB_LOST or I2C_STATUS_TIMEOUT on failure
+ *  I2C_STATUS_BUS_ERROR if a slave still held SDA after the bus was recovered, nothing is sent
+ */
+i2c_status_t i2c_transfer(I2C_Type *i2c, uint8_t addr, const uint8_t *tx, uint16_t tx_len, uint8_t *rx, uint16_t rx_len, uint8_t flags);
+
+/*
+ * Function to queue a transaction on the interrupt driven engine. If the bus is idle the transaction
+ * is started right away, otherwise it runs after the transactions of the same priority queued before it.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *  xfer pointer to the transaction descriptor
+ *
+ * Returns:
+ *  I2C_STATUS_PENDING if the transaction was queued
+ *  I2C_STATUS_QUEUE_FULL if there was no room in the queue
+ */
+i2c_status_t i2c_submit(I2C_Type *i2c, i2c_xfer_t *xfer);
+
+/*
+ * Function to calculate the value of the I2C F register (MULT and ICR) which gives the fastest SCL that
+ * does not go over the requested frequency. MULT is kept at 1 whenever possible, since the errata sheet
+ * says a repeated start cannot be generated with any other MULT. Has no hardware access.
+ *
+ * Parameters:
+ *  bus_clk_hz the bus clock feeding the I2C module in Hz
+ *  scl_hz the requested SCL frequency in Hz
+ *
+ * Returns:
+ *  value for the F register, the slowest setting if the requested frequency can not be reached
+ */
+uint8_t i2c_calc_freq_reg(uint32_t bus_clk_hz, uint32_t scl_hz);
+
+/*
+ * Function to calculate the SCL frequency produced by a F register value
+ *
+ * Parameters:
+ *  bus_clk_hz the bus clock feeding the I2C module in Hz
+ *  freq_reg value of the F register
+ *
+ * Returns:
+ *  SCL frequency in Hz
+ */
+uint32_t i2c_calc_scl_freq(uint32_t bus_clk_hz, uint8_t freq_reg);
+
+/*
+ * Function to set the bus speed of an I2C peripheral, based on the current bus clock. Waits for the bus to be idle
+ * before changing it.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *  speed the speed profile to use
+ *
+ * Returns:
+ *  actual SCL frequency in Hz
+ */
+uint32_t i2c_set_speed(I2C_Type *i2c, i2c_speed_t speed);
+
+/*
+ * Function to find the fastest speed profile that all the given devices on a bus are rated for
+ *
+ * Parameters:
+ *  i2c the I2C peripheral, devices on other buses are skipped
+ *  devices array of pointers to the devices
+ *  num_devices number of devices in the array
+ *
+ * Returns:
+ *  the slowest of the max_speed of the devices
+ */
+i2c_speed_t i2c_get_speed_limit(I2C_Type *i2c, const i2c_device_t *devices[], uint8_t num_devices);
+
+/*
+ * Function to probe the bus speed at boot. Starting from standard mode the speed is stepped up
+ * towards the limit of the devices, at each step every device is addressed. The step is
+ * reverted and probing stops as soon as a device does not ack or the bus reports an error.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral, devices on other buses are skipped
+ *  devices array of pointers to the devices
+ *  num_devices number of devices in the array
+ *
+ * Returns:
+ *  the speed profile the bus was left at
+ */
+i2c_speed_t i2c_probe_speed(I2C_Type *i2c, const i2c_device_t *devices[], uint8_t num_devices);
+
+/*
+ * Function to check if the interrupt driven engine is running or has queued transactions
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *
+ * Returns:
+ *  1 if busy, 0 if idle
+ */
+int i2c_engine_busy(I2C_Type *i2c);
+
+/*
+ * Blocking call to wait till the interrupt driven engine has finished all queued transactions and the
+ * bus is free. i2c_transfer() waits for this itself and then keeps the engine claimed, since both drive
+ * the same peripheral.
+ * A transaction which makes no progress for longer than the timeout is aborted and the bus is recovered
+ * by i2c_tick(), so the wait is bounded by the number of queued transactions.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *
+ * Returns:
+ *  none
+ */
+void i2c_wait_idle(I2C_Type *i2c);
+
+/*
+ * Function to queue a transaction on the engine and wait for it to finish. Used with
+ * I2C_XFER_FLAG_HIGH_PRIORITY so that a short read only waits for the transaction already on the
+ * bus, instead of all queued display traffic.
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *  xfer pointer to the transaction descriptor
+ *
+ * Returns:
+ *  final status of the transaction
+ */
+i2c_status_t i2c_submit_and_wait(I2C_Type *i2c, i2c_xfer_t *xfer);
+
+/*
+ * Function to get the counters of the engine arbiter
+ *
+ * Parameters:
+ *  i2c the I2C peripheral
+ *  stats(out) pointer to structure to copy the counters into
+ *
+ * Returns:
+ *  none
+ */
+void i2c_get_arbiter_stats(I2C_Type *i2c, i2c_arbiter_stats_t *stats);
+
+/*
+ * Function to set the timeout used by every wait on the bus
+ *
+ * Parameters:
+ *  ms timeout in milliseconds
+ *
+ * Returns:
+ *  none
+ */
+void i2c_set_timeout(uint32_t ms);
+
+/*
+ * Function to give the engine transactions their deadline, called from the SysTick interrupt every ms.
+ * A transaction which makes no progress for longer than the timeout is aborted with I2C_STATUS_TIMEOUT
+ * and the bus is recovered, whether or not anything waits on it.
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void i2c_tick();
+
+#ifdef I2C_FAULT_INJECT
+/*
+ * Function to set how often a fault is injected
+ *
+ * Parameters:
+ *  fault the fault to set the rate of
+ *  per_mille chance out of 1000 that the fault is injected at each point it can happen
+ *
+ * Returns:
+ *  none
+ */
+void i2c_set_fault_rate(i2c_fault_t fault, uint16_t per_mille);
+
+/*
+ * Function to get the number of faults injected so far
+ *
+ * Parameters:
+ *  stats(out) pointer to structure to copy the counters into
+ *
+ * Returns:
+ *  none
+ */
+void i2c_get_fault_stats(i2c_fault_stats_t *stats);
+#endif
+
+#ifdef I2C_TRACE
+/*
+ * Function to print the trace ring over the debug console, oldest event first, and clear it.
+ * Recording is paused while printing, so the dump is a consistent picture of the bus up to the call.
+ * Each line is: time in us, bus, event, data, all in hex.
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void i2c_trace_dump();
+#endif
+
+#ifdef I2C_PROFILE
+/*
+ * Function to print the profiler counters, the latency histogram and the bus utilisation
+ * over the debug console
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void i2c_profile_dump();
+
+/*
+ * Function to clear all profiler counters
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+void i2c_profile_reset();
+
+/*
+ * Function to get the share of time the bus was busy over the last complete window
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  utilisation in percent
+ */
+uint8_t i2c_profile_utilization();
+
+/*
+ * Function to get the total time the bus was busy with transactions to one device, since the
+ * profiler counters were last cleared
+ *
+ * Parameters:
+ *  addr 7-bit address of the device
+ *
+ * Returns:
+ *  busy time in microseconds, 0 for a device not in the table
+ */
+uint32_t i2c_profile_busy_us(uint8_t addr);
+#endif
+
 #endif
@@ -0,0 +1,496 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    mag_cal.c
+ * @brief   Streaming ellipsoid fit used to calibrate the magnetometer. Fits the quadric
+ *
+ * 				A*x^2 + B*y^2 + C*z^2 + D*yz + E*xz + F*xy + G*x + H*y + I*z = 1
+ *
+ * 			by least squares, through the normal equations (sum of d*d')*p = sum of d, with d the
+ * 			9 terms of a sample. The sums are kept in 64 bit integers, so adding a sample is 45
+ * 			multiply-accumulates with no floating point. Solving is done once, in software double
+ * 			with no libm: about 780 additions, 1050 multiplications and 360 divisions per solve,
+ * 			once after a calibration run of many seconds. Its time on the core has not been measured.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "mag_cal.h"
+#include "QMC5883L.h"
+
+#define QUADRATIC_TERM_SHIFT	2//quadratic terms are stored divided by 4, so they stay within 24 bits
+#define NUM_QUADRATIC_TERMS		6
+#define JACOBI_MAX_SWEEPS		16
+#define AXIS_COUNT				3
+#define DOUBLE_EXP_SHIFT		52
+#define DOUBLE_EXP_BIAS			((int64_t)1023 << DOUBLE_EXP_SHIFT)
+#define NEWTON_STEPS			5//the first guess is within 10%, 5 steps reach full double precision
+
+typedef union{
+	double value;
+	int64_t bits;
+}double_bits_t;
+
+/*
+ * Function to get the absolute value of a double
+ *
+ * Parameters:
+ *  x the value
+ *
+ * Returns:
+ *  |x|
+ */
+static inline double cal_abs(double x)
+{
+	return (x < 0) ? -x : x;
+}
+
+/*
+ * Function to round a double to the nearest integer, halves away from zero
+ *
+ * Parameters:
+ *  x the value, within the range of int32_t
+ *
+ * Returns:
+ *  the rounded value
+ */
+static inline int32_t cal_round(double x)
+{
+	return (int32_t)((x < 0) ? (x - 0.5) : (x + 0.5));
+}
+
+/*
+ * Function to take the square root with newton steps, from a first guess made by halving the
+ * exponent in the bit pattern. Used instead of sqrt() so the fit only needs the soft float
+ * arithmetic of the compiler, and not libm with its error handling
+ *
+ * Parameters:
+ *  x the value
+ *
+ * Returns:
+ *  square root of x, 0 if x is not positive
+ */
+static double cal_sqrt(double x)
+{
+	double_bits_t guess = {x};
+	double y;
+
+	if(x <= 0)
+	{
+		return 0;
+	}
+	guess.bits = ((guess.bits - DOUBLE_EXP_BIAS) >> 1) + DOUBLE_EXP_BIAS;
+	y = guess.value;
+	for(int i = 0; i < NEWTON_STEPS; i++)
+	{
+		y = (y + x/y)*0.5;
+	}
+	return y;
+}
+
+/*
+ * Function to take the cube root with newton steps, from a first guess made by dividing the
+ * exponent in the bit pattern by 3. Used instead of cbrt() for the same reason as cal_sqrt()
+ *
+ * Parameters:
+ *  x the value
+ *
+ * Returns:
+ *  cube root of x, 0 if x is not positive
+ */
+static double cal_cbrt(double x)
+{
+	double_bits_t guess = {x};
+	double y;
+
+	if(x <= 0)
+	{
+		return 0;
+	}
+	guess.bits = (guess.bits - DOUBLE_EXP_BIAS)/3 + DOUBLE_EXP_BIAS;
+	y = guess.value;
+	for(int i = 0; i < NEWTON_STEPS; i++)
+	{
+		y = (2*y + x/(y*y))/3;
+	}
+	return y;
+}
+
+/*
+ * Function to find the index of an element of the upper triangle of the 9x9 sum of d*d'
+ *
+ * Parameters:
+ *  row row of the element
+ *  col column of the element, not less than row
+ *
+ * Returns:
+ *  index into dtd
+ */
+static inline int dtd_index(int row, int col)
+{
+	return row*MAG_CAL_NUM_TERMS - row*(row - 1)/2 + (col - row);
+}
+
+/*
+ * Function to clear the calibrator before a new calibration run
+ *
+ * Parameters:
+ *  cal(out) pointer to the calibrator
+ *
+ * Returns:
+ *  none
+ */
+void mag_cal_init(mag_cal_t *cal)
+{
+	for(int i = 0; i < MAG_CAL_NUM_SUMS; i++)
+	{
+		cal->dtd[i] = 0;
+	}
+	for(int i = 0; i < MAG_CAL_NUM_TERMS; i++)
+	{
+		cal->dt1[i] = 0;
+	}
+	cal->samples = 0;
+	cal->rejected = 0;
+}
+
+/*
+ * Function to add a raw sample to the fit. Samples with an axis beyond MAG_CAL_MAX_INPUT, or
+ * past MAG_CAL_MAX_SAMPLES, are counted as rejected.
+ *
+ * With axes within 13 bits every term is within 24 bits, each product within 48 bits, and
+ * MAG_CAL_MAX_SAMPLES of them within 62 bits
+ *
+ * Parameters:
+ *  cal(in/out) pointer to the calibrator
+ *  sample(in) pointer to the raw x, y and z values
+ *
+ * Returns:
+ *  1 if the sample was added
+ *  0 if it was rejected
+ */
+uint8_t mag_cal_add_sample(mag_cal_t *cal, const int16_t sample[])
+{
+	int32_t x = sample[AXIS_X], y = sample[AXIS_Y], z = sample[AXIS_Z];
+	int32_t d[MAG_CAL_NUM_TERMS];
+	int k = 0;
+
+	if(cal->samples >= MAG_CAL_MAX_SAMPLES ||
+	   x > MAG_CAL_MAX_INPUT || x < -MAG_CAL_MAX_INPUT ||
+	   y > MAG_CAL_MAX_INPUT || y < -MAG_CAL_MAX_INPUT ||
+	   z > MAG_CAL_MAX_INPUT || z < -MAG_CAL_MAX_INPUT)
+	{
+		cal->rejected++;
+		return 0;
+	}
+
+	d[0] = (x*x) >> QUADRATIC_TERM_SHIFT;
+	d[1] = (y*y) >> QUADRATIC_TERM_SHIFT;
+	d[2] = (z*z) >> QUADRATIC_TERM_SHIFT;
+	d[3] = (y*z) >> QUADRATIC_TERM_SHIFT;
+	d[4] = (x*z) >> QUADRATIC_TERM_SHIFT;
+	d[5] = (x*y) >> QUADRATIC_TERM_SHIFT;
+	d[6] = x;
+	d[7] = y;
+	d[8] = z;
+
+	for(int row = 0; row < MAG_CAL_NUM_TERMS; row++)
+	{
+		for(int col = row; col < MAG_CAL_NUM_TERMS; col++)
+		{
+			cal->dtd[k++] += (int64_t)d[row] * d[col];
+		}
+		cal->dt1[row] += d[row];
+	}
+	cal->samples++;
+	return 1;
+}
+
+/*
+ * Function to solve the normal equations for the quadric coefficients. The columns are scaled
+ * to a unit diagonal first, the quadratic and linear terms differ by about 2^11 in size, then
+ * gaussian elimination with partial pivoting is used
+ *
+ * Parameters:
+ *  cal(in) pointer to the calibrator
+ *  p(out) pointer to the 9 coefficients, in the order of the terms
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the system is singular
+ */
+static uint8_t solve_normal_equations(const mag_cal_t *cal, double p[])
+{
+	double a[MAG_CAL_NUM_TERMS][MAG_CAL_NUM_TERMS + 1];
+	double scale[MAG_CAL_NUM_TERMS];
+	double factor, tmp;
+	int pivot;
+
+	for(int i = 0; i < MAG_CAL_NUM_TERMS; i++)
+	{
+		tmp = (double)cal->dtd[dtd_index(i, i)];
+		if(tmp <= 0)
+		{
+			return 0;
+		}
+		scale[i] = 1.0/cal_sqrt(tmp);
+	}
+	for(int row = 0; row < MAG_CAL_NUM_TERMS; row++)
+	{
+		for(int col = row; col < MAG_CAL_NUM_TERMS; col++)
+		{
+			a[row][col] = (double)cal->dtd[dtd_index(row, col)] * scale[row] * scale[col];
+			a[col][row] = a[row][col];
+		}
+		a[row][MAG_CAL_NUM_TERMS] = (double)cal->dt1[row] * scale[row];
+	}
+
+	for(int col = 0; col < MAG_CAL_NUM_TERMS; col++)
+	{
+		pivot = col;
+		for(int row = col + 1; row < MAG_CAL_NUM_TERMS; row++)
+		{
+			if(cal_abs(a[row][col]) > cal_abs(a[pivot][col]))
+			{
+				pivot = row;
+			}
+		}
+		if(cal_abs(a[pivot][col]) < 1e-12)
+		{
+			return 0;
+		}
+		for(int k = col; k <= MAG_CAL_NUM_TERMS; k++)
+		{
+			tmp = a[col][k];
+			a[col][k] = a[pivot][k];
+			a[pivot][k] = tmp;
+		}
+		for(int row = col + 1; row < MAG_CAL_NUM_TERMS; row++)
+		{
+			factor = a[row][col]/a[col][col];
+			for(int k = col; k <= MAG_CAL_NUM_TERMS; k++)
+			{
+				a[row][k] -= factor*a[col][k];
+			}
+		}
+	}
+	for(int row = MAG_CAL_NUM_TERMS - 1; row >= 0; row--)
+	{
+		tmp = a[row][MAG_CAL_NUM_TERMS];
+		for(int k = row + 1; k < MAG_CAL_NUM_TERMS; k++)
+		{
+			tmp -= a[row][k]*p[k];
+		}
+		p[row] = tmp/a[row][row];
+	}
+	for(int i = 0; i < MAG_CAL_NUM_TERMS; i++)
+	{
+		p[i] *= scale[i];
+	}
+	return 1;
+}
+
+/*
+ * Function to diagonalise a symmetric 3x3 matrix with jacobi rotations, m = v*diag(eig)*v'
+ *
+ * Parameters:
+ *  m(in) the symmetric matrix
+ *  eig(out) the eigenvalues
+ *  v(out) the eigenvectors, one per column
+ *
+ * Returns:
+ *  none
+ */
+static void eigen_symmetric_3x3(const double m[AXIS_COUNT][AXIS_COUNT], double eig[], double v[AXIS_COUNT][AXIS_COUNT])
+{
+	double a[AXIS_COUNT][AXIS_COUNT];
+	double theta, t, c, s, tmp_p, tmp_q;
+
+	for(int i = 0; i < AXIS_COUNT; i++)
+	{
+		for(int j = 0; j < AXIS_COUNT; j++)
+		{
+			a[i][j] = m[i][j];
+			v[i][j] = (i == j);
+		}
+	}
+	for(int sweep = 0; sweep < JACOBI_MAX_SWEEPS; sweep++)
+	{
+		if(cal_abs(a[0][1]) + cal_abs(a[0][2]) + cal_abs(a[1][2]) < 1e-15*(cal_abs(a[0][0]) + cal_abs(a[1][1]) + cal_abs(a[2][2])))
+		{
+			break;
+		}
+		for(int p = 0; p < AXIS_COUNT - 1; p++)
+		{
+			for(int q = p + 1; q < AXIS_COUNT; q++)
+			{
+				if(a[p][q] == 0)
+				{
+					continue;
+				}
+				theta = (a[q][q] - a[p][p])/(2*a[p][q]);
+				t = (theta >= 0 ? 1.0 : -1.0)/(cal_abs(theta) + cal_sqrt(theta*theta + 1));
+				c = 1/cal_sqrt(t*t + 1);
+				s = t*c;
+				for(int k = 0; k < AXIS_COUNT; k++)
+				{//a = a*r
+					tmp_p = a[k][p];
+					tmp_q = a[k][q];
+					a[k][p] = c*tmp_p - s*tmp_q;
+					a[k][q] = s*tmp_p + c*tmp_q;
+				}
+				for(int k = 0; k < AXIS_COUNT; k++)
+				{//a = r'*a
+					tmp_p = a[p][k];
+					tmp_q = a[q][k];
+					a[p][k] = c*tmp_p - s*tmp_q;
+					a[q][k] = s*tmp_p + c*tmp_q;
+				}
+				for(int k = 0; k < AXIS_COUNT; k++)
+				{
+					tmp_p = v[k][p];
+					tmp_q = v[k][q];
+					v[k][p] = c*tmp_p - s*tmp_q;
+					v[k][q] = s*tmp_p + c*tmp_q;
+				}
+			}
+		}
+	}
+	for(int i = 0; i < AXIS_COUNT; i++)
+	{
+		eig[i] = a[i][i];
+	}
+}
+
+/*
+ * Function to fit an ellipsoid to the samples added so far, and turn it into the hard iron offset
+ * and soft iron matrix used by qmc_calibrate_data().
+ *
+ * With q the symmetric matrix of the quadratic coefficients and g the linear ones, the centre is
+ * c = -inv(q)*g/2 and the ellipsoid is (v - c)'*(q/k)*(v - c) = 1 with k = 1 + c'*q*c. The soft
+ * iron matrix is the symmetric square root of q/k, scaled by the mean radius of the ellipsoid
+ *
+ * Parameters:
+ *  cal(in) pointer to the calibrator
+ *  result(out) pointer to the calibration data to fill, only written on success
+ *
+ * Returns:
+ *  1 on success
+ *  0 if there are too few samples, or they do not describe an ellipsoid
+ */
+uint8_t mag_cal_solve(const mag_cal_t *cal, qmc_calibration_data_t *result)
+{
+	double p[MAG_CAL_NUM_TERMS];
+	double q[AXIS_COUNT][AXIS_COUNT], q_inv[AXIS_COUNT][AXIS_COUNT];
+	double v[AXIS_COUNT][AXIS_COUNT], eig[AXIS_COUNT];
+	double centre[AXIS_COUNT], w[AXIS_COUNT][AXIS_COUNT];
+	double det, k, radius, entry;
+
+	if(cal->samples < MAG_CAL_MIN_SAMPLES || !solve_normal_equations(cal, p))
+	{
+		return 0;
+	}
+	for(int i = 0; i < NUM_QUADRATIC_TERMS; i++)
+	{
+		p[i] /= (1 << QUADRATIC_TERM_SHIFT);
+	}
+
+	q[0][0] = p[0];
+	q[1][1] = p[1];
+	q[2][2] = p[2];
+	q[1][2] = q[2][1] = p[3]/2;
+	q[0][2] = q[2][0] = p[4]/2;
+	q[0][1] = q[1][0] = p[5]/2;
+
+	//inverse through the adjugate
+	q_inv[0][0] = q[1][1]*q[2][2] - q[1][2]*q[2][1];
+	q_inv[0][1] = q[0][2]*q[2][1] - q[0][1]*q[2][2];
+	q_inv[0][2] = q[0][1]*q[1][2] - q[0][2]*q[1][1];
+	q_inv[1][0] = q[1][2]*q[2][0] - q[1][0]*q[2][2];
+	q_inv[1][1] = q[0][0]*q[2][2] - q[0][2]*q[2][0];
+	q_inv[1][2] = q[0][2]*q[1][0] - q[0][0]*q[1][2];
+	q_inv[2][0] = q[1][0]*q[2][1] - q[1][1]*q[2][0];
+	q_inv[2][1] = q[0][1]*q[2][0] - q[0][0]*q[2][1];
+	q_inv[2][2] = q[0][0]*q[1][1] - q[0][1]*q[1][0];
+	det = q[0][0]*q_inv[0][0] + q[0][1]*q_inv[1][0] + q[0][2]*q_inv[2][0];
+	if(det == 0)
+	{
+		return 0;
+	}
+
+	k = 1;
+	for(int i = 0; i < AXIS_COUNT; i++)
+	{
+		centre[i] = 0;
+		for(int j = 0; j < AXIS_COUNT; j++)
+		{
+			centre[i] -= q_inv[i][j]*p[NUM_QUADRATIC_TERMS + j]/(2*det);
+		}
+	}
+	for(int i = 0; i < AXIS_COUNT; i++)
+	{
+		for(int j = 0; j < AXIS_COUNT; j++)
+		{
+			k += centre[i]*q[i][j]*centre[j];
+		}
+	}
+	if(k <= 0)
+	{
+		return 0;
+	}
+	for(int i = 0; i < AXIS_COUNT; i++)
+	{
+		for(int j = 0; j < AXIS_COUNT; j++)
+		{
+			q[i][j] /= k;
+		}
+	}
+
+	eigen_symmetric_3x3(q, eig, v);
+	if(eig[0] <= 0 || eig[1] <= 0 || eig[2] <= 0)
+	{//not an ellipsoid, the samples do not cover enough orientations
+		return 0;
+	}
+	radius = 1/cal_sqrt(cal_cbrt(eig[0]*eig[1]*eig[2]));//geometric mean of the semi axes, 1/sqrt(eig)
+
+	for(int i = 0; i < AXIS_COUNT; i++)
+	{
+		for(int j = 0; j < AXIS_COUNT; j++)
+		{
+			w[i][j] = 0;
+			for(int n = 0; n < AXIS_COUNT; n++)
+			{
+				w[i][j] += v[i][n]*cal_sqrt(eig[n])*v[j][n];
+			}
+			w[i][j] *= radius;
+			if(w[i][j] >= 2 || w[i][j] < -2)
+			{//outside of Q2.14
+				return 0;
+			}
+		}
+		if(centre[i] > INT16_MAX || centre[i] < INT16_MIN)
+		{
+			return 0;
+		}
+	}
+
+	for(int i = 0; i < AXIS_COUNT; i++)
+	{
+		result->offset[i] = (int16_t)cal_round(centre[i]);
+		for(int j = 0; j < AXIS_COUNT; j++)
+		{
+			entry = w[i][j]*(1 << QMC_CAL_FRAC_BITS);
+			result->matrix[i][j] = (entry >= INT16_MAX) ? INT16_MAX : (int16_t)cal_round(entry);
+		}
+	}
+	return 1;
+}
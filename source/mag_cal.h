@@ -0,0 +1,79 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    mag_cal.h
+ * @brief   Header file for the streaming ellipsoid fit used to calibrate the magnetometer. Samples
+ * 			are folded into the sums of a least squares fit as they arrive, so the memory used and
+ * 			the cost of a sample do not depend on the number of samples.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __MAG_CAL_H__
+#define __MAG_CAL_H__
+#include "stdint.h"
+#include "QMC5883L.h"
+
+#define MAG_CAL_NUM_TERMS	(9U)//x^2, y^2, z^2, yz, xz, xy, x, y, z
+#define MAG_CAL_NUM_SUMS	(MAG_CAL_NUM_TERMS*(MAG_CAL_NUM_TERMS + 1)/2)
+#define MAG_CAL_MAX_INPUT	(8191)//larger axis values are rejected, keeps the sums inside 64 bits
+#define MAG_CAL_MAX_SAMPLES	(16384U)
+#define MAG_CAL_MIN_SAMPLES	(MAG_CAL_NUM_TERMS*4)
+
+typedef struct{
+	int64_t dtd[MAG_CAL_NUM_SUMS];//upper triangle of the sum of d*d' over the samples, d being the terms
+	int64_t dt1[MAG_CAL_NUM_TERMS];//sum of d over the samples
+	uint16_t samples;
+	uint16_t rejected;
+}mag_cal_t;
+
+/*
+ * Function to clear the calibrator before a new calibration run
+ *
+ * Parameters:
+ *  cal(out) pointer to the calibrator
+ *
+ * Returns:
+ *  none
+ */
+void mag_cal_init(mag_cal_t *cal);
+
+/*
+ * Function to add a raw sample to the fit. Samples with an axis beyond MAG_CAL_MAX_INPUT, or
+ * past MAG_CAL_MAX_SAMPLES, are counted as rejected
+ *
+ * Parameters:
+ *  cal(in/out) pointer to the calibrator
+ *  sample(in) pointer to the raw x, y and z values
+ *
+ * Returns:
+ *  1 if the sample was added
+ *  0 if it was rejected
+ */
+uint8_t mag_cal_add_sample(mag_cal_t *cal, const int16_t sample[]);
+
+/*
+ * Function to fit an ellipsoid to the samples added so far, and turn it into the hard iron offset
+ * and soft iron matrix used by qmc_calibrate_data(). The matrix maps the ellipsoid onto a sphere
+ * with the mean radius of the ellipsoid, so calibrated values keep the scale of the raw ones
+ *
+ * Parameters:
+ *  cal(in) pointer to the calibrator
+ *  result(out) pointer to the calibration data to fill, only written on success
+ *
+ * Returns:
+ *  1 on success
+ *  0 if there are too few samples, or they do not describe an ellipsoid
+ */
+uint8_t mag_cal_solve(const mag_cal_t *cal, qmc_calibration_data_t *result);
+
+#endif
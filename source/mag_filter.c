@@ -0,0 +1,150 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    mag_filter.c
+ * @brief   Low pass filter and decimator of the magnetometer samples. Each output is the average of
+ * 			a block of ratio samples(a boxcar filter, decimated at the end of every block), so every
+ * 			sample the QMC5883L produces contributes to the output.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "mag_filter.h"
+#include "QMC5883L.h"
+#include "systick.h"
+
+/*
+ * Function to divide a block sum by the ratio, rounding to the nearest integer. Only runs once
+ * per output, the Cortex-M0+ has no divide instruction
+ *
+ * Parameters:
+ *  sum the block sum
+ *  ratio number of samples in the block
+ *
+ * Returns:
+ *  the block average
+ */
+static inline int16_t block_average(int32_t sum, uint16_t ratio)
+{
+	if(sum < 0)
+	{
+		return (int16_t)((sum - ratio/2) / ratio);
+	}
+	return (int16_t)((sum + ratio/2) / ratio);
+}
+
+/*
+ * Function to set up a filter, which starts with the next sample the QMC5883L produces. The output
+ * rate is the output data rate of the QMC5883L divided by the ratio, a 200Hz ODR with a ratio of 8
+ * gives a 25Hz output. Averaging a block of samples brings the white noise down by sqrt(ratio)
+ *
+ * Parameters:
+ *  filter(out) pointer to the filter
+ *  ratio number of samples averaged into one output, 1 to MAG_FILTER_MAX_RATIO
+ *
+ * Returns:
+ *  none
+ */
+void mag_filter_init(mag_filter_t *filter, uint16_t ratio)
+{
+	if(ratio == 0)
+	{
+		ratio = 1;
+	}else if(ratio > MAG_FILTER_MAX_RATIO){
+		ratio = MAG_FILTER_MAX_RATIO;
+	}
+	qmc_sample_reader_init(&filter->reader);
+	filter->ratio = ratio;
+	filter->count = 0;
+	filter->out_ready = 0;
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		filter->sum[i] = 0;
+	}
+}
+
+/*
+ * Function to run every sample that arrived since the last call through the filter, without
+ * blocking. Samples flagged with OVL are left out of the average, the axes are clipped in them.
+ * The block is summed in 1/4 LSB with the frac bits of the samples, which 2G samples have when
+ * auto ranging gives them in 8G LSB, so the average keeps the resolution of the 2G range
+ *
+ * Parameters:
+ *  filter(in/out) pointer to the filter
+ *
+ * Returns:
+ *  1 if there is an output not yet returned by mag_filter_wait()
+ *  0 otherwise
+ */
+uint8_t mag_filter_update(mag_filter_t *filter)
+{
+	qmc_sample_t sample;
+	while(qmc_sample_pop(&filter->reader, &sample))
+	{
+		if(sample.status & SR_OVL_MASK)
+		{
+			continue;
+		}
+		if(filter->count == 0)
+		{
+			filter->first_time_us = sample.time_us;
+		}
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			filter->sum[i] += ((int32_t)sample.axis[i] << QMC_SAMPLE_FRAC_BITS) + QMC_SAMPLE_FRAC(&sample, i);
+		}
+		if(++filter->count < filter->ratio)
+		{
+			continue;
+		}
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			filter->out[i] = block_average(filter->sum[i], filter->ratio << QMC_SAMPLE_FRAC_BITS);
+			filter->sum[i] = 0;
+		}
+		filter->out_time_us = filter->first_time_us + (sample.time_us - filter->first_time_us)/2;
+		filter->out_ready = 1;
+		filter->count = 0;
+	}
+	return filter->out_ready;
+}
+
+/*
+ * Function to wait for the next output of the filter. If the consumer is slower than the output
+ * rate only the latest output is returned
+ *
+ * Parameters:
+ *  filter(in/out) pointer to the filter
+ *  result(out) pointer to 16-bit integer array to collect the filtered x, y and z values
+ *
+ * Returns:
+ *  1 on success
+ *  0 if no output was ready within MAG_FILTER_TIMEOUT_MS
+ */
+qmc_error_t mag_filter_wait(mag_filter_t *filter, int16_t result[])
+{
+	ticktime_t start = now();
+	while(!mag_filter_update(filter))
+	{
+		if(now() - start > MAG_FILTER_TIMEOUT_MS)
+		{
+			return QMC_ERROR_TIMEOUT;
+		}
+		qmc_restart_stalled_read();
+	}
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		result[i] = filter->out[i];
+	}
+	filter->out_ready = 0;
+	return QMC_OK;
+}
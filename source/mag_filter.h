@@ -0,0 +1,81 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    mag_filter.h
+ * @brief   Header file for the low pass filter and decimator of the magnetometer samples. It takes
+ * 			every sample the QMC5883L produces out of the sample ring and averages blocks of them
+ * 			down to the rate the consumer wants.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __MAG_FILTER_H__
+#define __MAG_FILTER_H__
+#include "stdint.h"
+#include "QMC5883L.h"
+
+#define MAG_FILTER_MAX_RATIO	(64U)//keeps the block sums well inside 32 bits
+#define MAG_FILTER_TIMEOUT_MS	(500U)
+
+typedef struct{
+	qmc_sample_reader_t reader;
+	uint16_t ratio;//samples averaged into one output
+	uint16_t count;//samples in the current block
+	int32_t sum[3];
+	uint32_t first_time_us;//time of the first sample in the current block
+	int16_t out[3];//latest output
+	uint32_t out_time_us;//time at the middle of the block the output was averaged over
+	uint8_t out_ready;//output not yet returned by mag_filter_wait()
+}mag_filter_t;
+
+/*
+ * Function to set up a filter, which starts with the next sample the QMC5883L produces. The output
+ * rate is the output data rate of the QMC5883L divided by the ratio, a 200Hz ODR with a ratio of 8
+ * gives a 25Hz output. Averaging a block of samples brings the white noise down by sqrt(ratio)
+ *
+ * Parameters:
+ *  filter(out) pointer to the filter
+ *  ratio number of samples averaged into one output, 1 to MAG_FILTER_MAX_RATIO
+ *
+ * Returns:
+ *  none
+ */
+void mag_filter_init(mag_filter_t *filter, uint16_t ratio);
+
+/*
+ * Function to run every sample that arrived since the last call through the filter, without
+ * blocking. Needs INT_ENB_ENABLE on the QMC5883L, the samples come from its sample ring
+ *
+ * Parameters:
+ *  filter(in/out) pointer to the filter
+ *
+ * Returns:
+ *  1 if there is an output not yet returned by mag_filter_wait()
+ *  0 otherwise
+ */
+uint8_t mag_filter_update(mag_filter_t *filter);
+
+/*
+ * Function to wait for the next output of the filter. If the consumer is slower than the output
+ * rate only the latest output is returned
+ *
+ * Parameters:
+ *  filter(in/out) pointer to the filter
+ *  result(out) pointer to 16-bit integer array to collect the filtered x, y and z values
+ *
+ * Returns:
+ *  1 on success
+ *  0 if no output was ready within MAG_FILTER_TIMEOUT_MS
+ */
+qmc_error_t mag_filter_wait(mag_filter_t *filter, int16_t result[]);
+
+#endif
@@ -0,0 +1,281 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    mag_hardiron.c
+ * @brief   Background hard iron estimator. With c = matrix*(raw - offset), the calibrated sample, the
+ * 			offset takes a gradient step on (|c|^2 - r^2)^2 for each sample that passes the quality
+ * 			gate:
+ *
+ * 				offset += mu*((|c|^2 - r^2)/r^2)*matrix'*c
+ *
+ * 			and r^2 follows |c|^2 through a low pass filter. A sample passes the gate if the
+ * 			device turned far enough since the last one used, so a unit left in one place does not
+ * 			pull the estimate, and if |c|^2 is not far off r^2, so a magnet held near it is ignored.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "mag_hardiron.h"
+#include "QMC5883L.h"
+
+#define Q8_SHIFT				8
+#define Q12_SHIFT				12
+#define MU_SHIFT				6//mu = 1/64, error of the offset falls by about 1/96 per sample used
+#define RADIUS_FILTER_SHIFT		4
+#define RESIDUAL_FILTER_SHIFT	4
+#define MIN_TURN_SHIFT			4//sample used once the field moved by r/4 since the last one
+#define MAX_ERROR_SHIFT			1//samples more than r^2/2 off the sphere are disturbances
+#define MAX_CENTERED			12287//with matrix entries below 2, keeps |c|^2 inside 32 bits
+#define MAX_TURN_STEP			(2*MAX_CENTERED)//per axis, keeps the turn inside 32 bits and still above any gate
+#define OCTANT_WINDOW			256//samples used per coverage window
+#define NUM_OCTANTS				8
+#define FULL_RESIDUAL_Q12		410//a mean error of 10% gives no confidence
+#define PERCENT					100
+
+/*
+ * Function to start the estimate over from a calibration
+ *
+ * Parameters:
+ *  est(out) pointer to the estimator
+ *  cal(in) pointer to the calibration
+ *
+ * Returns:
+ *  none
+ */
+static void mag_hardiron_restart(mag_hardiron_t *est, const qmc_calibration_data_t *cal)
+{
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		est->offset_q8[i] = (int32_t)cal->offset[i] << Q8_SHIFT;
+		est->last_raw[i] = 0;
+		for(int j = AXIS_X; j <= AXIS_Z; j++)
+		{
+			est->matrix[i][j] = cal->matrix[i][j];
+		}
+	}
+	est->radius2 = 0;
+	est->residual_q12 = FULL_RESIDUAL_Q12;
+	est->octants = 0;
+	est->prev_octants = 0;
+	est->window_count = 0;
+	est->accepted = 0;
+	est->rejected = 0;
+}
+
+/*
+ * Function to start the estimator from the offset currently used by qmc_calibrate_data(). The soft
+ * iron matrix is taken as well, mag_hardiron_update() starts over if it changes
+ *
+ * Parameters:
+ *  est(out) pointer to the estimator
+ *
+ * Returns:
+ *  none
+ */
+void mag_hardiron_init(mag_hardiron_t *est)
+{
+	qmc_calibration_data_t cal;
+
+	qmc_get_calibration(&cal);
+	qmc_sample_reader_init(&est->reader);
+	mag_hardiron_restart(est, &cal);
+}
+
+/*
+ * Function to add one raw sample to the estimator. Samples that did not turn far enough from the
+ * last one used are skipped without counting as rejected. The division only runs for samples that
+ * are used, which the turn gate keeps to a small share of the output data rate
+ *
+ * Parameters:
+ *  est(in/out) pointer to the estimator
+ *  raw(in) pointer to the raw x, y and z values
+ *
+ * Returns:
+ *  1 if the sample was used
+ *  0 if it failed the quality gate
+ */
+uint8_t mag_hardiron_add_sample(mag_hardiron_t *est, const int16_t raw[])
+{
+	int32_t centered[3], c[3], grad, d, turn2 = 0, r2 = 0, err, err_q12, scale;
+	uint8_t octant = 0;
+
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		centered[i] = raw[i] - (est->offset_q8[i] >> Q8_SHIFT);
+		if(centered[i] > MAX_CENTERED || centered[i] < -MAX_CENTERED)
+		{
+			est->rejected++;
+			return 0;
+		}
+		d = raw[i] - est->last_raw[i];
+		if(d > MAX_TURN_STEP || d < -MAX_TURN_STEP)
+		{
+			d = MAX_TURN_STEP;
+		}
+		turn2 += d*d;
+	}
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		c[i] = (est->matrix[i][AXIS_X]*centered[AXIS_X] + est->matrix[i][AXIS_Y]*centered[AXIS_Y] +
+				est->matrix[i][AXIS_Z]*centered[AXIS_Z]) >> QMC_CAL_FRAC_BITS;
+		r2 += c[i]*c[i];
+	}
+
+	if(est->radius2 == 0)
+	{//first sample, nothing to compare against yet
+		est->radius2 = r2;
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			est->last_raw[i] = raw[i];
+		}
+		return 0;
+	}
+	if(turn2 < (est->radius2 >> MIN_TURN_SHIFT))
+	{
+		return 0;
+	}
+	err = r2 - est->radius2;
+	scale = est->radius2 >> Q12_SHIFT;
+	if(scale == 0 || err > (est->radius2 >> MAX_ERROR_SHIFT) || err < -(est->radius2 >> MAX_ERROR_SHIFT))
+	{
+		est->rejected++;
+		return 0;
+	}
+
+	err_q12 = err/scale;
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		grad = (est->matrix[AXIS_X][i]*c[AXIS_X] + est->matrix[AXIS_Y][i]*c[AXIS_Y] +
+				est->matrix[AXIS_Z][i]*c[AXIS_Z]) >> QMC_CAL_FRAC_BITS;
+		est->offset_q8[i] += (err_q12*grad) >> (Q12_SHIFT - Q8_SHIFT + MU_SHIFT);
+		est->last_raw[i] = raw[i];
+		octant = (octant << 1) | (c[i] < 0);
+	}
+	est->radius2 += (r2 - est->radius2) >> RADIUS_FILTER_SHIFT;
+	est->residual_q12 += ((err_q12 < 0 ? -err_q12 : err_q12) - est->residual_q12) >> RESIDUAL_FILTER_SHIFT;
+
+	est->octants |= 1 << octant;
+	if(++est->window_count == OCTANT_WINDOW)
+	{
+		est->prev_octants = est->octants;
+		est->octants = 0;
+		est->window_count = 0;
+	}
+	est->accepted++;
+	return 1;
+}
+
+/*
+ * Function to get the confidence of the estimate. It is the share of the octants of the field seen
+ * over the current and previous window, scaled down linearly with the mean error against the
+ * estimated sphere, reaching 0 at a mean error of 10%
+ *
+ * Parameters:
+ *  est(in) pointer to the estimator
+ *
+ * Returns:
+ *  confidence in percent
+ */
+uint8_t mag_hardiron_confidence(const mag_hardiron_t *est)
+{
+	uint8_t seen = est->octants | est->prev_octants;
+	uint32_t count = 0;
+
+	if(est->residual_q12 >= FULL_RESIDUAL_Q12)
+	{
+		return 0;
+	}
+	for(int i = 0; i < NUM_OCTANTS; i++)
+	{
+		count += (seen >> i) & 1;
+	}
+	return (count*PERCENT*(FULL_RESIDUAL_Q12 - est->residual_q12))/(NUM_OCTANTS*FULL_RESIDUAL_Q12);
+}
+
+/*
+ * Function to check if the soft iron matrix of a calibration is the one the estimator works with
+ *
+ * Parameters:
+ *  est(in) pointer to the estimator
+ *  cal(in) pointer to the calibration
+ *
+ * Returns:
+ *  1 if the matrix is the same, 0 otherwise
+ */
+static uint8_t mag_hardiron_same_matrix(const mag_hardiron_t *est, const qmc_calibration_data_t *cal)
+{
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		for(int j = AXIS_X; j <= AXIS_Z; j++)
+		{
+			if(est->matrix[i][j] != cal->matrix[i][j])
+			{
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+ * Function to run every sample that arrived since the last call through the estimator, without
+ * blocking. Once the confidence is at least MAG_HARDIRON_MIN_CONFIDENCE the calibration offset is
+ * moved at most one count per axis towards the estimate per call that used a sample, however many
+ * it used, so the heading does not jump. If the soft iron matrix was changed by a new calibration
+ * the estimate starts over from it, since the radius and the offset were learned through the old
+ * matrix
+ *
+ * Parameters:
+ *  est(in/out) pointer to the estimator
+ *
+ * Returns:
+ *  none
+ */
+void mag_hardiron_update(mag_hardiron_t *est)
+{
+	qmc_sample_t sample;
+	qmc_calibration_data_t cal;
+	uint32_t accepted;
+	int32_t target;
+
+	qmc_get_calibration(&cal);
+	if(!mag_hardiron_same_matrix(est, &cal))
+	{
+		mag_hardiron_restart(est, &cal);
+	}
+	accepted = est->accepted;
+
+	while(qmc_sample_pop(&est->reader, &sample))
+	{
+		if(!(sample.status & SR_OVL_MASK))
+		{
+			mag_hardiron_add_sample(est, sample.axis);
+		}
+	}
+	if(est->accepted == accepted || mag_hardiron_confidence(est) < MAG_HARDIRON_MIN_CONFIDENCE)
+	{
+		return;
+	}
+
+	qmc_get_calibration(&cal);//again, the offset may have followed the temperature meanwhile
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		target = (est->offset_q8[i] + (1 << (Q8_SHIFT - 1))) >> Q8_SHIFT;
+		if(target > cal.offset[i])
+		{
+			cal.offset[i]++;
+		}else if(target < cal.offset[i]){
+			cal.offset[i]--;
+		}
+	}
+	qmc_set_calibration(&cal);
+}
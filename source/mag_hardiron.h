@@ -0,0 +1,95 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    mag_hardiron.h
+ * @brief   Header file for the background hard iron estimator. It keeps refining the hard iron
+ * 			offset from the samples taken while the compass is in normal use, and moves the
+ * 			offset used by qmc_calibrate_data() towards it a count at a time.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __MAG_HARDIRON_H__
+#define __MAG_HARDIRON_H__
+#include "stdint.h"
+#include "QMC5883L.h"
+
+#define MAG_HARDIRON_MIN_CONFIDENCE	(50U)//percent, below this the estimate is not applied
+
+typedef struct{
+	qmc_sample_reader_t reader;
+	int32_t offset_q8[3];//estimated offset, 8 fractional bits
+	int16_t matrix[3][3];//soft iron matrix in use, Q2.14
+	int32_t radius2;//estimated squared field radius
+	int16_t last_raw[3];//last sample that was used
+	int32_t residual_q12;//mean of |radius error|/radius^2, 12 fractional bits
+	uint8_t octants;//octants of the field seen in this window
+	uint8_t prev_octants;//octants of the field seen in the previous window
+	uint16_t window_count;
+	uint32_t accepted;//samples used for the estimate
+	uint32_t rejected;//samples that failed the quality gate
+}mag_hardiron_t;
+
+/*
+ * Function to start the estimator from the offset currently used by qmc_calibrate_data(). The soft
+ * iron matrix is taken as well, mag_hardiron_update() starts over if it changes
+ *
+ * Parameters:
+ *  est(out) pointer to the estimator
+ *
+ * Returns:
+ *  none
+ */
+void mag_hardiron_init(mag_hardiron_t *est);
+
+/*
+ * Function to run every sample that arrived since the last call through the estimator, without
+ * blocking. Needs INT_ENB_ENABLE on the QMC5883L, the samples come from its sample ring. Once the
+ * confidence is at least MAG_HARDIRON_MIN_CONFIDENCE the calibration offset is moved at most one
+ * count per axis towards the estimate per call that used a sample, however many it used, so the
+ * heading does not jump. A new soft iron matrix starts the estimate over
+ *
+ * Parameters:
+ *  est(in/out) pointer to the estimator
+ *
+ * Returns:
+ *  none
+ */
+void mag_hardiron_update(mag_hardiron_t *est);
+
+/*
+ * Function to add one raw sample to the estimator. Called by mag_hardiron_update() for each sample
+ * in the ring, and can be called directly to replay recorded samples
+ *
+ * Parameters:
+ *  est(in/out) pointer to the estimator
+ *  raw(in) pointer to the raw x, y and z values
+ *
+ * Returns:
+ *  1 if the sample was used
+ *  0 if it failed the quality gate
+ */
+uint8_t mag_hardiron_add_sample(mag_hardiron_t *est, const int16_t raw[]);
+
+/*
+ * Function to get the confidence of the estimate. It grows with the number of octants of the
+ * field seen recently, and falls with the mean error of the samples against the estimated sphere
+ *
+ * Parameters:
+ *  est(in) pointer to the estimator
+ *
+ * Returns:
+ *  confidence in percent
+ */
+uint8_t mag_hardiron_confidence(const mag_hardiron_t *est);
+
+#endif
@@ -0,0 +1,310 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    mag_motion.c
+ * @brief   Motion adaptive rate controller. The turn rate is the angle between two samples at
+ * 			least MAG_MOTION_WINDOW_MS apart, over the time between them. For small angles the
+ * 			angle in radians is |change|/|field|, both taken as sums of absolute values so there
+ * 			is no square root. That is off by up to about 1.7x depending on the direction, close
+ * 			enough to pick a profile. Measuring over a window instead of sample to sample keeps
+ * 			the noise of the fast profiles from reading as turning.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#include "mag_motion.h"
+#include "QMC5883L.h"
+#include "i2c.h"
+#include "fsl_debug_console.h"
+
+#define US_PER_MS			1000
+#define MS_PER_S			1000
+#define Q12_SHIFT			12
+#define MAX_RATIO_Q12		(2 << Q12_SHIFT)//angles past 2 radians are all fast
+#define MDEG_PER_RAD		57296
+#define MAX_GAP_SHIFT		2//samples more than 4 windows apart, after a stall, only start a new window
+
+const mag_motion_profile_t mag_motion_profiles[MAG_MOTION_NUM_PROFILES] = {
+		{ODR_OPTION_10HZ, OSR_OPTION_512, 10, 15, 0},//still, least noise for the least power
+		{ODR_OPTION_50HZ, OSR_OPTION_256, 50, 60, 8},
+		{ODR_OPTION_200HZ, OSR_OPTION_64, 200, 0, 40},//turning, follows the heading closely
+};
+
+/*
+ * Function to bring the stats of the profile in use up to date with the counters of the QMC5883L
+ * driver and the bus profiler
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *
+ * Returns:
+ *  none
+ */
+static void mag_motion_account(mag_motion_t *motion)
+{
+	qmc_sample_stats_t sample_stats;
+	mag_motion_stats_t *stats = &motion->stats[motion->profile];
+	ticktime_t time = now();
+
+	qmc_get_sample_stats(&sample_stats);
+	stats->active_ms += time - motion->mark_time;
+	stats->samples += sample_stats.samples - motion->mark_samples;
+	stats->isr_us += sample_stats.isr_us - motion->mark_isr_us;
+	motion->mark_time = time;
+	motion->mark_samples = sample_stats.samples;
+	motion->mark_isr_us = sample_stats.isr_us;
+#ifdef I2C_PROFILE
+	uint32_t bus_us = i2c_profile_busy_us(QMC_DEVICE_ADDR);
+	stats->bus_us += bus_us - motion->mark_bus_us;
+	motion->mark_bus_us = bus_us;
+#endif
+}
+
+/*
+ * Function to switch to a profile, with a single write of CR1
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *  profile index of the profile
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the profile could not be written, the old one stays in use
+ */
+static qmc_error_t mag_motion_switch(mag_motion_t *motion, uint8_t profile)
+{
+	if(qmc_set_rate(mag_motion_profiles[profile].odr, mag_motion_profiles[profile].osr) != QMC_OK)
+	{
+		return QMC_NACK_ERROR;
+	}
+	mag_motion_account(motion);
+	motion->profile = profile;
+	motion->stats[profile].entries++;
+	motion->quiet_start = now();
+	return QMC_OK;
+}
+
+/*
+ * Function to start the controller in the first(slowest) profile, and set the QMC5883L to it
+ *
+ * Parameters:
+ *  motion(out) pointer to the controller
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the profile could not be written to the QMC5883L
+ */
+qmc_error_t mag_motion_init(mag_motion_t *motion)
+{
+	qmc_sample_stats_t sample_stats;
+
+	qmc_sample_reader_init(&motion->reader);
+	motion->anchored = 0;
+	motion->rate_dps = 0;
+	motion->profile = 0;
+	for(int i = 0; i < MAG_MOTION_NUM_PROFILES; i++)
+	{
+		motion->stats[i] = (mag_motion_stats_t){0};
+	}
+	qmc_get_sample_stats(&sample_stats);
+	motion->mark_time = now();
+	motion->mark_samples = sample_stats.samples;
+	motion->mark_isr_us = sample_stats.isr_us;
+#ifdef I2C_PROFILE
+	motion->mark_bus_us = i2c_profile_busy_us(QMC_DEVICE_ADDR);
+#endif
+	return mag_motion_switch(motion, 0);
+}
+
+/*
+ * Function to measure the turn rate from the anchor sample to a sample, once the sample is at
+ * least MAG_MOTION_WINDOW_MS after it. The sample becomes the next anchor
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *  sample(in) pointer to the sample
+ *
+ * Returns:
+ *  1 if the turn rate was measured
+ *  0 if the window is not over yet
+ */
+static uint8_t mag_motion_add_sample(mag_motion_t *motion, const qmc_sample_t *sample)
+{
+	uint32_t elapsed_us = sample->time_us - motion->anchor_time_us;
+	int32_t change = 0, field = 0, d;
+	int32_t ratio_q12, angle_mdeg;
+	uint8_t measured = 0;
+
+	if(motion->anchored && elapsed_us < MAG_MOTION_WINDOW_MS*US_PER_MS)
+	{
+		return 0;
+	}
+	if(motion->anchored && elapsed_us <= (MAG_MOTION_WINDOW_MS*US_PER_MS) << MAX_GAP_SHIFT)
+	{
+		for(int i = AXIS_X; i <= AXIS_Z; i++)
+		{
+			d = sample->axis[i] - motion->anchor[i];
+			change += (d < 0) ? -d : d;
+			field += (motion->anchor[i] < 0) ? -motion->anchor[i] : motion->anchor[i];
+		}
+		if(field)
+		{
+			ratio_q12 = (change << Q12_SHIFT)/field;
+			if(ratio_q12 > MAX_RATIO_Q12)
+			{
+				ratio_q12 = MAX_RATIO_Q12;
+			}
+			angle_mdeg = (ratio_q12*MDEG_PER_RAD) >> Q12_SHIFT;
+			motion->rate_dps = (angle_mdeg*US_PER_MS)/elapsed_us;//mdeg per ms is deg per s
+			measured = 1;
+		}
+	}
+	for(int i = AXIS_X; i <= AXIS_Z; i++)
+	{
+		motion->anchor[i] = sample->axis[i];
+	}
+	motion->anchor_time_us = sample->time_us;
+	motion->anchored = 1;
+	return measured;
+}
+
+/*
+ * Function to run every sample that arrived since the last call through the turn rate estimate,
+ * without blocking, and switch the profile if the turn rate asks for it
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *
+ * Returns:
+ *  1 if the profile was switched
+ *  0 otherwise
+ */
+uint8_t mag_motion_update(mag_motion_t *motion)
+{
+	qmc_sample_t sample;
+	uint8_t measured = 0;
+	uint8_t profile = motion->profile;
+
+	while(qmc_sample_pop(&motion->reader, &sample))
+	{
+		if(!(sample.status & SR_OVL_MASK))
+		{
+			measured |= mag_motion_add_sample(motion, &sample);
+		}
+	}
+	if(!measured)
+	{
+		return 0;
+	}
+
+	while(profile < MAG_MOTION_NUM_PROFILES - 1 && motion->rate_dps > mag_motion_profiles[profile].up_dps)
+	{
+		profile++;
+	}
+	if(profile == motion->profile && profile > 0)
+	{
+		if(motion->rate_dps >= mag_motion_profiles[profile].down_dps)
+		{
+			motion->quiet_start = now();
+		}else if(now() - motion->quiet_start > MAG_MOTION_HOLD_MS){
+			profile--;
+		}
+	}
+	if(profile == motion->profile)
+	{
+		return 0;
+	}
+	return mag_motion_switch(motion, profile) == QMC_OK;
+}
+
+/*
+ * Function to get the profile in use
+ *
+ * Parameters:
+ *  motion(in) pointer to the controller
+ *
+ * Returns:
+ *  pointer to the profile
+ */
+const mag_motion_profile_t *mag_motion_profile(const mag_motion_t *motion)
+{
+	return &mag_motion_profiles[motion->profile];
+}
+
+/*
+ * Function to count thread time spent processing samples against the profile in use
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *  us time in microseconds
+ *
+ * Returns:
+ *  none
+ */
+void mag_motion_add_cpu_us(mag_motion_t *motion, uint32_t us)
+{
+	motion->stats[motion->profile].thread_us += us;
+}
+
+/*
+ * Function to scale a time spent over an active time to a time per second
+ *
+ * Parameters:
+ *  us time spent in microseconds
+ *  active_ms time it was spent over in milliseconds
+ *
+ * Returns:
+ *  microseconds per second
+ */
+static uint32_t per_second(uint32_t us, uint32_t active_ms)
+{
+	if(active_ms == 0)
+	{
+		return 0;
+	}
+	return (uint32_t)(((uint64_t)us*MS_PER_S)/active_ms);
+}
+
+/*
+ * Function to print the time spent in each profile, and the cpu time per second each profile
+ * costs, over the debug console. The bus time per second is only measured, and printed, with
+ * I2C_PROFILE
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *
+ * Returns:
+ *  none
+ */
+void mag_motion_dump(mag_motion_t *motion)
+{
+	const mag_motion_profile_t *profile;
+	mag_motion_stats_t *stats;
+
+	mag_motion_account(motion);
+#ifdef I2C_PROFILE
+	PRINTF("PROFILE ODR OSR TIME_MS ENTRIES SAMPLES BUS_US/S ISR_US/S THREAD_US/S\r\n");
+#else
+	PRINTF("PROFILE ODR OSR TIME_MS ENTRIES SAMPLES ISR_US/S THREAD_US/S\r\n");
+#endif
+	for(int i = 0; i < MAG_MOTION_NUM_PROFILES; i++)
+	{
+		profile = &mag_motion_profiles[i];
+		stats = &motion->stats[i];
+		PRINTF("%c%d %dHz %d %d %d %d ", (i == motion->profile) ? '*' : ' ', i, profile->odr_hz,
+				QMC_OSR_MAX >> profile->osr, stats->active_ms, stats->entries, stats->samples);
+#ifdef I2C_PROFILE
+		PRINTF("%d ", per_second(stats->bus_us, stats->active_ms));
+#endif
+		PRINTF("%d %d\r\n", per_second(stats->isr_us, stats->active_ms), per_second(stats->thread_us, stats->active_ms));
+	}
+}
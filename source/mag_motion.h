@@ -0,0 +1,133 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Krish Shah
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Krish Shah and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+ * @file    mag_motion.h
+ * @brief   Header file for the motion adaptive rate controller. It estimates how fast the
+ * 			compass is turning from the sample ring, and steps the output data rate and over
+ * 			sample ratio of the QMC5883L between a few profiles, slow and quiet while it sits
+ * 			still, fast while it turns.
+ *
+ * @author  Krish Shah
+ * @date    December 13 2023
+ *
+ */
+#ifndef __MAG_MOTION_H__
+#define __MAG_MOTION_H__
+#include "stdint.h"
+#include "QMC5883L.h"
+#include "i2c.h"
+#include "systick.h"
+
+#define MAG_MOTION_NUM_PROFILES	(3U)
+#define MAG_MOTION_WINDOW_MS	(100U)//turn rate measured between samples at least this far apart, keeps the noise out
+#define MAG_MOTION_HOLD_MS		(2000U)//turn rate has to stay below the down level this long to step down
+
+typedef struct{
+	qmc_cr1_odr_options_t odr;
+	qmc_cr1_osr_options_t osr;
+	uint16_t odr_hz;
+	uint16_t up_dps;//step up above this turn rate, unused for the last profile
+	uint16_t down_dps;//step down below this turn rate, unused for the first profile
+}mag_motion_profile_t;
+
+extern const mag_motion_profile_t mag_motion_profiles[MAG_MOTION_NUM_PROFILES];
+
+typedef struct{
+	uint32_t active_ms;//time spent in the profile
+	uint32_t entries;//switches into the profile
+	uint32_t samples;
+	uint32_t isr_us;//QMC5883L interrupt time
+	uint32_t thread_us;//sample processing time reported with mag_motion_add_cpu_us()
+#ifdef I2C_PROFILE
+	uint32_t bus_us;//QMC5883L bus time, the bus profiler is the only per device bus timer
+#endif
+}mag_motion_stats_t;
+
+typedef struct{
+	qmc_sample_reader_t reader;
+	int16_t anchor[3];//sample the next turn rate is measured from
+	uint32_t anchor_time_us;
+	uint8_t anchored;
+	uint16_t rate_dps;//last turn rate
+	uint8_t profile;
+	ticktime_t quiet_start;//time the turn rate last was at or above the down level
+	mag_motion_stats_t stats[MAG_MOTION_NUM_PROFILES];
+	ticktime_t mark_time;//counters at the last time the stats were brought up to date
+	uint32_t mark_samples;
+	uint32_t mark_isr_us;
+#ifdef I2C_PROFILE
+	uint32_t mark_bus_us;
+#endif
+}mag_motion_t;
+
+/*
+ * Function to start the controller in the first(slowest) profile, and set the QMC5883L to it
+ *
+ * Parameters:
+ *  motion(out) pointer to the controller
+ *
+ * Returns:
+ *  1 on success
+ *  0 if the profile could not be written to the QMC5883L
+ */
+qmc_error_t mag_motion_init(mag_motion_t *motion);
+
+/*
+ * Function to run every sample that arrived since the last call through the turn rate estimate,
+ * without blocking, and switch the profile if the turn rate asks for it. A faster profile is taken
+ * as soon as the turn rate is above its up level, a slower one only after the turn rate stayed
+ * below the down level for MAG_MOTION_HOLD_MS. Each switch is a single register write
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *
+ * Returns:
+ *  1 if the profile was switched
+ *  0 otherwise
+ */
+uint8_t mag_motion_update(mag_motion_t *motion);
+
+/*
+ * Function to get the profile in use
+ *
+ * Parameters:
+ *  motion(in) pointer to the controller
+ *
+ * Returns:
+ *  pointer to the profile
+ */
+const mag_motion_profile_t *mag_motion_profile(const mag_motion_t *motion);
+
+/*
+ * Function to count thread time spent processing samples against the profile in use
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *  us time in microseconds
+ *
+ * Returns:
+ *  none
+ */
+void mag_motion_add_cpu_us(mag_motion_t *motion, uint32_t us);
+
+/*
+ * Function to print the time spent in each profile, and the cpu time per second each profile
+ * costs, over the debug console. With I2C_PROFILE the bus time per second is printed as well
+ *
+ * Parameters:
+ *  motion(in/out) pointer to the controller
+ *
+ * Returns:
+ *  none
+ */
+void mag_motion_dump(mag_motion_t *motion);
+
+#endif
@@ -61,6 +61,48 @@
 #include "systick.h"
 
 #undef CALIBRATION_MODE//change to #define to dump calibration data on the terminal and to #undef to run state machine.
+#undef I2C_SPEED_PROBE_MODE//change to #define to step the I2C speed up at boot till a device stops responding,
+						   //#undef runs the bus at the rated speed of the devices
+
+static const i2c_device_t *i2c_devices[] = {&ssd1306_i2c_device, &qmc_i2c_device};
+#define NUM_I2C_DEVICES (sizeof(i2c_devices)/sizeof(i2c_devices[0]))
+
+static I2C_Type *const i2c_buses[] = {I2C0, I2C1};
+#define NUM_I2C_BUSES (sizeof(i2c_buses)/sizeof(i2c_buses[0]))
+
+/*
+ * Function to initialise every I2C bus that has a device on it and set its speed
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  none
+ */
+static void init_i2c_buses()
+{
+	for(int i = 0; i < NUM_I2C_BUSES; i++)
+	{
+		int used = 0;
+		for(int j = 0; j < NUM_I2C_DEVICES; j++)
+		{
+			if(i2c_devices[j]->bus == i2c_buses[i])
+			{
+				used = 1;
+			}
+		}
+		if(!used)
+		{
+			continue;
+		}
+		init_i2c(i2c_buses[i]);
+#ifdef I2C_SPEED_PROBE_MODE
+		i2c_probe_speed(i2c_buses[i], i2c_devices, NUM_I2C_DEVICES);
+#else
+		i2c_set_speed(i2c_buses[i], i2c_get_speed_limit(i2c_buses[i], i2c_devices, NUM_I2C_DEVICES));
+#endif
+	}
+}
 
 int main(void)
 {
@@ -71,18 +113,22 @@ int main(void)
 
     /* Init Modules. */
     init_systick();
-    init_i2c();
+    init_i2c_buses();
     init_ssd1306();
 
 	qmc_config_t config;
-	config.int_enb = INT_ENB_DISABLE;
-	config.rol_pnt = ROL_PNT_DISABLE;
+	config.int_enb = INT_ENB_ENABLE;//DRDY wired to QMC_DRDY_PIN
+	config.rol_pnt = ROL_PNT_ENABLE;//status and data in one read
 	config.soft_rst = SOFT_RST_DISABLE;
-	config.osr = OSR_OPTION_512;
-	config.rng = RNG_OPTION_8G;
-	config.odr = ODR_OPTION_200HZ;
+	config.osr = OSR_OPTION_512;//with the odr, the still profile mag_motion starts in
+	config.rng = RNG_OPTION_8G;//starting range, auto ranging goes to 2G once the field allows it
+	config.auto_rng = AUTO_RNG_ENABLE;
+	config.odr = ODR_OPTION_10HZ;
 	config.mode = MODE_OPTION_CONTINUOUS;
-	init_qmc(&config);
+	if(init_qmc(&config) != QMC_OK)
+	{
+		PRINTF("QMC5883L did not respond during init\r\n");
+	}
 #ifdef CALIBRATION_MODE
 	qmc_dump_calibration_data(1024);
 	while(1);//block after return from dump calibration
@@ -27,50 +27,139 @@
 #define LSH_MUL_128 7
 #define TEST_STATE_TIME 1000
 #define DISPLAY_BUFFFER_LEN 1024
+#define DISPLAY_NUM_PAGES 8
+#define DISPLAY_PAGE_LEN (DISPLAY_BUFFFER_LEN/DISPLAY_NUM_PAGES)
+#define SSD1306_USE_DMA//change to #undef to push frames one byte per I2C interrupt instead of using DMA
 static uint8_t DISPLAY_BUFFER[DISPLAY_BUFFFER_LEN] = {0};
 
+const i2c_device_t ssd1306_i2c_device = {
+		.bus = SSD1306_I2C_BUS,
+		.addr = SSD1306_DEVICE_ADDR,
+		.max_speed = SSD1306_MAX_I2C_SPEED,
+		.retries = SSD1306_I2C_RETRIES,
+};
 
+/*
+ * One transaction per display page, so that a high priority transaction queued while a frame is
+ * being sent waits for at most 128 data bytes. The display is in page addressing mode and each
+ * transaction starts with single command control bytes which set the GDDRAM pointer to its page
+ * and column 0, then one control byte for the data. The pointer is never carried from one page
+ * to the next, so a page which is NACKed or aborted part way cannot shift the pages after it.
+ */
+#ifdef SSD1306_USE_DMA
+#define PAGE_XFER_FLAGS I2C_XFER_FLAG_DMA
+#else
+#define PAGE_XFER_FLAGS 0
+#endif
+#define PAGE_XFER(page) {\
+		.addr = SSD1306_DEVICE_ADDR,\
+		.flags = PAGE_XFER_FLAGS,\
+		.cmd = {SSD1306_CMD_BYTE_SEND_ONE_COMMAND, SSD1306_SET_PAGE_START + (page),\
+				SSD1306_CMD_BYTE_SEND_ONE_COMMAND, SSD1306_SET_COL_LOW_NIBBLE,\
+				SSD1306_CMD_BYTE_SEND_ONE_COMMAND, SSD1306_SET_COL_HIGH_NIBBLE,\
+				SSD1306_CMD_BYTE_SEND_MULTIPLE_DATA},\
+		.cmd_len = 7,\
+		.tx = &DISPLAY_BUFFER[(page)*DISPLAY_PAGE_LEN],\
+		.tx_len = DISPLAY_PAGE_LEN,\
+		.status = I2C_STATUS_OK,\
+}
 
+static i2c_xfer_t page_xfer[DISPLAY_NUM_PAGES] = {
+		PAGE_XFER(0), PAGE_XFER(1), PAGE_XFER(2), PAGE_XFER(3),
+		PAGE_XFER(4), PAGE_XFER(5), PAGE_XFER(6), PAGE_XFER(7),
+};
 
 /*
- * Function to send one command to SSD1306 IC
+ * Function to check if a frame queued by ssd1306_update_display() is still being transmitted
  *
  * Parameters:
- *  cmd the byte value of the command to be sent
+ *  none
  *
  * Returns:
- *  1 on success
- *  0 on failure
+ *  1 if the frame is still on the bus, 0 once it is done
  */
-ssd1306_error_t ssd1306_send_one_cmd(uint8_t cmd)
+int ssd1306_frame_in_progress()
 {
-	I2C_TRANSMIT_MODE();
-	I2C_START();
-	I2C_SEND_BYTE(I2C_GET_ADDRESS(SSD1306_DEVICE_ADDR, I2C_WRITE));
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
+	for(int page = 0; page < DISPLAY_NUM_PAGES; page++)
 	{
-		return SSD1306_NACK_ERROR;
+		if(page_xfer[page].status == I2C_STATUS_PENDING)
+		{
+			return 1;
+		}
 	}
+	return 0;
+}
 
-	I2C_SEND_BYTE(SSD1306_CMD_BYTE_SEND_MULTIPLE_COMMANDS);
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
+/*
+ * Function to wait till the previous frame has been pushed out by the I2C engine, so that the
+ * framebuffer is not modified while it is being transmitted
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  1 if the previous frame was sent successfully
+ *  0 on failure
+ */
+ssd1306_error_t ssd1306_wait_frame()
+{
+	ssd1306_error_t ret = SSD1306_OK;
+	if(ssd1306_frame_in_progress())
 	{
-		return SSD1306_NACK_ERROR;
+		i2c_wait_idle(SSD1306_I2C_BUS);
+	}
+	for(int page = 0; page < DISPLAY_NUM_PAGES; page++)
+	{
+		if(page_xfer[page].status != I2C_STATUS_OK)
+		{
+			ret = SSD1306_NACK_ERROR;
+		}
 	}
+	return ret;
+}
 
-	I2C_SEND_BYTE(cmd);
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
+/*
+ * Function to send one command to SSD1306 IC in a single I2C transaction
+ *
+ * Parameters:
+ *  cmd the byte value of the command to be sent
+ *
+ * Returns:
+ *  1 on success
+ *  0 on failure
+ */
+static ssd1306_error_t ssd1306_i2c_write_cmd(uint8_t cmd)
+{
+	uint8_t tx[] = {SSD1306_CMD_BYTE_SEND_MULTIPLE_COMMANDS, cmd};
+	if(i2c_transfer(SSD1306_I2C_BUS, SSD1306_DEVICE_ADDR, tx, sizeof(tx), NULL, 0, 0) != I2C_STATUS_OK)
 	{
 		return SSD1306_NACK_ERROR;
 	}
-	I2C_STOP();
-	b_delay(10);//i2c lockup
 	return SSD1306_OK;
 }
 
+/*
+ * Function to send one command to SSD1306 IC, retrying up to the retry budget of the device
+ *
+ * Parameters:
+ *  cmd the byte value of the command to be sent
+ *
+ * Returns:
+ *  1 on success
+ *  0 on failure
+ */
+ssd1306_error_t ssd1306_send_one_cmd(uint8_t cmd)
+{
+	for(int attempt = 0; attempt <= ssd1306_i2c_device.retries; attempt++)
+	{
+		if(ssd1306_i2c_write_cmd(cmd) == SSD1306_OK)
+		{
+			return SSD1306_OK;
+		}
+	}
+	return SSD1306_NACK_ERROR;
+}
+
 /*
  * Function to initialise SSD1306 Display.
  * Follows the initilasation sequence provided in the IC Datasheet
@@ -107,6 +196,9 @@ ssd1306_error_t init_ssd1306()
 	ssd1306_send_one_cmd(SSD1306_SET_CHARGE_PUMP);
 	ssd1306_send_one_cmd(SSD1306_CHARGE_PUMP_VALUE);
 
+	ssd1306_send_one_cmd(SSD1306_SET_MEMORY_ADDR_MODE);//every page transaction addresses itself
+	ssd1306_send_one_cmd(SSD1306_MEMORY_ADDR_MODE_PAGE);
+
 	ssd1306_send_one_cmd(SSD1306_SET_DISPLAY_ON);
 
 	ssd1306_clear_buffer();
@@ -118,8 +210,12 @@ ssd1306_error_t init_ssd1306()
  * Function to update the entire display screen at once with new values present in the
  * buffer
  *
- * It first sets the page address and col address ranges, which also resets the respective pointer.
- * After that 1024 Bytes of buffer are transmitted to the display in one I2C Transaction
+ * The 1024 Bytes of buffer are queued on the interrupt driven I2C engine as one I2C Transaction per page,
+ * which hands the data bytes to the DMA controller when SSD1306_USE_DMA is defined. Every page
+ * transaction addresses its own page and column 0 before its data, see PAGE_XFER().
+ * Splitting the frame lets high priority sensor reads run between the pages.
+ * The function returns as soon as the frame is queued, the buffer functions wait for the transfer to
+ * finish before touching the framebuffer again.
  *
  * Parameters:
  *  none
@@ -130,44 +226,14 @@ ssd1306_error_t init_ssd1306()
  */
 ssd1306_error_t ssd1306_update_display()
 {
-	ssd1306_send_one_cmd(SSD1306_SET_MEMORY_ADDR_MODE);
-	ssd1306_send_one_cmd(SSD1306_MEMORY_ADDR_MODE_HORI);
-
-	ssd1306_send_one_cmd(SSD1306_SET_PAGE_ADDR);
-	ssd1306_send_one_cmd(SSD1306_PAGE_START_ADDR);
-	ssd1306_send_one_cmd(SSD1306_PAGE_END_ADDR);
-
-	ssd1306_send_one_cmd(SSD1306_SET_COL_ADDR);
-	ssd1306_send_one_cmd(SSD1306_COL_ADDR_START_ADDR);
-	ssd1306_send_one_cmd(SSD1306_COL_ADDR_END_ADDR);
-
-	I2C_TRANSMIT_MODE();
-	I2C_START();
-	I2C_SEND_BYTE(I2C_GET_ADDRESS(SSD1306_DEVICE_ADDR, I2C_WRITE));
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
-	{
-		return SSD1306_NACK_ERROR;
-	}
-
-	I2C_SEND_BYTE(SSD1306_CMD_BYTE_SEND_MULTIPLE_DATA);
-	I2C_WAIT_IICIF();
-	if(I2C_RXAK() == I2C_NACK)
-	{
-		return SSD1306_NACK_ERROR;
-	}
-
-	for(int i = 0; i < DISPLAY_BUFFFER_LEN; i++)
+	ssd1306_wait_frame();
+	for(int page = 0; page < DISPLAY_NUM_PAGES; page++)
 	{
-		I2C_SEND_BYTE(DISPLAY_BUFFER[i]);
-		I2C_WAIT_IICIF();
-		if(I2C_RXAK() == I2C_NACK)
+		if(i2c_submit(SSD1306_I2C_BUS, &page_xfer[page]) != I2C_STATUS_PENDING)
 		{
 			return SSD1306_NACK_ERROR;
 		}
 	}
-	I2C_STOP();
-	b_delay(10);
 	return SSD1306_OK;
 }
 
@@ -183,6 +249,7 @@ ssd1306_error_t ssd1306_update_display()
  */
 ssd1306_error_t ssd1306_clear_buffer()
 {
+	ssd1306_wait_frame();
 	memset(DISPLAY_BUFFER,0,DISPLAY_BUFFFER_LEN);
 	return SSD1306_OK;
 }
@@ -204,6 +271,7 @@ ssd1306_error_t ssd1306_write_string_in_buffer(uint8_t page,uint8_t column,char
 	{
 		return SSD1306_BUFFER_ERROR;
 	}
+	ssd1306_wait_frame();
 	uint16_t j = 0;
 	uint16_t column_offset = 0, page_offset = 0;
 	column_offset = column;//provides the x displacment of the string start from the top left of the screen
@@ -19,8 +19,12 @@
 #ifndef __SSD1306_H__
 #define __SSD1306_H__
 #include "stdint.h"
+#include "i2c.h"
 
 #define SSD1306_DEVICE_ADDR 					(0x3CU)
+#define SSD1306_I2C_BUS							I2C1
+#define SSD1306_MAX_I2C_SPEED					I2C_SPEED_FAST
+#define SSD1306_I2C_RETRIES						(2U)
 
 #define SSD1306_CMD_BYTE_SEND_ONE_COMMAND 		(0x80U)
 #define SSD1306_CMD_BYTE_SEND_MULTIPLE_COMMANDS (0x00U)
@@ -32,6 +36,10 @@
 #define SSD1306_SET_PAGE_ADDR					(0x22U)
 
 #define SSD1306_MEMORY_ADDR_MODE_HORI			(0x00U)
+#define SSD1306_MEMORY_ADDR_MODE_PAGE			(0x02U)
+#define SSD1306_SET_PAGE_START					(0xB0U)//page addressing mode, low 3 bits are the page
+#define SSD1306_SET_COL_LOW_NIBBLE				(0x00U)//page addressing mode, low nibble of the column
+#define SSD1306_SET_COL_HIGH_NIBBLE				(0x10U)//page addressing mode, high nibble of the column
 #define SSD1306_COL_ADDR_START_ADDR				(0x00U)
 #define SSD1306_COL_ADDR_END_ADDR				(0x7FU)
 #define SSD1306_PAGE_START_ADDR					(0x00U)
@@ -74,6 +82,8 @@ typedef enum{
 	SSD1306_OK,
 }ssd1306_error_t;
 
+extern const i2c_device_t ssd1306_i2c_device;
+
 /*
  * Function to initialise SSD1306 Display.
  * Follows the initilasation sequence provided in the IC Datasheet
@@ -91,8 +101,12 @@ ssd1306_error_t init_ssd1306();
  * Function to update the entire display screen at once with new values present in the
  * buffer
  *
- * It first sets the page address and col address ranges, which also resets the respective pointer.
- * After that 1024 Bytes of buffer are transmitted to the display in one I2C Transaction
+ * The 1024 Bytes of buffer are queued on the interrupt driven I2C engine as one I2C Transaction per page,
+ * which hands the data bytes to the DMA controller when SSD1306_USE_DMA is defined. Every page
+ * transaction addresses its own page and column 0 before its data, so a page that fails leaves only
+ * its own row stale and the pages after it still land in place.
+ * The function returns as soon as the frame is queued, the buffer functions wait for the transfer to
+ * finish before touching the framebuffer again.
  *
  * Parameters:
  *  none
@@ -103,6 +117,30 @@ ssd1306_error_t init_ssd1306();
  */
 ssd1306_error_t ssd1306_update_display();
 
+/*
+ * Function to check if a frame queued by ssd1306_update_display() is still being transmitted
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  1 if the frame is still on the bus, 0 once it is done
+ */
+int ssd1306_frame_in_progress();
+
+/*
+ * Function to wait till the previous frame has been pushed out by the I2C engine, so that the
+ * framebuffer is not modified while it is being transmitted
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  1 if the previous frame was sent successfully
+ *  0 on failure
+ */
+ssd1306_error_t ssd1306_wait_frame();
+
 /*
  * Function to clear the framebuffer by filling it with 0
  *
@@ -116,7 +154,7 @@ ssd1306_error_t ssd1306_update_display();
 ssd1306_error_t ssd1306_clear_buffer();
 
 /*
- * Function to send one command to SSD1306 IC
+ * Function to send one command to SSD1306 IC, retrying up to the retry budget of the device
  *
  * Parameters:
  *  cmd the byte value of the command to be sent
@@ -29,17 +29,18 @@
 #include "systick.h"
 #include "ssd1306.h"
 #include "QMC5883L.h"
+#include "mag_filter.h"
+#include "mag_hardiron.h"
+#include "mag_motion.h"
+#include "i2c.h"
 #include "fsl_debug_console.h"
 #include "ui.h"
-#include "math.h"
-
-#define PI 3.14159
+#include "heading.h"
 
 #define TEST_DISPLAY_DURATION 	   10000
 #define RAW_DISPLAY_DURATION  	   5000
 #define DIRECTION_DISPLAY_DURATION 5000
-#define PI_RADIAN_IN_DEGREES	    180
-#define TWO_PI_RADIAN_IN_DEGREES	360
+#define DISPLAY_RATE_HZ		   25//samples averaged down to this rate for the display, 8 of them at 200Hz
 
 typedef enum{
 	TEST_DISPLAY,
@@ -63,12 +64,30 @@ typedef struct{
 	state_t TIMER_ELAPSED_next_state;
 }state_table_entry_t;
 
+static mag_filter_t display_filter;
+static mag_hardiron_t hardiron;
+static mag_motion_t motion;
+
 state_table_entry_t state_table[] = {
 		{test_display_callback,RAW_DISPLAY},
 		{raw_display_callback,DIRECTION_DISPLAY},
 		{direction_display_callback,RAW_DISPLAY}
 };
 
+/*
+ * Function to get the number of samples averaged into one display update at an output data rate
+ *
+ * Parameters:
+ *  odr_hz output data rate of the QMC5883L
+ *
+ * Returns:
+ *  number of samples, at least 1
+ */
+static uint16_t display_decimation(uint16_t odr_hz)
+{
+	return (odr_hz > DISPLAY_RATE_HZ) ? odr_hz/DISPLAY_RATE_HZ : 1;
+}
+
 /*
  * Callback function which runs on entering the testing state
  *
@@ -99,8 +118,10 @@ void test_display_callback(state_info_t *state_machine)
 void raw_display_callback(state_info_t *state_machine)
 {
 	int16_t result[3];
-	qmc_get_nex_raw_sample(result);
-	display_raw_reading_display(result[AXIS_X], result[AXIS_Y], result[AXIS_Z]);
+	if(mag_filter_wait(&display_filter, result) == QMC_OK)
+	{//on a timeout the previous frame stays on the display
+		display_raw_reading_display(result[AXIS_X], result[AXIS_Y], result[AXIS_Z]);
+	}
 	if(now() - state_machine->state_start_time > RAW_DISPLAY_DURATION)
 	{
 		state_machine->timer_elapsed_event_flag = 1;
@@ -119,19 +140,11 @@ void raw_display_callback(state_info_t *state_machine)
 void direction_display_callback(state_info_t *state_machine)
 {
 	int16_t result[3];
-	double direction = 0;
-	qmc_get_nex_raw_sample(result);
-	qmc_calibrate_data(result);
-	direction = atan2(result[AXIS_Y],result[AXIS_X]);//atan2 is discontinuous at 180 degrees thus 360*
-													 //should be added to it if value is less than 0
-													 //during the radian to degree conversion
-	if(direction < 0)
-	{
-		direction = ((direction)*PI_RADIAN_IN_DEGREES/PI) + TWO_PI_RADIAN_IN_DEGREES;
-	}else{
-		direction = (direction)*PI_RADIAN_IN_DEGREES/PI;
+	if(mag_filter_wait(&display_filter, result) == QMC_OK)
+	{//on a timeout the previous frame stays on the display
+		qmc_calibrate_data(result);
+		display_direction_display(heading_decidegrees(result[AXIS_X], result[AXIS_Y]));
 	}
-	display_direction_display(direction);
 	if(now() - state_machine->state_start_time > DIRECTION_DISPLAY_DURATION){
 		state_machine->timer_elapsed_event_flag = 1;
 	}
@@ -154,9 +167,29 @@ void direction_display_callback(state_info_t *state_machine)
 void run_state_machine()
 {
 	state_info_t state_machine;
+	qmc_sample_stats_t sample_stats;
+	i2c_arbiter_stats_t arbiter_stats;
+	uint32_t loop_start_us;
+	uint32_t work_start_us;
+	uint32_t loop_end_us;
+	uint32_t loop_us;
+	uint8_t profile_switched;
+	const mag_motion_profile_t *profile;
+	uint32_t loop_max_us = 0;
+	int16_t tout;
+	qmc_config_t qmc_config;
+#ifdef I2C_FAULT_INJECT
+	i2c_fault_stats_t fault_stats;
+#endif
 	state_machine.current_state = TEST_DISPLAY;
 	state_machine.timer_elapsed_event_flag = 0;
 	state_machine.state_start_time = now();
+	mag_hardiron_init(&hardiron);
+	if(mag_motion_init(&motion) != QMC_OK)
+	{
+		PRINTF("PROFILE NOT SET\r\n");
+	}
+	mag_filter_init(&display_filter, display_decimation(mag_motion_profile(&motion)->odr_hz));
 
 	while(1)
 	{
@@ -166,8 +199,55 @@ void run_state_machine()
 			state_machine.current_state = state_table[state_machine.current_state].TIMER_ELAPSED_next_state;
 			state_machine.state_start_time = now();
 			PRINTF("ENTERING STATE %d at %d\r\n",state_machine.current_state,now());
+			//drop what piled up in the last state
+			mag_filter_init(&display_filter, display_decimation(mag_motion_profile(&motion)->odr_hz));
+			qmc_get_sample_stats(&sample_stats);
+			i2c_get_arbiter_stats(QMC_I2C_BUS, &arbiter_stats);
+			PRINTF("SAMPLES %d LOST %d SKIPPED %d DELAYED %d\r\n",sample_stats.samples,sample_stats.overruns,
+					sample_stats.skipped,arbiter_stats.delayed);
+			qmc_get_config(&qmc_config);
+			PRINTF("RANGE %dG SWITCHES %d\r\n",qmc_config.rng == RNG_OPTION_2G ? 2 : 8,sample_stats.range_switches);
+			PRINTF("HARD IRON %d %d %d CONFIDENCE %d%%\r\n",hardiron.offset_q8[AXIS_X] >> 8,
+					hardiron.offset_q8[AXIS_Y] >> 8,hardiron.offset_q8[AXIS_Z] >> 8,mag_hardiron_confidence(&hardiron));
+			if(qmc_get_temperature(&tout) == QMC_OK)
+			{
+				PRINTF("TEMP %d (%d/C)\r\n",tout,QMC_TEMP_LSB_PER_C);
+			}
+			mag_motion_dump(&motion);
+			PRINTF("LOOP MAX %dus\r\n",loop_max_us);//worst case time of one pass through the state, over the last state
+			loop_max_us = 0;
+#ifdef I2C_FAULT_INJECT
+			i2c_get_fault_stats(&fault_stats);
+			PRINTF("FAULTS NACK %d BUSY %d ARBL %d IICIF %d\r\n",fault_stats.injected[I2C_FAULT_NACK],
+					fault_stats.injected[I2C_FAULT_STUCK_BUSY],fault_stats.injected[I2C_FAULT_ARB_LOST],
+					fault_stats.injected[I2C_FAULT_DROP_IICIF]);
+#endif
+#ifdef I2C_PROFILE
+			i2c_profile_dump();
+#endif
+#ifdef I2C_TRACE
+			i2c_trace_dump();
+#endif
 		}
 
+		loop_start_us = now_us();//the prints above are left out
 		state_table[state_machine.current_state].action_transition_in(&state_machine);
+		work_start_us = now_us();
+		mag_hardiron_update(&hardiron);
+		profile_switched = mag_motion_update(&motion);
+		loop_end_us = now_us();
+		mag_motion_add_cpu_us(&motion, loop_end_us - work_start_us);
+		loop_us = loop_end_us - loop_start_us;
+		if(loop_us > loop_max_us)
+		{
+			loop_max_us = loop_us;
+		}
+
+		if(profile_switched)
+		{
+			profile = mag_motion_profile(&motion);
+			PRINTF("PROFILE %dHz OSR %d TURN %d DPS at %d\r\n",profile->odr_hz,QMC_OSR_MAX >> profile->osr,motion.rate_dps,now());
+			mag_filter_init(&display_filter, display_decimation(profile->odr_hz));
+		}
 	}
 }
@@ -21,9 +21,12 @@
 #include "systick.h"
 #include "board.h"
 #include "core_cm0plus.h"
+#include "i2c.h"
 
 
-#define SYSTICK_LOAD_VALUE 3000
+#define SYSTICK_LOAD_VALUE 2999//the counter reloads every LOAD + 1 counts, 1ms at 3MHz
+#define SYSTICK_COUNTS_PER_US 3
+#define US_PER_TICK 1000
 #define MUX_GPIO 1
 
 ticktime_t tick = 0;
@@ -61,6 +64,28 @@ ticktime_t now()
 	return tick;
 }
 
+/*
+ * A function to get the time since startup in microseconds, read from the systick counter. Wraps
+ * around after about 71 minutes, so only differences between two values should be used. Must not be
+ * called with interrupts disabled, since the tick count does not advance then.
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  uint32_t current time in microseconds
+ */
+uint32_t now_us()
+{
+	uint32_t ms;
+	uint32_t val;
+	do{//read again if the counter reloaded in between
+		ms = tick;
+		val = SysTick->VAL;
+	}while(ms != tick);
+	return (ms * US_PER_TICK) + ((SYSTICK_LOAD_VALUE - val) / SYSTICK_COUNTS_PER_US);
+}
+
 /*
  * A function reset the tick counter
  *
@@ -119,7 +144,8 @@ void b_delay(int ms)
 }
 
 /*
- * Systick Interrupt Handler is used to increment the value of the ticks variable .
+ * Systick Interrupt Handler is used to increment the value of the ticks variable, and to give the I2C
+ * engine transactions their deadline.
  *
  * Parameters:
  *  none
@@ -130,4 +156,5 @@ void b_delay(int ms)
 void SysTick_Handler()
 {
 	tick++;
+	i2c_tick();
 }
@@ -47,6 +47,19 @@ void init_systick();
  */
 ticktime_t now();
 
+/*
+ * A function to get the time since startup in microseconds, read from the systick counter. Wraps
+ * around after about 71 minutes, so only differences between two values should be used. Must not be
+ * called with interrupts disabled, since the tick count does not advance then.
+ *
+ * Parameters:
+ *  none
+ *
+ * Returns:
+ *  uint32_t current time in microseconds
+ */
+uint32_t now_us();
+
 /*
  * A function reset the tick counter
  *
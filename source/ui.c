@@ -24,6 +24,8 @@
 #include "stdio.h"
 #include "systick.h"
 
+#define DECIDEGREES_PER_DEGREE 10
+
 /*
  * Function to calculate frame rate of the display. It measures the time from which it was previously called
  * to the current time, to find a delta value. 1s (1000ms) divided by this delta is the number of frames per
@@ -84,12 +86,12 @@ void display_raw_reading_display(int16_t x, int16_t y,int16_t z)
  * Function to render the calculated azimuth value on the display
  *
  * Parameters:
- *  direction value of the azimuth to display on the screen
+ *  direction value of the azimuth to display on the screen, in 0.1 degree units
  *
  * Returns:
  *  none
  */
-void display_direction_display(int16_t direction)
+void display_direction_display(uint16_t direction)
 {
 	char buf[100];
 
@@ -98,7 +100,7 @@ void display_direction_display(int16_t direction)
 	sprintf(buf,"Direction:");
 	ssd1306_write_string_in_buffer(0, 0, buf, strlen(buf));
 
-	sprintf(buf,"%d Degrees",direction);
+	sprintf(buf,"%d.%d Degrees",direction/DECIDEGREES_PER_DEGREE,direction%DECIDEGREES_PER_DEGREE);
 	ssd1306_write_string_in_buffer(1, 0, buf, strlen(buf));
 
 	ssd1306_update_display();
@@ -39,10 +39,10 @@ void display_raw_reading_display(int16_t x, int16_t y,int16_t z);
  * Function to render the calculated azimuth value on the display
  *
  * Parameters:
- *  direction value of the azimuth to display on the screen
+ *  direction value of the azimuth to display on the screen, in 0.1 degree units
  *
  * Returns:
  *  none
  */
-void display_direction_display(int16_t direction);
+void display_direction_display(uint16_t direction);
 #endif